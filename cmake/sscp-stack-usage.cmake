@@ -0,0 +1,215 @@
+# Worst-case stack usage of the public API, from the call graphs GCC writes with
+# -fcallgraph-info=su (see the SSCP_STACK_USAGE option).
+#
+#   cmake -DOBJECT_DIR=<objects of the library> -DHEADER=<inc/sscp-host.h> -P sscp-stack-usage.cmake
+#
+# The worst case of a function is its own frame plus the worst case of the deepest
+# function it calls. An indirect call (transport, crypto backend) counts as the
+# deepest function of the library that is only ever called through a pointer, its
+# own indirect calls included. The C library, OpenSSL and the callbacks of the
+# application are not counted. The threads of the queues have their own stack, and are reported on their own: their
+# frames plus the deepest job.
+
+if(NOT OBJECT_DIR OR NOT HEADER)
+    message(FATAL_ERROR "OBJECT_DIR and HEADER must be given")
+endif()
+
+file(GLOB_RECURSE CALLGRAPHS "${OBJECT_DIR}/*.ci")
+if(NOT CALLGRAPHS)
+    message(FATAL_ERROR "No call graph in ${OBJECT_DIR}: build the library with SSCP_STACK_USAGE")
+endif()
+
+# Functions, their frame and what they call
+set(FUNCTIONS "")
+set(CALLED "")
+foreach(CALLGRAPH ${CALLGRAPHS})
+    file(STRINGS "${CALLGRAPH}" LINES)
+    foreach(LINE IN LISTS LINES)
+        if(LINE MATCHES "^node: { title: \"([^\"]+)\" label: \"[^\"]*\\\\n([0-9]+) bytes \\(([a-z,]+)\\)\"")
+            string(MAKE_C_IDENTIFIER "${CMAKE_MATCH_1}" ID)
+            list(APPEND FUNCTIONS "${CMAKE_MATCH_1}")
+            set_property(GLOBAL PROPERTY "FRAME_${ID}" "${CMAKE_MATCH_2}")
+            if(CMAKE_MATCH_3 STREQUAL "dynamic")
+                set_property(GLOBAL PROPERTY "DYNAMIC_${ID}" TRUE)
+            endif()
+        elseif(LINE MATCHES "^edge: { sourcename: \"([^\"]+)\" targetname: \"([^\"]+)\"")
+            string(MAKE_C_IDENTIFIER "${CMAKE_MATCH_1}" ID)
+            set_property(GLOBAL APPEND PROPERTY "CALLS_${ID}" "${CMAKE_MATCH_2}")
+            list(APPEND CALLED "${CMAKE_MATCH_2}")
+        endif()
+    endforeach()
+endforeach()
+list(REMOVE_DUPLICATES CALLED)
+
+# The public API, as declared by the header
+file(STRINGS "${HEADER}" DECLARATIONS REGEX "^[A-Za-z_][A-Za-z0-9_ *]*[ *](SSCP_[A-Za-z0-9_]+)\\(")
+set(APIS "")
+foreach(DECLARATION IN LISTS DECLARATIONS)
+    if(DECLARATION MATCHES "[ *](SSCP_[A-Za-z0-9_]+)\\(")
+        list(APPEND APIS "${CMAKE_MATCH_1}")
+    endif()
+endforeach()
+
+# Worst case of a function, in WORST<pass>_<id>; FLAGS<pass>_<id> tells what it does not bound
+function(sscp_worst_case NAME)
+    string(MAKE_C_IDENTIFIER "${NAME}" ID)
+    get_property(DONE GLOBAL PROPERTY "WORST${PASS}_${ID}" SET)
+    if(DONE)
+        return()
+    endif()
+    get_property(VISITING GLOBAL PROPERTY "VISITING${PASS}_${ID}")
+    if(VISITING)
+        set_property(GLOBAL PROPERTY "RECURSION" TRUE)
+        return()
+    endif()
+    set_property(GLOBAL PROPERTY "VISITING${PASS}_${ID}" TRUE)
+
+    get_property(FRAME GLOBAL PROPERTY "FRAME_${ID}")
+    if(NOT FRAME)
+        set(FRAME 0)
+    endif()
+    get_property(DYNAMIC GLOBAL PROPERTY "DYNAMIC_${ID}")
+    set(FLAGS "")
+    if(DYNAMIC)
+        list(APPEND FLAGS "dynamic")
+    endif()
+
+    set(DEEPEST 0)
+    get_property(CALLS GLOBAL PROPERTY "CALLS_${ID}")
+    foreach(CALLEE IN LISTS CALLS)
+        if(CALLEE STREQUAL "__indirect_call")
+            list(APPEND FLAGS "indirect")
+            if(INDIRECT_WORST GREATER DEEPEST)
+                set(DEEPEST ${INDIRECT_WORST})
+            endif()
+            continue()
+        endif()
+        sscp_worst_case("${CALLEE}")
+        string(MAKE_C_IDENTIFIER "${CALLEE}" CALLEE_ID)
+        get_property(WORST GLOBAL PROPERTY "WORST${PASS}_${CALLEE_ID}")
+        get_property(CALLEE_FLAGS GLOBAL PROPERTY "FLAGS${PASS}_${CALLEE_ID}")
+        get_property(RECURSION GLOBAL PROPERTY "RECURSION")
+        if(RECURSION)
+            list(APPEND FLAGS "recursive")
+            set_property(GLOBAL PROPERTY "RECURSION" FALSE)
+        endif()
+        if(NOT WORST)
+            set(WORST 0)
+        endif()
+        if(WORST GREATER DEEPEST)
+            set(DEEPEST ${WORST})
+        endif()
+        list(APPEND FLAGS ${CALLEE_FLAGS})
+    endforeach()
+
+    math(EXPR TOTAL "${FRAME} + ${DEEPEST}")
+    if(FLAGS)
+        list(REMOVE_DUPLICATES FLAGS)
+    endif()
+    set_property(GLOBAL PROPERTY "WORST${PASS}_${ID}" ${TOTAL})
+    set_property(GLOBAL PROPERTY "FLAGS${PASS}_${ID}" "${FLAGS}")
+    set_property(GLOBAL PROPERTY "VISITING${PASS}_${ID}" FALSE)
+endfunction()
+
+# Deepest of the functions, and its worst case
+function(sscp_deepest RESULT)
+    set(DEEPEST "")
+    set(DEEPEST_WORST -1)
+    foreach(NAME IN LISTS ARGN)
+        sscp_worst_case("${NAME}")
+        string(MAKE_C_IDENTIFIER "${NAME}" ID)
+        get_property(WORST GLOBAL PROPERTY "WORST${PASS}_${ID}")
+        if(WORST GREATER DEEPEST_WORST)
+            set(DEEPEST "${NAME}")
+            set(DEEPEST_WORST ${WORST})
+        endif()
+    endforeach()
+    set(${RESULT} "${DEEPEST}" PARENT_SCOPE)
+endfunction()
+
+# The threads of the queues run the jobs; the other functions that are only called
+# through a pointer are the transports and the crypto backends: static functions (GCC
+# names them after their file) that nothing calls directly. An external function that
+# nothing calls is an entry point of its own, the API being the ones of the header.
+set(THREADS "")
+set(JOBS "")
+set(POINTED "")
+foreach(NAME IN LISTS FUNCTIONS)
+    string(REGEX REPLACE "^.*:" "" SHORT "${NAME}")
+    list(FIND CALLED "${NAME}" IS_CALLED)
+    list(FIND APIS "${SHORT}" IS_API)
+    if(SHORT MATCHES "Thread$")
+        list(APPEND THREADS "${NAME}")
+    elseif(SHORT MATCHES "Job$")
+        list(APPEND JOBS "${NAME}")
+    elseif(IS_CALLED EQUAL -1 AND IS_API EQUAL -1 AND NAME MATCHES ":")
+        list(APPEND POINTED "${NAME}")
+    endif()
+endforeach()
+
+# An indirect call costs the worst case of the deepest function that is only called
+# through a pointer. Those make indirect calls of their own (a transport or a
+# progress callback into a crypto backend): those go to the ones that make none.
+set(PASS 0)
+set(INDIRECT_WORST 0)
+set(LEAVES "")
+foreach(NAME IN LISTS POINTED)
+    sscp_worst_case("${NAME}")
+    string(MAKE_C_IDENTIFIER "${NAME}" ID)
+    get_property(FLAGS GLOBAL PROPERTY "FLAGS${PASS}_${ID}")
+    list(FIND FLAGS "indirect" INDIRECT)
+    if(INDIRECT EQUAL -1)
+        list(APPEND LEAVES "${NAME}")
+    endif()
+endforeach()
+sscp_deepest(INDIRECT_TARGET ${LEAVES})
+string(MAKE_C_IDENTIFIER "${INDIRECT_TARGET}" ID)
+get_property(INDIRECT_WORST GLOBAL PROPERTY "WORST${PASS}_${ID}")
+
+set(PASS 1)
+sscp_deepest(INDIRECT_TARGET ${POINTED})
+string(MAKE_C_IDENTIFIER "${INDIRECT_TARGET}" ID)
+get_property(INDIRECT_WORST GLOBAL PROPERTY "WORST${PASS}_${ID}")
+
+set(PASS 2)
+string(REGEX REPLACE "^.*:" "" INDIRECT_BOUND "${INDIRECT_TARGET}")
+
+sscp_deepest(DEEPEST_JOB ${JOBS})
+string(MAKE_C_IDENTIFIER "${DEEPEST_JOB}" ID)
+get_property(JOB_WORST GLOBAL PROPERTY "WORST${PASS}_${ID}")
+string(REGEX REPLACE "^.*:" "" JOB_BOUND "${DEEPEST_JOB}")
+
+set(REPORT "Worst-case stack usage (bytes), indirect calls bound by ${INDIRECT_BOUND} (${INDIRECT_WORST}):\n")
+list(SORT APIS)
+list(REMOVE_DUPLICATES APIS)
+foreach(NAME IN ITEMS ${APIS} "-" ${THREADS})
+    if(NAME STREQUAL "-")
+        string(APPEND REPORT "Threads of the library, on their own stack, running ${JOB_BOUND}:\n")
+        continue()
+    endif()
+    string(MAKE_C_IDENTIFIER "${NAME}" ID)
+    get_property(DEFINED GLOBAL PROPERTY "FRAME_${ID}" SET)
+    if(NOT DEFINED)
+        continue()
+    endif()
+    sscp_worst_case("${NAME}")
+    get_property(WORST GLOBAL PROPERTY "WORST${PASS}_${ID}")
+    get_property(FLAGS GLOBAL PROPERTY "FLAGS${PASS}_${ID}")
+    string(REGEX REPLACE "^.*:" "" SHORT "${NAME}")
+    if(SHORT MATCHES "Thread$" AND JOB_WORST)
+        math(EXPR WORST "${WORST} + ${JOB_WORST}")
+    endif()
+    string(LENGTH "${WORST}" LENGTH)
+    math(EXPR PADDING "8 - ${LENGTH}")
+    string(REPEAT " " ${PADDING} PAD)
+    string(REPLACE ";" ", " FLAGS "${FLAGS}")
+    if(FLAGS)
+        set(FLAGS " (${FLAGS})")
+    endif()
+    string(APPEND REPORT "${PAD}${WORST}  ${SHORT}${FLAGS}\n")
+endforeach()
+
+message("${REPORT}")
+if(OUTPUT)
+    file(WRITE "${OUTPUT}" "${REPORT}")
+endif()
@@ -0,0 +1,574 @@
+#ifndef _WIN32
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "sscp-host_i.h"
+#include "emulator.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+struct _EMULATOR_ST
+{
+	BYTE authKey[16];
+	SSCP_CTX_ST* session; /* Only the session keys are used */
+	BYTE rndA[16];
+	BYTE rndB[16];
+	BYTE A[4];
+	BOOL authenticated;
+	BOOL counterTaken; /* lastCounter and lastHmac are the ones of the last command of the session */
+	DWORD lastCounter;
+	BYTE lastHmac[32];
+
+	BYTE baudrate; /* Selector, as given to SET_BAUDRATE */
+	BYTE maxBaudrate; /* Highest selector SET_BAUDRATE takes */
+	BYTE status; /* Status of the response being built */
+
+	BYTE cardUid[10];
+	BYTE cardUidSz;
+	EMULATOR_CARD_APDU cardApdu;
+	void* cardApduData;
+
+	DWORD exchangeCount;
+	volatile DWORD responseDelayMs;
+	volatile DWORD corruptCount; /* Responses still to be sent with a wrong CRC */
+
+	/* Bytes received, not processed yet */
+	BYTE input[SSCP_FRAME_MAX_SZ];
+	DWORD inputSz;
+
+	/* Working buffers, per emulator so that several of them run side by side */
+	BYTE commandData[SSCP_MAX_PAYLOAD_SZ];
+	BYTE response[SSCP_MAX_PAYLOAD_SZ];
+#ifndef _WIN32
+	BYTE readBuffer[1024];
+	BYTE output[SSCP_FRAME_MAX_SZ];
+#endif
+
+#ifndef _WIN32
+	int fd; /* Master side of the pty, or TCP connection */
+	int listenFd; /* TCP only */
+	char portName[128];
+	pthread_t thread;
+	BOOL started;
+	volatile BOOL running;
+#endif
+};
+
+EMULATOR_ST* Emulator_Alloc(const BYTE authKeyValue[16])
+{
+	EMULATOR_ST* emu = calloc(1, sizeof(EMULATOR_ST));
+
+	if (emu == NULL)
+		return NULL;
+
+	memcpy(emu->authKey, authKeyValue, 16);
+	emu->baudrate = 0x02; /* 38400 */
+	emu->maxBaudrate = 0x04; /* 115200 */
+	emu->session = SSCP_Alloc();
+	if (emu->session == NULL)
+	{
+		free(emu);
+		return NULL;
+	}
+
+#ifndef _WIN32
+	emu->fd = -1;
+	emu->listenFd = -1;
+#endif
+	return emu;
+}
+
+void Emulator_Free(EMULATOR_ST* emu)
+{
+	if (emu == NULL)
+		return;
+#ifndef _WIN32
+	Emulator_Stop(emu);
+#endif
+	SSCP_Free(emu->session);
+	memset(emu, 0, sizeof(EMULATOR_ST));
+	free(emu);
+}
+
+void Emulator_SetCard(EMULATOR_ST* emu, const BYTE uid[], BYTE uidSz)
+{
+	if ((uid == NULL) || (uidSz > sizeof(emu->cardUid)))
+		uidSz = 0;
+	if (uidSz > 0)
+		memcpy(emu->cardUid, uid, uidSz);
+	emu->cardUidSz = uidSz;
+}
+
+void Emulator_SetCardApdu(EMULATOR_ST* emu, EMULATOR_CARD_APDU cardApdu, void* userData)
+{
+	emu->cardApdu = cardApdu;
+	emu->cardApduData = userData;
+}
+
+void Emulator_SetSession(EMULATOR_ST* emu, const BYTE rndA[16], const BYTE rndB[16])
+{
+	SSCP_ComputeSessionKeys(emu->session, emu->authKey, rndA, rndB);
+	emu->authenticated = TRUE;
+	emu->counterTaken = FALSE;
+}
+
+void Emulator_SetMaxBaudrate(EMULATOR_ST* emu, BYTE selector)
+{
+	emu->maxBaudrate = selector;
+}
+
+void Emulator_Restart(EMULATOR_ST* emu)
+{
+	emu->authenticated = FALSE;
+	emu->counterTaken = FALSE;
+}
+
+void Emulator_SetResponseDelay(EMULATOR_ST* emu, DWORD delayMs)
+{
+	emu->responseDelayMs = delayMs;
+}
+
+void Emulator_CorruptResponses(EMULATOR_ST* emu, DWORD count)
+{
+	emu->corruptCount = count;
+}
+
+DWORD Emulator_GetExchangeCount(EMULATOR_ST* emu)
+{
+	return emu->exchangeCount;
+}
+
+/* Signed and ciphered response: counter, code, length, data, type, status, HMAC, padding, then IV */
+BOOL Emulator_BuildResponse(EMULATOR_ST* emu, DWORD counter, DWORD commandHeader, const BYTE data[], DWORD dataSz, BYTE payload[], DWORD maxPayloadSz, DWORD* payloadSz)
+{
+	BYTE initVector[16];
+	DWORD sz = 0;
+
+	if (8 + dataSz + 2 + 32 + 16 + 16 > maxPayloadSz)
+		return FALSE;
+
+	payload[sz++] = (BYTE)(counter >> 24);
+	payload[sz++] = (BYTE)(counter >> 16);
+	payload[sz++] = (BYTE)(counter >> 8);
+	payload[sz++] = (BYTE)(counter);
+	payload[sz++] = (BYTE)(commandHeader >> 8);
+	payload[sz++] = (BYTE)(commandHeader);
+	payload[sz++] = (BYTE)(dataSz >> 8);
+	payload[sz++] = (BYTE)(dataSz);
+	if (dataSz > 0)
+		memmove(&payload[sz], data, dataSz);
+	sz += dataSz;
+	payload[sz++] = (BYTE)(commandHeader >> 16); /* Type */
+	payload[sz++] = emu->status;
+
+	if (!SSCP_HMACEx(&emu->session->sessionSignBA, payload, sz, &payload[sz]))
+		return FALSE;
+	sz += 32;
+
+	if ((sz % 16) != 0)
+		payload[sz++] = 0x80;
+	while ((sz % 16) != 0)
+		payload[sz++] = 0x00;
+
+	if (!SSCP_GetRandom(initVector, 16))
+		return FALSE;
+	if (!SSCP_CipherEx(&emu->session->sessionCipherBA, initVector, payload, sz))
+		return FALSE;
+	memcpy(&payload[sz], initVector, 16);
+	sz += 16;
+
+	*payloadSz = sz;
+	return TRUE;
+}
+
+/* Data of the response to a (deciphered and verified) command */
+static DWORD Emulator_Command(EMULATOR_ST* emu, DWORD commandHeader, const BYTE data[], DWORD dataSz, BYTE response[])
+{
+	DWORD sz = 0;
+
+	switch (commandHeader)
+	{
+		case SSCP_CMD_SET_BAUDRATE:
+			/* The line speed of a pty or of a socket doesn't matter */
+			if ((dataSz != 1) || (data[0] > emu->maxBaudrate))
+				emu->status = 0x01;
+			else
+				emu->baudrate = data[0];
+		break;
+
+		case SSCP_CMD_OUTPUTS:
+		case SSCP_CMD_OUTPUT_RGB:
+		case SSCP_CMD_EXTERNAL_LED_COLORS:
+		case SSCP_CMD_RELEASE_RF:
+		case SSCP_CMD_SET_RS485_ADDRESS:
+		case SSCP_CMD_CHANGE_READER_KEYS:
+		break;
+
+		case SSCP_CMD_GET_INFOS:
+			response[sz++] = 0x01; /* Version */
+			response[sz++] = emu->baudrate;
+			response[sz++] = 0x00; /* Address */
+			response[sz++] = 0x13; /* Voltage (5000 mV) */
+			response[sz++] = 0x88;
+		break;
+
+		case SSCP_CMD_GET_SERIAL_NUMBER:
+			response[sz++] = 'E';
+			response[sz++] = 0x12;
+			response[sz++] = 0x34;
+			response[sz++] = 0x56;
+			response[sz++] = 0x78;
+		break;
+
+		case SSCP_CMD_GET_READER_TYPE:
+			memcpy(response, "EMULATOR", 8);
+			sz = 8;
+		break;
+
+		case SSCP_CMD_SCAN_GLOBAL:
+		case SSCP_CMD_SCAN_A_RAW:
+			if (emu->cardUidSz == 0)
+			{
+				response[sz++] = 0x00; /* No card */
+				break;
+			}
+			response[sz++] = 0x01; /* ISO 14443-A */
+			if (commandHeader == SSCP_CMD_SCAN_GLOBAL)
+				response[sz++] = 0x01; /* Card count */
+			response[sz++] = 0x00; /* ATQA */
+			response[sz++] = 0x44;
+			response[sz++] = 0x00; /* SAK */
+			response[sz++] = emu->cardUidSz;
+			memcpy(&response[sz], emu->cardUid, emu->cardUidSz);
+			sz += emu->cardUidSz;
+		break;
+
+		case SSCP_CMD_TRANSCEIVE_APDU:
+			/* Status OK, then the response of the card, or the APDU itself (after the reserved byte) */
+			response[sz++] = 0x00;
+			if (emu->cardApdu != NULL)
+			{
+				sz += emu->cardApdu(emu->cardApduData, &data[1], (dataSz > 1) ? dataSz - 1 : 0, &response[sz]);
+			}
+			else if (dataSz > 1)
+			{
+				memcpy(&response[sz], &data[1], dataSz - 1);
+				sz += dataSz - 1;
+			}
+		break;
+
+		default:
+			memcpy(response, data, dataSz);
+			sz = dataSz;
+		break;
+	}
+
+	return sz;
+}
+
+static DWORD Emulator_Authenticate(EMULATOR_ST* emu, const BYTE command[], DWORD commandSz, BYTE response[])
+{
+	BYTE hA[32];
+
+	if (commandSz == 2 + 16)
+	{
+		/* 1st step: B | A | RndA | RndB | HMAC */
+		memcpy(emu->rndA, &command[2], 16);
+		SSCP_GetRandom(emu->rndB, 16);
+		SSCP_GetRandom(emu->A, 4);
+		SSCP_GetRandom(&response[0], 4);
+		memcpy(&response[4], emu->A, 4);
+		memcpy(&response[8], emu->rndA, 16);
+		memcpy(&response[24], emu->rndB, 16);
+		SSCP_HMAC(emu->authKey, response, 40, &response[40]);
+		emu->authenticated = FALSE;
+		return 40 + 32;
+	}
+
+	if (commandSz == 4 + 16 + 32)
+	{
+		/* 2nd step: A | RndB | HMAC */
+		SSCP_HMAC(emu->authKey, command, 20, hA);
+		if (!memcmp(command, emu->A, 4) && !memcmp(&command[4], emu->rndB, 16) && !memcmp(&command[20], hA, 32))
+			Emulator_SetSession(emu, emu->rndA, emu->rndB);
+		memset(response, 0, 6);
+		response[5] = 0x08;
+		return 6;
+	}
+
+	return 0;
+}
+
+/* Deciphers and checks a secure command; returns the size of the response payload, 0 to stay mute */
+static DWORD Emulator_Secure(EMULATOR_ST* emu, BYTE command[], DWORD commandSz, BYTE response[], DWORD maxResponseSz)
+{
+	BYTE* data = emu->commandData;
+	BYTE hmac[32];
+	DWORD counter, commandHeader, dataSz, responseSz = 0;
+
+	if (!emu->authenticated)
+		return 0;
+	if ((commandSz < 16 + 48) || ((commandSz % 16) != 0))
+		return 0;
+
+	commandSz -= 16;
+	if (!SSCP_DecipherEx(&emu->session->sessionCipherAB, &command[commandSz], command, commandSz))
+		return 0;
+
+	counter = ((DWORD) command[0] << 24) | ((DWORD) command[1] << 16) | ((DWORD) command[2] << 8) | command[3];
+	commandHeader = ((DWORD) command[4] << 16) | ((DWORD) command[5] << 8) | command[6];
+	dataSz = ((DWORD) command[7] << 8) | command[8];
+	if (9 + dataSz + 32 > commandSz)
+		return 0;
+
+	SSCP_HMACEx(&emu->session->sessionSignAB, command, 9 + dataSz, hmac);
+	if (memcmp(hmac, &command[9 + dataSz], 32))
+		return 0;
+
+	/* As a reader, refuse a counter the session has taken, unless the same command is sent again */
+	if (emu->counterTaken && (((LONG)(counter - emu->lastCounter) < 0) || ((counter == emu->lastCounter) && memcmp(hmac, emu->lastHmac, 32))))
+		return 0;
+	emu->counterTaken = TRUE;
+	emu->lastCounter = counter;
+	memcpy(emu->lastHmac, hmac, 32);
+
+	emu->status = 0x00;
+	dataSz = Emulator_Command(emu, commandHeader, &command[9], dataSz, data);
+
+	if (!Emulator_BuildResponse(emu, counter + 1, commandHeader, data, dataSz, response, maxResponseSz, &responseSz))
+		return 0;
+
+	emu->exchangeCount++;
+	return responseSz;
+}
+
+DWORD Emulator_Process(EMULATOR_ST* emu, const BYTE input[], DWORD inputSz, BYTE output[], DWORD maxOutputSz)
+{
+	BYTE* response = emu->response;
+	DWORD outputSz = 0;
+
+	while (inputSz > 0)
+	{
+		DWORD n = sizeof(emu->input) - emu->inputSz;
+		if (n > inputSz)
+			n = inputSz;
+		memcpy(&emu->input[emu->inputSz], input, n);
+		emu->inputSz += n;
+		input += n;
+		inputSz -= n;
+
+		for (;;)
+		{
+			DWORD length, responseSz = 0;
+			BYTE crc[2];
+
+			/* Resynchronise on SOF */
+			while ((emu->inputSz > 0) && (emu->input[0] != 0x02))
+				memmove(emu->input, &emu->input[1], --emu->inputSz);
+			if (emu->inputSz < 5)
+				break;
+
+			length = ((DWORD) emu->input[1] << 8) | emu->input[2];
+			if (length > SSCP_MAX_PAYLOAD_SZ)
+			{
+				memmove(emu->input, &emu->input[1], --emu->inputSz);
+				continue;
+			}
+			if (emu->inputSz < 5 + length + 2)
+				break;
+
+			SSCP_SCR16(&emu->input[1], 4, &emu->input[5], length, crc);
+			if (!memcmp(crc, &emu->input[5 + length], 2))
+			{
+				if (emu->input[4] == SSCP_PROTOCOL_AUTHENTICATE)
+					responseSz = Emulator_Authenticate(emu, &emu->input[5], length, response);
+				else if (emu->input[4] == SSCP_PROTOCOL_SECURE)
+					responseSz = Emulator_Secure(emu, &emu->input[5], length, response, sizeof(emu->response));
+			}
+
+			if ((responseSz > 0) && (outputSz + 5 + responseSz + 2 <= maxOutputSz))
+			{
+				output[outputSz++] = 0x02;
+				output[outputSz++] = (BYTE)(responseSz >> 8);
+				output[outputSz++] = (BYTE)(responseSz);
+				output[outputSz++] = emu->input[3]; /* Address */
+				output[outputSz++] = emu->input[4]; /* Protocol */
+				memcpy(&output[outputSz], response, responseSz);
+				SSCP_SCR16(&output[outputSz - 4], 4, response, responseSz, &output[outputSz + responseSz]);
+				if (emu->corruptCount > 0)
+				{
+					emu->corruptCount--;
+					output[outputSz + responseSz] ^= 0xFF;
+				}
+				outputSz += responseSz + 2;
+			}
+
+			emu->inputSz -= 5 + length + 2;
+			memmove(emu->input, &emu->input[5 + length + 2], emu->inputSz);
+		}
+	}
+
+	return outputSz;
+}
+
+#ifndef _WIN32
+
+static void* Emulator_Thread(void* arg)
+{
+	EMULATOR_ST* emu = arg;
+	BYTE* input = emu->readBuffer;
+	BYTE* output = emu->output;
+
+	while (emu->running)
+	{
+		struct pollfd pfd;
+		ssize_t n;
+		DWORD outputSz, offset;
+
+		if (emu->fd < 0)
+		{
+			/* TCP: wait for the host to connect */
+			pfd.fd = emu->listenFd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 100) > 0)
+			{
+				int one = 1;
+				emu->fd = accept(emu->listenFd, NULL, NULL);
+				if (emu->fd >= 0)
+					setsockopt(emu->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			}
+			continue;
+		}
+
+		pfd.fd = emu->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		n = read(emu->fd, input, sizeof(emu->readBuffer));
+		if (n <= 0)
+		{
+			if ((n == 0) && (emu->listenFd >= 0))
+			{
+				/* The host has disconnected */
+				close(emu->fd);
+				emu->fd = -1;
+			}
+			continue;
+		}
+
+		outputSz = Emulator_Process(emu, input, (DWORD) n, output, sizeof(emu->output));
+		if ((outputSz > 0) && (emu->responseDelayMs > 0))
+			usleep(emu->responseDelayMs * 1000);
+		for (offset = 0; offset < outputSz; )
+		{
+			ssize_t w = write(emu->fd, &output[offset], outputSz - offset);
+			if (w <= 0)
+				break;
+			offset += (DWORD) w;
+		}
+	}
+
+	return NULL;
+}
+
+static BOOL Emulator_StartThread(EMULATOR_ST* emu)
+{
+	emu->running = TRUE;
+	if (pthread_create(&emu->thread, NULL, Emulator_Thread, emu) != 0)
+	{
+		emu->running = FALSE;
+		Emulator_Stop(emu);
+		return FALSE;
+	}
+
+	emu->started = TRUE;
+	return TRUE;
+}
+
+BOOL Emulator_StartPty(EMULATOR_ST* emu)
+{
+	const char* name;
+
+	Emulator_Stop(emu);
+
+	emu->fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (emu->fd < 0)
+		return FALSE;
+	if ((grantpt(emu->fd) != 0) || (unlockpt(emu->fd) != 0) || ((name = ptsname(emu->fd)) == NULL))
+	{
+		Emulator_Stop(emu);
+		return FALSE;
+	}
+	snprintf(emu->portName, sizeof(emu->portName), "%s", name);
+
+	return Emulator_StartThread(emu);
+}
+
+/* Listen on the loopback interface, on a port chosen by the system */
+BOOL Emulator_StartTcp(EMULATOR_ST* emu)
+{
+	struct sockaddr_in addr;
+	socklen_t addrSz = sizeof(addr);
+	int one = 1;
+
+	Emulator_Stop(emu);
+
+	emu->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (emu->listenFd < 0)
+		return FALSE;
+	setsockopt(emu->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if ((bind(emu->listenFd, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+		|| (listen(emu->listenFd, 1) != 0)
+		|| (getsockname(emu->listenFd, (struct sockaddr*) &addr, &addrSz) != 0))
+	{
+		Emulator_Stop(emu);
+		return FALSE;
+	}
+	snprintf(emu->portName, sizeof(emu->portName), "tcp://127.0.0.1:%u", ntohs(addr.sin_port));
+
+	return Emulator_StartThread(emu);
+}
+
+void Emulator_Stop(EMULATOR_ST* emu)
+{
+	if (emu->started)
+	{
+		emu->running = FALSE;
+		pthread_join(emu->thread, NULL);
+		emu->started = FALSE;
+	}
+	if (emu->fd >= 0)
+		close(emu->fd);
+	if (emu->listenFd >= 0)
+		close(emu->listenFd);
+	emu->fd = -1;
+	emu->listenFd = -1;
+}
+
+const char* Emulator_GetPortName(EMULATOR_ST* emu)
+{
+	return emu->portName;
+}
+
+#endif
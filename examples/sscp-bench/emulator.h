@@ -0,0 +1,55 @@
+#ifndef __SSCP_EMULATOR_H__
+#define __SSCP_EMULATOR_H__
+
+/*
+ * Software SSCPv2 reader: mutual authentication, secure exchanges, and a handful of
+ * commands (outputs, infos, scan, APDU echo). Any other command echoes its data.
+ *
+ * Emulator_Process() is the transport-independent core: it takes the bytes sent by the
+ * host and gives back the bytes of the response frames. Emulator_StartPty() runs it
+ * behind a pseudo-terminal, and Emulator_StartTcp() behind a loopback TCP port (POSIX
+ * only); the name given by Emulator_GetPortName() can then be given to SSCP_Open().
+ */
+
+#include <sscp-host.h>
+
+typedef struct _EMULATOR_ST EMULATOR_ST;
+
+EMULATOR_ST* Emulator_Alloc(const BYTE authKeyValue[16]);
+void Emulator_Free(EMULATOR_ST* emu);
+
+/* Card in the field (NULL: no card) */
+void Emulator_SetCard(EMULATOR_ST* emu, const BYTE uid[], BYTE uidSz);
+
+/* Response of the card (data and status word) to an APDU; without it, the card echoes the APDU */
+typedef DWORD (*EMULATOR_CARD_APDU)(void* userData, const BYTE apdu[], DWORD apduSz, BYTE response[]);
+void Emulator_SetCardApdu(EMULATOR_ST* emu, EMULATOR_CARD_APDU cardApdu, void* userData);
+
+/* The reader restarts: its session is gone, it is mute to the secure frames until authenticated again */
+void Emulator_Restart(EMULATOR_ST* emu);
+
+/* Highest selector SET_BAUDRATE takes (0x04, 115200, by default), the others get an error status */
+void Emulator_SetMaxBaudrate(EMULATOR_ST* emu, BYTE selector);
+
+/* Time taken before each response is written behind the pty or the TCP port (0 by default) */
+void Emulator_SetResponseDelay(EMULATOR_ST* emu, DWORD delayMs);
+
+/* The next count responses go out with a wrong CRC, as hit by a glitch on the line */
+void Emulator_CorruptResponses(EMULATOR_ST* emu, DWORD count);
+
+DWORD Emulator_Process(EMULATOR_ST* emu, const BYTE input[], DWORD inputSz, BYTE output[], DWORD maxOutputSz);
+
+/* Secure frame payload answering a command, for the benchmarks of the host's parser */
+BOOL Emulator_BuildResponse(EMULATOR_ST* emu, DWORD counter, DWORD commandHeader, const BYTE data[], DWORD dataSz, BYTE payload[], DWORD maxPayloadSz, DWORD* payloadSz);
+void Emulator_SetSession(EMULATOR_ST* emu, const BYTE rndA[16], const BYTE rndB[16]);
+
+#ifndef _WIN32
+BOOL Emulator_StartPty(EMULATOR_ST* emu);
+BOOL Emulator_StartTcp(EMULATOR_ST* emu);
+void Emulator_Stop(EMULATOR_ST* emu);
+const char* Emulator_GetPortName(EMULATOR_ST* emu);
+#endif
+
+DWORD Emulator_GetExchangeCount(EMULATOR_ST* emu);
+
+#endif
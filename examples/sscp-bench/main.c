@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "sscp-host_i.h"
+#include "emulator.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BENCH_SAMPLES 200
+#define BENCH_MIN_BATCH_NS 20000.0 /* A sample lasts at least 20us, to weigh the timer out */
+
+static const DWORD BENCH_SIZES[] = { 0, 16, 64, 256, 1024, 4096 };
+#define BENCH_SIZE_COUNT (sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]))
+#define BENCH_MAX_ECHO_SZ (SSCP_MAX_PAYLOAD_SZ - SSCP_COMMAND_HEADROOM - SSCP_COMMAND_TAILROOM - 1)
+
+static const BYTE BENCH_AUTH_KEY[16] = { 0xE7, 0x4A, 0x54, 0x0F, 0xA0, 0x7C, 0x4D, 0xB1, 0xB4, 0x64, 0x21, 0x12, 0x6D, 0xF7, 0xAD, 0x36 };
+static const BYTE BENCH_KEY[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF };
+static const BYTE BENCH_IV[16] = { 0 };
+
+static BYTE benchBuffer[SSCP_FRAME_MAX_SZ];
+
+typedef void (*BENCH_FUNC)(void* param, DWORD size);
+
+static double Bench_NowNs(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double) now.QuadPart * 1e9 / (double) freq.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+#endif
+}
+
+static int Bench_Compare(const void* a, const void* b)
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+/* Times func(param, size); prints the per-operation latency percentiles, ops/s and MB/s */
+static void Bench_Run(const char* name, BENCH_FUNC func, void* param, DWORD size, DWORD samples)
+{
+	static double ns[BENCH_SAMPLES];
+	double start, total = 0;
+	DWORD batch = 1, i, j;
+
+	if (samples > BENCH_SAMPLES)
+		samples = BENCH_SAMPLES;
+
+	/* Calibrate the batch size */
+	for (;;)
+	{
+		start = Bench_NowNs();
+		for (j = 0; j < batch; j++)
+			func(param, size);
+		if ((Bench_NowNs() - start >= BENCH_MIN_BATCH_NS) || (batch >= 1000000))
+			break;
+		batch *= 2;
+	}
+
+	for (i = 0; i < samples; i++)
+	{
+		start = Bench_NowNs();
+		for (j = 0; j < batch; j++)
+			func(param, size);
+		ns[i] = (Bench_NowNs() - start) / batch;
+		total += ns[i];
+	}
+
+	qsort(ns, samples, sizeof(double), Bench_Compare);
+
+	printf("%-16s %5lu B  p50 %10.0f ns  p90 %10.0f ns  p99 %10.0f ns  %10.0f ops/s", name, size,
+		ns[samples / 2], ns[(samples * 90) / 100], ns[(samples * 99) / 100], 1e9 * samples / total);
+	if (size > 0)
+		printf("  %8.1f MB/s", (1e9 * samples / total) * size / 1e6);
+	printf("\n");
+}
+
+static void Bench_CRC(void* param, DWORD size)
+{
+	BYTE crc[2];
+	(void) param;
+	SSCP_SCR16(benchBuffer, 4, &benchBuffer[4], size, crc);
+}
+
+static void Bench_Cipher(void* param, DWORD size)
+{
+	(void) param;
+	SSCP_Cipher(BENCH_KEY, BENCH_IV, benchBuffer, size);
+}
+
+static void Bench_Decipher(void* param, DWORD size)
+{
+	(void) param;
+	SSCP_Decipher(BENCH_KEY, BENCH_IV, benchBuffer, size);
+}
+
+static void Bench_HMAC(void* param, DWORD size)
+{
+	BYTE hmac[32];
+	(void) param;
+	SSCP_HMAC(BENCH_KEY, benchBuffer, size, hmac);
+}
+
+typedef struct
+{
+	SSCP_CTX_ST* ctx;
+	BYTE response[SSCP_FRAME_MAX_SZ];
+	BYTE responseData[SSCP_MAX_PAYLOAD_SZ];
+	DWORD responseSz[BENCH_SIZE_COUNT];
+	BYTE canned[BENCH_SIZE_COUNT][SSCP_FRAME_MAX_SZ];
+} BENCH_EXCHANGE_ST;
+
+static DWORD Bench_SizeIndex(DWORD size)
+{
+	DWORD i;
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		if (BENCH_SIZES[i] == size)
+			break;
+	return i;
+}
+
+/* Command build (sign, pad, cipher) and response parse (decipher, check), without the transport */
+static void Bench_Exchange(void* param, DWORD size)
+{
+	BENCH_EXCHANGE_ST* bench = param;
+	DWORD i = Bench_SizeIndex(size);
+	DWORD commandSz, responseDataSz;
+	LONG rc;
+
+	bench->ctx->counter = 1;
+	rc = SSCP_ExchangePrepare(bench->ctx, SSCP_CMD_TRANSCEIVE_APDU, benchBuffer, sizeof(benchBuffer), size, &commandSz);
+	if (rc == SSCP_SUCCESS)
+	{
+		memcpy(bench->response, bench->canned[i], bench->responseSz[i]);
+		rc = SSCP_ExchangeVerify(bench->ctx, SSCP_CMD_TRANSCEIVE_APDU, bench->response, bench->responseSz[i], bench->responseData, sizeof(bench->responseData), &responseDataSz);
+	}
+	if (rc != SSCP_SUCCESS)
+	{
+		printf("Exchange failed, rc=%ld\n", rc);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static BOOL Bench_ExchangeSetup(BENCH_EXCHANGE_ST* bench, EMULATOR_ST* emu)
+{
+	BYTE rndA[16], rndB[16];
+	DWORD i;
+
+	SSCP_GetRandom(rndA, 16);
+	SSCP_GetRandom(rndB, 16);
+	if (!SSCP_ComputeSessionKeys(bench->ctx, BENCH_AUTH_KEY, rndA, rndB))
+		return FALSE;
+	Emulator_SetSession(emu, rndA, rndB);
+
+	/* The response carries as many bytes as the command (an echo) */
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		if (!Emulator_BuildResponse(emu, 2, SSCP_CMD_TRANSCEIVE_APDU, benchBuffer, BENCH_SIZES[i], bench->canned[i], sizeof(bench->canned[i]), &bench->responseSz[i]))
+			return FALSE;
+
+	return TRUE;
+}
+
+#ifndef _WIN32
+static void Bench_EndToEnd(void* param, DWORD size)
+{
+	SSCP_CTX_ST* ctx = param;
+	static BYTE response[SSCP_MAX_PAYLOAD_SZ];
+	DWORD responseSz;
+	LONG rc;
+
+	rc = SSCP_Exchange(ctx, 0x00FFFF, benchBuffer, size, response, sizeof(response), &responseSz);
+	if ((rc != SSCP_SUCCESS) || (responseSz != size))
+	{
+		printf("SSCP_Exchange failed, rc=%ld\n", rc);
+		exit(EXIT_FAILURE);
+	}
+}
+
+#define BENCH_BATCH_ITEMS 4
+
+/* BENCH_BATCH_ITEMS exchanges one after the other, as the application would make them */
+static void Bench_Sequence(void* param, DWORD size)
+{
+	DWORD i;
+	for (i = 0; i < BENCH_BATCH_ITEMS; i++)
+		Bench_EndToEnd(param, size);
+}
+
+/* The same exchanges in a single SSCP_ExchangeBatch() */
+static void Bench_Batch(void* param, DWORD size)
+{
+	SSCP_CTX_ST* ctx = param;
+	static BYTE response[BENCH_BATCH_ITEMS][SSCP_MAX_PAYLOAD_SZ];
+	SSCP_BATCH_ITEM_ST items[BENCH_BATCH_ITEMS];
+	DWORD i;
+	LONG rc;
+
+	memset(items, 0, sizeof(items));
+	for (i = 0; i < BENCH_BATCH_ITEMS; i++)
+	{
+		items[i].commandHeader = 0x00FFFF;
+		items[i].commandData = benchBuffer;
+		items[i].commandDataSz = size;
+		items[i].responseData = response[i];
+		items[i].maxResponseDataSz = sizeof(response[i]);
+	}
+
+	rc = SSCP_ExchangeBatch(ctx, items, BENCH_BATCH_ITEMS, NULL);
+	if ((rc != SSCP_SUCCESS) || (items[BENCH_BATCH_ITEMS - 1].actResponseDataSz != size))
+	{
+		printf("SSCP_ExchangeBatch failed, rc=%ld\n", rc);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Authenticate then exchange with the emulator, through the transport it has been started on */
+static BOOL Bench_Transport(EMULATOR_ST* emu, BOOL (*start)(EMULATOR_ST* emu), const char* label, DWORD samples)
+{
+	SSCP_CTX_ST* ctx = SSCP_Alloc();
+	SSCP_SETTINGS_ST settings;
+	DWORD count, i;
+	char name[32];
+	LONG rc;
+
+	if ((ctx == NULL) || !start(emu))
+	{
+		printf("Failed to start the emulator (%s)\n", label);
+		return FALSE;
+	}
+
+	rc = SSCP_Open(ctx, Emulator_GetPortName(emu), 115200, 0);
+	if (rc == SSCP_SUCCESS)
+		rc = SSCP_Authenticate(ctx, NULL);
+	if (rc != SSCP_SUCCESS)
+	{
+		printf("Failed to open the emulator on %s, rc=%ld\n", Emulator_GetPortName(emu), rc);
+		SSCP_Free(ctx);
+		Emulator_Stop(emu);
+		return FALSE;
+	}
+
+	count = Emulator_GetExchangeCount(emu);
+	snprintf(name, sizeof(name), "Exchange/%s", label);
+
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+	{
+		/* The ciphered frame of the echo must fit in SSCP_MAX_PAYLOAD_SZ */
+		DWORD size = (BENCH_SIZES[i] > BENCH_MAX_ECHO_SZ) ? BENCH_MAX_ECHO_SZ : BENCH_SIZES[i];
+		Bench_Run(name, Bench_EndToEnd, ctx, size, (samples / 10 > 0) ? samples / 10 : 1);
+	}
+
+	snprintf(name, sizeof(name), "Sequence x%d/%s", BENCH_BATCH_ITEMS, label);
+	Bench_Run(name, Bench_Sequence, ctx, 16, (samples / 10 > 0) ? samples / 10 : 1);
+	snprintf(name, sizeof(name), "Batch x%d/%s", BENCH_BATCH_ITEMS, label);
+	Bench_Run(name, Bench_Batch, ctx, 16, (samples / 10 > 0) ? samples / 10 : 1);
+
+	/* The same echoes, ciphered while they are sent */
+	SSCP_GetSettings(ctx, &settings);
+	settings.pipeline = TRUE;
+	SSCP_SetSettings(ctx, &settings);
+	snprintf(name, sizeof(name), "Pipeline/%s", label);
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+	{
+		DWORD size = (BENCH_SIZES[i] > BENCH_MAX_ECHO_SZ) ? BENCH_MAX_ECHO_SZ : BENCH_SIZES[i];
+		Bench_Run(name, Bench_EndToEnd, ctx, size, (samples / 10 > 0) ? samples / 10 : 1);
+	}
+
+	printf("%lu exchanges served by the emulator on %s\n\n", Emulator_GetExchangeCount(emu) - count, Emulator_GetPortName(emu));
+
+	SSCP_Close(ctx);
+	SSCP_Free(ctx);
+	Emulator_Stop(emu);
+	return TRUE;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	static BENCH_EXCHANGE_ST exchange;
+	EMULATOR_ST* emu;
+	const char* aesBackend;
+	const char* sha256Backend;
+	DWORD i, samples = BENCH_SAMPLES;
+
+	if ((argc > 1) && (atoi(argv[1]) > 0))
+		samples = (DWORD) atoi(argv[1]);
+
+	for (i = 0; i < sizeof(benchBuffer); i++)
+		benchBuffer[i] = (BYTE) i;
+
+	SSCP_GetCryptoBackends(&aesBackend, &sha256Backend);
+	printf("AES: %s, SHA-256: %s\n\n", aesBackend, sha256Backend);
+
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		Bench_Run("SSCP_SCR16", Bench_CRC, NULL, BENCH_SIZES[i], samples);
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		Bench_Run("SSCP_Cipher", Bench_Cipher, NULL, BENCH_SIZES[i], samples);
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		Bench_Run("SSCP_Decipher", Bench_Decipher, NULL, BENCH_SIZES[i], samples);
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		Bench_Run("SSCP_HMAC", Bench_HMAC, NULL, BENCH_SIZES[i], samples);
+	printf("\n");
+
+	emu = Emulator_Alloc(BENCH_AUTH_KEY);
+	exchange.ctx = SSCP_Alloc();
+	if ((emu == NULL) || (exchange.ctx == NULL) || !Bench_ExchangeSetup(&exchange, emu))
+	{
+		printf("Failed to prepare the exchange benchmark\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < BENCH_SIZE_COUNT; i++)
+		Bench_Run("Prepare+Verify", Bench_Exchange, &exchange, BENCH_SIZES[i], samples);
+	printf("\n");
+
+	SSCP_Free(exchange.ctx);
+
+#ifndef _WIN32
+	if (!Bench_Transport(emu, Emulator_StartPty, "pty", samples) || !Bench_Transport(emu, Emulator_StartTcp, "tcp", samples))
+		return EXIT_FAILURE;
+#endif
+
+	Emulator_Free(emu);
+	return EXIT_SUCCESS;
+}
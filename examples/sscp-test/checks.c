@@ -0,0 +1,2163 @@
+/*
+ * Behaviour checks of the library, run by CTest: each check drives one part of the
+ * library, most of them against the reader emulator of sscp-bench (behind a pty).
+ *
+ * sscp-checks [name...] runs the checks given (all by default); the exit code is the
+ * number of checks that failed.
+ */
+#define _XOPEN_SOURCE 600 /* posix_openpt() */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sscp-host_i.h"
+#include "emulator.h"
+
+static const BYTE authKey[16] = { 0xE7, 0x4A, 0x54, 0x0F, 0xA0, 0x7C, 0x4D, 0xB1, 0xB4, 0x64, 0x21, 0x12, 0x6D, 0xF7, 0xAD, 0x36 };
+
+/* Fail the check if cond is FALSE */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			return FALSE; \
+		} \
+	} while (0)
+
+/* Emulated reader, behind a pty */
+/* ----------------------------- */
+
+typedef struct
+{
+	EMULATOR_ST* emu;
+	SSCP_CTX_ST* ctx;
+} READER_ST;
+
+/* Open a context on a new emulated reader, authenticated if asked to */
+static BOOL ReaderOpen(READER_ST* reader, BOOL authenticate)
+{
+	memset(reader, 0, sizeof(READER_ST));
+
+	reader->emu = Emulator_Alloc(authKey);
+	if ((reader->emu == NULL) || !Emulator_StartPty(reader->emu))
+		return FALSE;
+
+	reader->ctx = SSCP_Alloc();
+	if (reader->ctx == NULL)
+		return FALSE;
+	if (SSCP_Open(reader->ctx, Emulator_GetPortName(reader->emu), 115200, 0) != SSCP_SUCCESS)
+		return FALSE;
+
+	if (authenticate && (SSCP_Authenticate(reader->ctx, NULL) != SSCP_SUCCESS))
+		return FALSE;
+
+	return TRUE;
+}
+
+static void ReaderClose(READER_ST* reader)
+{
+	SSCP_Free(reader->ctx);
+	if (reader->emu != NULL)
+	{
+		Emulator_Stop(reader->emu);
+		Emulator_Free(reader->emu);
+	}
+	memset(reader, 0, sizeof(READER_ST));
+}
+
+/* Request queue and completions */
+/* ----------------------------- */
+
+#define QUEUE_PRODUCERS 4
+#define QUEUE_POSTS 50
+
+typedef struct
+{
+	SSCP_CTX_ST* ctx;
+	DWORD producer;
+	SSCP_REQUEST_ST requests[QUEUE_POSTS];
+	DWORD seen[QUEUE_POSTS];
+} QUEUE_PRODUCER_ST;
+
+static volatile LONG queueOrder[QUEUE_PRODUCERS]; /* Next post the worker must run, per producer */
+static volatile LONG queueDisorders;
+
+static LONG QueueJob(SSCP_CTX_ST* ctx, void* userData)
+{
+	DWORD* seen = (DWORD*) userData;
+	DWORD producer = seen[0] >> 16;
+	DWORD post = seen[0] & 0xFFFF;
+
+	(void) ctx;
+	if ((DWORD) queueOrder[producer] != post)
+		SSCP_ATOMIC_ADD(&queueDisorders, 1);
+	queueOrder[producer] = post + 1;
+	return SSCP_SUCCESS;
+}
+
+static void* QueueProducer(void* arg)
+{
+	QUEUE_PRODUCER_ST* producer = (QUEUE_PRODUCER_ST*) arg;
+	DWORD i;
+
+	for (i = 0; i < QUEUE_POSTS; i++)
+	{
+		producer->seen[i] = (producer->producer << 16) | i;
+		producer->requests[i].job = QueueJob;
+		producer->requests[i].userData = &producer->seen[i];
+		if (SSCP_QueuePost(producer->ctx, &producer->requests[i]) != SSCP_SUCCESS)
+			SSCP_ATOMIC_ADD(&queueDisorders, 1);
+	}
+	return NULL;
+}
+
+/* The posts of many threads all run, each thread's in the order it posted them */
+static BOOL CheckQueueProducers(void)
+{
+	static QUEUE_PRODUCER_ST producers[QUEUE_PRODUCERS];
+	pthread_t threads[QUEUE_PRODUCERS];
+	READER_ST reader;
+	DWORD i, j;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	CHECK(SSCP_QueueStart(reader.ctx) == SSCP_SUCCESS);
+
+	memset(producers, 0, sizeof(producers));
+	for (i = 0; i < QUEUE_PRODUCERS; i++)
+	{
+		producers[i].ctx = reader.ctx;
+		producers[i].producer = i;
+		queueOrder[i] = 0;
+		CHECK(pthread_create(&threads[i], NULL, QueueProducer, &producers[i]) == 0);
+	}
+	for (i = 0; i < QUEUE_PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < QUEUE_PRODUCERS; i++)
+		for (j = 0; j < QUEUE_POSTS; j++)
+			CHECK(SSCP_QueueWait(reader.ctx, &producers[i].requests[j], SSCP_ASYNC_INFINITE) == SSCP_SUCCESS);
+
+	CHECK(queueDisorders == 0);
+	for (i = 0; i < QUEUE_PRODUCERS; i++)
+		CHECK(queueOrder[i] == QUEUE_POSTS);
+
+	/* Exchanges from another thread go through the worker as well */
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_QueueStop(reader.ctx) == SSCP_SUCCESS);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+typedef struct
+{
+	SSCP_QUEUE_ST* completions;
+	DWORD timeoutMs;
+	SSCP_REQUEST_ST* volatile taken;
+	volatile LONG over;
+} QUEUE_TAKER_ST;
+
+static void* QueueTaker(void* arg)
+{
+	QUEUE_TAKER_ST* taker = (QUEUE_TAKER_ST*) arg;
+
+	taker->taken = SSCP_QueueTake(taker->completions, taker->timeoutMs);
+	SSCP_ATOMIC_STORE(&taker->over, 1);
+	return NULL;
+}
+
+/* A taker that times out does not hide another one that waits without limit */
+static BOOL CheckCompletionTakers(void)
+{
+	QUEUE_TAKER_ST forever, brief;
+	pthread_t foreverThread, briefThread;
+	SSCP_REQUEST_ST request;
+	DWORD waitedMs;
+
+	memset(&forever, 0, sizeof(forever));
+	memset(&brief, 0, sizeof(brief));
+	memset(&request, 0, sizeof(request));
+
+	forever.completions = brief.completions = SSCP_QueueCompletionsAlloc();
+	CHECK(forever.completions != NULL);
+	forever.timeoutMs = SSCP_ASYNC_INFINITE;
+	brief.timeoutMs = 50;
+
+	CHECK(pthread_create(&foreverThread, NULL, QueueTaker, &forever) == 0);
+	usleep(20000);
+	CHECK(pthread_create(&briefThread, NULL, QueueTaker, &brief) == 0);
+	pthread_join(briefThread, NULL);
+	CHECK(brief.taken == NULL);
+	CHECK(!forever.over);
+
+	SSCP_QueueComplete(forever.completions, &request);
+	for (waitedMs = 0; !SSCP_ATOMIC_LOAD(&forever.over) && (waitedMs < 2000); waitedMs += 10)
+		usleep(10000);
+	CHECK(forever.over);
+	pthread_join(foreverThread, NULL);
+	CHECK(forever.taken == &request);
+
+	/* Nothing left */
+	CHECK(SSCP_QueueTake(forever.completions, 0) == NULL);
+	SSCP_QueueCompletionsFree(forever.completions);
+	return TRUE;
+}
+
+/* Asynchronous exchange */
+/* --------------------- */
+
+/* A command cancelled once sent counts as a failed exchange, and the counter skips */
+static BOOL CheckAsyncCancel(void)
+{
+	static const BYTE outputs[3] = { 1, 1, 0 };
+	SSCP_STATISTICS_EX_ST before, after;
+	READER_ST reader;
+	DWORD counter;
+	LONG rc;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+
+	/* Nothing sent yet: nothing to count */
+	CHECK(SSCP_AsyncSubmit(reader.ctx, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_SUCCESS);
+	counter = reader.ctx->counter;
+	CHECK(SSCP_AsyncCancel(reader.ctx) == SSCP_SUCCESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK((after.exchanges == before.exchanges) && (reader.ctx->counter == counter));
+
+	/* Sent, the response not there yet */
+	Emulator_SetResponseDelay(reader.emu, 200);
+	CHECK(SSCP_AsyncSubmit(reader.ctx, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_SUCCESS);
+	counter = reader.ctx->counter;
+	do
+		rc = SSCP_AsyncPoll(reader.ctx);
+	while ((rc == SSCP_ERR_IN_PROGRESS) && (reader.ctx->async.state != SSCP_ASYNC_RECV));
+	CHECK(rc == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncCancel(reader.ctx) == SSCP_SUCCESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+
+	CHECK(after.exchanges == before.exchanges + 1);
+	CHECK(after.failures == before.failures + 1);
+	CHECK(after.timeouts == before.timeouts + 1);
+	CHECK(after.counterResyncs == before.counterResyncs + 1);
+	CHECK(reader.ctx->counter == counter + 2);
+
+	/* Cancelled again: already counted */
+	CHECK(SSCP_AsyncCancel(reader.ctx) == SSCP_SUCCESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+	CHECK(before.exchanges == after.exchanges);
+
+	/* The late response is dropped, the reader takes the next counter */
+	Emulator_SetResponseDelay(reader.emu, 0);
+	usleep(300000);
+	SSCP_Outputs(reader.ctx, 1, 1, 0);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* The pending exchange of a reader holds the line: the other readers of the bus wait for it */
+static BOOL CheckAsyncBus(void)
+{
+	static const BYTE outputs[3] = { 1, 1, 0 };
+	SSCP_BATCH_ITEM_ST item;
+	SSCP_CTX_ST* readerA;
+	SSCP_CTX_ST* readerB;
+	EMULATOR_ST* emu;
+	SSCP_BUS_ST* bus;
+	LONG rc;
+
+	emu = Emulator_Alloc(authKey);
+	CHECK((emu != NULL) && Emulator_StartPty(emu));
+	bus = SSCP_BusAlloc();
+	CHECK(bus != NULL);
+	CHECK(SSCP_BusOpen(bus, Emulator_GetPortName(emu), 115200, 0) == SSCP_SUCCESS);
+	readerA = SSCP_BusGetReader(bus, 1);
+	readerB = SSCP_BusGetReader(bus, 2);
+	CHECK((readerA != NULL) && (readerB != NULL));
+	CHECK(SSCP_Authenticate(readerA, NULL) == SSCP_SUCCESS);
+
+	memset(&item, 0, sizeof(item));
+	item.commandHeader = SSCP_CMD_OUTPUTS;
+	item.commandData = outputs;
+	item.commandDataSz = sizeof(outputs);
+
+	/* Until A completes, whatever it has received so far */
+	Emulator_SetResponseDelay(emu, 50);
+	CHECK(SSCP_AsyncSubmit(readerA, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncPoll(readerA) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_AsyncSubmit(readerB, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_Authenticate(readerB, NULL) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_Outputs(readerB, 1, 1, 0) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_ExchangeBatch(readerB, &item, 1, NULL) == SSCP_ERR_IN_PROGRESS);
+	while ((rc = SSCP_AsyncPoll(readerA)) == SSCP_ERR_IN_PROGRESS)
+		usleep(1000);
+	CHECK(rc == SSCP_SUCCESS);
+	CHECK(SSCP_Outputs(readerB, 1, 1, 0) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_AsyncComplete(readerA, NULL, 0, NULL) == SSCP_SUCCESS);
+	Emulator_SetResponseDelay(emu, 0);
+
+	/* Then the line is free, as after a cancel */
+	CHECK(SSCP_Outputs(readerA, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncSubmit(readerA, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncSubmit(readerB, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_AsyncCancel(readerA) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(readerB, NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_Outputs(readerB, 1, 1, 0) == SSCP_SUCCESS);
+
+	SSCP_BusFree(bus);
+	Emulator_Stop(emu);
+	Emulator_Free(emu);
+	return TRUE;
+}
+
+/* Reception of the frames */
+/* ----------------------- */
+
+/* Frame for the reader at address 0, the payload a count from first */
+static DWORD FrameBuild(BYTE frame[], BYTE protocol, DWORD length, BYTE first)
+{
+	DWORD i;
+
+	frame[0] = 0x02;
+	frame[1] = (BYTE)(length >> 8);
+	frame[2] = (BYTE) length;
+	frame[3] = 0x00;
+	frame[4] = protocol;
+	for (i = 0; i < length; i++)
+		frame[5 + i] = (BYTE)(first + i);
+	SSCP_SCR16(&frame[1], 4, &frame[5], length, &frame[5 + length]);
+
+	return 5 + length + 2;
+}
+
+/* As if the bytes had been received */
+static void RingFeed(SSCP_CTX_ST* ctx, const BYTE data[], DWORD dataSz)
+{
+	DWORD i;
+
+	for (i = 0; i < dataSz; i++)
+	{
+		ctx->port->rxRing[(ctx->port->rxHead + ctx->port->rxCount) % SSCP_RX_RING_SZ] = data[i];
+		ctx->port->rxCount++;
+	}
+}
+
+/* A SOF in the noise before a frame is not taken for the frame */
+static BOOL CheckRingResync(void)
+{
+	static const BYTE noise[] = { 0xFF, 0x02, 0x00, 0x05, 0x7E, 0x02, 0x13, 0x02, 0x00, 0x00, 0x00, 0x99 };
+	BYTE frame[64], stray[5], header[5], payload[64], crc[2];
+	DWORD frameSz;
+	SSCP_CTX_ST* ctx = SSCP_Alloc();
+
+	CHECK(ctx != NULL);
+	frameSz = FrameBuild(frame, SSCP_PROTOCOL_SECURE, 32, 0x40);
+
+	/* Headers that are not for the context */
+	RingFeed(ctx, noise, sizeof(noise));
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_SUCCESS);
+	CHECK(!memcmp(header, frame, 5) && !memcmp(payload, &frame[5], 32));
+	CHECK(ctx->port->rxCount == 0);
+
+	/* A header that could be one, and the frame after it: the CRC tells */
+	memcpy(stray, frame, 5);
+	stray[2] = 3;
+	RingFeed(ctx, stray, sizeof(stray));
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_SUCCESS);
+	CHECK(!memcmp(header, frame, 5) && !memcmp(payload, &frame[5], 32));
+	CHECK(ctx->port->rxCount == 0);
+
+	/* Not all there yet */
+	RingFeed(ctx, noise, sizeof(noise));
+	RingFeed(ctx, frame, frameSz - 1);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_ERR_IN_PROGRESS);
+	RingFeed(ctx, &frame[frameSz - 1], 1);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_SUCCESS);
+
+	/* A corrupted frame, with nothing after it, is reported */
+	frame[10] ^= 0x01;
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_ERR_WRONG_RESPONSE_CRC);
+	CHECK(ctx->port->rxCount == 0);
+
+	/* A SOF in its last byte: the frame that may start there is waited for */
+	frame[frameSz - 1] = 0x02;
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_ERR_IN_PROGRESS);
+	RingFeed(ctx, &stray[1], 4);
+	frameSz = FrameBuild(frame, SSCP_PROTOCOL_SECURE, 32, 0x40);
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_SUCCESS);
+	CHECK(!memcmp(header, frame, 5) && !memcmp(payload, &frame[5], 32));
+	CHECK(ctx->port->rxCount == 0);
+
+	/* ... and if nothing comes, the corrupted frame is reported once the line is quiet */
+	frame[10] ^= 0x01;
+	frame[frameSz - 1] = 0x02;
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, sizeof(payload), crc) == SSCP_ERR_IN_PROGRESS);
+	CHECK(SSCP_SerialRingSettle(ctx, header, crc));
+	CHECK(ctx->port->rxCount == 0);
+	CHECK(!SSCP_SerialRingSettle(ctx, header, crc));
+
+	/* Too long for the buffer, but a frame */
+	frameSz = FrameBuild(frame, SSCP_PROTOCOL_SECURE, 32, 0x40);
+	RingFeed(ctx, frame, frameSz);
+	CHECK(SSCP_SerialRingFrame(ctx, header, payload, 16, crc) == SSCP_ERR_RESPONSE_TOO_LONG);
+
+	SSCP_Free(ctx);
+	return TRUE;
+}
+
+/* Same for the frames received as they come */
+static BOOL CheckStreamResync(void)
+{
+	static const BYTE noise[] = { 0x13, 0x02, 0x00, 0x05, 0x7E, 0x02, 0x02, 0x01 };
+	BYTE frame[600], header[5], crc[2];
+	static BYTE payload[600];
+	DWORD frameSz;
+	SSCP_CTX_ST* ctx;
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	CHECK(master >= 0);
+	CHECK((grantpt(master) == 0) && (unlockpt(master) == 0));
+
+	ctx = SSCP_Alloc();
+	CHECK(ctx != NULL);
+	CHECK(SSCP_Open(ctx, ptsname(master), 115200, 0) == SSCP_SUCCESS);
+
+	frameSz = FrameBuild(frame, SSCP_PROTOCOL_SECURE, 512, 0x10);
+	CHECK(write(master, noise, sizeof(noise)) == (ssize_t) sizeof(noise));
+	CHECK(write(master, frame, frameSz) == (ssize_t) frameSz);
+
+	CHECK(SSCP_SerialRecvStream(ctx, header, payload, sizeof(payload), crc, NULL, NULL) == SSCP_SUCCESS);
+	CHECK(!memcmp(header, frame, 5) && !memcmp(payload, &frame[5], 512) && !memcmp(crc, &frame[5 + 512], 2));
+
+	SSCP_Free(ctx);
+	close(master);
+	return TRUE;
+}
+
+static LONG StreamOutputs(void* userData, DWORD offset, BYTE buffer[], DWORD length)
+{
+	static const BYTE outputs[3] = { 1, 1, 0 };
+
+	(void) userData;
+	memcpy(buffer, &outputs[offset], length);
+	return SSCP_SUCCESS;
+}
+
+/* The reader has taken the counter of a streamed command that timed out: the next command skips it */
+static BOOL CheckStreamTimeout(void)
+{
+	SSCP_STATISTICS_EX_ST before, after;
+	BYTE response[SSCP_STREAM_RESPONSE_OVERHEAD];
+	READER_ST reader;
+	DWORD received;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+
+	/* Beyond the 250 ms of the control commands */
+	Emulator_SetResponseDelay(reader.emu, 400);
+	CHECK(SSCP_ExchangeStream(reader.ctx, SSCP_CMD_OUTPUTS, 3, StreamOutputs, NULL, response, sizeof(response), NULL) == SSCP_ERR_COMM_RECV_MUTE);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK(after.counterResyncs == before.counterResyncs + 1);
+
+	/* Once the late response is in and dropped, the session goes on */
+	Emulator_SetResponseDelay(reader.emu, 0);
+	usleep(300000);
+	CHECK(SSCP_SerialFillRing(reader.ctx, 0, &received) == SSCP_SUCCESS);
+	CHECK(received > 0);
+	SSCP_SerialFlushRing(reader.ctx);
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, NULL, NULL, NULL) == SSCP_SUCCESS);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Multidrop bus */
+/* ------------- */
+
+/* One context per address, all on the port of the bus; a frame goes to the reader of its address only */
+static BOOL CheckBusReaders(void)
+{
+	BYTE frame[64], header[5], payload[64], crc[2];
+	SSCP_CTX_ST* readerA;
+	SSCP_CTX_ST* readerB;
+	EMULATOR_ST* emu;
+	SSCP_BUS_ST* bus;
+
+	emu = Emulator_Alloc(authKey);
+	CHECK((emu != NULL) && Emulator_StartPty(emu));
+	bus = SSCP_BusAlloc();
+	CHECK(bus != NULL);
+	CHECK(SSCP_BusOpen(bus, Emulator_GetPortName(emu), 115200, 0) == SSCP_SUCCESS);
+
+	readerA = SSCP_BusGetReader(bus, 1);
+	readerB = SSCP_BusGetReader(bus, 2);
+	CHECK((readerA != NULL) && (readerB != NULL) && (readerA != readerB));
+	CHECK(SSCP_BusGetReader(bus, 1) == readerA);
+	CHECK(SSCP_BusGetReader(bus, SSCP_BUS_MAX_READERS) == NULL);
+	CHECK((readerA->port == readerB->port) && (readerA->address == 1) && (readerB->address == 2));
+
+	/* Each reader has its own session */
+	CHECK(SSCP_Authenticate(readerA, NULL) == SSCP_SUCCESS);
+	CHECK((readerA->stats.sessionCount == 1) && (readerB->stats.sessionCount == 0));
+	CHECK(SSCP_Outputs(readerA, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(readerB, NULL) == SSCP_SUCCESS);
+	CHECK((readerA->stats.sessionCount == 1) && (readerB->stats.sessionCount == 1));
+	CHECK(SSCP_Outputs(readerB, 1, 1, 0) == SSCP_SUCCESS);
+
+	/* A frame for B in the ring of the port */
+	frame[0] = 0x02;
+	frame[1] = 0x00;
+	frame[2] = 16;
+	frame[3] = readerB->address;
+	frame[4] = SSCP_PROTOCOL_SECURE;
+	memset(&frame[5], 0x5A, 16);
+	SSCP_SCR16(&frame[1], 4, &frame[5], 16, &frame[5 + 16]);
+	SSCP_SerialFlushRing(readerA);
+	RingFeed(readerA, frame, 5 + 16 + 2);
+	CHECK(SSCP_SerialRingFrame(readerA, header, payload, sizeof(payload), crc) == SSCP_ERR_IN_PROGRESS);
+	SSCP_SerialFlushRing(readerA);
+	RingFeed(readerB, frame, 5 + 16 + 2);
+	CHECK(SSCP_SerialRingFrame(readerB, header, payload, sizeof(payload), crc) == SSCP_SUCCESS);
+	CHECK(header[3] == readerB->address);
+
+	/* Released on its own, the context leaves the bus, and the port stays open for the others */
+	SSCP_Free(readerB);
+	CHECK(bus->readers[2] == NULL);
+	CHECK(SSCP_Authenticate(readerA, NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_Outputs(readerA, 1, 1, 0) == SSCP_SUCCESS);
+
+	SSCP_BusFree(bus);
+	Emulator_Stop(emu);
+	Emulator_Free(emu);
+	return TRUE;
+}
+
+/* Large exchanges */
+/* --------------- */
+
+#define LARGE_COMMAND_SZ 3000
+
+/* Byte of the large TRANSCEIVE_APDU at offset, after its reserved byte */
+static BYTE LargeByte(DWORD offset)
+{
+	return (offset == 0) ? 0x00 : (BYTE)(offset * 7 + 3);
+}
+
+typedef struct
+{
+	DWORD nextOffset;
+	DWORD calls;
+	BOOL inOrder;
+} LARGE_SOURCE_ST;
+
+static LONG LargeSource(void* userData, DWORD offset, BYTE buffer[], DWORD length)
+{
+	LARGE_SOURCE_ST* source = userData;
+	DWORD i;
+
+	if ((offset != source->nextOffset) || (length > 1024))
+		source->inOrder = FALSE;
+	source->nextOffset = offset + length;
+	source->calls++;
+
+	for (i = 0; i < length; i++)
+		buffer[i] = LargeByte(offset + i);
+	return SSCP_SUCCESS;
+}
+
+/* Response of the emulated card, that echoes the APDU after the status of the reader */
+static BOOL LargeEchoed(const BYTE response[], DWORD responseSz)
+{
+	DWORD i;
+
+	if (responseSz != LARGE_COMMAND_SZ)
+		return FALSE;
+	for (i = 0; i < responseSz; i++)
+		if (response[i] != LargeByte(i))
+			return FALSE;
+
+	return TRUE;
+}
+
+/* A command of several pieces is read from the application in order, and its response deciphered in place */
+static BOOL CheckStreamLarge(void)
+{
+	static BYTE response[LARGE_COMMAND_SZ + SSCP_STREAM_RESPONSE_OVERHEAD];
+	LARGE_SOURCE_ST source;
+	READER_ST reader;
+	DWORD responseSz;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	memset(&source, 0, sizeof(source));
+	source.inOrder = TRUE;
+	CHECK(SSCP_ExchangeStream(reader.ctx, SSCP_CMD_TRANSCEIVE_APDU, LARGE_COMMAND_SZ, LargeSource, &source, response, sizeof(response), &responseSz) == SSCP_SUCCESS);
+	CHECK(source.inOrder && (source.nextOffset == LARGE_COMMAND_SZ) && (source.calls >= 3));
+	CHECK(LargeEchoed(response, responseSz));
+
+	/* No room for the whole response frame: the frame is dropped, the session goes on */
+	CHECK(SSCP_ExchangeStream(reader.ctx, SSCP_CMD_TRANSCEIVE_APDU, LARGE_COMMAND_SZ, LargeSource, &source, response, LARGE_COMMAND_SZ, &responseSz) == SSCP_ERR_RESPONSE_TOO_LONG);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* In pipeline mode, the same, through SSCP_Exchange(); the frame is sent again as it was ciphered */
+static BOOL CheckPipelineLarge(void)
+{
+	static BYTE command[LARGE_COMMAND_SZ], response[LARGE_COMMAND_SZ];
+	SSCP_STATISTICS_EX_ST before, after;
+	SSCP_SETTINGS_ST settings;
+	READER_ST reader;
+	DWORD i, responseSz;
+
+	for (i = 0; i < LARGE_COMMAND_SZ; i++)
+		command[i] = LargeByte(i);
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	CHECK(SSCP_GetSettings(reader.ctx, &settings) == SSCP_SUCCESS);
+	settings.pipeline = TRUE;
+	CHECK(SSCP_SetSettings(reader.ctx, &settings) == SSCP_SUCCESS);
+
+	CHECK(SSCP_Exchange(reader.ctx, SSCP_CMD_TRANSCEIVE_APDU, command, sizeof(command), response, sizeof(response), &responseSz) == SSCP_SUCCESS);
+	CHECK(LargeEchoed(response, responseSz));
+
+	/* The reader takes the resending with the same counter, so the cipher must be the same */
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+	Emulator_CorruptResponses(reader.emu, 1);
+	memset(response, 0, sizeof(response));
+	CHECK(SSCP_Exchange(reader.ctx, SSCP_CMD_TRANSCEIVE_APDU, command, sizeof(command), response, sizeof(response), &responseSz) == SSCP_SUCCESS);
+	CHECK(LargeEchoed(response, responseSz));
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK((after.corruptedRetries == before.corruptedRetries + 1) && (after.recoveries == before.recoveries + 1));
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Timeouts */
+/* -------- */
+
+/* Each class of command waits for its own timeout, plus the time its frame takes on the line */
+static BOOL CheckTimeoutClasses(void)
+{
+	static const BYTE cardUid[4] = { 0x04, 0x5A, 0x18, 0xC2 };
+	SSCP_TIMEOUT_PROFILE_ST profile;
+	SSCP_RETRY_POLICY_ST policy;
+	BYTE uid[10], ats[32], uidSz, atsSz;
+	READER_ST reader;
+	WORD protocol;
+	DWORD received, timeoutMs;
+	int i;
+
+	CHECK(SSCP_TimeoutClass(SSCP_CMD_GET_INFOS) == SSCP_TIMEOUT_CLASS_CONTROL);
+	CHECK(SSCP_TimeoutClass(SSCP_CMD_SCAN_GLOBAL) == SSCP_TIMEOUT_CLASS_CARD);
+	CHECK(SSCP_TimeoutClass(SSCP_CMD_SET_BAUDRATE) == SSCP_TIMEOUT_CLASS_SETUP);
+
+	/* 1152 bytes take 100 ms at 115200 bauds, 32 characters 3 ms */
+	CHECK(ReaderOpen(&reader, TRUE));
+	CHECK(SSCP_FirstByteTimeout(reader.ctx, SSCP_TIMEOUT_CLASS_CONTROL, 0) == SSCP_RESPONSE_CONTROL_TIMEOUT);
+	CHECK(SSCP_FirstByteTimeout(reader.ctx, SSCP_TIMEOUT_CLASS_CARD, 1152) == SSCP_RESPONSE_CARD_TIMEOUT + 100);
+	CHECK(SSCP_InterByteTimeout(reader.ctx) == SSCP_RESPONSE_NEXT_MIN_TIMEOUT + 3);
+
+	/* A reader that takes 100 ms: in time for a card command, too late for a control one (that no resending catches up) */
+	memset(&policy, 0, sizeof(policy));
+	policy.maxAttempts = 1;
+	CHECK(SSCP_SetRetryPolicy(reader.ctx, &policy) == SSCP_SUCCESS);
+	memset(&profile, 0, sizeof(profile));
+	profile.controlMs = 50;
+	CHECK(SSCP_SetTimeoutProfile(reader.ctx, &profile) == SSCP_SUCCESS);
+	Emulator_SetCard(reader.emu, cardUid, sizeof(cardUid));
+	Emulator_SetResponseDelay(reader.emu, 100);
+	CHECK(SSCP_ScanNFC(reader.ctx, &protocol, uid, sizeof(uid), &uidSz, ats, sizeof(ats), &atsSz) == SSCP_SUCCESS);
+	CHECK((uidSz == sizeof(cardUid)) && !memcmp(uid, cardUid, uidSz));
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, NULL, NULL, NULL) == SSCP_ERR_COMM_RECV_MUTE);
+
+	/* The late responses dropped, the session goes on */
+	Emulator_SetResponseDelay(reader.emu, 0);
+	usleep(400000);
+	CHECK(SSCP_SerialFillRing(reader.ctx, 0, &received) == SSCP_SUCCESS);
+	SSCP_SerialFlushRing(reader.ctx);
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, NULL, NULL, NULL) == SSCP_SUCCESS);
+
+	/* Adaptive: down to the observed response time, doubled after a timeout, never beyond the configured one */
+	memset(&profile, 0, sizeof(profile));
+	profile.adaptive = TRUE;
+	CHECK(SSCP_SetTimeoutProfile(reader.ctx, &profile) == SSCP_SUCCESS);
+	for (i = 0; i < 8; i++)
+		CHECK(SSCP_GetInfos(reader.ctx, NULL, NULL, NULL, NULL) == SSCP_SUCCESS);
+	timeoutMs = SSCP_FirstByteTimeout(reader.ctx, SSCP_TIMEOUT_CLASS_CONTROL, 0);
+	CHECK(timeoutMs < SSCP_RESPONSE_CONTROL_TIMEOUT);
+	SSCP_TimeoutExpired(reader.ctx, SSCP_TIMEOUT_CLASS_CONTROL);
+	CHECK(SSCP_FirstByteTimeout(reader.ctx, SSCP_TIMEOUT_CLASS_CONTROL, 0) > timeoutMs);
+	for (i = 0; i < 8; i++)
+		SSCP_TimeoutExpired(reader.ctx, SSCP_TIMEOUT_CLASS_CONTROL);
+	CHECK(SSCP_FirstByteTimeout(reader.ctx, SSCP_TIMEOUT_CLASS_CONTROL, 0) == SSCP_RESPONSE_CONTROL_TIMEOUT);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Retry policy */
+/* ------------ */
+
+/* A corrupted response is sent again with the same counter; once the attempts are spent, the counter skips the one the reader took */
+static BOOL CheckRetryCorrupted(void)
+{
+	SSCP_STATISTICS_EX_ST before, after;
+	SSCP_RETRY_POLICY_ST policy;
+	READER_ST reader;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+
+	/* One glitch: recovered by the resending */
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+	Emulator_CorruptResponses(reader.emu, 1);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK(after.crcErrors == before.crcErrors + 1);
+	CHECK(after.corruptedRetries == before.corruptedRetries + 1);
+	CHECK(after.recoveries == before.recoveries + 1);
+	CHECK(after.counterResyncs == before.counterResyncs);
+
+	/* Every attempt hit: the reader has taken the counter, the next command must be beyond it */
+	before = after;
+	Emulator_CorruptResponses(reader.emu, SSCP_RetryAttempts(reader.ctx));
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_ERR_WRONG_RESPONSE_CRC);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK(after.corruptedRetries == before.corruptedRetries + SSCP_RetryAttempts(reader.ctx) - 1);
+	CHECK(after.counterResyncs == before.counterResyncs + 1);
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, NULL, NULL, NULL) == SSCP_SUCCESS);
+
+	/* Resendings after the timeouts only */
+	memset(&policy, 0, sizeof(policy));
+	policy.timeoutsOnly = TRUE;
+	CHECK(SSCP_SetRetryPolicy(reader.ctx, &policy) == SSCP_SUCCESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &before, FALSE) == SSCP_SUCCESS);
+	Emulator_CorruptResponses(reader.emu, 1);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_ERR_WRONG_RESPONSE_CRC);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK(after.corruptedRetries == before.corruptedRetries);
+	CHECK(after.counterResyncs == before.counterResyncs + 1);
+
+	/* The counter kept, as asked */
+	policy.keepCounter = TRUE;
+	CHECK(SSCP_SetRetryPolicy(reader.ctx, &policy) == SSCP_SUCCESS);
+	before = after;
+	Emulator_CorruptResponses(reader.emu, 1);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_ERR_WRONG_RESPONSE_CRC);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &after, FALSE) == SSCP_SUCCESS);
+	CHECK(after.counterResyncs == before.counterResyncs);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Card presence polling */
+/* --------------------- */
+
+#define POLL_EVENTS 8
+
+typedef struct
+{
+	BYTE events[POLL_EVENTS];
+	BYTE uidSz[POLL_EVENTS];
+	BYTE firstUidByte[POLL_EVENTS];
+	DWORD count;
+	BOOL stopOnArrival;
+} POLL_LOG_ST;
+
+static BOOL PollChanged(SSCP_CTX_ST* ctx, BYTE event, const SSCP_CARD_ST* card, void* userData)
+{
+	POLL_LOG_ST* log = userData;
+
+	(void) ctx;
+
+	if (log->count < POLL_EVENTS)
+	{
+		log->events[log->count] = event;
+		log->uidSz[log->count] = card->uidSz;
+		log->firstUidByte[log->count] = card->uid[0];
+	}
+	log->count++;
+
+	return ((event == SSCP_POLL_CARD_ARRIVED) && log->stopOnArrival) ? FALSE : TRUE;
+}
+
+/* Step until the field has been polled for the given time */
+static BOOL PollRunFor(SSCP_CTX_ST* ctx, DWORD durationMs)
+{
+	DWORD startMs = SSCP_GetTickMs();
+	DWORD nextPollMs;
+
+	while (SSCP_GetTickMs() - startMs < durationMs)
+	{
+		CHECK(SSCP_PollStep(ctx, &nextPollMs) == SSCP_SUCCESS);
+		if (nextPollMs == SSCP_POLL_STOPPED)
+			break;
+		usleep(((nextPollMs < 5) ? nextPollMs : 5) * 1000);
+	}
+
+	return TRUE;
+}
+
+/* Each card is told once on arrival and once on removal; the period grows while the field stays empty */
+static BOOL CheckPollPresence(void)
+{
+	static const BYTE uidA[4] = { 0xA1, 0x22, 0x33, 0x44 };
+	static const BYTE uidB[7] = { 0xB1, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77 };
+	SSCP_POLL_CONFIG_ST config;
+	POLL_LOG_ST log;
+	READER_ST reader;
+	DWORD nextPollMs;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	memset(&config, 0, sizeof(config));
+	config.idleIntervalMs = 2 * SSCP_SCAN_GLOBAL_GUARD_TIME;
+	config.idleAfterMs = 100;
+	memset(&log, 0, sizeof(log));
+	CHECK(SSCP_PollStart(reader.ctx, &config, PollChanged, &log) == SSCP_SUCCESS);
+
+	/* Empty field: nothing told, the period backs off */
+	CHECK(PollRunFor(reader.ctx, 500));
+	CHECK(log.count == 0);
+	CHECK(reader.ctx->poll.intervalMs == config.idleIntervalMs);
+
+	/* A card: told once, however long it stays, and the period is back to the guard time */
+	Emulator_SetCard(reader.emu, uidA, sizeof(uidA));
+	CHECK(PollRunFor(reader.ctx, 600));
+	CHECK(log.count == 1);
+	CHECK((log.events[0] == SSCP_POLL_CARD_ARRIVED) && (log.uidSz[0] == sizeof(uidA)) && (log.firstUidByte[0] == uidA[0]));
+	CHECK(reader.ctx->poll.intervalMs == SSCP_SCAN_GLOBAL_GUARD_TIME);
+
+	/* Another card in its place: the first one is removed, then the second one arrives */
+	Emulator_SetCard(reader.emu, uidB, sizeof(uidB));
+	CHECK(PollRunFor(reader.ctx, 300));
+	CHECK(log.count == 3);
+	CHECK((log.events[1] == SSCP_POLL_CARD_REMOVED) && (log.firstUidByte[1] == uidA[0]));
+	CHECK((log.events[2] == SSCP_POLL_CARD_ARRIVED) && (log.uidSz[2] == sizeof(uidB)) && (log.firstUidByte[2] == uidB[0]));
+
+	Emulator_SetCard(reader.emu, NULL, 0);
+	CHECK(PollRunFor(reader.ctx, 300));
+	CHECK(log.count == 4);
+	CHECK((log.events[3] == SSCP_POLL_CARD_REMOVED) && (log.firstUidByte[3] == uidB[0]));
+
+	/* The callback stops the polling: the scans the application makes get the plain guard time */
+	log.stopOnArrival = TRUE;
+	Emulator_SetCard(reader.emu, uidA, sizeof(uidA));
+	CHECK(PollRunFor(reader.ctx, 600));
+	CHECK(log.count == 5);
+	CHECK(SSCP_PollStep(reader.ctx, &nextPollMs) == SSCP_SUCCESS);
+	CHECK(nextPollMs == SSCP_POLL_STOPPED);
+	CHECK(reader.ctx->guardValue == SSCP_SCAN_GLOBAL_GUARD_TIME);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Health */
+/* ------ */
+
+#define HEALTH_CHANGES 8
+
+static BYTE healthChanges[HEALTH_CHANGES];
+static DWORD healthChangeCount;
+
+static void HealthChanged(SSCP_CTX_ST* ctx, BYTE state, const SSCP_HEALTH_ST* health, void* userData)
+{
+	(void) ctx;
+	(void) health;
+	(void) userData;
+
+	if (healthChangeCount < HEALTH_CHANGES)
+		healthChanges[healthChangeCount] = state;
+	healthChangeCount++;
+}
+
+/* Step until the reader has been watched for the given time */
+static BOOL HealthRun(SSCP_CTX_ST* ctx, DWORD durationMs)
+{
+	DWORD startMs = SSCP_GetTickMs();
+	DWORD nextStepMs;
+
+	while (SSCP_GetTickMs() - startMs < durationMs)
+	{
+		CHECK(SSCP_HealthStep(ctx, &nextStepMs) == SSCP_SUCCESS);
+		CHECK(nextStepMs != SSCP_HEALTH_STOPPED);
+		usleep(((nextStepMs < 5) ? nextStepMs : 5) * 1000);
+	}
+
+	return TRUE;
+}
+
+/* A silent reader gets its heartbeats; once restarted, it is found down, then its session is established again */
+static BOOL CheckHealthTransitions(void)
+{
+	SSCP_TIMEOUT_PROFILE_ST profile;
+	SSCP_HEALTH_CONFIG_ST config;
+	SSCP_HEALTH_ST health;
+	READER_ST reader;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	memset(&profile, 0, sizeof(profile));
+	profile.controlMs = 50;
+	CHECK(SSCP_SetTimeoutProfile(reader.ctx, &profile) == SSCP_SUCCESS);
+
+	memset(&config, 0, sizeof(config));
+	config.intervalMs = 20;
+	config.idleGapMs = 1;
+	config.retryMs = 20;
+	healthChangeCount = 0;
+	CHECK(SSCP_HealthStart(reader.ctx, &config, HealthChanged, NULL) == SSCP_SUCCESS);
+
+	/* In order: heartbeats, no change */
+	CHECK(HealthRun(reader.ctx, 100));
+	CHECK(SSCP_GetHealth(reader.ctx, &health) == SSCP_SUCCESS);
+	CHECK(health.state == SSCP_HEALTH_OK);
+	CHECK((health.heartbeats >= 2) && (health.heartbeatFailures == 0));
+	CHECK(health.voltage == 5000);
+	CHECK(healthChangeCount == 0);
+
+	/* Restarted: mute to the session, down, then authenticated again */
+	Emulator_Restart(reader.emu);
+	CHECK(HealthRun(reader.ctx, 1000));
+	CHECK(SSCP_GetHealth(reader.ctx, &health) == SSCP_SUCCESS);
+	CHECK(health.state == SSCP_HEALTH_OK);
+	CHECK((health.linkLosses == 1) && (health.sessionLosses == 1) && (health.reauthentications == 1));
+	CHECK(health.heartbeatFailures >= 1);
+	CHECK(healthChangeCount == 2);
+	CHECK((healthChanges[0] == SSCP_HEALTH_LINK_DOWN) && (healthChanges[1] == SSCP_HEALTH_OK));
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+
+	/* Left to the application: the state is told, the session is not touched */
+	config.manualRecovery = TRUE;
+	healthChangeCount = 0;
+	CHECK(SSCP_HealthStart(reader.ctx, &config, HealthChanged, NULL) == SSCP_SUCCESS);
+	Emulator_Restart(reader.emu);
+	CHECK(HealthRun(reader.ctx, 500));
+	CHECK(SSCP_GetHealth(reader.ctx, &health) == SSCP_SUCCESS);
+	CHECK((health.state == SSCP_HEALTH_LINK_DOWN) && (health.reauthentications == 0));
+	CHECK((healthChangeCount == 1) && (healthChanges[0] == SSCP_HEALTH_LINK_DOWN));
+
+	CHECK(SSCP_HealthStop(reader.ctx) == SSCP_SUCCESS);
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Baudrate switch */
+/* --------------- */
+
+/* The reader and the port take the new baudrate; a switch that changes nothing neither exchanges nor waits */
+static BOOL CheckBaudrateSwitch(void)
+{
+	READER_ST reader;
+	BYTE selector;
+	DWORD exchanges, startMs;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	CHECK(SSCP_NegotiateBaudrate(reader.ctx, 57600) == SSCP_SUCCESS);
+	CHECK(reader.ctx->port->baudrate == 57600);
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, &selector, NULL, NULL) == SSCP_SUCCESS);
+	CHECK(selector == 0x03);
+
+	exchanges = Emulator_GetExchangeCount(reader.emu);
+	CHECK(SSCP_NegotiateBaudrate(reader.ctx, 57600) == SSCP_SUCCESS);
+	CHECK(SSCP_NegotiateBaudrate(reader.ctx, 230400) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(Emulator_GetExchangeCount(reader.emu) == exchanges);
+
+	/* Refused by the reader: the port stays at its baudrate, without waiting for a switch */
+	Emulator_SetMaxBaudrate(reader.emu, 0x02);
+	startMs = SSCP_GetTickMs();
+	CHECK(SSCP_NegotiateBaudrate(reader.ctx, 115200) > 0);
+	CHECK(SSCP_GetTickMs() - startMs < SSCP_BAUDRATE_SWITCH_DELAY);
+	CHECK(reader.ctx->port->baudrate == 57600);
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, &selector, NULL, NULL) == SSCP_SUCCESS);
+	CHECK(selector == 0x03);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* TCP transport */
+/* ------------- */
+
+/* A reader behind a gateway: same session as on a serial port; once the gateway is gone, the exchanges fail at once */
+static BOOL CheckTcpTransport(void)
+{
+	static const BYTE outputs[3] = { 1, 1, 0 };
+	BYTE response[SSCP_STREAM_RESPONSE_OVERHEAD];
+	EMULATOR_ST* emu;
+	SSCP_CTX_ST* ctx;
+	char name[64];
+	DWORD startMs;
+	LONG rc;
+
+	ctx = SSCP_Alloc();
+	CHECK(ctx != NULL);
+	CHECK(SSCP_Open(ctx, "tcp://127.0.0.1", 115200, 0) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(SSCP_Open(ctx, "tcp://127.0.0.1:", 115200, 0) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(SSCP_Open(ctx, "tcp://[::1]", 115200, 0) == SSCP_ERR_INVALID_PARAMETER);
+
+	emu = Emulator_Alloc(authKey);
+	CHECK((emu != NULL) && Emulator_StartTcp(emu));
+	snprintf(name, sizeof(name), "%s", Emulator_GetPortName(emu));
+	CHECK(SSCP_Open(ctx, name, 115200, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(ctx, NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_Outputs(ctx, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_ExchangeStream(ctx, SSCP_CMD_OUTPUTS, 3, StreamOutputs, NULL, response, sizeof(response), NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncSubmit(ctx, SSCP_CMD_OUTPUTS, outputs, sizeof(outputs)) == SSCP_SUCCESS);
+	while ((rc = SSCP_AsyncPoll(ctx)) == SSCP_ERR_IN_PROGRESS)
+		usleep(1000);
+	CHECK(rc == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncComplete(ctx, NULL, 0, NULL) == SSCP_SUCCESS);
+
+	/* The connection closed: no waiting for the response timeout */
+	Emulator_Stop(emu);
+	startMs = SSCP_GetTickMs();
+	rc = SSCP_GetInfos(ctx, NULL, NULL, NULL, NULL);
+	CHECK((rc == SSCP_ERR_COMM_RECV_FAILED) || (rc == SSCP_ERR_COMM_SEND_FAILED));
+	CHECK(SSCP_GetTickMs() - startMs < SSCP_RESPONSE_CONTROL_TIMEOUT);
+	CHECK(SSCP_Close(ctx) == SSCP_SUCCESS);
+
+	/* Nobody listens any more */
+	CHECK(SSCP_Open(ctx, name, 115200, 0) == SSCP_ERR_COMM_NOT_AVAILABLE);
+
+	SSCP_Free(ctx);
+	Emulator_Free(emu);
+	return TRUE;
+}
+
+/* Key cache */
+/* --------- */
+
+/* Entries of the cache that hold the key */
+static DWORD CacheHolds(SSCP_KEY_CACHE_ST* cache, const BYTE key[16])
+{
+	DWORD i, count = 0;
+
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+		if (cache->entries[i].ready && !memcmp(cache->entries[i].key, key, 16))
+			count++;
+
+	return count;
+}
+
+/* Cached or not, the derivations are the same */
+static BOOL CacheUse(SSCP_KEY_CACHE_ST* cache, const BYTE key[16])
+{
+	static const BYTE message[] = "rndA | rndB";
+	BYTE hmac[32], expectedHmac[32];
+	BYTE blocks[32], expectedBlocks[32], keyPrime[16], expectedKeyPrime[16];
+	DWORD i;
+
+	for (i = 0; i < sizeof(blocks); i++)
+		blocks[i] = expectedBlocks[i] = (BYTE)(i * 7);
+
+	CHECK(SSCP_KeyCacheHMAC(cache, key, message, sizeof(message), hmac));
+	CHECK(SSCP_HMAC(key, message, sizeof(message), expectedHmac));
+	CHECK(!memcmp(hmac, expectedHmac, 32));
+
+	SSCP_KeyCacheEncrypt(cache, key, blocks, 2, keyPrime);
+	SSCP_KeyCacheEncrypt(NULL, key, expectedBlocks, 2, expectedKeyPrime);
+	CHECK(!memcmp(blocks, expectedBlocks, 32) && !memcmp(keyPrime, expectedKeyPrime, 16));
+
+	return TRUE;
+}
+
+/* A key is filled once, then found; once full, the least recently used entry is replaced */
+static BOOL CheckKeyCache(void)
+{
+	BYTE keys[SSCP_KEY_CACHE_SLOTS + 2][16];
+	SSCP_KEY_CACHE_ST* cache = SSCP_KeyCacheAlloc();
+	READER_ST reader;
+	DWORD i;
+
+	CHECK(cache != NULL);
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS + 2; i++)
+		memset(keys[i], (int)(0x11 * (i + 1)), 16);
+
+	/* Miss, then hit */
+	CHECK(CacheUse(cache, keys[0]));
+	CHECK(CacheHolds(cache, keys[0]) == 1);
+	CHECK(CacheUse(cache, keys[0]));
+	CHECK(CacheHolds(cache, keys[0]) == 1);
+
+	/* Full; keys[1] is then the least recently used */
+	for (i = 1; i < SSCP_KEY_CACHE_SLOTS; i++)
+		CHECK(CacheUse(cache, keys[i]));
+	CHECK(CacheUse(cache, keys[0]));
+
+	CHECK(CacheUse(cache, keys[SSCP_KEY_CACHE_SLOTS]));
+	CHECK(CacheHolds(cache, keys[SSCP_KEY_CACHE_SLOTS]) == 1);
+	CHECK(CacheHolds(cache, keys[1]) == 0);
+	CHECK(CacheHolds(cache, keys[0]) == 1);
+	for (i = 2; i < SSCP_KEY_CACHE_SLOTS; i++)
+		CHECK(CacheHolds(cache, keys[i]) == 1);
+
+	/* Every entry held by another thread: processed without the cache */
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+		cache->entries[i].refs++;
+	CHECK(CacheUse(cache, keys[SSCP_KEY_CACHE_SLOTS + 1]));
+	CHECK(CacheHolds(cache, keys[SSCP_KEY_CACHE_SLOTS + 1]) == 0);
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+		cache->entries[i].refs--;
+
+	/* Through an authentication */
+	CHECK(ReaderOpen(&reader, FALSE));
+	CHECK(SSCP_SetKeyCache(reader.ctx, cache) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(reader.ctx, NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(reader.ctx, NULL) == SSCP_SUCCESS);
+	CHECK(CacheHolds(cache, authKey) == 1);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+	ReaderClose(&reader);
+
+	SSCP_KeyCacheFree(cache);
+	return TRUE;
+}
+
+/* APDU script */
+/* ----------- */
+
+/*
+ * The emulated card echoes the APDU: one that ends with 61 xx gets a GET RESPONSE,
+ * whose echo (class, C0, 00, then 00 xx as the status word) tells its class
+ */
+static BOOL CheckGetResponseClass(void)
+{
+	static const BYTE classes[][2] =
+	{
+		{ 0x00, 0x00 }, { 0x0D, 0x01 }, { 0x13, 0x03 }, /* Channels 0 to 3, secure messaging and chaining bits dropped */
+		{ 0x40, 0x40 }, { 0x6B, 0x4B }, { 0x5F, 0x4F }, /* Channels 4 to 19 */
+		{ 0x90, 0x00 }, /* Proprietary class */
+	};
+	READER_ST reader;
+	DWORD i;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+	{
+		BYTE apdu[4] = { classes[i][0], 0xB0, 0x61, 0x10 };
+		BYTE response[16];
+		SSCP_APDU_STEP_ST step;
+
+		memset(&step, 0, sizeof(step));
+		step.apdu = apdu;
+		step.apduSz = sizeof(apdu);
+		step.flags = SSCP_APDU_CHAIN_GET_RESPONSE;
+		step.response = response;
+		step.maxResponseSz = sizeof(response);
+		CHECK(SSCP_RunApduScript(reader.ctx, &step, 1, NULL) == SSCP_SUCCESS);
+		CHECK((step.actResponseSz == 5) && (step.sw == 0x0010));
+		CHECK((response[2] == classes[i][1]) && (response[3] == 0xC0));
+	}
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* What the emulated card expects, and what it answers */
+typedef struct
+{
+	BYTE apdu[16];
+	DWORD apduSz;
+	BYTE response[8];
+	DWORD responseSz;
+} CARD_EXCHANGE_ST;
+
+typedef struct
+{
+	const CARD_EXCHANGE_ST* exchanges;
+	DWORD exchangeCount;
+	DWORD done;
+	BOOL unexpected;
+} CARD_SCRIPT_ST;
+
+/* The card of the script, that answers 6F00 to an APDU it does not expect */
+static DWORD CardScriptApdu(void* userData, const BYTE apdu[], DWORD apduSz, BYTE response[])
+{
+	CARD_SCRIPT_ST* script = (CARD_SCRIPT_ST*) userData;
+	const CARD_EXCHANGE_ST* exchange = &script->exchanges[script->done];
+
+	if ((script->done >= script->exchangeCount) || (apduSz != exchange->apduSz) || memcmp(apdu, exchange->apdu, apduSz))
+	{
+		script->unexpected = TRUE;
+		response[0] = 0x6F;
+		response[1] = 0x00;
+		return 2;
+	}
+
+	script->done++;
+	memcpy(response, exchange->response, exchange->responseSz);
+	return exchange->responseSz;
+}
+
+/* 6Cxx sends again the APDU just sent, GET RESPONSE included, with Le = xx in the form of its Le */
+static BOOL CheckApduWrongLength(void)
+{
+	static const CARD_EXCHANGE_ST exchanges[] =
+	{
+		/* GET RESPONSE, then the GET RESPONSE again */
+		{ { 0x00, 0xB0, 0x00, 0x00, 0x00 }, 5, { 0x61, 0x10 }, 2 },
+		{ { 0x00, 0xC0, 0x00, 0x00, 0x10 }, 5, { 0x6C, 0x04 }, 2 },
+		{ { 0x00, 0xC0, 0x00, 0x00, 0x04 }, 5, { 0xDE, 0xAD, 0xBE, 0xEF, 0x90, 0x00 }, 6 },
+		/* Short case 4 */
+		{ { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00, 0x00 }, 8, { 0x6C, 0x1C }, 2 },
+		{ { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00, 0x1C }, 8, { 0x90, 0x00 }, 2 },
+		/* Extended case 2 */
+		{ { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x00 }, 7, { 0x6C, 0x20 }, 2 },
+		{ { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x20 }, 7, { 0xAA, 0x90, 0x00 }, 3 },
+		/* Extended case 4, 6C00 is 256 */
+		{ { 0x00, 0xCB, 0x3F, 0xFF, 0x00, 0x00, 0x02, 0x5C, 0x00, 0x00, 0x00 }, 11, { 0x6C, 0x00 }, 2 },
+		{ { 0x00, 0xCB, 0x3F, 0xFF, 0x00, 0x00, 0x02, 0x5C, 0x00, 0x01, 0x00 }, 11, { 0xBB, 0x90, 0x00 }, 3 },
+		/* Case 3: no Le to correct */
+		{ { 0x00, 0xD6, 0x00, 0x00, 0x01, 0xAA }, 6, { 0x6C, 0x10 }, 2 },
+	};
+	static const DWORD stepFirst[] = { 0, 3, 5, 7, 9 };
+	SSCP_APDU_STEP_ST steps[5];
+	CARD_SCRIPT_ST script;
+	BYTE responses[5][8];
+	READER_ST reader;
+	DWORD i, doneCount;
+
+	memset(&script, 0, sizeof(script));
+	script.exchanges = exchanges;
+	script.exchangeCount = sizeof(exchanges) / sizeof(exchanges[0]);
+
+	memset(steps, 0, sizeof(steps));
+	for (i = 0; i < 5; i++)
+	{
+		steps[i].apdu = exchanges[stepFirst[i]].apdu;
+		steps[i].apduSz = exchanges[stepFirst[i]].apduSz;
+		steps[i].expectedSw = 0x9000;
+		steps[i].expectedSwMask = 0xFFFF;
+		steps[i].flags = SSCP_APDU_CHAIN_GET_RESPONSE;
+		steps[i].response = responses[i];
+		steps[i].maxResponseSz = sizeof(responses[i]);
+	}
+
+	CHECK(ReaderOpen(&reader, TRUE));
+	Emulator_SetCardApdu(reader.emu, CardScriptApdu, &script);
+	CHECK(SSCP_RunApduScript(reader.ctx, steps, 5, &doneCount) == SSCP_ERR_NFC_CARD_UNEXPECTED_SW);
+	CHECK(!script.unexpected && (script.done == script.exchangeCount) && (doneCount == 5));
+
+	CHECK((steps[0].result == SSCP_SUCCESS) && (steps[0].actResponseSz == 4) && !memcmp(responses[0], "\xDE\xAD\xBE\xEF", 4));
+	CHECK((steps[1].result == SSCP_SUCCESS) && (steps[1].actResponseSz == 0));
+	CHECK((steps[2].result == SSCP_SUCCESS) && (steps[2].actResponseSz == 1) && (responses[2][0] == 0xAA));
+	CHECK((steps[3].result == SSCP_SUCCESS) && (steps[3].actResponseSz == 1) && (responses[3][0] == 0xBB));
+	CHECK((steps[4].result == SSCP_ERR_NFC_CARD_UNEXPECTED_SW) && (steps[4].sw == 0x6C10));
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Sessions carried over */
+/* --------------------- */
+
+/* Another context (another process) on the port of the reader */
+static SSCP_CTX_ST* ReaderReopen(READER_ST* reader)
+{
+	SSCP_Free(reader->ctx);
+	reader->ctx = SSCP_Alloc();
+	if ((reader->ctx == NULL) || (SSCP_Open(reader->ctx, Emulator_GetPortName(reader->emu), 115200, 0) != SSCP_SUCCESS))
+		return NULL;
+
+	return reader->ctx;
+}
+
+/* A session goes on in another context; a blob that is not the one sealed, or that is stale, does not */
+static BOOL CheckSessionResume(void)
+{
+	static const BYTE sealKey[16] = { 0x53, 0x45, 0x41, 0x4C };
+	BYTE blob[SSCP_SESSION_BLOB_SZ], other[SSCP_SESSION_BLOB_SZ];
+	READER_ST reader;
+	BOOL resumed;
+
+	CHECK(ReaderOpen(&reader, FALSE));
+	CHECK(SSCP_ExportSession(reader.ctx, sealKey, blob) == SSCP_ERR_INVALID_CONTEXT); /* No session yet */
+	CHECK(SSCP_Authenticate(reader.ctx, NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_ExportSession(reader.ctx, sealKey, blob) == SSCP_SUCCESS);
+
+	/* Tampered, sealed with another key, or cut */
+	CHECK(ReaderReopen(&reader) != NULL);
+	memcpy(other, blob, sizeof(other));
+	other[40] ^= 0x01;
+	CHECK(SSCP_ImportSession(reader.ctx, sealKey, other, sizeof(other)) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(SSCP_ImportSession(reader.ctx, authKey, blob, sizeof(blob)) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(SSCP_ImportSession(reader.ctx, sealKey, blob, 10) == SSCP_ERR_INVALID_PARAMETER);
+
+	/* The session goes on, its counter included */
+	CHECK(SSCP_ResumeSession(reader.ctx, sealKey, blob, sizeof(blob), NULL, &resumed) == SSCP_SUCCESS);
+	CHECK(resumed);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+
+	/* A new session makes the blob stale: a new authentication instead */
+	CHECK(SSCP_Authenticate(reader.ctx, NULL) == SSCP_SUCCESS);
+	CHECK(ReaderReopen(&reader) != NULL);
+	CHECK(SSCP_ResumeSession(reader.ctx, sealKey, blob, sizeof(blob), NULL, &resumed) == SSCP_SUCCESS);
+	CHECK(!resumed);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Batch of commands */
+/* ----------------- */
+
+#define BATCH_ITEMS 6
+
+/* Each item of a batch gets its own response, a faulty item stops it before anything is sent */
+static BOOL CheckBatch(void)
+{
+	static const BYTE outputs[3] = { 0x01, 0x01, 0x00 };
+	static BYTE commands[BATCH_ITEMS][200], responses[BATCH_ITEMS][256];
+	SSCP_BATCH_ITEM_ST items[BATCH_ITEMS];
+	READER_ST reader;
+	DWORD doneCount, counter, i;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+
+	/* Outputs, then APDUs long enough for the next frame to be ciphered during the exchange, then the infos */
+	memset(items, 0, sizeof(items));
+	items[0].commandHeader = SSCP_CMD_OUTPUTS;
+	items[0].commandData = outputs;
+	items[0].commandDataSz = sizeof(outputs);
+	for (i = 1; i < BATCH_ITEMS - 1; i++)
+	{
+		memset(commands[i], (int) i, sizeof(commands[i]));
+		items[i].commandHeader = SSCP_CMD_TRANSCEIVE_APDU;
+		items[i].commandData = commands[i];
+		items[i].commandDataSz = 50 * i;
+		items[i].responseData = responses[i];
+		items[i].maxResponseDataSz = sizeof(responses[i]);
+	}
+	items[BATCH_ITEMS - 1].commandHeader = SSCP_CMD_GET_INFOS;
+	items[BATCH_ITEMS - 1].responseData = responses[BATCH_ITEMS - 1];
+	items[BATCH_ITEMS - 1].maxResponseDataSz = sizeof(responses[BATCH_ITEMS - 1]);
+
+	counter = reader.ctx->counter;
+	CHECK(SSCP_ExchangeBatch(reader.ctx, items, BATCH_ITEMS, &doneCount) == SSCP_SUCCESS);
+	CHECK(doneCount == BATCH_ITEMS);
+	CHECK(reader.ctx->counter == counter + 2 * BATCH_ITEMS);
+	for (i = 0; i < BATCH_ITEMS; i++)
+		CHECK(items[i].result == SSCP_SUCCESS);
+	CHECK(items[0].actResponseDataSz == 0);
+	for (i = 1; i < BATCH_ITEMS - 1; i++)
+	{
+		/* The emulator answers an APDU with a status, then the APDU after its first byte */
+		CHECK(items[i].actResponseDataSz == 50 * i);
+		CHECK((responses[i][0] == 0x00) && !memcmp(&responses[i][1], &commands[i][1], 50 * i - 1));
+	}
+	CHECK(items[BATCH_ITEMS - 1].actResponseDataSz == 5);
+
+	/* Too long, or no data but a size: refused with nothing sent, the session goes on */
+	counter = reader.ctx->counter;
+	items[2].commandDataSz = SSCP_MAX_PAYLOAD_SZ + 1;
+	CHECK(SSCP_ExchangeBatch(reader.ctx, items, BATCH_ITEMS, &doneCount) == SSCP_ERR_COMMAND_TOO_LONG);
+	CHECK(doneCount == 0);
+	items[2].commandDataSz = 100;
+	items[2].commandData = NULL;
+	CHECK(SSCP_ExchangeBatch(reader.ctx, items, BATCH_ITEMS, &doneCount) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(doneCount == 0);
+	CHECK(reader.ctx->counter == counter);
+	CHECK(SSCP_GetInfos(reader.ctx, NULL, NULL, NULL, NULL) == SSCP_SUCCESS);
+
+	/* Nothing to exchange */
+	CHECK(SSCP_ExchangeBatch(reader.ctx, NULL, 0, &doneCount) == SSCP_SUCCESS);
+	CHECK(doneCount == 0);
+	CHECK(SSCP_ExchangeBatch(NULL, items, BATCH_ITEMS, &doneCount) == SSCP_ERR_INVALID_CONTEXT);
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Capture and replay */
+/* ------------------ */
+
+#if SSCP_WITH_CAPTURE
+
+/* The session of the capture: an authentication, then a few exchanges */
+static BOOL CaptureSession(SSCP_CTX_ST* ctx, const char* portName)
+{
+	DWORD i;
+
+	CHECK(SSCP_Open(ctx, portName, 115200, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(ctx, NULL) == SSCP_SUCCESS);
+	for (i = 0; i < 3; i++)
+		CHECK(SSCP_GetInfos(ctx, NULL, NULL, NULL, NULL) == SSCP_SUCCESS);
+	SSCP_Close(ctx);
+
+	return TRUE;
+}
+
+/* A recorded session plays back without the reader, a host that diverges from it is told */
+static BOOL CheckCaptureReplay(void)
+{
+	char path[64], portName[256];
+	SSCP_CTX_ST* ctx;
+	READER_ST reader;
+
+	snprintf(path, sizeof(path), "/tmp/sscp-checks-%lu.cap", (unsigned long) getpid());
+
+	CHECK(ReaderOpen(&reader, FALSE));
+	snprintf(portName, sizeof(portName), "capture:%s|%s", path, Emulator_GetPortName(reader.emu));
+	SSCP_Close(reader.ctx);
+	CHECK(CaptureSession(reader.ctx, portName));
+	ReaderClose(&reader);
+
+	/* The reader is gone: with the recorded latency, then without */
+	ctx = SSCP_Alloc();
+	CHECK(ctx != NULL);
+	snprintf(portName, sizeof(portName), "replay:%s", path);
+	CHECK(CaptureSession(ctx, portName));
+	snprintf(portName, sizeof(portName), "replay:%s|max", path);
+	CHECK(CaptureSession(ctx, portName));
+
+	/* Another command than the recorded one */
+	CHECK(SSCP_Open(ctx, portName, 115200, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_Authenticate(ctx, NULL) == SSCP_SUCCESS);
+	CHECK(SSCP_Outputs(ctx, 1, 1, 0) == SSCP_ERR_COMM_SEND_FAILED);
+	SSCP_Close(ctx);
+
+	/* A capture of a replay, and a file that is not there */
+	snprintf(portName, sizeof(portName), "capture:%s.copy|replay:%s", path, path);
+	CHECK(SSCP_Open(ctx, portName, 115200, 0) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(SSCP_Open(ctx, "replay:/nonexistent/sscp.cap", 115200, 0) == SSCP_ERR_COMM_NOT_AVAILABLE);
+
+	SSCP_Free(ctx);
+	remove(path);
+	return TRUE;
+}
+
+#endif
+
+/* Statistics */
+/* ---------- */
+
+/* Figures of the command in the snapshot, NULL if it is not there */
+static const SSCP_COMMAND_STATISTICS_ST* StatsCommand(const SSCP_STATISTICS_EX_ST* stats, DWORD commandHeader)
+{
+	DWORD i;
+
+	for (i = 0; i < SSCP_STATS_MAX_COMMANDS; i++)
+		if (stats->commands[i].commandHeader == commandHeader)
+			return &stats->commands[i];
+
+	return NULL;
+}
+
+/* A reset restarts every figure, the maximal latency included */
+static BOOL CheckStatsReset(void)
+{
+	static SSCP_STATISTICS_EX_ST stats;
+	const SSCP_COMMAND_STATISTICS_ST* command;
+	READER_ST reader;
+
+	CHECK(ReaderOpen(&reader, TRUE));
+
+	/* A slow exchange, then the snapshot that resets */
+	Emulator_SetResponseDelay(reader.emu, 50);
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+	Emulator_SetResponseDelay(reader.emu, 0);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &stats, TRUE) == SSCP_SUCCESS);
+	command = StatsCommand(&stats, SSCP_CMD_OUTPUTS);
+	CHECK((command != NULL) && (command->count == 1) && (command->maxUs >= 50000));
+
+	/* Nothing since the reset */
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &stats, FALSE) == SSCP_SUCCESS);
+	command = StatsCommand(&stats, SSCP_CMD_OUTPUTS);
+	CHECK((command != NULL) && (command->count == 0) && (command->maxUs == 0));
+
+	/* The maximum of the fast exchanges only */
+	CHECK(SSCP_Outputs(reader.ctx, 1, 1, 0) == SSCP_SUCCESS);
+	CHECK(SSCP_GetStatisticsEx(reader.ctx, &stats, FALSE) == SSCP_SUCCESS);
+	command = StatsCommand(&stats, SSCP_CMD_OUTPUTS);
+	CHECK((command != NULL) && (command->count == 1) && (command->maxUs > 0) && (command->maxUs < 50000));
+
+	ReaderClose(&reader);
+	return TRUE;
+}
+
+/* Random values of the exchanges */
+/* ------------------------------ */
+
+/*
+ * Known answer of the CTR_DRBG (NIST SP 800-90A, AES-128, no derivation function,
+ * no prediction resistance, no personalization string nor additional input), in the
+ * layout of the CAVP CTR_DRBG.rsp tests: instantiate, reseed, generate 512 bits
+ * twice, the second output is the expected one. Cross-checked with the CTR-DRBG of
+ * OpenSSL 3 (AES-128-CTR, use_df = 0).
+ */
+static BOOL CheckCtrDrbg(void)
+{
+	static const BYTE entropyInput[32] = {
+		0xED, 0x1E, 0x7F, 0x21, 0xEF, 0x66, 0xEA, 0x5D, 0x8E, 0x2A, 0x85, 0xB9, 0x33, 0x72, 0x45, 0x44,
+		0x5B, 0x71, 0xD6, 0x39, 0x3A, 0x4E, 0xEC, 0xB0, 0xE6, 0x3C, 0x19, 0x3D, 0x0F, 0x72, 0xF9, 0xA9
+	};
+	static const BYTE entropyInputReseed[32] = {
+		0x30, 0x3F, 0xB5, 0x19, 0xF0, 0xA4, 0xE1, 0x7D, 0x6D, 0xF0, 0xB6, 0x42, 0x6A, 0xA0, 0xEC, 0xB2,
+		0xA3, 0x60, 0x79, 0xBD, 0x48, 0xBE, 0x47, 0xAD, 0x2A, 0x8D, 0xBF, 0xE4, 0x8D, 0xA3, 0xEF, 0xAD
+	};
+	static const BYTE returnedBits[64] = {
+		0xF8, 0x01, 0x11, 0xD0, 0x8E, 0x87, 0x46, 0x72, 0xF3, 0x2F, 0x42, 0x99, 0x71, 0x33, 0xA5, 0x21,
+		0x0F, 0x7A, 0x93, 0x75, 0xE2, 0x2C, 0xEA, 0x70, 0x58, 0x7F, 0x9C, 0xFA, 0xFE, 0xBE, 0x0F, 0x6A,
+		0x6A, 0xA2, 0xEB, 0x68, 0xE7, 0xDD, 0x91, 0x64, 0x53, 0x6D, 0x53, 0xFA, 0x02, 0x0F, 0xCA, 0xB2,
+		0x0F, 0x54, 0xCA, 0xDD, 0xFA, 0xB7, 0xD6, 0xD9, 0x1E, 0x5F, 0xFE, 0xC1, 0xDF, 0xD8, 0xDE, 0xAA
+	};
+	/* The same, without the reseed */
+	static const BYTE returnedBitsNoReseed[64] = {
+		0x10, 0x6B, 0x8F, 0x72, 0xEF, 0xF2, 0x91, 0xE3, 0x07, 0x7F, 0xDE, 0x2A, 0x39, 0xF7, 0xF2, 0x38,
+		0x44, 0xCE, 0xF5, 0x71, 0xD2, 0xD1, 0x7C, 0xDE, 0xC2, 0x88, 0x58, 0x25, 0xF2, 0x25, 0x09, 0x70,
+		0x69, 0x7F, 0xB3, 0x21, 0x35, 0x29, 0xE9, 0x3F, 0x5B, 0x48, 0x63, 0xED, 0x58, 0x0A, 0x13, 0xD5,
+		0x7E, 0x5D, 0x7A, 0x60, 0x93, 0xAD, 0x83, 0x94, 0x0B, 0x7B, 0xCB, 0x48, 0xDD, 0x15, 0x1D, 0xE5
+	};
+	SSCP_CTX_ST* ctx = SSCP_Alloc();
+	BYTE output[64];
+
+	CHECK(ctx != NULL);
+
+	SSCP_DrbgInstantiate(ctx, entropyInput);
+	SSCP_DrbgReseed(ctx, entropyInputReseed);
+	SSCP_DrbgGenerate(ctx, output, sizeof(output));
+	SSCP_DrbgGenerate(ctx, output, sizeof(output));
+	CHECK(!memcmp(output, returnedBits, sizeof(output)));
+
+	SSCP_DrbgInstantiate(ctx, entropyInput);
+	SSCP_DrbgGenerate(ctx, output, sizeof(output));
+	SSCP_DrbgGenerate(ctx, output, sizeof(output));
+	CHECK(!memcmp(output, returnedBitsNoReseed, sizeof(output)));
+
+	SSCP_Free(ctx);
+	return TRUE;
+}
+
+/* Frame CRC */
+/* --------- */
+
+/* Bit-by-bit CRC-16/CCITT, the reference of the table-driven SSCP_SCR16() */
+static void CrcBitwise(const BYTE part1[], DWORD part1Sz, const BYTE part2[], DWORD part2Sz, BYTE pcrc[2])
+{
+	WORD crc = 0xFFFF;
+	DWORD i, j;
+
+	for (i = 0; i < part1Sz + part2Sz; i++)
+	{
+		crc ^= (WORD)((i < part1Sz) ? part1[i] : part2[i - part1Sz]) << 8;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x8000) ? (WORD)((crc << 1) ^ 0x1021) : (WORD)(crc << 1);
+	}
+
+	pcrc[0] = (BYTE)(crc >> 8);
+	pcrc[1] = (BYTE)(crc);
+}
+
+/* The check value, every split of a short frame between the two parts, and pseudo-random frames up to the largest payload */
+static BOOL CheckCrc(void)
+{
+	static const BYTE check[9] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+	static BYTE data[4 + SSCP_MAX_PAYLOAD_SZ];
+	BYTE crcA[2], crcB[2];
+	DWORD seed = 0x5CC9;
+	DWORD i, sz, split;
+
+	/* CRC-16/CCITT-FALSE check value */
+	SSCP_SCR16(check, sizeof(check), NULL, 0, crcA);
+	CHECK((crcA[0] == 0x29) && (crcA[1] == 0xB1));
+
+	for (i = 0; i < sizeof(data); i++)
+	{
+		seed = (seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+		data[i] = (BYTE)(seed >> 16);
+	}
+
+	for (sz = 0; sz <= 16; sz++)
+	{
+		for (split = 0; split <= sz; split++)
+		{
+			SSCP_SCR16(data, split, &data[split], sz - split, crcA);
+			CrcBitwise(data, split, &data[split], sz - split, crcB);
+			CHECK(!memcmp(crcA, crcB, 2));
+		}
+	}
+
+	/* Header, then payload, as in the frames */
+	for (sz = 17; sz <= sizeof(data); sz += 1 + (sz / 8))
+	{
+		SSCP_SCR16(data, 4, &data[4], sz - 4, crcA);
+		CrcBitwise(data, 4, &data[4], sz - 4, crcB);
+		CHECK(!memcmp(crcA, crcB, 2));
+	}
+
+	SSCP_SCR16(data, 4, &data[4], sizeof(data) - 4, crcA);
+	CrcBitwise(data, 4, &data[4], sizeof(data) - 4, crcB);
+	CHECK(!memcmp(crcA, crcB, 2));
+
+	return TRUE;
+}
+
+/* Crypto backends */
+/* --------------- */
+
+/* The AES backends this build and this CPU have: the portable one first, the reference of the others */
+static DWORD AesBackends(const AES_BACKEND_ST* backends[3])
+{
+	DWORD count = 0;
+
+	backends[count++] = &AES_BACKEND_C;
+	if (AES_ProbeHardware() != NULL)
+		backends[count++] = AES_ProbeHardware();
+#if SSCP_WITH_OPENSSL
+	backends[count++] = &AES_BACKEND_OPENSSL;
+#endif
+
+	return count;
+}
+
+/* Expanded key, bound to the given backend instead of the one the library selects */
+static BOOL AesBind(AES_CTX_ST* aes, const AES_BACKEND_ST* backend, const BYTE key[16])
+{
+	AES_InitEx(aes, key, 128);
+	if ((aes->backend != NULL) && (aes->backend->free != NULL))
+		aes->backend->free(aes);
+
+	aes->backend = &AES_BACKEND_C;
+	aes->backend_data[0] = NULL;
+	aes->backend_data[1] = NULL;
+	if ((backend->init != NULL) && !backend->init(aes, key))
+		return FALSE;
+
+	aes->backend = backend;
+	return TRUE;
+}
+
+/* FIPS-197 C.1 and SP 800-38A F.2.1, then the CBC and the multi-block entry points of each backend against the portable code */
+static BOOL CheckAesBackends(void)
+{
+	static const BYTE fipsKey[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+	static const BYTE fipsPlain[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF };
+	static const BYTE fipsCipher[16] = { 0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30, 0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A };
+	static const BYTE cbcKey[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+	static const BYTE cbcIv[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+	static const BYTE cbcPlain[64] = {
+		0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96, 0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A,
+		0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C, 0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51,
+		0x30, 0xC8, 0x1C, 0x46, 0xA3, 0x5C, 0xE4, 0x11, 0xE5, 0xFB, 0xC1, 0x19, 0x1A, 0x0A, 0x52, 0xEF,
+		0xF6, 0x9F, 0x24, 0x45, 0xDF, 0x4F, 0x9B, 0x17, 0xAD, 0x2B, 0x41, 0x7B, 0xE6, 0x6C, 0x37, 0x10
+	};
+	static const BYTE cbcCipher[64] = {
+		0x76, 0x49, 0xAB, 0xAC, 0x81, 0x19, 0xB2, 0x46, 0xCE, 0xE9, 0x8E, 0x9B, 0x12, 0xE9, 0x19, 0x7D,
+		0x50, 0x86, 0xCB, 0x9B, 0x50, 0x72, 0x19, 0xEE, 0x95, 0xDB, 0x11, 0x3A, 0x91, 0x76, 0x78, 0xB2,
+		0x73, 0xBE, 0xD6, 0xB8, 0xE3, 0xC1, 0x74, 0x3B, 0x71, 0x16, 0xE6, 0x9E, 0x22, 0x22, 0x95, 0x16,
+		0x3F, 0xF1, 0xCA, 0xA1, 0x68, 0x1F, 0xAC, 0x09, 0x12, 0x0E, 0xCA, 0x30, 0x75, 0x86, 0xE1, 0xA7
+	};
+	/* Around the 4 blocks of the vectorized kernels */
+	static const DWORD blockCounts[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 33, 64 };
+	static BYTE plain[64 * 16], reference[64 * 16], data[64 * 16];
+	const AES_BACKEND_ST* backends[3];
+	DWORD backendCount, b, i, n;
+	AES_CTX_ST portable, aes;
+	BYTE iv[16], referenceIv[16];
+	DWORD seed = 0xAE5;
+
+	for (i = 0; i < sizeof(plain); i++)
+	{
+		seed = (seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+		plain[i] = (BYTE)(seed >> 16);
+	}
+
+	backendCount = AesBackends(backends);
+	CHECK(AesBind(&portable, &AES_BACKEND_C, cbcKey));
+
+	for (b = 0; b < backendCount; b++)
+	{
+		/* Known answers */
+		CHECK(AesBind(&aes, backends[b], fipsKey));
+		memcpy(data, fipsPlain, 16);
+		AES_Encrypt(&aes, data);
+		CHECK(!memcmp(data, fipsCipher, 16));
+		AES_Decrypt(&aes, data);
+		CHECK(!memcmp(data, fipsPlain, 16));
+		AES_Free(&aes);
+
+		CHECK(AesBind(&aes, backends[b], cbcKey));
+		memcpy(data, cbcPlain, 64);
+		memcpy(iv, cbcIv, 16);
+		AES_EncryptCBC(&aes, iv, data, 4);
+		CHECK(!memcmp(data, cbcCipher, 64) && !memcmp(iv, &cbcCipher[48], 16));
+		memcpy(iv, cbcIv, 16);
+		AES_DecryptCBC(&aes, iv, data, 4);
+		CHECK(!memcmp(data, cbcPlain, 64) && !memcmp(iv, &cbcCipher[48], 16));
+
+		/* Same as the portable code, whatever the number of blocks */
+		for (i = 0; i < sizeof(blockCounts) / sizeof(blockCounts[0]); i++)
+		{
+			n = blockCounts[i];
+
+			memcpy(reference, plain, 16 * n);
+			memcpy(referenceIv, cbcIv, 16);
+			AES_EncryptCBC(&portable, referenceIv, reference, n);
+			memcpy(data, plain, 16 * n);
+			memcpy(iv, cbcIv, 16);
+			AES_EncryptCBC(&aes, iv, data, n);
+			CHECK(!memcmp(data, reference, 16 * n) && !memcmp(iv, referenceIv, 16));
+
+			memcpy(iv, cbcIv, 16);
+			AES_DecryptCBC(&aes, iv, data, n);
+			CHECK(!memcmp(data, plain, 16 * n) && !memcmp(iv, referenceIv, 16));
+
+			memcpy(reference, plain, 16 * n);
+			AES_EncryptBlocks(&portable, reference, n);
+			AES_EncryptBlocks(&aes, data, n);
+			CHECK(!memcmp(data, reference, 16 * n));
+			AES_DecryptBlocks(&aes, data, n);
+			CHECK(!memcmp(data, plain, 16 * n));
+		}
+
+		AES_Free(&aes);
+	}
+
+	AES_Free(&portable);
+	return TRUE;
+}
+
+/* The SHA-256 backends this build and this CPU have */
+static DWORD Sha256Backends(const SHA256_BACKEND_ST* backends[2])
+{
+	DWORD count = 0;
+
+	backends[count++] = &SHA256_BACKEND_C;
+	if (SHA256_ProbeHardware() != NULL)
+		backends[count++] = SHA256_ProbeHardware();
+
+	return count;
+}
+
+/* SHA-256 of the message through the compression function of the backend */
+static void Sha256With(const SHA256_BACKEND_ST* backend, const BYTE message[], DWORD length, BYTE digest[32])
+{
+	static const DWORD initial[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+	unsigned long long bits = (unsigned long long) length * 8;
+	DWORD state[8];
+	BYTE tail[128];
+	DWORD full = length / 64, rest = length % 64, tailSz, i;
+
+	memcpy(state, initial, sizeof(state));
+	if (full > 0)
+		backend->compress(state, message, full);
+
+	/* Padding: 80, zeros, then the length in bits */
+	tailSz = (rest < 56) ? 64 : 128;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, &message[64 * full], rest);
+	tail[rest] = 0x80;
+	for (i = 0; i < 8; i++)
+		tail[tailSz - 1 - i] = (BYTE)(bits >> (8 * i));
+	backend->compress(state, tail, tailSz / 64);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = (BYTE)(state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* HMAC-SHA256 (RFC 2104) through the compression function of the backend, for a key of 64 bytes at most */
+static void HmacWith(const SHA256_BACKEND_ST* backend, const BYTE key[], DWORD keySz, const BYTE message[], DWORD length, BYTE hmac[32])
+{
+	static BYTE buffer[64 + 512];
+	DWORD i;
+
+	memset(buffer, 0, 64);
+	memcpy(buffer, key, keySz);
+	for (i = 0; i < 64; i++)
+		buffer[i] ^= 0x36;
+	memcpy(&buffer[64], message, length);
+	Sha256With(backend, buffer, 64 + length, hmac);
+
+	memset(buffer, 0, 64);
+	memcpy(buffer, key, keySz);
+	for (i = 0; i < 64; i++)
+		buffer[i] ^= 0x5C;
+	memcpy(&buffer[64], hmac, 32);
+	Sha256With(backend, buffer, 64 + 32, hmac);
+}
+
+/* FIPS 180-2 and RFC 4231 known answers, then the HMAC of the library against each backend over many lengths */
+static BOOL CheckSha256Backends(void)
+{
+	static const BYTE abcDigest[32] = {
+		0xBA, 0x78, 0x16, 0xBF, 0x8F, 0x01, 0xCF, 0xEA, 0x41, 0x41, 0x40, 0xDE, 0x5D, 0xAE, 0x22, 0x23,
+		0xB0, 0x03, 0x61, 0xA3, 0x96, 0x17, 0x7A, 0x9C, 0xB4, 0x10, 0xFF, 0x61, 0xF2, 0x00, 0x15, 0xAD
+	};
+	static const char twoBlocks[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	static const BYTE twoBlocksDigest[32] = {
+		0x24, 0x8D, 0x6A, 0x61, 0xD2, 0x06, 0x38, 0xB8, 0xE5, 0xC0, 0x26, 0x93, 0x0C, 0x3E, 0x60, 0x39,
+		0xA3, 0x3C, 0xE4, 0x59, 0x64, 0xFF, 0x21, 0x67, 0xF6, 0xEC, 0xED, 0xD4, 0x19, 0xDB, 0x06, 0xC1
+	};
+	static const BYTE rfcKey1[20] = { 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B };
+	static const BYTE rfcHmac1[32] = {
+		0xB0, 0x34, 0x4C, 0x61, 0xD8, 0xDB, 0x38, 0x53, 0x5C, 0xA8, 0xAF, 0xCE, 0xAF, 0x0B, 0xF1, 0x2B,
+		0x88, 0x1D, 0xC2, 0x00, 0xC9, 0x83, 0x3D, 0xA7, 0x26, 0xE9, 0x37, 0x6C, 0x2E, 0x32, 0xCF, 0xF7
+	};
+	static const BYTE rfcHmac2[32] = {
+		0x5B, 0xDC, 0xC1, 0x46, 0xBF, 0x60, 0x75, 0x4E, 0x6A, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xC7,
+		0x5A, 0x00, 0x3F, 0x08, 0x9D, 0x27, 0x39, 0x83, 0x9D, 0xEC, 0x58, 0xB9, 0x64, 0xEC, 0x38, 0x43
+	};
+	static BYTE message[512];
+	const SHA256_BACKEND_ST* backends[2];
+	DWORD backendCount, b, i, length;
+	SHA256_CTX_ST sha256;
+	HMAC_CTX_ST prepared;
+	BYTE digest[32], expected[32];
+	DWORD seed = 0x5A256;
+
+	for (i = 0; i < sizeof(message); i++)
+	{
+		seed = (seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+		message[i] = (BYTE)(seed >> 16);
+	}
+
+	/* The backend the library uses */
+	SHA256_Init(&sha256);
+	SHA256_Update(&sha256, (const BYTE*) "abc", 3);
+	SHA256_Final(&sha256, digest);
+	CHECK(!memcmp(digest, abcDigest, 32));
+	HMAC_SHA256_Prepare(&prepared, rfcKey1, sizeof(rfcKey1));
+	CHECK(SSCP_HMACEx(&prepared, (const BYTE*) "Hi There", 8, digest) && !memcmp(digest, rfcHmac1, 32));
+	HMAC_SHA256_Prepare(&prepared, (const BYTE*) "Jefe", 4);
+	CHECK(SSCP_HMACEx(&prepared, (const BYTE*) "what do ya want for nothing?", 28, digest) && !memcmp(digest, rfcHmac2, 32));
+
+	backendCount = Sha256Backends(backends);
+	for (b = 0; b < backendCount; b++)
+	{
+		Sha256With(backends[b], (const BYTE*) "abc", 3, digest);
+		CHECK(!memcmp(digest, abcDigest, 32));
+		Sha256With(backends[b], (const BYTE*) twoBlocks, sizeof(twoBlocks) - 1, digest);
+		CHECK(!memcmp(digest, twoBlocksDigest, 32));
+		HmacWith(backends[b], rfcKey1, sizeof(rfcKey1), (const BYTE*) "Hi There", 8, digest);
+		CHECK(!memcmp(digest, rfcHmac1, 32));
+		HmacWith(backends[b], (const BYTE*) "Jefe", 4, (const BYTE*) "what do ya want for nothing?", 28, digest);
+		CHECK(!memcmp(digest, rfcHmac2, 32));
+
+		/* Every length of the padding, then multi-block messages */
+		for (length = 0; length <= sizeof(message); length += (length < 192) ? 1 : 37)
+		{
+			CHECK(SSCP_HMAC(authKey, message, length, digest));
+			HmacWith(backends[b], authKey, sizeof(authKey), message, length, expected);
+			CHECK(!memcmp(digest, expected, 32));
+		}
+	}
+
+	return TRUE;
+}
+
+/* Self test */
+/* --------- */
+
+static const BYTE selfTestOutputs[3] = { 0x02, 0x0A, 0x00 }; /* The command of the canned response */
+
+/* A context on the loopback of the self test, authenticated with its vectors */
+static SSCP_CTX_ST* SelfTestOpen(BOOL pipeline, BOOL authenticate)
+{
+	SSCP_CTX_ST* ctx = SSCP_Alloc();
+	SSCP_SETTINGS_ST settings;
+
+	if ((ctx == NULL) || (SSCP_GetSettings(ctx, &settings) != SSCP_SUCCESS))
+		return NULL;
+	settings.selfTest = TRUE;
+	settings.pipeline = pipeline;
+	if ((SSCP_SetSettings(ctx, &settings) != SSCP_SUCCESS) || (authenticate && (SSCP_Authenticate(ctx, NULL) != SSCP_SUCCESS)))
+	{
+		SSCP_Free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static LONG SelfTestSource(void* userData, DWORD offset, BYTE buffer[], DWORD length)
+{
+	(void) userData;
+	memcpy(buffer, &selfTestOutputs[offset], length);
+	return SSCP_SUCCESS;
+}
+
+/* Each way to exchange goes through the loopback, as with a reader */
+static BOOL CheckSelfTest(void)
+{
+	SSCP_AUTH_TARGET_ST targets[2];
+	SSCP_BATCH_ITEM_ST item;
+	SSCP_CTX_ST* ctx;
+	BYTE response[128]; /* The whole response frame, for SSCP_ExchangeStream() */
+	DWORD i, count;
+	LONG rc;
+
+	/* Synchronous, pipelined or not */
+	for (i = 0; i < 2; i++)
+	{
+		ctx = SelfTestOpen(i == 1, TRUE);
+		CHECK(ctx != NULL);
+		CHECK(SSCP_Exchange(ctx, SSCP_CMD_OUTPUTS, selfTestOutputs, sizeof(selfTestOutputs), NULL, 0, NULL) == SSCP_SUCCESS);
+		SSCP_Free(ctx);
+	}
+
+	/* Asynchronous */
+	ctx = SelfTestOpen(FALSE, TRUE);
+	CHECK(ctx != NULL);
+	CHECK(SSCP_AsyncSubmit(ctx, SSCP_CMD_OUTPUTS, selfTestOutputs, sizeof(selfTestOutputs)) == SSCP_SUCCESS);
+	while ((rc = SSCP_AsyncPoll(ctx)) == SSCP_ERR_IN_PROGRESS)
+		;
+	CHECK(rc == SSCP_SUCCESS);
+	CHECK(SSCP_AsyncComplete(ctx, response, sizeof(response), &count) == SSCP_SUCCESS);
+	SSCP_Free(ctx);
+
+	/* Streamed */
+	ctx = SelfTestOpen(FALSE, TRUE);
+	CHECK(ctx != NULL);
+	CHECK(SSCP_ExchangeStream(ctx, SSCP_CMD_OUTPUTS, sizeof(selfTestOutputs), SelfTestSource, NULL, response, sizeof(response), &count) == SSCP_SUCCESS);
+	SSCP_Free(ctx);
+
+	/* Batched */
+	ctx = SelfTestOpen(FALSE, TRUE);
+	CHECK(ctx != NULL);
+	memset(&item, 0, sizeof(item));
+	item.commandHeader = SSCP_CMD_OUTPUTS;
+	item.commandData = selfTestOutputs;
+	item.commandDataSz = sizeof(selfTestOutputs);
+	CHECK(SSCP_ExchangeBatch(ctx, &item, 1, &count) == SSCP_SUCCESS);
+	CHECK((count == 1) && (item.result == SSCP_SUCCESS));
+	SSCP_Free(ctx);
+
+	/* Bring-up of several readers */
+	memset(targets, 0, sizeof(targets));
+	for (i = 0; i < 2; i++)
+	{
+		targets[i].ctx = SelfTestOpen(FALSE, FALSE);
+		CHECK(targets[i].ctx != NULL);
+	}
+	CHECK(SSCP_AuthenticateAll(targets, SSCP_AUTH_MAX_TARGETS + 1, &count) == SSCP_ERR_INVALID_PARAMETER); /* Refused before anything is read */
+	CHECK(SSCP_AuthenticateAll(targets, 2, &count) == SSCP_SUCCESS);
+	CHECK(count == 2);
+	for (i = 0; i < 2; i++)
+	{
+		CHECK(SSCP_Exchange(targets[i].ctx, SSCP_CMD_OUTPUTS, selfTestOutputs, sizeof(selfTestOutputs), NULL, 0, NULL) == SSCP_SUCCESS);
+		SSCP_Free(targets[i].ctx);
+	}
+
+	return TRUE;
+}
+
+#define BUS_SELFTEST_BLOCKS 16
+
+/* The readers of a bus go through the loopback of the master, and leave nothing behind */
+static BOOL CheckBusSelfTest(void)
+{
+	BYTE* pool = malloc(BUS_SELFTEST_BLOCKS * SSCP_MemoryBlockSize() + 63);
+	SSCP_BUS_ST* bus;
+	SSCP_CTX_ST* reader;
+	BYTE address;
+	BOOL works;
+	LONG rc;
+
+	CHECK(pool != NULL);
+	CHECK(SSCP_SetMemoryPool(pool, BUS_SELFTEST_BLOCKS * SSCP_MemoryBlockSize() + 63) == SSCP_SUCCESS);
+
+	SSCP_SELFTEST = TRUE;
+	bus = SSCP_BusAlloc();
+	works = (bus != NULL);
+	for (address = 1; works && (address <= 5); address++)
+		works = (SSCP_BusGetReader(bus, address) != NULL);
+	reader = works ? SSCP_BusGetReader(bus, 5) : NULL;
+	works = works && (SSCP_Authenticate(reader, NULL) == SSCP_SUCCESS);
+	works = works && (SSCP_Exchange(reader, SSCP_CMD_OUTPUTS, selfTestOutputs, sizeof(selfTestOutputs), NULL, 0, NULL) == SSCP_SUCCESS);
+	SSCP_BusFree(bus);
+	SSCP_SELFTEST = FALSE;
+
+	/* Refused if a block is still held (the pool then stays in use) */
+	rc = SSCP_SetMemoryPool(NULL, 0);
+	CHECK(rc == SSCP_SUCCESS);
+	free(pool);
+	CHECK(works);
+
+	return TRUE;
+}
+
+#define FLEET_POOL_TARGETS 100
+#define FLEET_POOL_BLOCKS (3 * FLEET_POOL_TARGETS + 2) /* A context, its loopback and its queue per target, and the tables */
+
+/* With a pool, a bring-up the tables of a block can't hold goes by passes; with the pool exhausted, nothing is tried */
+static BOOL CheckFleetPool(void)
+{
+	static SSCP_AUTH_TARGET_ST targets[FLEET_POOL_TARGETS];
+	static SSCP_CTX_ST* spares[FLEET_POOL_BLOCKS];
+	DWORD poolSz = FLEET_POOL_BLOCKS * SSCP_MemoryBlockSize() + 63;
+	BYTE* pool = malloc(poolSz);
+	DWORD count = 0, spareCount = 0, i;
+	BOOL works = TRUE;
+	LONG rc;
+
+	CHECK(pool != NULL);
+	CHECK(SSCP_SetMemoryPool(pool, poolSz) == SSCP_SUCCESS);
+
+	memset(targets, 0, sizeof(targets));
+	for (i = 0; works && (i < FLEET_POOL_TARGETS); i++)
+	{
+		targets[i].ctx = SelfTestOpen(FALSE, FALSE);
+		works = (targets[i].ctx != NULL);
+	}
+	works = works && (SSCP_AuthenticateAll(targets, FLEET_POOL_TARGETS, &count) == SSCP_SUCCESS) && (count == FLEET_POOL_TARGETS);
+	for (i = 0; works && (i < FLEET_POOL_TARGETS); i++)
+		works = (SSCP_Exchange(targets[i].ctx, SSCP_CMD_OUTPUTS, selfTestOutputs, sizeof(selfTestOutputs), NULL, 0, NULL) == SSCP_SUCCESS);
+
+	/* No block left for the tables */
+	while (works && (spareCount < FLEET_POOL_BLOCKS) && ((spares[spareCount] = SSCP_Alloc()) != NULL))
+		spareCount++;
+	works = works && (SSCP_AuthenticateAll(targets, FLEET_POOL_TARGETS, &count) == SSCP_ERR_OUT_OF_MEMORY) && (count == 0);
+	for (i = 0; works && (i < FLEET_POOL_TARGETS); i++)
+		works = (targets[i].result == SSCP_ERR_OUT_OF_MEMORY);
+
+	for (i = 0; i < spareCount; i++)
+		SSCP_Free(spares[i]);
+	for (i = 0; i < FLEET_POOL_TARGETS; i++)
+		SSCP_Free(targets[i].ctx);
+
+	rc = SSCP_SetMemoryPool(NULL, 0);
+	CHECK(rc == SSCP_SUCCESS);
+	free(pool);
+	CHECK(works);
+
+	return TRUE;
+}
+
+/* Fleet bring-up */
+/* -------------- */
+
+/* Readers on different ports are authenticated at the same time; one that fails holds nobody back */
+static BOOL CheckFleetPorts(void)
+{
+	static const BYTE wrongKey[16] = { 0x01 };
+	SSCP_AUTH_TARGET_ST targets[3];
+	READER_ST readers[3];
+	DWORD count, i;
+	LONG rc;
+
+	memset(targets, 0, sizeof(targets));
+	for (i = 0; i < 3; i++)
+	{
+		CHECK(ReaderOpen(&readers[i], FALSE));
+		targets[i].ctx = readers[i].ctx;
+	}
+	Emulator_SetResponseDelay(readers[0].emu, 100);
+	targets[1].authKeyValue = wrongKey;
+
+	CHECK(SSCP_AuthenticateAll(NULL, 3, &count) == SSCP_ERR_INVALID_PARAMETER);
+	CHECK(SSCP_AuthenticateAll(targets, SSCP_AUTH_MAX_TARGETS + 1, &count) == SSCP_ERR_INVALID_PARAMETER);
+
+	/* The first reader takes 100 ms per step: the others are done long before it */
+	rc = SSCP_AuthenticateAll(targets, 3, &count);
+	CHECK((rc != SSCP_SUCCESS) && (rc == targets[1].result));
+	CHECK(count == 2);
+	CHECK((targets[0].result == SSCP_SUCCESS) && (targets[2].result == SSCP_SUCCESS));
+	CHECK(targets[0].elapsedUs >= 200000);
+	CHECK((targets[1].elapsedUs < 100000) && (targets[2].elapsedUs < 100000));
+
+	/* Each outcome is the one of SSCP_Authenticate() */
+	CHECK(SSCP_Authenticate(readers[1].ctx, wrongKey) == targets[1].result);
+	for (i = 0; i < 3; i += 2)
+		CHECK(SSCP_Outputs(readers[i].ctx, 1, 1, 0) == SSCP_SUCCESS);
+
+	for (i = 0; i < 3; i++)
+		ReaderClose(&readers[i]);
+	return TRUE;
+}
+
+/* Checks */
+/* ------ */
+
+typedef struct
+{
+	const char* name;
+	BOOL (*run)(void);
+} CHECK_ST;
+
+static const CHECK_ST checks[] =
+{
+	{ "queue-producers", CheckQueueProducers },
+	{ "completion-takers", CheckCompletionTakers },
+	{ "async-cancel", CheckAsyncCancel },
+	{ "async-bus", CheckAsyncBus },
+	{ "bus-readers", CheckBusReaders },
+	{ "ring-resync", CheckRingResync },
+	{ "stream-resync", CheckStreamResync },
+	{ "stream-timeout", CheckStreamTimeout },
+	{ "stream-large", CheckStreamLarge },
+	{ "pipeline-large", CheckPipelineLarge },
+	{ "timeout-classes", CheckTimeoutClasses },
+	{ "retry-corrupted", CheckRetryCorrupted },
+	{ "poll-presence", CheckPollPresence },
+	{ "health-transitions", CheckHealthTransitions },
+	{ "baudrate-switch", CheckBaudrateSwitch },
+	{ "tcp-transport", CheckTcpTransport },
+	{ "key-cache", CheckKeyCache },
+	{ "get-response-class", CheckGetResponseClass },
+	{ "apdu-wrong-length", CheckApduWrongLength },
+	{ "session-resume", CheckSessionResume },
+	{ "batch", CheckBatch },
+#if SSCP_WITH_CAPTURE
+	{ "capture-replay", CheckCaptureReplay },
+#endif
+	{ "stats-reset", CheckStatsReset },
+	{ "crc", CheckCrc },
+	{ "ctr-drbg", CheckCtrDrbg },
+	{ "aes-backends", CheckAesBackends },
+	{ "sha256-backends", CheckSha256Backends },
+	{ "selftest", CheckSelfTest },
+	{ "bus-selftest", CheckBusSelfTest },
+	{ "fleet-pool", CheckFleetPool },
+	{ "fleet-ports", CheckFleetPorts },
+};
+
+int main(int argc, char** argv)
+{
+	int failures = 0;
+	DWORD i;
+	int j;
+
+	SSCP_DEBUG_EXCHANGE = FALSE;
+	SSCP_DEBUG_AUTHENTICATE = FALSE;
+
+	for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+	{
+		BOOL wanted = (argc < 2);
+
+		for (j = 1; j < argc; j++)
+			if (!strcmp(argv[j], checks[i].name))
+				wanted = TRUE;
+		if (!wanted)
+			continue;
+
+		printf("%s\n", checks[i].name);
+		if (!checks[i].run())
+		{
+			printf("FAILED %s\n", checks[i].name);
+			failures++;
+		}
+	}
+
+	printf("%d check(s) failed\n", failures);
+	return failures;
+}
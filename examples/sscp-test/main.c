@@ -8,6 +8,11 @@ extern BOOL SSCP_SELFTEST;
 extern BOOL SSCP_DEBUG_EXCHANGE;
 extern BOOL SSCP_DEBUG_AUTHENTICATE;
 
+#if defined(SSCP_WITH_HEAP) && !SSCP_WITH_HEAP
+/* Built without heap: the contexts come from here */
+static BYTE memoryPool[64 * 1024];
+#endif
+
 void showStatistics(SSCP_CTX_ST* ctx)
 {
 	SSCP_STATISTICS_ST stats;
@@ -35,6 +40,14 @@ int main(int argc, char** argv)
 	LONG rc;
 	DWORD i;
 
+#if defined(SSCP_WITH_HEAP) && !SSCP_WITH_HEAP
+	if (SSCP_SetMemoryPool(memoryPool, sizeof(memoryPool)) != SSCP_SUCCESS)
+	{
+		printf("SSCP_SetMemoryPool failed\n");
+		return -1;
+	}
+#endif
+
 	SSCP_SELFTEST = TRUE;	
 	SSCP_DEBUG_EXCHANGE = TRUE;
 	SSCP_DEBUG_AUTHENTICATE = TRUE;
@@ -28,6 +28,7 @@
 
 #define SSCP_ERR_COMMAND_TOO_LONG -5 /* Library error: command is too long for the communication layer */
 #define SSCP_ERR_RESPONSE_TOO_LONG -6 /* Library error: response is too long for the communication layer */
+#define SSCP_ERR_IN_PROGRESS -7 /* Library call error: an asynchronous exchange is still running */
 
 #define SSCP_ERR_INTERNAL_FAILURE -8 /* Library error: an internal operation has failed */
 #define SSCP_ERR_OUT_OF_MEMORY -9 /* Library error: dynamic allocation failed */
@@ -56,5 +57,6 @@
 #define SSCP_ERR_NFC_CARD_ABSENT -40 /* Card error: no card */
 #define SSCP_ERR_NFC_CARD_MUTE_OR_REMOVED -41 /* Card error: timeout */
 #define SSCP_ERR_NFC_CARD_COMM_ERROR -42 /* Card error: communication error */
+#define SSCP_ERR_NFC_CARD_UNEXPECTED_SW -43 /* Card error: status word does not match the expected one */
 
 #endif
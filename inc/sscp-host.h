@@ -50,11 +50,52 @@ typedef struct _SSCP_CTX_ST SSCP_CTX_ST;
 SSCP_CTX_ST* SSCP_Alloc(void);
 void SSCP_Free(SSCP_CTX_ST* ctx);
 
+/*
+ * Memory of the library: the heap, or blocks of a pool of the application, given
+ * before anything is allocated (the only memory when built without heap).
+ */
+LONG SSCP_SetMemoryPool(void* pool, DWORD poolSz);
+DWORD SSCP_MemoryBlockSize(void);
+
 LONG SSCP_Open(SSCP_CTX_ST* ctx, const char* commName, DWORD commBaudrate, DWORD commFlags);
 LONG SSCP_Close(SSCP_CTX_ST* ctx);
 LONG SSCP_SelectAddress(SSCP_CTX_ST* ctx, BYTE address);
 LONG SSCP_SelectBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate);
 
+/*
+ * Per-context settings. The process-wide SSCP_SELFTEST and SSCP_DEBUG_* flags are
+ * only the defaults of the contexts allocated afterwards; a bus reader starts with
+ * the settings of its bus.
+ */
+typedef struct
+{
+	BOOL selfTest; /* The port is a loopback with canned responses and fixed random values, see sscp-test */
+	BOOL debugExchange;
+	BOOL debugAuthenticate;
+	BOOL debugCrypto; /* Traces the session keys: never in production */
+	BOOL debugSerial;
+	BOOL debugTcp;
+	BOOL pipeline; /* Cipher each command while it is sent, decipher each response while it arrives */
+} SSCP_SETTINGS_ST;
+
+LONG SSCP_SetSettings(SSCP_CTX_ST* ctx, const SSCP_SETTINGS_ST* settings);
+LONG SSCP_GetSettings(SSCP_CTX_ST* ctx, SSCP_SETTINGS_ST* settings);
+
+/*
+ * Multidrop RS-485 bus: one port shared by several readers, each one with its own
+ * address, session and statistics. The contexts returned by SSCP_BusGetReader() are
+ * used with the functions below just like standalone ones.
+ */
+typedef struct _SSCP_BUS_ST SSCP_BUS_ST;
+
+SSCP_BUS_ST* SSCP_BusAlloc(void);
+void SSCP_BusFree(SSCP_BUS_ST* bus);
+LONG SSCP_BusOpen(SSCP_BUS_ST* bus, const char* commName, DWORD commBaudrate, DWORD commFlags);
+LONG SSCP_BusClose(SSCP_BUS_ST* bus);
+LONG SSCP_BusSelectBaudrate(SSCP_BUS_ST* bus, DWORD baudrate);
+LONG SSCP_BusNegotiateBaudrate(SSCP_BUS_ST* bus, DWORD baudrate);
+SSCP_CTX_ST* SSCP_BusGetReader(SSCP_BUS_ST* bus, BYTE address);
+
 LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16]);
 LONG SSCP_Outputs(SSCP_CTX_ST* ctx, BYTE ledColor, BYTE ledDuration, BYTE buzzerDuration);
 LONG SSCP_OutputsRGB(SSCP_CTX_ST* ctx, DWORD ledColor, BYTE ledDuration, BYTE buzzerDuration);
@@ -65,13 +106,341 @@ LONG SSCP_GetReaderType(SSCP_CTX_ST* ctx, char *readerType, BYTE maxReaderTypeSz
 
 LONG SSCP_SetAddress(SSCP_CTX_ST* ctx, BYTE address);
 LONG SSCP_SetBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate);
+LONG SSCP_NegotiateBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate); /* SetBaudrate, SelectBaudrate, check, or fall back */
+
+/*
+ * Response timeouts, per class of command. The first byte timeout also covers the
+ * time the command takes on the line at the port's baudrate, the inter byte timeout
+ * follows from the baudrate unless given.
+ */
+typedef struct
+{
+	DWORD controlMs; /* GetInfos, Outputs, GetSerialNumber, GetReaderType... (0: 250 ms) */
+	DWORD cardMs; /* ScanNFC, ScanARaw, TransceiveNFC, ReleaseNFC (0: 1000 ms) */
+	DWORD setupMs; /* Authenticate, SetBaudrate, SetAddress (0: 1000 ms) */
+	DWORD interByteMs; /* Between two bursts of the response (0: from the baudrate) */
+	BOOL adaptive; /* Shorten the first byte timeouts towards the observed response times */
+} SSCP_TIMEOUT_PROFILE_ST;
+
+LONG SSCP_SetTimeoutProfile(SSCP_CTX_ST* ctx, const SSCP_TIMEOUT_PROFILE_ST* profile);
+LONG SSCP_GetTimeoutProfile(SSCP_CTX_ST* ctx, SSCP_TIMEOUT_PROFILE_ST* profile);
+
+/*
+ * Retry policy of the secure exchanges: a command whose response did not come, or came
+ * corrupted, is sent again as it is (see sscp-host-retry.c).
+ */
+typedef struct
+{
+	BYTE maxAttempts; /* Transmissions of a command, the first one included (0: 3) */
+	BOOL timeoutsOnly; /* Only send again after a timeout, not after a wrong CRC */
+	DWORD resendTimeoutMs; /* First byte timeout of the resendings, within the class one (0: the observed response time) */
+	DWORD backoffMs; /* Random wait before a resending, up to this, doubled at each one (0: none) */
+	DWORD backoffMaxMs; /* Longest random wait (0: 8 times backoffMs) */
+	BOOL keepCounter; /* After a failed exchange, do not skip the counter the reader may have used */
+} SSCP_RETRY_POLICY_ST;
+
+LONG SSCP_SetRetryPolicy(SSCP_CTX_ST* ctx, const SSCP_RETRY_POLICY_ST* policy);
+LONG SSCP_GetRetryPolicy(SSCP_CTX_ST* ctx, SSCP_RETRY_POLICY_ST* policy);
 
 LONG SSCP_ScanNFC(SSCP_CTX_ST* ctx, WORD *protocol, BYTE uid[], BYTE maxUidSz, BYTE* actUidSz, BYTE ats[], BYTE maxAtsSz, BYTE* actAtsSz);
 LONG SSCP_ScanARaw(SSCP_CTX_ST* ctx, WORD *protocol, BYTE uid[], BYTE maxUidSz, BYTE* actUidSz, BYTE ats[], BYTE maxAtsSz, BYTE* actAtsSz);
 
+/*
+ * Card presence polling: the engine scans for cards (guard time honoured, without
+ * sleeping when a slower exchange already covered it), reports the arrival and the
+ * removal of the cards, and slows the poll rate down when the field stays empty.
+ * The callback returns FALSE to stop the polling.
+ */
+typedef struct
+{
+	WORD protocol; /* As returned by SSCP_ScanNFC() */
+	BYTE uid[32];
+	BYTE uidSz;
+	BYTE ats[64];
+	BYTE atsSz;
+} SSCP_CARD_ST;
+
+#define SSCP_POLL_CARD_ARRIVED 1
+#define SSCP_POLL_CARD_REMOVED 2
+
+typedef BOOL (*SSCP_POLL_CALLBACK)(SSCP_CTX_ST* ctx, BYTE event, const SSCP_CARD_ST* card, void* userData);
+
+typedef struct
+{
+	BOOL scanARaw; /* Use SSCP_ScanARaw() instead of SSCP_ScanNFC() */
+	DWORD activeIntervalMs; /* Poll period when there is activity, 0 for the guard time */
+	DWORD idleIntervalMs; /* Longest poll period, reached when the field stays empty (0: 1s) */
+	DWORD idleAfterMs; /* Time without a card before the period starts growing (0: 5s) */
+} SSCP_POLL_CONFIG_ST;
+
+#define SSCP_POLL_STOPPED 0xFFFFFFFF
+
+LONG SSCP_PollStart(SSCP_CTX_ST* ctx, const SSCP_POLL_CONFIG_ST* config, SSCP_POLL_CALLBACK callback, void* userData);
+LONG SSCP_PollStep(SSCP_CTX_ST* ctx, DWORD* nextPollMs);
+LONG SSCP_PollRun(SSCP_CTX_ST* ctx, const SSCP_POLL_CONFIG_ST* config, SSCP_POLL_CALLBACK callback, void* userData);
+LONG SSCP_PollStop(SSCP_CTX_ST* ctx);
+
+/*
+ * Health of the readers: a heartbeat when a reader has been silent for a while,
+ * and a new session when it has lost its own (see sscp-host-health.c).
+ */
+#define SSCP_HEALTH_OK 0 /* The reader answers within its session */
+#define SSCP_HEALTH_LINK_DOWN 1 /* No valid frame from the reader */
+#define SSCP_HEALTH_SESSION_LOST 2 /* The reader answers, out of the session (restarted) */
+
+typedef struct
+{
+	DWORD intervalMs; /* Silence of the reader before a heartbeat (0: 5s) */
+	DWORD idleGapMs; /* Idle time of the port before a heartbeat takes it (0: 50ms) */
+	DWORD retryMs; /* Period of the attempts while the reader is down (0: 1s) */
+	const BYTE* authKeyValue; /* Key of the new sessions, copied (NULL: the default key) */
+	BOOL manualRecovery; /* Only tell the lost sessions, the application authenticates */
+} SSCP_HEALTH_CONFIG_ST;
+
+typedef struct
+{
+	BYTE state; /* SSCP_HEALTH_* */
+	LONG lastResult; /* Of the exchange that has set the state */
+	DWORD heartbeats;
+	DWORD heartbeatFailures;
+	DWORD linkLosses;
+	DWORD sessionLosses;
+	DWORD reauthentications;
+	DWORD silenceMs; /* Since the last answer of the reader */
+	WORD voltage; /* As reported by the last heartbeat */
+	WORD voltageMin;
+	WORD voltageMax;
+	WORD voltageAvg; /* Smoothed, 1/8 per heartbeat */
+	DWORD latencyUs; /* Round trip of the last heartbeat */
+	DWORD latencyAvgUs; /* Smoothed, 1/8 per heartbeat */
+	DWORD latencyMaxUs;
+} SSCP_HEALTH_ST;
+
+typedef void (*SSCP_HEALTH_CALLBACK)(SSCP_CTX_ST* ctx, BYTE state, const SSCP_HEALTH_ST* health, void* userData);
+
+#define SSCP_HEALTH_STOPPED 0xFFFFFFFF
+
+LONG SSCP_HealthStart(SSCP_CTX_ST* ctx, const SSCP_HEALTH_CONFIG_ST* config, SSCP_HEALTH_CALLBACK callback, void* userData);
+LONG SSCP_HealthStep(SSCP_CTX_ST* ctx, DWORD* nextStepMs);
+LONG SSCP_BusHealthStep(SSCP_BUS_ST* bus, DWORD* nextStepMs);
+LONG SSCP_HealthStop(SSCP_CTX_ST* ctx);
+LONG SSCP_GetHealth(SSCP_CTX_ST* ctx, SSCP_HEALTH_ST* health);
+
 LONG SSCP_TransceiveNFC(SSCP_CTX_ST* ctx, const BYTE commandApdu[], DWORD commandApduSz, BYTE responseApdu[], DWORD maxResponseApduSz, DWORD *actResponseApduSz);
+
+/*
+ * In-place APDU exchange: the APDU is built at buffer[SSCP_APDU_HEADROOM], and
+ * SSCP_APDU_TAILROOM bytes must remain available after it (for the signature,
+ * the padding and the IV).
+ */
+#define SSCP_APDU_HEADROOM 10
+#define SSCP_APDU_TAILROOM 64
+
+LONG SSCP_TransceiveNFCInPlace(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz, DWORD commandApduSz, BYTE responseApdu[], DWORD maxResponseApduSz, DWORD *actResponseApduSz);
 LONG SSCP_ReleaseNFC(SSCP_CTX_ST* ctx);
 
+/*
+ * Card transaction: APDUs exchanged back to back with the card, each one with the
+ * status word it must end with, and the chaining it allows. A step whose status word
+ * does not match (any bit set in expectedSwMask differs from expectedSw) ends the
+ * script with SSCP_ERR_NFC_CARD_UNEXPECTED_SW, unless SSCP_APDU_CONTINUE_ON_SW is set.
+ */
+#define SSCP_APDU_CHAIN_GET_RESPONSE 0x01 /* 61xx: GET RESPONSE, 6Cxx: the last APDU again with Le = xx */
+#define SSCP_APDU_CHAIN_ADDITIONAL_FRAME 0x02 /* 91AF: DESFire ADDITIONAL FRAME (90 AF 00 00 00) */
+#define SSCP_APDU_CONTINUE_ON_SW 0x04 /* An unexpected status word does not end the script */
+
+typedef struct
+{
+	const BYTE* apdu;
+	DWORD apduSz;
+	WORD expectedSw; /* e.g. 0x9000, or 0x9100 for DESFire */
+	WORD expectedSwMask; /* 0xFFFF for an exact match, 0 for any status word */
+	BYTE flags; /* SSCP_APDU_* */
+	BYTE* response; /* Data of all the parts, without the status words (may be NULL) */
+	DWORD maxResponseSz;
+	DWORD actResponseSz; /* Out */
+	WORD sw; /* Out: status word of the last part */
+	LONG result; /* Out */
+	DWORD elapsedUs; /* Out: duration of the step, chaining included */
+} SSCP_APDU_STEP_ST;
+
+LONG SSCP_RunApduScript(SSCP_CTX_ST* ctx, SSCP_APDU_STEP_ST steps[], DWORD stepCount, DWORD* doneCount);
+
+/*
+ * Non-blocking secure exchange, to drive many readers from one event loop:
+ * submit the command, wait on the handle given by SSCP_AsyncGetPollInfo() and call
+ * SSCP_AsyncPoll() until it returns something else than SSCP_ERR_IN_PROGRESS, then
+ * fetch the response with SSCP_AsyncComplete(). commandHeader is one of SSCP_CMD_*.
+ */
+#ifdef _WIN32
+typedef HANDLE SSCP_POLL_HANDLE;
+#else
+typedef int SSCP_POLL_HANDLE;
+#endif
+
+#define SSCP_ASYNC_INFINITE 0xFFFFFFFF
+
+LONG SSCP_AsyncSubmit(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData[], DWORD commandDataSz);
+LONG SSCP_AsyncPoll(SSCP_CTX_ST* ctx);
+LONG SSCP_AsyncComplete(SSCP_CTX_ST* ctx, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
+LONG SSCP_AsyncCancel(SSCP_CTX_ST* ctx);
+LONG SSCP_AsyncGetPollInfo(SSCP_CTX_ST* ctx, SSCP_POLL_HANDLE* handle, BOOL* wantWrite, DWORD* timeoutMs);
+
+/*
+ * Sequence of secure commands (e.g. LEDs, buzzer, release RF and scan on a badge
+ * accept), exchanged one after the other in a single call; each command is ciphered
+ * while the reader processes the previous one.
+ */
+typedef struct
+{
+	DWORD commandHeader; /* SSCP_CMD_* */
+	const BYTE* commandData; /* May be NULL if commandDataSz is 0 */
+	DWORD commandDataSz;
+	BYTE* responseData; /* May be NULL */
+	DWORD maxResponseDataSz;
+	DWORD actResponseDataSz; /* Out */
+	LONG result; /* Out: what SSCP_Exchange() would have returned */
+} SSCP_BATCH_ITEM_ST;
+
+LONG SSCP_ExchangeBatch(SSCP_CTX_ST* ctx, SSCP_BATCH_ITEM_ST items[], DWORD itemCount, DWORD* doneCount);
+
+/*
+ * Request queue, to share a context (or the readers of a bus) between threads: a
+ * worker thread per port runs the requests the other threads post, in order. A
+ * request is a secure command, as SSCP_Exchange() takes it, or a job: a function
+ * run by the worker, for a sequence that must not be interleaved with the others.
+ * While the queue runs, the exchange functions may be called from any thread, they
+ * are posted and wait for their outcome. The request belongs to the caller, and
+ * must remain valid until it is over.
+ */
+typedef struct _SSCP_REQUEST_ST SSCP_REQUEST_ST;
+
+typedef LONG (*SSCP_REQUEST_JOB)(SSCP_CTX_ST* ctx, void* userData);
+typedef void (*SSCP_REQUEST_CALLBACK)(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request, void* userData);
+
+struct _SSCP_REQUEST_ST
+{
+	DWORD commandHeader; /* SSCP_CMD_*, if job is NULL */
+	const BYTE* commandData; /* May be NULL if commandDataSz is 0 */
+	DWORD commandDataSz;
+	BYTE* responseData; /* May be NULL */
+	DWORD maxResponseDataSz;
+	DWORD actResponseDataSz; /* Out */
+	SSCP_REQUEST_JOB job; /* Run instead of a command (may be NULL) */
+	SSCP_REQUEST_CALLBACK callback; /* Called by the worker once the request is over (may be NULL) */
+	void* userData; /* For the job and the callback */
+	LONG result; /* Out: what SSCP_Exchange() or the job returned */
+	/* Private, zero before the first post */
+	SSCP_CTX_ST* ctx;
+	SSCP_REQUEST_ST* volatile next;
+	volatile LONG state;
+	struct _SSCP_QUEUE_ST* completions; /* Of the dispatcher it has been posted through */
+};
+
+LONG SSCP_QueueStart(SSCP_CTX_ST* ctx);
+LONG SSCP_QueueStop(SSCP_CTX_ST* ctx);
+LONG SSCP_QueuePost(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request);
+LONG SSCP_QueueWait(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request, DWORD timeoutMs);
+
+/*
+ * Dispatcher over many ports (e.g. a USB to RS-485 adapter per line): the worker of
+ * each port's request queue runs the requests of that port, the ports all work at
+ * the same time, and the requests of all of them, once over, come out of a single
+ * completion queue, with the port and the address of the reader they were for.
+ */
+typedef struct _SSCP_DISPATCHER_ST SSCP_DISPATCHER_ST;
+
+#define SSCP_DISPATCHER_MAX_PORTS 32
+#define SSCP_DISPATCHER_PIN_WORKERS 0x00000001 /* The workers of the ports on distinct cores, as long as there are some */
+
+SSCP_DISPATCHER_ST* SSCP_DispatcherAlloc(DWORD flags);
+void SSCP_DispatcherFree(SSCP_DISPATCHER_ST* dispatcher);
+LONG SSCP_DispatcherAddPort(SSCP_DISPATCHER_ST* dispatcher, SSCP_CTX_ST* ctx, DWORD* portIndex);
+LONG SSCP_DispatcherPost(SSCP_DISPATCHER_ST* dispatcher, SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request);
+LONG SSCP_DispatcherNext(SSCP_DISPATCHER_ST* dispatcher, DWORD timeoutMs, SSCP_REQUEST_ST** request, DWORD* portIndex, BYTE* address);
+
+/*
+ * Bring-up of a set of readers: the readers of different ports are authenticated at
+ * the same time, those of a same bus one step after the other.
+ */
+#define SSCP_AUTH_MAX_TARGETS 4096 /* Targets of a single call: 32 ports of 128 readers (by passes of a block with a memory pool) */
+
+typedef struct
+{
+	SSCP_CTX_ST* ctx;
+	const BYTE* authKeyValue; /* May be NULL for the default key */
+	LONG result; /* Out: what SSCP_Authenticate() would have returned */
+	DWORD elapsedUs; /* Out: from the call to the outcome */
+} SSCP_AUTH_TARGET_ST;
+
+LONG SSCP_AuthenticateAll(SSCP_AUTH_TARGET_ST targets[], DWORD targetCount, DWORD* successCount);
+
+/*
+ * Key cache, shared by the contexts that authenticate with the same keys: what is
+ * derived from an authentication key alone (K' = AES(K, K), its key schedule, the
+ * HMAC midstates of K) is computed once for all the readers. Wiped when freed.
+ */
+typedef struct _SSCP_KEY_CACHE_ST SSCP_KEY_CACHE_ST;
+
+SSCP_KEY_CACHE_ST* SSCP_KeyCacheAlloc(void);
+void SSCP_KeyCacheFree(SSCP_KEY_CACHE_ST* cache);
+LONG SSCP_SetKeyCache(SSCP_CTX_ST* ctx, SSCP_KEY_CACHE_ST* cache);
+
+/*
+ * Session of a reader, sealed (ciphered and signed) with a key of the application,
+ * to be resumed by another process without a new authentication.
+ */
+#define SSCP_SESSION_BLOB_SZ 128
+
+LONG SSCP_ExportSession(SSCP_CTX_ST* ctx, const BYTE sealKeyValue[16], BYTE blob[SSCP_SESSION_BLOB_SZ]);
+LONG SSCP_ImportSession(SSCP_CTX_ST* ctx, const BYTE sealKeyValue[16], const BYTE blob[], DWORD blobSz);
+LONG SSCP_ResumeSession(SSCP_CTX_ST* ctx, const BYTE sealKeyValue[16], const BYTE blob[], DWORD blobSz, const BYTE authKeyValue[16], BOOL* resumed);
+
+/*
+ * Binary trace of the frames and of the secure exchanges, recorded as they happen
+ * into a ring (and/or given to a sink), with nothing formatted; see SSCP_TraceAttach().
+ */
+#define SSCP_TRACE_TX 1 /* Frame sent */
+#define SSCP_TRACE_RX 2 /* Frame received (its CRC has not been checked yet) */
+#define SSCP_TRACE_TIMEOUT 3 /* No complete response in time */
+#define SSCP_TRACE_EXCHANGE 4 /* Secure exchange over */
+
+#define SSCP_TRACE_DATA_SZ 32
+
+typedef struct
+{
+	DWORD sequence; /* Position in the ring, the gaps are events that have been lost */
+	DWORD timeUs; /* Monotonic clock */
+	DWORD durationUs; /* EXCHANGE: from the first transmission to the outcome */
+	DWORD info; /* TX, RX: size of the frame; TIMEOUT: class of timeout; EXCHANGE: command */
+	DWORD retries; /* EXCHANGE: resendings after a timeout */
+	LONG result; /* TIMEOUT, EXCHANGE: SSCP_ERR_* code, or status of the reader */
+	BYTE type; /* SSCP_TRACE_* */
+	BYTE address;
+	WORD dataSz;
+	BYTE data[SSCP_TRACE_DATA_SZ]; /* TX, RX: beginning of the frame, see SSCP_TraceAttach() */
+} SSCP_TRACE_EVENT_ST;
+
+typedef struct _SSCP_TRACE_ST SSCP_TRACE_ST;
+
+typedef void (*SSCP_TRACE_SINK)(SSCP_CTX_ST* ctx, const SSCP_TRACE_EVENT_ST* event, void* userData);
+
+SSCP_TRACE_ST* SSCP_TraceAlloc(DWORD eventCount);
+void SSCP_TraceFree(SSCP_TRACE_ST* trace);
+LONG SSCP_TraceAttach(SSCP_CTX_ST* ctx, SSCP_TRACE_ST* trace, SSCP_TRACE_SINK sink, void* userData);
+DWORD SSCP_TraceRead(SSCP_TRACE_ST* trace, SSCP_TRACE_EVENT_ST events[], DWORD maxEvents, DWORD* lostEvents);
+
+/*
+ * Secure exchange of a large command, its data read piece by piece while the frame is
+ * ciphered and sent; the lengths of the protocol (16 bits) are the only limit.
+ */
+#define SSCP_STREAM_MAX_DATA_SZ 65463 /* 9 + data + 32, padded to 16, + 16 (IV) fit in a frame */
+#define SSCP_STREAM_RESPONSE_OVERHEAD 74 /* Room the response buffer needs beyond the response data */
+
+typedef LONG (*SSCP_STREAM_SOURCE)(void* userData, DWORD offset, BYTE buffer[], DWORD length);
+
+LONG SSCP_ExchangeStream(SSCP_CTX_ST* ctx, DWORD commandHeader, DWORD commandDataSz, SSCP_STREAM_SOURCE source, void* sourceData, BYTE response[], DWORD maxResponseSz, DWORD* actResponseDataSz);
+
 typedef struct
 {
 	DWORD totalTime;
@@ -85,6 +454,53 @@ typedef struct
 
 LONG SSCP_GetStatistics(SSCP_CTX_ST* ctx, SSCP_STATISTICS_ST *stats);
 
+/*
+ * Detailed statistics of the secure exchanges, since the last reset: outcomes, per
+ * command figures, and round-trip latency histogram (first transmission to verified
+ * response). Bucket i of the histogram holds the latencies from SSCP_LatencyBucketUs(i)
+ * to SSCP_LatencyBucketUs(i + 1) excluded; the percentiles are bucket upper bounds.
+ */
+#define SSCP_STATS_LATENCY_BUCKETS 100
+#define SSCP_STATS_MAX_COMMANDS 16
+
+typedef struct
+{
+	DWORD commandHeader; /* SSCP_CMD_*, the entries after the last used one are 0 */
+	DWORD count;
+	DWORD failures; /* Exchanges that ended with an SSCP_ERR_* code */
+	DWORD retries; /* Resendings after a timeout or a corrupted response */
+	DWORD meanUs;
+	DWORD maxUs; /* Since the last reset, as the other figures */
+} SSCP_COMMAND_STATISTICS_ST;
+
+typedef struct
+{
+	SSCP_STATISTICS_ST basic; /* As returned by SSCP_GetStatistics(), not reset */
+	DWORD exchanges;
+	DWORD failures; /* Exchanges that ended with an SSCP_ERR_* code */
+	DWORD retries; /* Resendings after a timeout or a corrupted response */
+	DWORD timeouts; /* Attempts that got no complete response */
+	DWORD crcErrors;
+	DWORD signatureErrors; /* Wrong HMAC */
+	DWORD counterErrors;
+	DWORD formatErrors; /* Wrong response length, type, command or format */
+	DWORD corruptedRetries; /* Resendings after a corrupted response */
+	DWORD recoveries; /* Exchanges that have succeeded after a resending */
+	DWORD backoffMs; /* Time waited before the resendings */
+	DWORD counterResyncs; /* Failed exchanges after which the counter has skipped a value */
+	DWORD latencyP50Us;
+	DWORD latencyP95Us;
+	DWORD latencyP99Us;
+	DWORD latency[SSCP_STATS_LATENCY_BUCKETS];
+	SSCP_COMMAND_STATISTICS_ST commands[SSCP_STATS_MAX_COMMANDS]; /* In the order of their first exchange */
+} SSCP_STATISTICS_EX_ST;
+
+LONG SSCP_GetStatisticsEx(SSCP_CTX_ST* ctx, SSCP_STATISTICS_EX_ST* stats, BOOL reset);
+DWORD SSCP_LatencyBucketUs(DWORD bucket);
+
+/* Names of the AES and SHA-256 implementations selected at runtime (hardware, OpenSSL or portable C) */
+void SSCP_GetCryptoBackends(const char** aesBackend, const char** sha256Backend);
+
 #include <sscp-consts.h>
 #include <sscp-errors.h>
 
@@ -0,0 +1,260 @@
+/**
+ * @file sscp-host-apdu-script.c
+ * @brief Multi-step card transactions (a list of APDUs) in a single call.
+ *
+ * Each step is an APDU, the status word it is expected to end with, and where to
+ * gather its response. The steps run back to back through the context's own
+ * buffers; a step that needs several exchanges with the card is chained here:
+ *
+ * - ISO 7816-4: 61xx is followed by GET RESPONSE (Le = xx), 6Cxx by the APDU
+ *   just sent (the command, or its GET RESPONSE) again with Le = xx, in the short
+ *   or extended form of its own Le;
+ * - DESFire, native commands wrapped in ISO 7816-4: 91AF is followed by
+ *   ADDITIONAL FRAME (90 AF 00 00 00).
+ *
+ * The response data of all the parts are gathered, the status word is the one of
+ * the last part. The script stops at the first step that fails or ends with an
+ * unexpected status word, unless the step allows to carry on.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_APDU_SCRIPT_MAX_PARTS 64 /* Exchanges of a single step, chaining included */
+
+/* Copy the APDU to exchange next into the transmit buffer */
+static void SSCP_ApduScriptLoad(SSCP_CTX_ST* ctx, const BYTE apdu[], DWORD apduSz)
+{
+	if (apduSz > 0)
+		memmove(&ctx->txBuffer[SSCP_APDU_HEADROOM], apdu, apduSz);
+}
+
+/*
+ * Class byte of a GET RESPONSE on the logical channel of the command, without its
+ * secure messaging and chaining bits (ISO 7816-4): first interindustry classes
+ * (000x xxcc) for the channels 0 to 3, further interindustry ones (01xx cccc) for the
+ * channels 4 to 19. A proprietary class has no channel, the basic one is used.
+ */
+static BYTE SSCP_ApduChannelClass(BYTE cla)
+{
+	if ((cla & 0xE0) == 0x00)
+		return (BYTE)(cla & 0x03);
+	if ((cla & 0xC0) == 0x40)
+		return (BYTE)(0x40 | (cla & 0x0F));
+
+	return 0x00;
+}
+
+/*
+ * Size of the Le field that ends the APDU (ISO 7816-4): 1 for the short cases 2
+ * and 4, 2 for the extended ones, 0 if the APDU has no Le (case 1 or 3) or is
+ * malformed
+ */
+static DWORD SSCP_ApduLeSize(const BYTE apdu[], DWORD apduSz)
+{
+	DWORD lc;
+
+	if (apduSz < 5)
+		return 0;
+	if (apduSz == 5)
+		return 1;
+
+	/* Short Lc */
+	if (apdu[4] != 0x00)
+		return (apduSz == 5 + (DWORD) apdu[4] + 1) ? 1 : 0;
+
+	/* Extended: 00, then Le, or Lc, the data and Le */
+	if (apduSz == 7)
+		return 2;
+	lc = ((DWORD) apdu[5] << 8) | apdu[6];
+	return (apduSz == 7 + lc + 2) ? 2 : 0;
+}
+
+/* Run a step: the APDU, then the chaining the card asks for */
+static LONG SSCP_ApduScriptStep(SSCP_CTX_ST* ctx, SSCP_APDU_STEP_ST* step)
+{
+	const BYTE* apdu = step->apdu; /* What is sent next, the transmit buffer is ciphered in place */
+	DWORD apduSz = step->apduSz;
+	BYTE chained[5]; /* GET RESPONSE or ADDITIONAL FRAME */
+	BYTE le[2]; /* For 6Cxx: Le that replaces the one of the APDU */
+	DWORD leSz = 0;
+	DWORD part;
+
+	for (part = 0; part < SSCP_APDU_SCRIPT_MAX_PARTS; part++)
+	{
+		const BYTE* response;
+		DWORD responseSz, dataSz;
+		BYTE sw1, sw2;
+		LONG rc;
+
+		SSCP_ApduScriptLoad(ctx, apdu, apduSz);
+		if (leSz > 0)
+			memcpy(&ctx->txBuffer[SSCP_APDU_HEADROOM + apduSz - leSz], le, leSz);
+
+		rc = SSCP_TransceiveNFC_Exchange(ctx, ctx->txBuffer, sizeof(ctx->txBuffer), apduSz, &response, &responseSz);
+		if (rc)
+			return rc;
+
+		if (responseSz < 2)
+			return SSCP_ERR_UNSUPPORTED_RESPONSE_LENGTH;
+
+		dataSz = responseSz - 2;
+		sw1 = response[dataSz];
+		sw2 = response[dataSz + 1];
+		step->sw = (WORD)((sw1 << 8) | sw2);
+
+		/* Gather the data of this part */
+		if (dataSz > 0)
+		{
+			if (step->actResponseSz + dataSz > step->maxResponseSz)
+				return SSCP_ERR_OUTPUT_BUFFER_OVERFLOW;
+			if (step->response != NULL)
+				memcpy(&step->response[step->actResponseSz], response, dataSz);
+			step->actResponseSz += dataSz;
+		}
+
+		if ((step->flags & SSCP_APDU_CHAIN_GET_RESPONSE) && (sw1 == 0x61))
+		{
+			/* GET RESPONSE, on the logical channel of the command */
+			chained[0] = (step->apduSz > 0) ? SSCP_ApduChannelClass(step->apdu[0]) : 0x00;
+			chained[1] = 0xC0;
+			chained[2] = 0x00;
+			chained[3] = 0x00;
+			chained[4] = sw2;
+			apdu = chained;
+			apduSz = 5;
+			leSz = 0;
+			continue;
+		}
+
+		if ((step->flags & SSCP_APDU_CHAIN_GET_RESPONSE) && (sw1 == 0x6C) && (SSCP_ApduLeSize(apdu, apduSz) > 0))
+		{
+			/* Wrong Le: the APDU just sent, with Le = xx (00 is 256) */
+			leSz = SSCP_ApduLeSize(apdu, apduSz);
+			if (leSz == 1)
+			{
+				le[0] = sw2;
+			}
+			else
+			{
+				le[0] = (sw2 == 0x00) ? 0x01 : 0x00;
+				le[1] = sw2;
+			}
+			continue;
+		}
+
+		if ((step->flags & SSCP_APDU_CHAIN_ADDITIONAL_FRAME) && (sw1 == 0x91) && (sw2 == 0xAF))
+		{
+			/* ADDITIONAL FRAME */
+			chained[0] = 0x90;
+			chained[1] = 0xAF;
+			chained[2] = 0x00;
+			chained[3] = 0x00;
+			chained[4] = 0x00;
+			apdu = chained;
+			apduSz = 5;
+			leSz = 0;
+			continue;
+		}
+
+		if ((step->sw & step->expectedSwMask) != (step->expectedSw & step->expectedSwMask))
+			return SSCP_ERR_NFC_CARD_UNEXPECTED_SW;
+
+		return SSCP_SUCCESS;
+	}
+
+	/* The card keeps asking for more */
+	return SSCP_ERR_RESPONSE_TOO_LONG;
+}
+
+/* Arguments of SSCP_RunApduScript(), for the worker of the queue */
+typedef struct
+{
+	SSCP_APDU_STEP_ST* steps;
+	DWORD stepCount;
+	DWORD* doneCount;
+} SSCP_APDU_SCRIPT_ARGS_ST;
+
+static LONG SSCP_ApduScriptJob(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_APDU_SCRIPT_ARGS_ST* args = (const SSCP_APDU_SCRIPT_ARGS_ST*) userData;
+
+	return SSCP_RunApduScript(ctx, args->steps, args->stepCount, args->doneCount);
+}
+
+/**
+ * @brief Run a card transaction: a list of APDUs, with their status word checks.
+ *
+ * The steps are exchanged one after the other with the card found by the last scan,
+ * with the chaining each step allows (see SSCP_APDU_CHAIN_GET_RESPONSE and
+ * SSCP_APDU_CHAIN_ADDITIONAL_FRAME). Each step receives its gathered response data,
+ * its final status word, its outcome and how long it took, chaining included.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in,out] steps APDUs of the transaction, and their outcomes.
+ * @param[in] stepCount Number of steps.
+ * @param[out] doneCount Number of steps that have been run, whatever their outcome;
+ *             the outcome of the following ones is not set (may be NULL).
+ *
+ * @return SSCP_SUCCESS if all the steps have run, otherwise the outcome of the step
+ *         that ended the script.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p steps is NULL, or a step has no APDU but a
+ *         size; nothing has been sent.
+ * @retval SSCP_ERR_COMMAND_TOO_LONG The APDU of a step is too long; nothing has been sent.
+ * @retval SSCP_ERR_NFC_CARD_UNEXPECTED_SW A step ended with a status word that does
+ *         not match the expected one.
+ * @retval SSCP_ERR_OUTPUT_BUFFER_OVERFLOW The response of a step does not fit in its buffer.
+ * @retval SSCP_ERR_RESPONSE_TOO_LONG The card still chains after SSCP_APDU_SCRIPT_MAX_PARTS parts.
+ */
+LONG SSCP_RunApduScript(SSCP_CTX_ST* ctx, SSCP_APDU_STEP_ST steps[], DWORD stepCount, DWORD* doneCount)
+{
+	DWORD i;
+
+	if (doneCount != NULL)
+		*doneCount = 0;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((steps == NULL) && (stepCount > 0))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	/* The queue runs: the whole transaction is a single job, no other command comes in between */
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_APDU_SCRIPT_ARGS_ST args = { steps, stepCount, doneCount };
+		return SSCP_QueueCallJob(ctx, SSCP_ApduScriptJob, &args);
+	}
+
+	/* Check all the steps before anything is sent */
+	for (i = 0; i < stepCount; i++)
+	{
+		if ((steps[i].apdu == NULL) && (steps[i].apduSz > 0))
+			return SSCP_ERR_INVALID_PARAMETER;
+		if (1 + steps[i].apduSz > SSCP_MAX_PAYLOAD_SZ)
+			return SSCP_ERR_COMMAND_TOO_LONG;
+	}
+
+	for (i = 0; i < stepCount; i++)
+	{
+		SSCP_APDU_STEP_ST* step = &steps[i];
+		DWORD startUs = SSCP_GetTickUs();
+		LONG rc;
+
+		step->actResponseSz = 0;
+		step->sw = 0;
+
+		rc = SSCP_ApduScriptStep(ctx, step);
+
+		step->elapsedUs = SSCP_GetTickUs() - startUs;
+		step->result = rc;
+		if (doneCount != NULL)
+			*doneCount = i + 1;
+
+		if ((rc == SSCP_ERR_NFC_CARD_UNEXPECTED_SW) && (step->flags & SSCP_APDU_CONTINUE_ON_SW))
+			continue;
+		if (rc != SSCP_SUCCESS)
+			return rc;
+	}
+
+	return SSCP_SUCCESS;
+}
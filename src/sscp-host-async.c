@@ -0,0 +1,457 @@
+/**
+ * @file sscp-host-async.c
+ * @brief Non-blocking secure exchange, for hosts that drive many readers from an event loop.
+ *
+ * SSCP_AsyncSubmit() builds and ciphers the frame exactly like SSCP_Exchange() does,
+ * then returns at once. The application waits on the handle returned by
+ * SSCP_AsyncGetPollInfo() (readable, or writable when asked), or until the timeout
+ * it tells, and calls SSCP_AsyncPoll() which moves the exchange forward without ever
+ * blocking. Once SSCP_AsyncPoll() returns something else than SSCP_ERR_IN_PROGRESS,
+ * SSCP_AsyncComplete() retrieves the response and makes the context ready for the
+ * next exchange.
+ *
+ * The guard time of the scan commands, and the retries on timeout, behave as in the
+ * blocking functions, only they are scheduled as deadlines instead of sleeps.
+ *
+ * @note While an asynchronous exchange is pending, the blocking functions called on
+ *       the same context, or on another reader of the same bus, return
+ *       SSCP_ERR_IN_PROGRESS: the readers of a bus share the line and its receive ring.
+ */
+#include "sscp-host_i.h"
+
+/* An asynchronous exchange is pending on the context, or holds the line of its port */
+BOOL SSCP_AsyncPending(SSCP_CTX_ST* ctx)
+{
+	return (ctx->async.state != SSCP_ASYNC_IDLE) || (ctx->port->asyncOwner != NULL);
+}
+
+static LONG SSCP_AsyncFinish(SSCP_CTX_ST* ctx, LONG rc)
+{
+	SSCP_RetryEnd(ctx, ctx->async.retry, (rc >= 0) ? SSCP_SUCCESS : rc);
+	SSCP_StatsRecord(ctx, ctx->async.commandHeader, rc, ctx->async.retry, SSCP_GetTickUs() - ctx->async.startUs);
+
+	ctx->async.state = SSCP_ASYNC_DONE;
+	ctx->async.result = rc;
+	return rc;
+}
+
+static void SSCP_AsyncStartSend(SSCP_CTX_ST* ctx)
+{
+	if (ctx->async.retry == 0)
+		ctx->async.startUs = SSCP_GetTickUs();
+	ctx->async.state = SSCP_ASYNC_SEND;
+	ctx->async.txOffset = 0;
+	ctx->async.rxOffset = 0;
+	ctx->async.rxLength = 0;
+	SSCP_SerialFlushRing(ctx);
+}
+
+/* What is left to send of the frame (header, payload, CRC) */
+static DWORD SSCP_AsyncPendingChunks(SSCP_CTX_ST* ctx, SSCP_SERIAL_CHUNK_ST frame[3])
+{
+	frame[0].buffer = ctx->async.txHeader;
+	frame[0].length = sizeof(ctx->async.txHeader);
+	frame[1].buffer = ctx->txBuffer;
+	frame[1].length = ctx->async.commandSz;
+	frame[2].buffer = ctx->async.txCrc;
+	frame[2].length = sizeof(ctx->async.txCrc);
+
+	return SSCP_SerialSkipChunks(frame, 3, ctx->async.txOffset);
+}
+
+/* The attempt has failed with rc: wait before sending again, if the retry policy says so */
+static BOOL SSCP_AsyncRetry(SSCP_CTX_ST* ctx, LONG rc)
+{
+	DWORD backoffMs;
+
+	if (!SSCP_RetryNext(ctx, ctx->async.retry, rc, &backoffMs))
+		return FALSE;
+	ctx->async.retry++;
+
+	/* The tail of a corrupted response comes within the inter byte timeout, it is dropped before the resending */
+	if ((rc != SSCP_ERR_COMM_RECV_MUTE) && (rc != SSCP_ERR_COMM_RECV_STOPPED) && (backoffMs < SSCP_InterByteTimeout(ctx)))
+		backoffMs = SSCP_InterByteTimeout(ctx);
+
+	ctx->async.deadline = SSCP_GetTickMs() + backoffMs;
+	ctx->async.state = SSCP_ASYNC_BACKOFF;
+	return TRUE;
+}
+
+/* Send as much of the frame as the driver accepts */
+static LONG SSCP_AsyncSend(SSCP_CTX_ST* ctx)
+{
+	SSCP_SERIAL_CHUNK_ST frame[3];
+	DWORD chunkCount;
+	LONG rc;
+
+	while ((chunkCount = SSCP_AsyncPendingChunks(ctx, frame)) > 0)
+	{
+		DWORD done;
+
+		rc = SSCP_TransportSendSomeV(ctx, frame, chunkCount, &done);
+		if (rc)
+			return rc;
+		if (done == 0)
+			return SSCP_ERR_IN_PROGRESS;
+
+		ctx->async.txOffset += done;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/* Receive what is available, until the response frame is complete */
+static LONG SSCP_AsyncRecv(SSCP_CTX_ST* ctx)
+{
+	LONG rc;
+
+	for (;;)
+	{
+		DWORD done;
+
+		/* The CRC is checked there */
+		rc = SSCP_SerialRingFrame(ctx, ctx->async.rxHeader, ctx->rxBuffer, sizeof(ctx->rxBuffer), ctx->async.rxCrc);
+		if (rc != SSCP_ERR_IN_PROGRESS)
+			break;
+
+		rc = SSCP_SerialFillRing(ctx, 0, &done);
+		if (rc)
+			return rc;
+		if (done == 0)
+			return SSCP_ERR_IN_PROGRESS;
+
+		ctx->async.rxOffset += done;
+		ctx->async.deadline = SSCP_GetTickMs() + SSCP_InterByteTimeout(ctx);
+	}
+	if (rc)
+		return rc;
+
+	ctx->async.rxLength = ctx->async.rxHeader[1];
+	ctx->async.rxLength <<= 8;
+	ctx->async.rxLength |= ctx->async.rxHeader[2];
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Start a non-blocking secure exchange.
+ *
+ * The command is prepared (signed and ciphered with the session keys) in the
+ * context's own buffer, so @p commandData may be released as soon as the function
+ * returns. Nothing is sent yet: call SSCP_AsyncPoll() to move the exchange forward.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in] commandHeader Command, one of the SSCP_CMD_* constants.
+ * @param[in] commandData Command data (may be NULL if @p commandDataSz is 0).
+ * @param[in] commandDataSz Size of the command data.
+ *
+ * @return SSCP_SUCCESS if the exchange has been started, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_IN_PROGRESS Another exchange is pending on the context or on
+ *         another reader of its bus, or the queue of the port runs (see SSCP_QueueStart()).
+ */
+LONG SSCP_AsyncSubmit(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData[], DWORD commandDataSz)
+{
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_AsyncPending(ctx) || (ctx->port->queue != NULL))
+		return SSCP_ERR_IN_PROGRESS;
+	if ((commandData == NULL) && (commandDataSz > 0))
+		return SSCP_ERR_INVALID_PARAMETER;
+	if (commandDataSz > SSCP_MAX_PAYLOAD_SZ)
+		return SSCP_ERR_COMMAND_TOO_LONG;
+
+	if (commandDataSz > 0)
+		memmove(&ctx->txBuffer[SSCP_COMMAND_HEADROOM], commandData, commandDataSz);
+
+	rc = SSCP_ExchangePrepare(ctx, commandHeader, ctx->txBuffer, sizeof(ctx->txBuffer), commandDataSz, &ctx->async.commandSz);
+	if (rc)
+		return rc;
+
+	ctx->async.commandHeader = commandHeader;
+	ctx->async.retry = 0;
+	ctx->async.result = SSCP_ERR_IN_PROGRESS;
+	ctx->async.responseDataSz = 0;
+	ctx->async.startUs = SSCP_GetTickUs();
+
+	/* Frame header and CRC, as in SSCP_ExchangeRaw() */
+	ctx->async.txHeader[0] = 0x02; /* SOF */
+	ctx->async.txHeader[1] = (BYTE)(ctx->async.commandSz >> 8);
+	ctx->async.txHeader[2] = (BYTE)(ctx->async.commandSz);
+	ctx->async.txHeader[3] = ctx->address;
+	ctx->async.txHeader[4] = SSCP_PROTOCOL_SECURE;
+	SSCP_SCR16(&ctx->async.txHeader[1], 4, ctx->txBuffer, ctx->async.commandSz, ctx->async.txCrc);
+
+	ctx->async.timeoutClass = SSCP_TimeoutClass(commandHeader);
+	ctx->port->asyncOwner = ctx;
+
+	/* The scan commands wait for the guard time, see SSCP_ScanNFC() */
+	switch (commandHeader)
+	{
+		case SSCP_CMD_SCAN_GLOBAL:
+		case SSCP_CMD_SCAN_A_RAW:
+			ctx->async.guardTimeMs = SSCP_SCAN_GLOBAL_GUARD_TIME;
+			ctx->async.state = SSCP_ASYNC_GUARD;
+		break;
+		default:
+			ctx->async.guardTimeMs = 0;
+			SSCP_AsyncStartSend(ctx);
+		break;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Move the pending exchange forward, without blocking.
+ *
+ * @param[in,out] ctx SSCP context.
+ *
+ * @return SSCP_ERR_IN_PROGRESS while the exchange is running. Otherwise the
+ *         exchange is over, and the value is what SSCP_AsyncComplete() returns.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL, or no exchange
+ *         has been submitted.
+ */
+LONG SSCP_AsyncPoll(SSCP_CTX_ST* ctx)
+{
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	for (;;)
+	{
+		switch (ctx->async.state)
+		{
+			case SSCP_ASYNC_IDLE:
+				return SSCP_ERR_INVALID_CONTEXT;
+
+			case SSCP_ASYNC_DONE:
+				return ctx->async.result;
+
+			case SSCP_ASYNC_GUARD:
+			{
+				DWORD remainingMs = SSCP_GuardRemaining(ctx);
+				if (remainingMs > 0)
+				{
+					ctx->async.deadline = SSCP_GetTickMs() + remainingMs;
+					return SSCP_ERR_IN_PROGRESS;
+				}
+				SSCP_InitGuardTime(ctx, ctx->async.guardTimeMs);
+				SSCP_AsyncStartSend(ctx);
+			}
+			break;
+
+			case SSCP_ASYNC_SEND:
+				rc = SSCP_AsyncSend(ctx);
+				if (rc == SSCP_ERR_IN_PROGRESS)
+					return rc;
+				if (rc)
+					return SSCP_AsyncFinish(ctx, rc);
+				if (SSCP_TRACE_ON(ctx))
+					SSCP_TraceFrame(ctx, SSCP_TRACE_TX, ctx->async.txHeader, ctx->txBuffer, ctx->async.commandSz);
+				ctx->async.state = SSCP_ASYNC_RECV;
+				ctx->async.sentAt = SSCP_GetTickMs();
+				ctx->async.deadline = ctx->async.sentAt + SSCP_FirstByteTimeout(ctx, ctx->async.timeoutClass, 5 + ctx->async.commandSz + 2);
+			break;
+
+			case SSCP_ASYNC_RECV:
+				rc = SSCP_AsyncRecv(ctx);
+				if (rc == SSCP_ERR_IN_PROGRESS)
+				{
+					if ((LONG)(SSCP_GetTickMs() - ctx->async.deadline) < 0)
+						return rc;
+
+					if (SSCP_SerialRingSettle(ctx, ctx->async.rxHeader, ctx->async.rxCrc))
+					{
+						/* Nothing came after a corrupted frame: it was the response */
+						rc = SSCP_ERR_WRONG_RESPONSE_CRC;
+					}
+					else
+					{
+						/* Timeout, same retry policy as SSCP_ExchangeInPlace() */
+						rc = (ctx->async.rxOffset == 0) ? SSCP_ERR_COMM_RECV_MUTE : SSCP_ERR_COMM_RECV_STOPPED;
+						SSCP_TimeoutExpired(ctx, ctx->async.timeoutClass);
+						if (SSCP_TRACE_ON(ctx))
+							SSCP_TraceEvent(ctx, SSCP_TRACE_TIMEOUT, ctx->async.timeoutClass, 0, rc, 0);
+					}
+				}
+				if (rc)
+				{
+					if (!SSCP_AsyncRetry(ctx, rc))
+						return SSCP_AsyncFinish(ctx, rc);
+					break;
+				}
+
+				SSCP_TimeoutSample(ctx, ctx->async.timeoutClass, 5 + ctx->async.commandSz + 2, SSCP_GetTickMs() - ctx->async.sentAt);
+
+				rc = SSCP_ExchangeVerify(ctx, ctx->async.commandHeader, ctx->rxBuffer, ctx->async.rxLength, NULL, SSCP_MAX_PAYLOAD_SZ, &ctx->async.responseDataSz);
+				return SSCP_AsyncFinish(ctx, rc);
+
+			case SSCP_ASYNC_BACKOFF:
+			{
+				DWORD received;
+
+				if ((LONG)(SSCP_GetTickMs() - ctx->async.deadline) < 0)
+					return SSCP_ERR_IN_PROGRESS;
+
+				/* Whatever the line has brought meanwhile is not the response to the resending */
+				SSCP_SerialFillRing(ctx, 0, &received);
+				SSCP_AsyncStartSend(ctx);
+			}
+			break;
+
+			default:
+				return SSCP_AsyncFinish(ctx, SSCP_ERR_INTERNAL_FAILURE);
+		}
+	}
+}
+
+/**
+ * @brief Retrieve the outcome of a finished exchange, and release the context.
+ *
+ * @param[in,out] ctx SSCP context.
+ * @param[out] responseData Buffer receiving the response data (may be NULL).
+ * @param[in] maxResponseDataSz Size of @p responseData.
+ * @param[out] actResponseDataSz Actual size of the response data (may be NULL).
+ *
+ * @return SSCP_SUCCESS, a positive status returned by the reader, or an SSCP_ERR_* code,
+ *         exactly as the blocking SSCP_Exchange() would have.
+ *
+ * @retval SSCP_ERR_IN_PROGRESS The exchange is not over yet; the context is left untouched.
+ * @retval SSCP_ERR_OUTPUT_BUFFER_OVERFLOW @p responseData is too small.
+ */
+LONG SSCP_AsyncComplete(SSCP_CTX_ST* ctx, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->async.state == SSCP_ASYNC_IDLE)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->async.state != SSCP_ASYNC_DONE)
+		return SSCP_ERR_IN_PROGRESS;
+
+	rc = ctx->async.result;
+	ctx->async.state = SSCP_ASYNC_IDLE;
+	ctx->port->asyncOwner = NULL;
+
+	if (actResponseDataSz != NULL)
+		*actResponseDataSz = ctx->async.responseDataSz;
+
+	if ((rc >= 0) && (ctx->async.responseDataSz > 0))
+	{
+		if (ctx->async.responseDataSz > maxResponseDataSz)
+			return SSCP_ERR_OUTPUT_BUFFER_OVERFLOW;
+		/* SSCP_ExchangeVerify() leaves the data after the counter (4), code (2) and length (2) */
+		if (responseData != NULL)
+			memcpy(responseData, &ctx->rxBuffer[8], ctx->async.responseDataSz);
+	}
+
+	return rc;
+}
+
+/**
+ * @brief Abandon the pending exchange, if any.
+ *
+ * Once some of the command has been sent, the reader may process it: the exchange
+ * then ends as if its response had not come in time (SSCP_ERR_COMM_RECV_MUTE, or
+ * SSCP_ERR_COMM_RECV_STOPPED if part of it came). It is counted as a failure in the
+ * statistics, and the counter of the context skips the one the reader may answer
+ * with, as after a timeout. A response that may still arrive afterwards is not
+ * consumed; the next exchange on the same line is likely to fail.
+ *
+ * @param[in,out] ctx SSCP context.
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_AsyncCancel(SSCP_CTX_ST* ctx)
+{
+	BOOL sent;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	sent = (ctx->async.retry > 0) || (ctx->async.state == SSCP_ASYNC_RECV) || (ctx->async.state == SSCP_ASYNC_BACKOFF)
+		|| ((ctx->async.state == SSCP_ASYNC_SEND) && (ctx->async.txOffset > 0));
+	if ((ctx->async.state != SSCP_ASYNC_IDLE) && (ctx->async.state != SSCP_ASYNC_DONE) && sent)
+		SSCP_AsyncFinish(ctx, (ctx->async.rxOffset > 0) ? SSCP_ERR_COMM_RECV_STOPPED : SSCP_ERR_COMM_RECV_MUTE);
+
+	ctx->async.state = SSCP_ASYNC_IDLE;
+	ctx->retry.resending = FALSE;
+	if (ctx->port->asyncOwner == ctx)
+		ctx->port->asyncOwner = NULL;
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Tell the event loop what to wait for before calling SSCP_AsyncPoll() again.
+ *
+ * @param[in] ctx SSCP context.
+ * @param[out] handle Port handle (file descriptor on Linux, or socket of a TCP port),
+ *             may be NULL. On a bus, all the readers share the same handle.
+ * @param[out] wantWrite TRUE if the handle shall be watched for writability, FALSE
+ *             for readability (may be NULL).
+ * @param[out] timeoutMs Delay after which SSCP_AsyncPoll() must be called even without
+ *             any event: 0 if it must be called now, SSCP_ASYNC_INFINITE when there is
+ *             no exchange pending (may be NULL).
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ *
+ * @note On Windows the handle is not opened overlapped: it may be registered for
+ *       WaitCommEvent-style notification, otherwise rely on the timeout. The
+ *       handle of a TCP port is the SOCKET, to be used with WSAEventSelect().
+ */
+LONG SSCP_AsyncGetPollInfo(SSCP_CTX_ST* ctx, SSCP_POLL_HANDLE* handle, BOOL* wantWrite, DWORD* timeoutMs)
+{
+	DWORD delay = 0;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	if (handle != NULL)
+	{
+#ifdef _WIN32
+		if (SSCP_TransportBase(ctx) == &SSCP_TRANSPORT_TCP)
+			*handle = (HANDLE) ctx->port->commSocket;
+		else
+			*handle = ctx->port->commHandle;
+#else
+		*handle = ctx->port->commFd;
+#endif
+	}
+
+	if (wantWrite != NULL)
+		*wantWrite = (ctx->async.state == SSCP_ASYNC_SEND) ? TRUE : FALSE;
+
+	switch (ctx->async.state)
+	{
+		case SSCP_ASYNC_IDLE:
+			delay = SSCP_ASYNC_INFINITE;
+		break;
+		case SSCP_ASYNC_GUARD:
+		case SSCP_ASYNC_RECV:
+		case SSCP_ASYNC_BACKOFF:
+		{
+			LONG left = (LONG)(ctx->async.deadline - SSCP_GetTickMs());
+			delay = (left > 0) ? (DWORD) left : 0;
+		}
+		break;
+		case SSCP_ASYNC_SEND:
+			/* Progress depends on the handle only, but the write timeout still applies */
+			delay = SSCP_InterByteTimeout(ctx);
+		break;
+		default:
+			delay = 0;
+		break;
+	}
+
+	if (timeoutMs != NULL)
+		*timeoutMs = delay;
+
+	return SSCP_SUCCESS;
+}
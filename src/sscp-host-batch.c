@@ -0,0 +1,203 @@
+/**
+ * @file sscp-host-batch.c
+ * @brief Several secure commands in one call, with the ciphering kept off the critical path.
+ *
+ * The commands are still exchanged one after the other (the reader handles a single
+ * command at a time), but each command is signed and ciphered while the reader works
+ * on the previous one: as soon as a frame is sent, the next one is prepared in the
+ * other buffer of the context, with the counter the reader's response is expected to
+ * leave (the response's counter + 1, that is, the command's one + 2). Only the wire
+ * and the reader remain between two commands.
+ *
+ * Should the reader move the counter by another amount, or an exchange fail, the
+ * frame prepared ahead is prepared again with the right counter before being sent.
+ */
+#include "sscp-host_i.h"
+
+/* Copy the command data of the item and prepare the frame in buffer, with the given counter */
+static LONG SSCP_BatchPrepare(SSCP_CTX_ST* ctx, const SSCP_BATCH_ITEM_ST* item, BYTE buffer[], DWORD counter, DWORD* frameSz)
+{
+	DWORD savedCounter = ctx->counter;
+	LONG rc;
+
+	if (item->commandDataSz > 0)
+		memmove(&buffer[SSCP_COMMAND_HEADROOM], item->commandData, item->commandDataSz);
+
+	/* SSCP_ExchangePrepare() signs with the counter of the context */
+	ctx->counter = counter;
+	rc = SSCP_ExchangePrepare(ctx, item->commandHeader, buffer, sizeof(ctx->txBuffer), item->commandDataSz, frameSz);
+	ctx->counter = savedCounter;
+
+	return rc;
+}
+
+/* Send the prepared frame, prepare the next one meanwhile, and get the response (retried on timeout) */
+static LONG SSCP_BatchExchange(SSCP_CTX_ST* ctx, SSCP_BATCH_ITEM_ST* item, const BYTE frame[], DWORD frameSz, SSCP_BATCH_ITEM_ST* next, BYTE nextBuffer[], DWORD nextCounter, DWORD* nextFrameSz, LONG* nextRc, DWORD* retries)
+{
+	BYTE timeoutClass = SSCP_TimeoutClass(item->commandHeader);
+	DWORD responseSz = 0;
+	DWORD sentAt;
+	BYTE retry;
+	LONG rc = SSCP_SUCCESS;
+
+	/* The scan commands wait for the guard time, see SSCP_ScanNFC() */
+	switch (item->commandHeader)
+	{
+		case SSCP_CMD_SCAN_GLOBAL:
+		case SSCP_CMD_SCAN_A_RAW:
+			SSCP_GuardTime(ctx, SSCP_SCAN_GLOBAL_GUARD_TIME);
+		break;
+		default:
+		break;
+	}
+
+	for (retry = 0; ; retry++)
+	{
+		rc = SSCP_ExchangeRawSend(ctx, ctx->address, SSCP_PROTOCOL_SECURE, timeoutClass, frame, frameSz, &sentAt);
+		if (rc)
+			break;
+
+		/* The reader is busy with this one: time to cipher the next one */
+		if ((retry == 0) && (next != NULL))
+			*nextRc = SSCP_BatchPrepare(ctx, next, nextBuffer, nextCounter, nextFrameSz);
+
+		rc = SSCP_ExchangeRawRecv(ctx, timeoutClass, frameSz, sentAt, ctx->rxBuffer, sizeof(ctx->rxBuffer), &responseSz);
+		if (rc == SSCP_SUCCESS)
+			break;
+		if (!SSCP_RetryWait(ctx, retry, rc))
+			break;
+	}
+	SSCP_RetryEnd(ctx, retry, rc);
+	*retries = retry;
+
+	if (rc)
+		return rc;
+
+	return SSCP_ExchangeVerify(ctx, item->commandHeader, ctx->rxBuffer, responseSz, item->responseData, item->maxResponseDataSz, &item->actResponseDataSz);
+}
+
+/* Arguments of SSCP_ExchangeBatch(), for the worker of the queue */
+typedef struct
+{
+	SSCP_BATCH_ITEM_ST* items;
+	DWORD itemCount;
+	DWORD* doneCount;
+} SSCP_BATCH_ARGS_ST;
+
+static LONG SSCP_BatchJob(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_BATCH_ARGS_ST* args = (const SSCP_BATCH_ARGS_ST*) userData;
+
+	return SSCP_ExchangeBatch(ctx, args->items, args->itemCount, args->doneCount);
+}
+
+/**
+ * @brief Exchange a sequence of secure commands.
+ *
+ * The commands are sent in order, each one as soon as the response to the previous
+ * one has been received and checked; the signature and the ciphering of a command
+ * take place while the reader is processing the previous one. The scan commands
+ * honour the guard time, as SSCP_ScanNFC() does.
+ *
+ * Each item receives the value SSCP_Exchange() would have returned for it: the
+ * statuses of the reader (positive values) do not stop the sequence, while an
+ * SSCP_ERR_* code does, since the session or the link can no longer be relied upon.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in,out] items Commands, and their outcomes.
+ * @param[in] itemCount Number of items.
+ * @param[out] doneCount Number of items that have been exchanged, whatever their
+ *             outcome; the result of the following ones is not set (may be NULL).
+ *
+ * @return SSCP_SUCCESS if all the items have been exchanged (their result tells
+ *         how each one went), otherwise the SSCP_ERR_* code that stopped the sequence.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p items is NULL, or an item has no data but a size.
+ * @retval SSCP_ERR_COMMAND_TOO_LONG The data of an item are too long; nothing has been sent.
+ * @retval SSCP_ERR_IN_PROGRESS An asynchronous exchange is pending on the context, or
+ *         on another reader of its bus.
+ */
+LONG SSCP_ExchangeBatch(SSCP_CTX_ST* ctx, SSCP_BATCH_ITEM_ST items[], DWORD itemCount, DWORD* doneCount)
+{
+	BYTE* buffers[2];
+	DWORD frameSz[2] = { 0, 0 };
+	DWORD counters[2]; /* Counter each buffer has been prepared with */
+	LONG prepared[2];
+	DWORD i;
+
+	if (doneCount != NULL)
+		*doneCount = 0;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((items == NULL) && (itemCount > 0))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	/* The queue runs: the sequence is a single job, no other command comes in between */
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_BATCH_ARGS_ST args = { items, itemCount, doneCount };
+		return SSCP_QueueCallJob(ctx, SSCP_BatchJob, &args);
+	}
+
+	if (SSCP_AsyncPending(ctx))
+		return SSCP_ERR_IN_PROGRESS;
+
+	/* Check all the items before anything is sent */
+	for (i = 0; i < itemCount; i++)
+	{
+		if ((items[i].commandData == NULL) && (items[i].commandDataSz > 0))
+			return SSCP_ERR_INVALID_PARAMETER;
+		if (items[i].commandDataSz > SSCP_MAX_PAYLOAD_SZ)
+			return SSCP_ERR_COMMAND_TOO_LONG;
+	}
+
+	if (itemCount == 0)
+		return SSCP_SUCCESS;
+
+	/* Two buffers: one frame is exchanged while the next one is prepared */
+	buffers[0] = ctx->txBuffer;
+	buffers[1] = ctx->batchBuffer;
+
+	counters[0] = ctx->counter;
+	prepared[0] = SSCP_BatchPrepare(ctx, &items[0], buffers[0], counters[0], &frameSz[0]);
+	counters[1] = 0;
+	prepared[1] = SSCP_ERR_INTERNAL_FAILURE;
+
+	for (i = 0; i < itemCount; i++)
+	{
+		BYTE cur = (BYTE)(i & 1);
+		BYTE nxt = (BYTE)(cur ^ 1);
+		SSCP_BATCH_ITEM_ST* next = (i + 1 < itemCount) ? &items[i + 1] : NULL;
+		DWORD startUs = SSCP_GetTickUs();
+		DWORD retries = 0;
+		LONG rc;
+
+		items[i].actResponseDataSz = 0;
+
+		/* Prepared ahead against a counter the reader did not leave, or not prepared at all */
+		if ((prepared[cur] != SSCP_SUCCESS) || (counters[cur] != ctx->counter))
+		{
+			counters[cur] = ctx->counter;
+			prepared[cur] = SSCP_BatchPrepare(ctx, &items[i], buffers[cur], counters[cur], &frameSz[cur]);
+		}
+
+		rc = prepared[cur];
+		if (rc == SSCP_SUCCESS)
+		{
+			counters[nxt] = ctx->counter + 2;
+			prepared[nxt] = SSCP_ERR_INTERNAL_FAILURE;
+			rc = SSCP_BatchExchange(ctx, &items[i], buffers[cur], frameSz[cur], next, buffers[nxt], counters[nxt], &frameSz[nxt], &prepared[nxt], &retries);
+			SSCP_StatsRecord(ctx, items[i].commandHeader, rc, retries, SSCP_GetTickUs() - startUs);
+		}
+
+		items[i].result = rc;
+		if (doneCount != NULL)
+			*doneCount = i + 1;
+		if (rc < 0)
+			return rc;
+	}
+
+	return SSCP_SUCCESS;
+}
@@ -0,0 +1,264 @@
+/**
+ * @file sscp-host-bus.c
+ * @brief Multidrop RS-485 bus: several reader sessions over a single port.
+ *
+ * A bus is made of a master context, that owns the serial port exactly like a
+ * standalone context does, and of one reader context per address. The reader
+ * contexts point to the port of the master, and keep their own address, session
+ * keys, counter and statistics, so the host may authenticate every reader once
+ * and then interleave the exchanges between them.
+ *
+ * @note The bus does not serialize the calls by itself: exchanges with the readers
+ *       of a same bus must not run concurrently, unless the queue of the port runs
+ *       (see SSCP_QueueStart()).
+ */
+#include "sscp-host_i.h"
+
+/**
+ * @brief Allocate a new bus object.
+ *
+ * @return A pointer to a newly allocated bus on success, or NULL if memory
+ *         allocation fails.
+ *
+ * @note The returned bus must be released afterwards using SSCP_BusFree().
+ */
+SSCP_BUS_ST* SSCP_BusAlloc(void)
+{
+	SSCP_BUS_ST* bus = SSCP_MemAlloc(sizeof(SSCP_BUS_ST));
+	if (bus == NULL)
+		return NULL;
+
+	bus->master = SSCP_Alloc();
+	if (bus->master == NULL)
+	{
+		SSCP_MemFree(bus);
+		return NULL;
+	}
+
+	return bus;
+}
+
+/**
+ * @brief Close the bus, and free it together with all its reader contexts.
+ *
+ * @param[in,out] bus Bus to free (may be NULL).
+ *
+ * @note The reader contexts returned by SSCP_BusGetReader() must not be used
+ *       afterwards.
+ */
+void SSCP_BusFree(SSCP_BUS_ST* bus)
+{
+	DWORD i;
+
+	if (bus == NULL)
+		return;
+
+	/* Nothing may run for the readers once they are freed */
+	SSCP_QueueStop(bus->master);
+
+	for (i = 0; i < SSCP_BUS_MAX_READERS; i++)
+	{
+		if (bus->readers[i] != NULL)
+			SSCP_Free(bus->readers[i]);
+	}
+
+	SSCP_Free(bus->master);
+	SSCP_MemFree(bus);
+}
+
+/**
+ * @brief Open and configure the port shared by the readers of the bus.
+ *
+ * @param[in,out] bus Bus object.
+ * @param[in] commName Platform-specific port identifier (see SSCP_Open()).
+ * @param[in] commBaudrate Initial baudrate in bits per second.
+ * @param[in] commFlags Reserved for future use (currently ignored).
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p bus parameter is NULL.
+ */
+LONG SSCP_BusOpen(SSCP_BUS_ST* bus, const char* commName, DWORD commBaudrate, DWORD commFlags)
+{
+	LONG rc;
+	DWORD i;
+
+	if (bus == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	rc = SSCP_Open(bus->master, commName, commBaudrate, commFlags);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < SSCP_BUS_MAX_READERS; i++)
+	{
+		if (bus->readers[i] != NULL)
+			bus->readers[i]->stats.whenOpen = bus->master->stats.whenOpen;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Close the port shared by the readers of the bus.
+ *
+ * The reader contexts remain attached to the bus, but their sessions are
+ * meaningless once the port has been closed.
+ *
+ * @param[in,out] bus Bus object.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p bus parameter is NULL.
+ */
+LONG SSCP_BusClose(SSCP_BUS_ST* bus)
+{
+	if (bus == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	return SSCP_Close(bus->master);
+}
+
+/**
+ * @brief Change the local baudrate of the port shared by the readers of the bus.
+ *
+ * See SSCP_SelectBaudrate(). All the readers of the bus must have been switched
+ * to the new baudrate beforehand (SSCP_SetBaudrate()).
+ *
+ * @param[in,out] bus Bus object.
+ * @param[in] baudrate Desired baudrate in bits per second.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p bus parameter is NULL.
+ */
+LONG SSCP_BusSelectBaudrate(SSCP_BUS_ST* bus, DWORD baudrate)
+{
+	if (bus == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	return SSCP_SelectBaudrate(bus->master, baudrate);
+}
+
+/**
+ * @brief Switch all the readers of the bus and the shared port to another baudrate.
+ *
+ * See SSCP_NegotiateBaudrate(). Every reader of the bus is told to change its
+ * baudrate, then the port follows, and each reader is checked at the new baudrate.
+ * If one of them fails, the whole bus is brought back to the former baudrate.
+ *
+ * @param[in,out] bus Bus object, all its readers being authenticated.
+ * @param[in] baudrate Desired baudrate in bits per second (see SSCP_SetBaudrate()).
+ *
+ * @return SSCP_SUCCESS if all the readers work at @p baudrate, otherwise an
+ *         SSCP_ERR_* error code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p bus parameter is NULL.
+ * @retval SSCP_ERR_COMM_CONTROL_FAILED Some readers could not be switched back, and
+ *         stay at @p baudrate (their addresses are in the debug output).
+ */
+LONG SSCP_BusNegotiateBaudrate(SSCP_BUS_ST* bus, DWORD baudrate)
+{
+	SSCP_CTX_ST* readers[SSCP_BUS_MAX_READERS];
+	DWORD readerCount = 0;
+	DWORD i;
+
+	if (bus == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	for (i = 0; i < SSCP_BUS_MAX_READERS; i++)
+	{
+		if (bus->readers[i] != NULL)
+			readers[readerCount++] = bus->readers[i];
+	}
+
+	/* No reader to tell, only the port changes */
+	if (readerCount == 0)
+		return SSCP_SelectBaudrate(bus->master, baudrate);
+
+	return SSCP_NegotiateReaders(readers, readerCount, baudrate);
+}
+
+/**
+ * @brief Get the context of the reader at the given address, creating it if needed.
+ *
+ * The context is used with the regular SSCP functions (SSCP_Authenticate(),
+ * SSCP_TransceiveNFC(), ...). It keeps its own session, so the host may switch
+ * between the readers of the bus without authenticating again.
+ *
+ * @param[in,out] bus Bus object.
+ * @param[in] address SSCP/RS-485 address of the reader (0..127).
+ *
+ * @return The reader context, or NULL if @p bus is NULL, @p address is out of
+ *         range or memory allocation fails.
+ *
+ * @note The context belongs to the bus, and is freed by SSCP_BusFree(). It may be
+ *       released earlier with SSCP_Free(), which only removes it from the bus.
+ */
+SSCP_CTX_ST* SSCP_BusGetReader(SSCP_BUS_ST* bus, BYTE address)
+{
+	SSCP_CTX_ST* ctx;
+
+	if (bus == NULL)
+		return NULL;
+	if (address >= SSCP_BUS_MAX_READERS)
+		return NULL;
+
+	if (bus->readers[address] != NULL)
+		return bus->readers[address];
+
+	ctx = SSCP_Alloc();
+	if (ctx == NULL)
+		return NULL;
+
+	/* The reader goes through the port of the bus, not through a self test loopback of its own */
+	if (ctx->port->transport != NULL)
+		SSCP_TransportClose(ctx);
+
+	ctx->port = bus->master->port;
+	ctx->bus = bus;
+	ctx->settings = bus->master->settings;
+	ctx->trace = bus->master->trace;
+	ctx->keyCache = bus->master->keyCache;
+	ctx->address = address;
+	ctx->stats.whenOpen = bus->master->stats.whenOpen;
+
+	bus->readers[address] = ctx;
+
+	return ctx;
+}
+
+void SSCP_BusDetachReader(SSCP_CTX_ST* ctx)
+{
+	SSCP_BUS_ST* bus = ctx->bus;
+
+	if ((ctx->address < SSCP_BUS_MAX_READERS) && (bus->readers[ctx->address] == ctx))
+		bus->readers[ctx->address] = NULL;
+
+	/* Its pending exchange, if any, does not hold the line anymore */
+	if (ctx->port->asyncOwner == ctx)
+		ctx->port->asyncOwner = NULL;
+
+	ctx->bus = NULL;
+	ctx->port = &ctx->ownPort;
+}
+
+LONG SSCP_BusMoveReader(SSCP_CTX_ST* ctx, BYTE address)
+{
+	SSCP_BUS_ST* bus = ctx->bus;
+
+	if (address >= SSCP_BUS_MAX_READERS)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	if (address == ctx->address)
+		return SSCP_SUCCESS;
+
+	if (bus->readers[address] != NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	bus->readers[ctx->address] = NULL;
+	bus->readers[address] = ctx;
+	ctx->address = address;
+
+	return SSCP_SUCCESS;
+}
@@ -0,0 +1,574 @@
+/**
+ * @file sscp-host-capture.c
+ * @brief Capture of the sessions with the readers, and their replay without a reader.
+ *
+ * "capture:<file>|<port>" opens the port as usual (a serial device or "tcp://..."),
+ * and writes into the file everything that goes through it: the bytes sent, the
+ * bytes received, the baudrate changes, and the random values the exchanges draw
+ * (the rndA of the authentications, the IVs of the commands), each with the time
+ * elapsed since the previous record.
+ *
+ * "replay:<file>" is a port without a reader: the bytes the host sends are checked
+ * against the recorded ones, the recorded responses come back with the latency the
+ * reader had, and the random values are the recorded ones, so that the session keys,
+ * and thus the whole ciphered traffic, are the same as in the recorded session.
+ * "replay:<file>|max" sends the responses back as soon as the host waits for them:
+ * what remains is the time the host's own stack takes.
+ *
+ * A host that sends something else than what has been recorded gets
+ * SSCP_ERR_COMM_SEND_FAILED: the responses that follow would not be the ones of its
+ * commands. Responses that the recorded host had read, and that the replaying one
+ * did not wait for, are dropped when it sends its next command.
+ *
+ * The file is a header (SSCP_CAPTURE_MAGIC), then records: type, delay since the
+ * previous record in microseconds (4 bytes), length (2 bytes), data; the numbers
+ * are big-endian, as on the wire.
+ */
+#include "sscp-host_i.h"
+
+#if SSCP_WITH_CAPTURE
+
+#include <stdio.h>
+
+#define SSCP_CAPTURE_MAGIC "SSCPCAP1"
+#define SSCP_CAPTURE_MAGIC_SZ 8
+#define SSCP_CAPTURE_RECORD_MAX 1024 /* Longer data are split into several records */
+
+/* Record types */
+#define SSCP_CAPTURE_SENT 'T'
+#define SSCP_CAPTURE_RECEIVED 'R'
+#define SSCP_CAPTURE_RANDOM 'N'
+#define SSCP_CAPTURE_BAUDRATE 'B'
+
+#define SSCP_REPLAY_MAX_SPEED "|max"
+
+typedef struct
+{
+	FILE* file;
+	const SSCP_TRANSPORT_ST* inner; /* Capture: the transport of the port */
+	DWORD lastUs; /* Capture: SSCP_GetTickUs() value of the last record */
+	BOOL maxSpeed; /* Replay: don't wait for the recorded latency */
+	/* Replay: the current record, and what has been consumed of it */
+	BYTE type; /* 0 at the end of the file */
+	DWORD length;
+	DWORD offset;
+	BYTE data[SSCP_CAPTURE_RECORD_MAX];
+	DWORD anchorUs; /* SSCP_GetTickUs() value when the last recorded command has been replayed */
+	DWORD elapsedUs; /* Recorded time between that command and the current record */
+} SSCP_CAPTURE_ST;
+
+static SSCP_CAPTURE_ST* SSCP_CaptureOf(SSCP_CTX_ST* ctx)
+{
+	return (SSCP_CAPTURE_ST*) ctx->port->transportData;
+}
+
+/* Name of the file, and what follows the '|' (NULL if there is none) */
+static LONG SSCP_CaptureSplit(const char* name, char path[], DWORD maxPathSz, const char** rest)
+{
+	const char* bar = strchr(name, '|');
+	size_t length = (bar != NULL) ? (size_t)(bar - name) : strlen(name);
+
+	if ((length == 0) || (length >= maxPathSz))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	memcpy(path, name, length);
+	path[length] = '\0';
+	*rest = (bar != NULL) ? bar + 1 : NULL;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_CaptureOpenFile(SSCP_CTX_ST* ctx, const char* path, const char* mode)
+{
+	SSCP_CAPTURE_ST* capture;
+
+	capture = (SSCP_CAPTURE_ST*) SSCP_MemAlloc(sizeof(SSCP_CAPTURE_ST));
+	if (capture == NULL)
+		return SSCP_ERR_OUT_OF_MEMORY;
+
+	capture->file = fopen(path, mode);
+	if (capture->file == NULL)
+	{
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("Failed to open %s\n", path);
+		SSCP_MemFree(capture);
+		return SSCP_ERR_COMM_NOT_AVAILABLE;
+	}
+
+	ctx->port->transportData = capture;
+	return SSCP_SUCCESS;
+}
+
+static void SSCP_CaptureCloseFile(SSCP_CTX_ST* ctx)
+{
+	SSCP_CAPTURE_ST* capture = SSCP_CaptureOf(ctx);
+
+	if (capture == NULL)
+		return;
+
+	fclose(capture->file);
+	memset(capture, 0, sizeof(SSCP_CAPTURE_ST));
+	SSCP_MemFree(capture);
+	ctx->port->transportData = NULL;
+}
+
+/* Records */
+/* ------- */
+
+static void SSCP_CaptureWrite(SSCP_CTX_ST* ctx, BYTE type, const BYTE data[], DWORD length)
+{
+	SSCP_CAPTURE_ST* capture = SSCP_CaptureOf(ctx);
+	BYTE header[7];
+	DWORD nowUs = SSCP_GetTickUs();
+	DWORD delayUs = nowUs - capture->lastUs;
+
+	capture->lastUs = nowUs;
+	if (delayUs > 0xFFFFFFFFUL)
+		delayUs = 0xFFFFFFFFUL;
+
+	do
+	{
+		DWORD count = (length < SSCP_CAPTURE_RECORD_MAX) ? length : SSCP_CAPTURE_RECORD_MAX;
+
+		header[0] = type;
+		header[1] = (BYTE)(delayUs >> 24);
+		header[2] = (BYTE)(delayUs >> 16);
+		header[3] = (BYTE)(delayUs >> 8);
+		header[4] = (BYTE)(delayUs);
+		header[5] = (BYTE)(count >> 8);
+		header[6] = (BYTE)(count);
+
+		if ((fwrite(header, sizeof(header), 1, capture->file) != 1) || ((count > 0) && (fwrite(data, count, 1, capture->file) != 1)))
+		{
+			if (ctx->settings.debugSerial)
+				SSCP_Trace("Failed to write the capture\n");
+			return; /* The session goes on, the capture is lost */
+		}
+
+		data += count;
+		length -= count;
+		delayUs = 0;
+	}
+	while (length > 0);
+}
+
+/* Next record of the replay, type 0 at the end of the file */
+static void SSCP_ReplayNext(SSCP_CAPTURE_ST* capture)
+{
+	BYTE header[7];
+
+	capture->type = 0;
+	capture->length = 0;
+	capture->offset = 0;
+
+	if (fread(header, sizeof(header), 1, capture->file) != 1)
+		return;
+
+	capture->length = ((DWORD) header[5] << 8) | header[6];
+	if ((capture->length > SSCP_CAPTURE_RECORD_MAX) || ((capture->length > 0) && (fread(capture->data, capture->length, 1, capture->file) != 1)))
+	{
+		capture->length = 0;
+		return;
+	}
+
+	capture->type = header[0];
+	capture->elapsedUs += ((DWORD) header[1] << 24) | ((DWORD) header[2] << 16) | ((DWORD) header[3] << 8) | header[4];
+}
+
+/*
+ * Move to the next record that has something left, the baudrate changes and the
+ * records of the dropped type skipped. Returns its type, 0 at the end of the file.
+ */
+static BYTE SSCP_ReplaySkip(SSCP_CAPTURE_ST* capture, BYTE dropped)
+{
+	while ((capture->type != 0) && ((capture->offset >= capture->length) || (capture->type == SSCP_CAPTURE_BAUDRATE) || (capture->type == dropped)))
+		SSCP_ReplayNext(capture);
+
+	return capture->type;
+}
+
+/* Random values of the exchanges */
+/* ------------------------------ */
+
+static BOOL SSCP_CaptureRandom(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz)
+{
+	if (!SSCP_DrbgDraw(ctx, buffer, bufferSz))
+		return FALSE;
+
+	SSCP_CaptureWrite(ctx, SSCP_CAPTURE_RANDOM, buffer, bufferSz);
+	return TRUE;
+}
+
+static BOOL SSCP_ReplayRandom(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz)
+{
+	SSCP_CAPTURE_ST* capture = SSCP_CaptureOf(ctx);
+
+	while (bufferSz > 0)
+	{
+		DWORD count;
+
+		/* A host that draws more than the recorded one has diverged: its next frame tells */
+		if (SSCP_ReplaySkip(capture, 0) != SSCP_CAPTURE_RANDOM)
+			return SSCP_DrbgDraw(ctx, buffer, bufferSz);
+
+		count = capture->length - capture->offset;
+		if (count > bufferSz)
+			count = bufferSz;
+		memcpy(buffer, &capture->data[capture->offset], count);
+		capture->offset += count;
+		buffer += count;
+		bufferSz -= count;
+	}
+
+	return TRUE;
+}
+
+/* Capture transport */
+/* ----------------- */
+
+static LONG SSCP_CaptureOpen(SSCP_CTX_ST* ctx, const char* commName)
+{
+	char path[260];
+	const char* portName;
+	const SSCP_TRANSPORT_ST* inner;
+	LONG rc;
+
+	rc = SSCP_CaptureSplit(commName + strlen(SSCP_CAPTURE_PREFIX), path, sizeof(path), &portName);
+	if (rc)
+		return rc;
+	if ((portName == NULL) || (*portName == '\0'))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	inner = SSCP_TransportFromName(portName);
+	if ((inner == &SSCP_TRANSPORT_CAPTURE) || (inner == &SSCP_TRANSPORT_REPLAY))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	rc = inner->open(ctx, portName);
+	if (rc)
+		return rc;
+
+	rc = SSCP_CaptureOpenFile(ctx, path, "wb");
+	if (rc)
+	{
+		inner->close(ctx);
+		return rc;
+	}
+
+	SSCP_CaptureOf(ctx)->inner = inner;
+	SSCP_CaptureOf(ctx)->lastUs = SSCP_GetTickUs();
+	if (fwrite(SSCP_CAPTURE_MAGIC, SSCP_CAPTURE_MAGIC_SZ, 1, SSCP_CaptureOf(ctx)->file) != 1)
+	{
+		SSCP_CaptureCloseFile(ctx);
+		inner->close(ctx);
+		return SSCP_ERR_COMM_NOT_AVAILABLE;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_CaptureClose(SSCP_CTX_ST* ctx)
+{
+	LONG rc = SSCP_CaptureOf(ctx)->inner->close(ctx);
+
+	SSCP_CaptureCloseFile(ctx);
+	return rc;
+}
+
+static LONG SSCP_CaptureConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+{
+	BYTE data[4];
+	LONG rc;
+
+	rc = SSCP_CaptureOf(ctx)->inner->configure(ctx, baudrate);
+	if (rc)
+		return rc;
+
+	data[0] = (BYTE)(baudrate >> 24);
+	data[1] = (BYTE)(baudrate >> 16);
+	data[2] = (BYTE)(baudrate >> 8);
+	data[3] = (BYTE)(baudrate);
+	SSCP_CaptureWrite(ctx, SSCP_CAPTURE_BAUDRATE, data, sizeof(data));
+
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_CaptureSetTimeouts(SSCP_CTX_ST* ctx, DWORD firstByte, DWORD interByte)
+{
+	return SSCP_CaptureOf(ctx)->inner->setTimeouts(ctx, firstByte, interByte);
+}
+
+/* The first sent bytes of the chunks, as a single record */
+static void SSCP_CaptureSent(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD sent)
+{
+	BYTE frame[SSCP_CAPTURE_RECORD_MAX];
+	DWORD offset = 0, i;
+
+	for (i = 0; (i < chunkCount) && (sent > 0); i++)
+	{
+		DWORD count = (chunks[i].length < sent) ? chunks[i].length : sent;
+		DWORD done = 0;
+
+		while (done < count)
+		{
+			DWORD piece = count - done;
+
+			if (piece > sizeof(frame) - offset)
+				piece = sizeof(frame) - offset;
+			memcpy(&frame[offset], &chunks[i].buffer[done], piece);
+			offset += piece;
+			done += piece;
+
+			if (offset == sizeof(frame))
+			{
+				SSCP_CaptureWrite(ctx, SSCP_CAPTURE_SENT, frame, offset);
+				offset = 0;
+			}
+		}
+		sent -= count;
+	}
+
+	if (offset > 0)
+		SSCP_CaptureWrite(ctx, SSCP_CAPTURE_SENT, frame, offset);
+}
+
+static LONG SSCP_CaptureSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	DWORD total = 0, i;
+	LONG rc;
+
+	rc = SSCP_CaptureOf(ctx)->inner->sendV(ctx, chunks, chunkCount);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < chunkCount; i++)
+		total += chunks[i].length;
+	SSCP_CaptureSent(ctx, chunks, chunkCount, total);
+
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_CaptureSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
+{
+	LONG rc;
+
+	rc = SSCP_CaptureOf(ctx)->inner->sendSomeV(ctx, chunks, chunkCount, sent);
+	if ((rc == SSCP_SUCCESS) && (*sent > 0))
+		SSCP_CaptureSent(ctx, chunks, chunkCount, *sent);
+
+	return rc;
+}
+
+static LONG SSCP_CaptureRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
+{
+	LONG rc;
+
+	rc = SSCP_CaptureOf(ctx)->inner->recvWait(ctx, buffer, length, timeoutMs, received);
+	if ((rc == SSCP_SUCCESS) && (*received > 0))
+		SSCP_CaptureWrite(ctx, SSCP_CAPTURE_RECEIVED, buffer, *received);
+
+	return rc;
+}
+
+const SSCP_TRANSPORT_ST SSCP_TRANSPORT_CAPTURE = {
+	"capture",
+	SSCP_CaptureOpen,
+	SSCP_CaptureClose,
+	SSCP_CaptureConfigure,
+	SSCP_CaptureSetTimeouts,
+	SSCP_CaptureSendV,
+	SSCP_CaptureSendSomeV,
+	SSCP_CaptureRecvWait,
+	SSCP_CaptureRandom
+};
+
+/* Replay transport */
+/* ---------------- */
+
+static LONG SSCP_ReplayOpen(SSCP_CTX_ST* ctx, const char* commName)
+{
+	char path[260];
+	const char* options;
+	BYTE magic[SSCP_CAPTURE_MAGIC_SZ];
+	SSCP_CAPTURE_ST* capture;
+	LONG rc;
+
+	rc = SSCP_CaptureSplit(commName + strlen(SSCP_REPLAY_PREFIX), path, sizeof(path), &options);
+	if (rc)
+		return rc;
+
+	rc = SSCP_CaptureOpenFile(ctx, path, "rb");
+	if (rc)
+		return rc;
+
+	capture = SSCP_CaptureOf(ctx);
+	if ((fread(magic, sizeof(magic), 1, capture->file) != 1) || memcmp(magic, SSCP_CAPTURE_MAGIC, sizeof(magic)))
+	{
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("%s is not a capture\n", path);
+		SSCP_CaptureCloseFile(ctx);
+		return SSCP_ERR_COMM_NOT_AVAILABLE;
+	}
+
+	capture->maxSpeed = ((options != NULL) && !strcmp(options, SSCP_REPLAY_MAX_SPEED + 1)) ? TRUE : FALSE;
+	capture->anchorUs = SSCP_GetTickUs();
+	SSCP_ReplayNext(capture);
+
+	/* Nothing to wait on, see SSCP_AsyncGetPollInfo() */
+#ifdef _WIN32
+	ctx->port->commHandle = INVALID_HANDLE_VALUE;
+#else
+	ctx->port->commFd = -1;
+#endif
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_ReplayClose(SSCP_CTX_ST* ctx)
+{
+	SSCP_CaptureCloseFile(ctx);
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_ReplayConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+{
+	(void) ctx;
+	(void) baudrate;
+	return SSCP_SUCCESS; /* The records are skipped as they come */
+}
+
+static LONG SSCP_ReplaySetTimeouts(SSCP_CTX_ST* ctx, DWORD firstByte, DWORD interByte)
+{
+	ctx->port->firstByteTimeout = firstByte;
+	ctx->port->interByteTimeout = interByte;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_ReplaySendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
+{
+	SSCP_CAPTURE_ST* capture = SSCP_CaptureOf(ctx);
+	DWORD total = 0, i;
+
+	*sent = 0;
+
+	for (i = 0; i < chunkCount; i++)
+	{
+		const BYTE* p = chunks[i].buffer;
+		DWORD left = chunks[i].length;
+
+		while (left > 0)
+		{
+			DWORD count;
+
+			/* The host moves on: the responses it has not read are dropped */
+			if (SSCP_ReplaySkip(capture, SSCP_CAPTURE_RECEIVED) != SSCP_CAPTURE_SENT)
+			{
+				if (ctx->settings.debugSerial)
+					SSCP_Trace("Replay: nothing more has been sent by the recorded host\n");
+				return SSCP_ERR_COMM_SEND_FAILED;
+			}
+
+			/* The latency of the reader counts from here */
+			if (capture->offset == 0)
+			{
+				capture->anchorUs = SSCP_GetTickUs();
+				capture->elapsedUs = 0;
+			}
+
+			count = capture->length - capture->offset;
+			if (count > left)
+				count = left;
+			if (memcmp(p, &capture->data[capture->offset], count))
+			{
+				if (ctx->settings.debugSerial)
+					SSCP_Trace("Replay: the host does not send what has been recorded\n");
+				return SSCP_ERR_COMM_SEND_FAILED;
+			}
+
+			capture->offset += count;
+			p += count;
+			left -= count;
+			total += count;
+		}
+	}
+
+	ctx->stats.bytesSent += total;
+	*sent = total;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_ReplaySendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	DWORD sent;
+
+	return SSCP_ReplaySendSomeV(ctx, chunks, chunkCount, &sent);
+}
+
+static LONG SSCP_ReplayRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
+{
+	SSCP_CAPTURE_ST* capture = SSCP_CaptureOf(ctx);
+	DWORD count;
+
+	*received = 0;
+
+	if (SSCP_ReplaySkip(capture, 0) != SSCP_CAPTURE_RECEIVED)
+	{
+		/* The recorded reader did not answer here either */
+		if (timeoutMs > 0)
+			SSCP_SleepMs(timeoutMs);
+		return SSCP_SUCCESS;
+	}
+
+	if (!capture->maxSpeed)
+	{
+		LONG waitUs = (LONG)(capture->anchorUs + capture->elapsedUs - SSCP_GetTickUs());
+
+		if (waitUs > 0)
+		{
+			if ((DWORD) waitUs > timeoutMs * 1000)
+			{
+				if (timeoutMs > 0)
+					SSCP_SleepMs(timeoutMs);
+				return SSCP_SUCCESS;
+			}
+			SSCP_SleepMs((DWORD) waitUs / 1000); /* The tick of the sleep, not more */
+		}
+	}
+
+	count = capture->length - capture->offset;
+	if (count > length)
+		count = length;
+	memcpy(buffer, &capture->data[capture->offset], count);
+	capture->offset += count;
+
+	ctx->stats.bytesReceived += count;
+	*received = count;
+	return SSCP_SUCCESS;
+}
+
+const SSCP_TRANSPORT_ST SSCP_TRANSPORT_REPLAY = {
+	"replay",
+	SSCP_ReplayOpen,
+	SSCP_ReplayClose,
+	SSCP_ReplayConfigure,
+	SSCP_ReplaySetTimeouts,
+	SSCP_ReplaySendV,
+	SSCP_ReplaySendSomeV,
+	SSCP_ReplayRecvWait,
+	SSCP_ReplayRandom
+};
+
+/* Transport that owns the handle of the port: the captured one, under a capture */
+const SSCP_TRANSPORT_ST* SSCP_TransportBase(SSCP_CTX_ST* ctx)
+{
+	if (ctx->port->transport == &SSCP_TRANSPORT_CAPTURE)
+		return SSCP_CaptureOf(ctx)->inner;
+
+	return ctx->port->transport;
+}
+
+#else
+
+const SSCP_TRANSPORT_ST* SSCP_TransportBase(SSCP_CTX_ST* ctx)
+{
+	return ctx->port->transport;
+}
+
+#endif
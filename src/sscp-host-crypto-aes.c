@@ -1,13 +1,26 @@
 #include "sscp-host-crypto_i.h"
 
-static DWORD AES_ExpandKey(DWORD key_schd[60], const BYTE key_data[], DWORD key_bits);
-static void AES_InvertKey(DWORD key_schd[60], DWORD rounds);
+#include <stdint.h>
+
+static DWORD AES_ExpandKey(DWORD key_schd[AES_SCHD_WORDS], const BYTE key_data[], DWORD key_bits);
+static void AES_InvertKey(DWORD key_schd[AES_SCHD_WORDS], DWORD rounds);
+static void AES_EncryptC(AES_CTX_ST* aes_ctx, BYTE data[16]);
+static void AES_DecryptC(AES_CTX_ST* aes_ctx, BYTE data[16]);
+
+const AES_BACKEND_ST AES_BACKEND_C = { "c", NULL, NULL, AES_EncryptC, AES_DecryptC, NULL, NULL, NULL, NULL };
 
 void AES_InitEx(AES_CTX_ST* aes_ctx, const BYTE key_data[], DWORD key_bits)
 {
+	const AES_BACKEND_ST* backend;
+
 	if (aes_ctx == NULL)
 		return;
 
+	/* Portable code until a backend accepts the context */
+	aes_ctx->backend = &AES_BACKEND_C;
+	aes_ctx->backend_data[0] = NULL;
+	aes_ctx->backend_data[1] = NULL;
+
 	/* Remember size of key */
 	aes_ctx->key_bits = key_bits;
 
@@ -17,8 +30,41 @@ void AES_InitEx(AES_CTX_ST* aes_ctx, const BYTE key_data[], DWORD key_bits)
 		return;
 
 	/* Invert the ciphering context to get the deciphering one */
-	memcpy(aes_ctx->dec_schd, aes_ctx->enc_schd, 60 * sizeof(DWORD));
+	memcpy(aes_ctx->dec_schd, aes_ctx->enc_schd, sizeof(aes_ctx->dec_schd));
 	AES_InvertKey(aes_ctx->dec_schd, aes_ctx->rounds);
+
+	/* Hand the context over to the fastest implementation available */
+	backend = AES_GetBackend();
+	if ((backend->init == NULL) || backend->init(aes_ctx, key_data))
+		aes_ctx->backend = backend;
+}
+
+void AES_Free(AES_CTX_ST* aes_ctx)
+{
+	if (aes_ctx == NULL)
+		return;
+
+	if ((aes_ctx->backend != NULL) && (aes_ctx->backend->free != NULL))
+		aes_ctx->backend->free(aes_ctx);
+
+	/* Don't leave the key schedule behind */
+	memset(aes_ctx, 0, sizeof(AES_CTX_ST));
+}
+
+void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	if (aes_ctx->backend != NULL)
+		aes_ctx->backend->encrypt(aes_ctx, data);
+	else
+		AES_EncryptC(aes_ctx, data);
+}
+
+void AES_Decrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	if (aes_ctx->backend != NULL)
+		aes_ctx->backend->decrypt(aes_ctx, data);
+	else
+		AES_DecryptC(aes_ctx, data);
 }
 
 void AES_Init(AES_CTX_ST* aes_ctx, const BYTE key_data[16])
@@ -26,6 +72,105 @@ void AES_Init(AES_CTX_ST* aes_ctx, const BYTE key_data[16])
 	AES_InitEx(aes_ctx, key_data, 128);
 }
 
+/* Blocks the CBC deciphering hands to the backend at a time, when it has no CBC of its own */
+#define AES_CBC_LANES 8
+
+/* dst ^= src, 16 bytes, a word at a time (memcpy makes no assumption on the alignment) */
+static void AES_Xor16(BYTE dst[16], const BYTE src[16])
+{
+	uint64_t d[2], s[2];
+
+	memcpy(d, dst, 16);
+	memcpy(s, src, 16);
+	d[0] ^= s[0];
+	d[1] ^= s[1];
+	memcpy(dst, d, 16);
+}
+
+/* ECB, in place: the blocks do not depend on each other, the backend may interleave them */
+void AES_EncryptBlocks(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	DWORD i;
+
+	if ((aes_ctx->backend != NULL) && (aes_ctx->backend->encrypt_blocks != NULL))
+	{
+		aes_ctx->backend->encrypt_blocks(aes_ctx, data, blocks);
+		return;
+	}
+
+	for (i = 0; i < blocks; i++)
+		AES_Encrypt(aes_ctx, &data[16 * i]);
+}
+
+void AES_DecryptBlocks(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	DWORD i;
+
+	if ((aes_ctx->backend != NULL) && (aes_ctx->backend->decrypt_blocks != NULL))
+	{
+		aes_ctx->backend->decrypt_blocks(aes_ctx, data, blocks);
+		return;
+	}
+
+	for (i = 0; i < blocks; i++)
+		AES_Decrypt(aes_ctx, &data[16 * i]);
+}
+
+/* CBC enciphering in place, each block depends on the previous one */
+void AES_EncryptCBC(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks)
+{
+	const BYTE* carry = iv;
+	DWORD i;
+
+	if (blocks == 0)
+		return;
+
+	if ((aes_ctx->backend != NULL) && (aes_ctx->backend->encrypt_cbc != NULL))
+	{
+		aes_ctx->backend->encrypt_cbc(aes_ctx, iv, data, blocks);
+		return;
+	}
+
+	for (i = 0; i < blocks; i++)
+	{
+		/* Cipher <- E ( Plain XOR IV ), the cipher is the IV of the next block */
+		AES_Xor16(&data[16 * i], carry);
+		AES_Encrypt(aes_ctx, &data[16 * i]);
+		carry = &data[16 * i];
+	}
+	memcpy(iv, carry, 16);
+}
+
+/* CBC deciphering in place: all the blocks at once, then the XOR with the previous cipher */
+void AES_DecryptCBC(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks)
+{
+	BYTE cipher[AES_CBC_LANES * 16];
+	DWORD count, i;
+
+	if ((aes_ctx->backend != NULL) && (aes_ctx->backend->decrypt_cbc != NULL))
+	{
+		aes_ctx->backend->decrypt_cbc(aes_ctx, iv, data, blocks);
+		return;
+	}
+
+	while (blocks > 0)
+	{
+		count = (blocks < AES_CBC_LANES) ? blocks : AES_CBC_LANES;
+
+		/* The cipher is needed after the deciphering in place */
+		memcpy(cipher, data, 16 * count);
+		AES_DecryptBlocks(aes_ctx, data, count);
+
+		AES_Xor16(data, iv);
+		for (i = 1; i < count; i++)
+			AES_Xor16(&data[16 * i], &cipher[16 * (i - 1)]);
+		memcpy(iv, &cipher[16 * (count - 1)], 16);
+
+		data += 16 * count;
+		blocks -= count;
+	}
+}
+
 void AES_Encrypt2(AES_CTX_ST* context, BYTE outbuf[16], const BYTE inbuf[16])
 {
 	memcpy(outbuf, inbuf, 16);
@@ -462,7 +607,20 @@ static void SET_DW(BYTE* p, DWORD dw)
 	p[0] = (BYTE)dw;
 }
 
-static DWORD AES_ExpandKey(DWORD key_schd[60], const BYTE key_data[], DWORD key_bits)
+void AES_ExportRoundKeys(AES_CTX_ST* aes_ctx)
+{
+	DWORD i;
+
+	for (i = 0; i < 4 * (aes_ctx->rounds + 1); i++)
+	{
+		SET_DW(&aes_ctx->enc_keys[4 * i], aes_ctx->enc_schd[i]);
+		SET_DW(&aes_ctx->dec_keys[4 * i], aes_ctx->dec_schd[i]);
+	}
+}
+
+// ---------------------------------
+
+static DWORD AES_ExpandKey(DWORD key_schd[AES_SCHD_WORDS], const BYTE key_data[], DWORD key_bits)
 {
 	register int k;
 	register int i;
@@ -476,8 +634,12 @@ static DWORD AES_ExpandKey(DWORD key_schd[60], const BYTE key_data[], DWORD key_
 	switch (key_bits)
 	{
 	case 128:
+#if SSCP_AES_MAX_KEY_BITS >= 192
 	case 192:
+#endif
+#if SSCP_AES_MAX_KEY_BITS >= 256
 	case 256:
+#endif
 		break;
 	default:
 		return 0;
@@ -509,6 +671,7 @@ static DWORD AES_ExpandKey(DWORD key_schd[60], const BYTE key_data[], DWORD key_
 		}
 	}
 
+#if SSCP_AES_MAX_KEY_BITS >= 192
 	key_schd[4] = GET_DW(key_data + 16);
 	key_schd[5] = GET_DW(key_data + 20);
 
@@ -534,6 +697,7 @@ static DWORD AES_ExpandKey(DWORD key_schd[60], const BYTE key_data[], DWORD key_
 		}
 	}
 
+#if SSCP_AES_MAX_KEY_BITS >= 256
 	key_schd[6] = GET_DW(key_data + 24);
 	key_schd[7] = GET_DW(key_data + 28);
 
@@ -564,13 +728,15 @@ static DWORD AES_ExpandKey(DWORD key_schd[60], const BYTE key_data[], DWORD key_
 			k += 8;
 		}
 	}
+#endif
+#endif
 
 	return 0;
 }
 
 // ---------------------------------
 
-static void AES_InvertKey(DWORD key_schd[60], DWORD rounds)
+static void AES_InvertKey(DWORD key_schd[AES_SCHD_WORDS], DWORD rounds)
 {
 	register DWORD t;
 	register DWORD i;
@@ -615,8 +781,7 @@ static void AES_InvertKey(DWORD key_schd[60], DWORD rounds)
 
 // ---------------------------------
 
-
-void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
+static void AES_EncryptC(AES_CTX_ST* aes_ctx, BYTE data[16])
 {
 	DWORD t0, t1, t2, t3;
 	DWORD s0, s1, s2, s3;
@@ -674,6 +839,7 @@ void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 	t2 = AES_TE0[s2 >> 24] ^ AES_TE1[(s3 >> 16) & 0xff] ^ AES_TE2[(s0 >> 8) & 0xff] ^ AES_TE3[s1 & 0xff] ^ aes_ctx->enc_schd[38];
 	t3 = AES_TE0[s3 >> 24] ^ AES_TE1[(s0 >> 16) & 0xff] ^ AES_TE2[(s1 >> 8) & 0xff] ^ AES_TE3[s2 & 0xff] ^ aes_ctx->enc_schd[39];
 
+#if SSCP_AES_MAX_KEY_BITS > 128
 	if (aes_ctx->rounds > 10)
 	{
 		//      round 10:
@@ -687,6 +853,7 @@ void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 		t2 = AES_TE0[s2 >> 24] ^ AES_TE1[(s3 >> 16) & 0xff] ^ AES_TE2[(s0 >> 8) & 0xff] ^ AES_TE3[s1 & 0xff] ^ aes_ctx->enc_schd[46];
 		t3 = AES_TE0[s3 >> 24] ^ AES_TE1[(s0 >> 16) & 0xff] ^ AES_TE2[(s1 >> 8) & 0xff] ^ AES_TE3[s2 & 0xff] ^ aes_ctx->enc_schd[47];
 
+#if SSCP_AES_MAX_KEY_BITS > 192
 		if (aes_ctx->rounds > 12)
 		{
 			//      round 12:
@@ -700,7 +867,9 @@ void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 			t2 = AES_TE0[s2 >> 24] ^ AES_TE1[(s3 >> 16) & 0xff] ^ AES_TE2[(s0 >> 8) & 0xff] ^ AES_TE3[s1 & 0xff] ^ aes_ctx->enc_schd[54];
 			t3 = AES_TE0[s3 >> 24] ^ AES_TE1[(s0 >> 16) & 0xff] ^ AES_TE2[(s1 >> 8) & 0xff] ^ AES_TE3[s2 & 0xff] ^ aes_ctx->enc_schd[55];
 		}
+#endif
 	}
+#endif
 
 	//      apply last round and map cipher state to byte array block:
 	k = (aes_ctx->rounds << 2);
@@ -721,7 +890,7 @@ void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 
 // ---------------------------------
 
-void AES_Decrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
+static void AES_DecryptC(AES_CTX_ST* aes_ctx, BYTE data[16])
 {
 	DWORD t0, t1, t2, t3;
 	DWORD s0, s1, s2, s3;
@@ -779,6 +948,7 @@ void AES_Decrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 	t2 = AES_TD0[s2 >> 24] ^ AES_TD1[(s1 >> 16) & 0xff] ^ AES_TD2[(s0 >> 8) & 0xff] ^ AES_TD3[s3 & 0xff] ^ aes_ctx->dec_schd[38];
 	t3 = AES_TD0[s3 >> 24] ^ AES_TD1[(s2 >> 16) & 0xff] ^ AES_TD2[(s1 >> 8) & 0xff] ^ AES_TD3[s0 & 0xff] ^ aes_ctx->dec_schd[39];
 
+#if SSCP_AES_MAX_KEY_BITS > 128
 	if (aes_ctx->rounds > 10)
 	{
 		//      round 10:
@@ -792,6 +962,7 @@ void AES_Decrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 		t2 = AES_TD0[s2 >> 24] ^ AES_TD1[(s1 >> 16) & 0xff] ^ AES_TD2[(s0 >> 8) & 0xff] ^ AES_TD3[s3 & 0xff] ^ aes_ctx->dec_schd[46];
 		t3 = AES_TD0[s3 >> 24] ^ AES_TD1[(s2 >> 16) & 0xff] ^ AES_TD2[(s1 >> 8) & 0xff] ^ AES_TD3[s0 & 0xff] ^ aes_ctx->dec_schd[47];
 
+#if SSCP_AES_MAX_KEY_BITS > 192
 		if (aes_ctx->rounds > 12)
 		{
 			//      round 12:
@@ -805,7 +976,9 @@ void AES_Decrypt(AES_CTX_ST* aes_ctx, BYTE data[16])
 			t2 = AES_TD0[s2 >> 24] ^ AES_TD1[(s1 >> 16) & 0xff] ^ AES_TD2[(s0 >> 8) & 0xff] ^ AES_TD3[s3 & 0xff] ^ aes_ctx->dec_schd[54];
 			t3 = AES_TD0[s3 >> 24] ^ AES_TD1[(s2 >> 16) & 0xff] ^ AES_TD2[(s1 >> 8) & 0xff] ^ AES_TD3[s0 & 0xff] ^ aes_ctx->dec_schd[55];
 		}
+#endif
 	}
+#endif
 
 	//      apply last round and map cipher state to byte array block:
 	k = (aes_ctx->rounds << 2);
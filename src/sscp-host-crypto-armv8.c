@@ -0,0 +1,311 @@
+/*
+ * AES and SHA-256 on ARMv8 processors, using the Cryptography Extensions.
+ * The code is compiled with per-function target attributes and only runs when the
+ * operating system reports the AES / SHA2 features.
+ */
+#include "sscp-host-crypto_i.h"
+
+#ifdef SSCP_CRYPTO_ARMV8
+
+#include <stdint.h>
+#include <arm_neon.h>
+
+#if defined(_MSC_VER)
+#define SSCP_TARGET_CRYPTO
+#elif defined(__clang__)
+#define SSCP_TARGET_CRYPTO __attribute__((target("crypto")))
+#else
+#define SSCP_TARGET_CRYPTO __attribute__((target("+crypto")))
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+static BOOL CPU_Has(BOOL wantSHA)
+{
+#if defined(_WIN32)
+	(void) wantSHA;
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) ? TRUE : FALSE;
+#elif defined(__linux__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	return (hwcap & (wantSHA ? HWCAP_SHA2 : HWCAP_AES)) ? TRUE : FALSE;
+#elif defined(__APPLE__)
+	/* Every Apple ARM64 core implements the extensions */
+	(void) wantSHA;
+	return TRUE;
+#elif defined(__ARM_FEATURE_CRYPTO)
+	(void) wantSHA;
+	return TRUE;
+#else
+	(void) wantSHA;
+	return FALSE;
+#endif
+}
+
+// ---------------------------------
+
+static BOOL AES_InitARMv8(AES_CTX_ST* aes_ctx, const BYTE key_data[])
+{
+	(void) key_data;
+	AES_ExportRoundKeys(aes_ctx);
+	return TRUE;
+}
+
+SSCP_TARGET_CRYPTO static void AES_EncryptARMv8(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	const BYTE* rk = aes_ctx->enc_keys;
+	DWORD r;
+	uint8x16_t s = vld1q_u8(data);
+
+	/* AESE does AddRoundKey first, so the last key is applied by hand */
+	for (r = 0; r < aes_ctx->rounds - 1; r++)
+		s = vaesmcq_u8(vaeseq_u8(s, vld1q_u8(rk + 16 * r)));
+	s = vaeseq_u8(s, vld1q_u8(rk + 16 * r));
+	s = veorq_u8(s, vld1q_u8(rk + 16 * (r + 1)));
+	vst1q_u8(data, s);
+}
+
+SSCP_TARGET_CRYPTO static void AES_DecryptARMv8(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	/* dec_keys is the equivalent inverse cipher schedule, which is what AESD/AESIMC expect */
+	const BYTE* rk = aes_ctx->dec_keys;
+	DWORD r;
+	uint8x16_t s = vld1q_u8(data);
+
+	for (r = 0; r < aes_ctx->rounds - 1; r++)
+		s = vaesimcq_u8(vaesdq_u8(s, vld1q_u8(rk + 16 * r)));
+	s = vaesdq_u8(s, vld1q_u8(rk + 16 * r));
+	s = veorq_u8(s, vld1q_u8(rk + 16 * (r + 1)));
+	vst1q_u8(data, s);
+}
+
+/*
+ * Several blocks: the round keys are loaded once, and 4 independent blocks go through
+ * the rounds together, so that the latency of AESE/AESD is hidden by the others.
+ */
+SSCP_TARGET_CRYPTO static void AES_LoadKeysARMv8(const BYTE rk[], DWORD rounds, uint8x16_t k[AES_MAX_ROUNDS + 1])
+{
+	DWORD r;
+
+	for (r = 0; r <= rounds; r++)
+		k[r] = vld1q_u8(rk + 16 * r);
+}
+
+SSCP_TARGET_CRYPTO static uint8x16_t AES_EncryptOneARMv8(const uint8x16_t k[AES_MAX_ROUNDS + 1], DWORD rounds, uint8x16_t s)
+{
+	DWORD r;
+
+	for (r = 0; r < rounds - 1; r++)
+		s = vaesmcq_u8(vaeseq_u8(s, k[r]));
+	s = vaeseq_u8(s, k[r]);
+	return veorq_u8(s, k[r + 1]);
+}
+
+SSCP_TARGET_CRYPTO static uint8x16_t AES_DecryptOneARMv8(const uint8x16_t k[AES_MAX_ROUNDS + 1], DWORD rounds, uint8x16_t s)
+{
+	DWORD r;
+
+	for (r = 0; r < rounds - 1; r++)
+		s = vaesimcq_u8(vaesdq_u8(s, k[r]));
+	s = vaesdq_u8(s, k[r]);
+	return veorq_u8(s, k[r + 1]);
+}
+
+SSCP_TARGET_CRYPTO static void AES_EncryptFourARMv8(const uint8x16_t k[AES_MAX_ROUNDS + 1], DWORD rounds, uint8x16_t s[4])
+{
+	DWORD r;
+
+	for (r = 0; r < rounds - 1; r++)
+	{
+		s[0] = vaesmcq_u8(vaeseq_u8(s[0], k[r]));
+		s[1] = vaesmcq_u8(vaeseq_u8(s[1], k[r]));
+		s[2] = vaesmcq_u8(vaeseq_u8(s[2], k[r]));
+		s[3] = vaesmcq_u8(vaeseq_u8(s[3], k[r]));
+	}
+	s[0] = veorq_u8(vaeseq_u8(s[0], k[r]), k[r + 1]);
+	s[1] = veorq_u8(vaeseq_u8(s[1], k[r]), k[r + 1]);
+	s[2] = veorq_u8(vaeseq_u8(s[2], k[r]), k[r + 1]);
+	s[3] = veorq_u8(vaeseq_u8(s[3], k[r]), k[r + 1]);
+}
+
+SSCP_TARGET_CRYPTO static void AES_DecryptFourARMv8(const uint8x16_t k[AES_MAX_ROUNDS + 1], DWORD rounds, uint8x16_t s[4])
+{
+	DWORD r;
+
+	for (r = 0; r < rounds - 1; r++)
+	{
+		s[0] = vaesimcq_u8(vaesdq_u8(s[0], k[r]));
+		s[1] = vaesimcq_u8(vaesdq_u8(s[1], k[r]));
+		s[2] = vaesimcq_u8(vaesdq_u8(s[2], k[r]));
+		s[3] = vaesimcq_u8(vaesdq_u8(s[3], k[r]));
+	}
+	s[0] = veorq_u8(vaesdq_u8(s[0], k[r]), k[r + 1]);
+	s[1] = veorq_u8(vaesdq_u8(s[1], k[r]), k[r + 1]);
+	s[2] = veorq_u8(vaesdq_u8(s[2], k[r]), k[r + 1]);
+	s[3] = veorq_u8(vaesdq_u8(s[3], k[r]), k[r + 1]);
+}
+
+SSCP_TARGET_CRYPTO static void AES_EncryptBlocksARMv8(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	uint8x16_t k[AES_MAX_ROUNDS + 1], s[4];
+	DWORD i;
+
+	AES_LoadKeysARMv8(aes_ctx->enc_keys, aes_ctx->rounds, k);
+
+	for (; blocks >= 4; blocks -= 4, data += 64)
+	{
+		for (i = 0; i < 4; i++)
+			s[i] = vld1q_u8(data + 16 * i);
+		AES_EncryptFourARMv8(k, aes_ctx->rounds, s);
+		for (i = 0; i < 4; i++)
+			vst1q_u8(data + 16 * i, s[i]);
+	}
+	for (; blocks > 0; blocks--, data += 16)
+		vst1q_u8(data, AES_EncryptOneARMv8(k, aes_ctx->rounds, vld1q_u8(data)));
+}
+
+SSCP_TARGET_CRYPTO static void AES_DecryptBlocksARMv8(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	uint8x16_t k[AES_MAX_ROUNDS + 1], s[4];
+	DWORD i;
+
+	AES_LoadKeysARMv8(aes_ctx->dec_keys, aes_ctx->rounds, k);
+
+	for (; blocks >= 4; blocks -= 4, data += 64)
+	{
+		for (i = 0; i < 4; i++)
+			s[i] = vld1q_u8(data + 16 * i);
+		AES_DecryptFourARMv8(k, aes_ctx->rounds, s);
+		for (i = 0; i < 4; i++)
+			vst1q_u8(data + 16 * i, s[i]);
+	}
+	for (; blocks > 0; blocks--, data += 16)
+		vst1q_u8(data, AES_DecryptOneARMv8(k, aes_ctx->rounds, vld1q_u8(data)));
+}
+
+/* CBC enciphering is serial, but the chaining stays in a register along with the keys */
+SSCP_TARGET_CRYPTO static void AES_EncryptCBCARMv8(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks)
+{
+	uint8x16_t k[AES_MAX_ROUNDS + 1];
+	uint8x16_t c = vld1q_u8(iv);
+
+	AES_LoadKeysARMv8(aes_ctx->enc_keys, aes_ctx->rounds, k);
+
+	for (; blocks > 0; blocks--, data += 16)
+	{
+		c = AES_EncryptOneARMv8(k, aes_ctx->rounds, veorq_u8(vld1q_u8(data), c));
+		vst1q_u8(data, c);
+	}
+	vst1q_u8(iv, c);
+}
+
+SSCP_TARGET_CRYPTO static void AES_DecryptCBCARMv8(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks)
+{
+	uint8x16_t k[AES_MAX_ROUNDS + 1], c[4], s[4];
+	uint8x16_t prev = vld1q_u8(iv);
+	DWORD i;
+
+	AES_LoadKeysARMv8(aes_ctx->dec_keys, aes_ctx->rounds, k);
+
+	for (; blocks >= 4; blocks -= 4, data += 64)
+	{
+		for (i = 0; i < 4; i++)
+			s[i] = c[i] = vld1q_u8(data + 16 * i);
+		AES_DecryptFourARMv8(k, aes_ctx->rounds, s);
+		vst1q_u8(data + 0, veorq_u8(s[0], prev));
+		vst1q_u8(data + 16, veorq_u8(s[1], c[0]));
+		vst1q_u8(data + 32, veorq_u8(s[2], c[1]));
+		vst1q_u8(data + 48, veorq_u8(s[3], c[2]));
+		prev = c[3];
+	}
+	for (; blocks > 0; blocks--, data += 16)
+	{
+		c[0] = vld1q_u8(data);
+		vst1q_u8(data, veorq_u8(AES_DecryptOneARMv8(k, aes_ctx->rounds, c[0]), prev));
+		prev = c[0];
+	}
+	vst1q_u8(iv, prev);
+}
+
+static const AES_BACKEND_ST AES_BACKEND_ARMV8 = { "armv8-ce", AES_InitARMv8, NULL, AES_EncryptARMv8, AES_DecryptARMv8, AES_EncryptBlocksARMv8, AES_DecryptBlocksARMv8, AES_EncryptCBCARMv8, AES_DecryptCBCARMv8 };
+
+const AES_BACKEND_ST* AES_ProbeHardware(void)
+{
+	return CPU_Has(FALSE) ? &AES_BACKEND_ARMV8 : NULL;
+}
+
+// ---------------------------------
+
+static const uint32_t SHA256_K32[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+SSCP_TARGET_CRYPTO static void SHA256_CompressARMv8(DWORD state[8], const BYTE data[], size_t blocks)
+{
+	uint32x4_t state0, state1, abcd_save, efgh_save;
+	uint32x4_t msg[4], wk, tmp;
+	uint32_t s[8];
+	int i;
+
+	/* DWORD may be wider than 32 bits */
+	for (i = 0; i < 8; i++)
+		s[i] = (uint32_t) state[i];
+
+	state0 = vld1q_u32(&s[0]);
+	state1 = vld1q_u32(&s[4]);
+
+	while (blocks--)
+	{
+		abcd_save = state0;
+		efgh_save = state1;
+
+		for (i = 0; i < 4; i++)
+			msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+		/* 16 groups of 4 rounds, the message schedule runs 4 words ahead */
+		for (i = 0; i < 16; i++)
+		{
+			wk = vaddq_u32(msg[i & 3], vld1q_u32(&SHA256_K32[4 * i]));
+			if (i < 12)
+				msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]), msg[(i + 2) & 3], msg[(i + 3) & 3]);
+			tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, wk);
+			state1 = vsha256h2q_u32(state1, tmp, wk);
+		}
+
+		state0 = vaddq_u32(state0, abcd_save);
+		state1 = vaddq_u32(state1, efgh_save);
+		data += 64;
+	}
+
+	vst1q_u32(&s[0], state0);
+	vst1q_u32(&s[4], state1);
+
+	for (i = 0; i < 8; i++)
+		state[i] = s[i];
+}
+
+static const SHA256_BACKEND_ST SHA256_BACKEND_ARMV8 = { "armv8-ce", SHA256_CompressARMv8 };
+
+const SHA256_BACKEND_ST* SHA256_ProbeHardware(void)
+{
+	return CPU_Has(TRUE) ? &SHA256_BACKEND_ARMV8 : NULL;
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Runtime selection of the AES and SHA-256 implementations.
+ * The CPU is probed once and the result cached: hardware backends first (AES-NI/SHA-NI
+ * on x86, Crypto Extensions on ARMv8), then OpenSSL for AES when built with it,
+ * then the portable code.
+ */
+#include "sscp-host-crypto_i.h"
+
+#if !defined(SSCP_CRYPTO_X86) && !defined(SSCP_CRYPTO_ARMV8)
+const AES_BACKEND_ST* AES_ProbeHardware(void)
+{
+	return NULL;
+}
+
+const SHA256_BACKEND_ST* SHA256_ProbeHardware(void)
+{
+	return NULL;
+}
+#endif
+
+const AES_BACKEND_ST* AES_GetBackend(void)
+{
+	static const AES_BACKEND_ST* volatile selected = NULL;
+	const AES_BACKEND_ST* backend = selected;
+
+	if (backend == NULL)
+	{
+		backend = AES_ProbeHardware();
+#if SSCP_WITH_OPENSSL
+		if (backend == NULL)
+			backend = &AES_BACKEND_OPENSSL;
+#endif
+		if (backend == NULL)
+			backend = &AES_BACKEND_C;
+
+		/* Probing is idempotent, a concurrent first call only does it twice */
+		selected = backend;
+	}
+
+	return backend;
+}
+
+const SHA256_BACKEND_ST* SHA256_GetBackend(void)
+{
+	static const SHA256_BACKEND_ST* volatile selected = NULL;
+	const SHA256_BACKEND_ST* backend = selected;
+
+	if (backend == NULL)
+	{
+		backend = SHA256_ProbeHardware();
+		if (backend == NULL)
+			backend = &SHA256_BACKEND_C;
+
+		selected = backend;
+	}
+
+	return backend;
+}
+
+/**
+ * @brief Tell which implementations the library uses for AES and SHA-256.
+ *
+ * @param aesBackend Receives the name of the AES backend ("aes-ni", "armv8-ce", "openssl" or "c"). May be NULL.
+ * @param sha256Backend Receives the name of the SHA-256 backend ("sha-ni", "armv8-ce" or "c"). May be NULL.
+ */
+void SSCP_GetCryptoBackends(const char** aesBackend, const char** sha256Backend)
+{
+	if (aesBackend != NULL)
+		*aesBackend = AES_GetBackend()->name;
+	if (sha256Backend != NULL)
+		*sha256Backend = SHA256_GetBackend()->name;
+}
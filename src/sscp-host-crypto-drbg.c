@@ -0,0 +1,178 @@
+/**
+ * @file sscp-host-crypto-drbg.c
+ * @brief Random values of the exchanges, from a per-context AES-CTR-DRBG.
+ *
+ * Each secure command needs a random IV, each authentication a random rndA: asking
+ * the system every time costs a getrandom() syscall per exchange (an open, a read
+ * and a close of /dev/urandom where getrandom() is not there).
+ *
+ * Each context has its own CTR_DRBG (NIST SP 800-90A, AES-128, no derivation
+ * function): seeded with 32 bytes from SSCP_GetRandom() on first use, it fills a
+ * pool of SSCP_DRBG_POOL_SZ bytes at a time, then updates its key and V so that the
+ * pool cannot be computed back from its state. The values are served from the pool,
+ * and wiped from it as they are. The system is asked again every
+ * SSCP_DRBG_RESEED_INTERVAL pools.
+ *
+ * As the rest of the context, the generator is only used by the thread that runs
+ * the exchanges of the context: there is no lock.
+ */
+#include "sscp-host-crypto_i.h"
+
+#define SSCP_DRBG_RESEED_INTERVAL 1024 /* Pools between two seedings, that is 256 KB */
+
+/* V + 1, as a 128-bit big endian value */
+static void SSCP_DrbgIncrement(BYTE v[16])
+{
+	int i;
+
+	for (i = 15; i >= 0; i--)
+	{
+		if (++v[i] != 0)
+			break;
+	}
+}
+
+/* CTR_DRBG_Update: new key and V, from the current ones and the provided data (may be NULL) */
+static void SSCP_DrbgUpdate(SSCP_CTX_ST* ctx, const BYTE provided[32])
+{
+	BYTE temp[32];
+	DWORD i;
+
+	for (i = 0; i < sizeof(temp); i += 16)
+	{
+		SSCP_DrbgIncrement(ctx->drbg.v);
+		AES_Encrypt2(&ctx->drbg.key, &temp[i], ctx->drbg.v);
+	}
+
+	if (provided != NULL)
+	{
+		for (i = 0; i < sizeof(temp); i++)
+			temp[i] ^= provided[i];
+	}
+
+	AES_Free(&ctx->drbg.key);
+	AES_Init(&ctx->drbg.key, temp);
+	memcpy(ctx->drbg.v, &temp[16], 16);
+
+	memset(temp, 0, sizeof(temp));
+}
+
+/* CTR_DRBG_Instantiate: key and V at zero, then the update with the seed (entropy input) */
+void SSCP_DrbgInstantiate(SSCP_CTX_ST* ctx, const BYTE seed[32])
+{
+	static const BYTE ZERO[16] = { 0 };
+
+	AES_Free(&ctx->drbg.key);
+	AES_Init(&ctx->drbg.key, ZERO);
+	memset(ctx->drbg.v, 0, 16);
+	SSCP_DrbgUpdate(ctx, seed);
+}
+
+/* CTR_DRBG_Reseed, without additional input */
+void SSCP_DrbgReseed(SSCP_CTX_ST* ctx, const BYTE seed[32])
+{
+	SSCP_DrbgUpdate(ctx, seed);
+}
+
+/*
+ * CTR_DRBG_Generate, without additional input: the counter blocks, all of them
+ * ciphered at once, then the update that leaves nothing behind to compute them back.
+ * The length is a multiple of 16.
+ */
+void SSCP_DrbgGenerate(SSCP_CTX_ST* ctx, BYTE output[], DWORD length)
+{
+	DWORD i;
+
+	for (i = 0; i < length; i += 16)
+	{
+		SSCP_DrbgIncrement(ctx->drbg.v);
+		memcpy(&output[i], ctx->drbg.v, 16);
+	}
+	AES_EncryptBlocks(&ctx->drbg.key, output, length / 16);
+	SSCP_DrbgUpdate(ctx, NULL);
+}
+
+/* Seeding and reseeding, with 32 bytes from the system */
+static BOOL SSCP_DrbgSeed(SSCP_CTX_ST* ctx)
+{
+	BYTE seed[32];
+
+	if (!SSCP_GetRandom(seed, sizeof(seed)))
+		return FALSE;
+
+	if (ctx->drbg.pools == 0)
+		SSCP_DrbgInstantiate(ctx, seed);
+	else
+		SSCP_DrbgReseed(ctx, seed);
+	ctx->drbg.pools = 1;
+
+	memset(seed, 0, sizeof(seed));
+	return TRUE;
+}
+
+/* A new pool */
+static BOOL SSCP_DrbgRefill(SSCP_CTX_ST* ctx)
+{
+	if ((ctx->drbg.pools == 0) || (ctx->drbg.pools > SSCP_DRBG_RESEED_INTERVAL))
+	{
+		if (!SSCP_DrbgSeed(ctx))
+			return FALSE;
+	}
+
+	SSCP_DrbgGenerate(ctx, ctx->drbg.pool, SSCP_DRBG_POOL_SZ);
+
+	ctx->drbg.pools++;
+	ctx->drbg.available = SSCP_DRBG_POOL_SZ;
+	return TRUE;
+}
+
+/* Random bytes from the pool of the context, refilled as needed */
+BOOL SSCP_DrbgDraw(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz)
+{
+	while (bufferSz > 0)
+	{
+		BYTE* from;
+		DWORD count;
+
+		if (ctx->drbg.available == 0)
+		{
+			if (!SSCP_DrbgRefill(ctx))
+				return FALSE;
+		}
+
+		/* From the end of the pool, wiped as it goes */
+		count = (bufferSz < ctx->drbg.available) ? bufferSz : ctx->drbg.available;
+		ctx->drbg.available -= count;
+		from = &ctx->drbg.pool[ctx->drbg.available];
+		memcpy(buffer, from, count);
+		memset(from, 0, count);
+
+		buffer += count;
+		bufferSz -= count;
+	}
+
+	return TRUE;
+}
+
+/**
+ * \brief random bytes for the exchanges of the context, without a syscall but once in a while
+ *
+ * A replayed session gets the values of the recorded one, see sscp-host-capture.c.
+ * Returns FALSE if the system fails to give the seed.
+ */
+BOOL SSCP_GetRandomEx(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz)
+{
+	const SSCP_TRANSPORT_ST* transport = ctx->port->transport;
+
+	if ((transport != NULL) && (transport->random != NULL))
+		return transport->random(ctx, buffer, bufferSz);
+
+	return SSCP_DrbgDraw(ctx, buffer, bufferSz);
+}
+
+/* The generator is forgotten, the next values come from a new seed */
+void SSCP_DrbgFree(SSCP_CTX_ST* ctx)
+{
+	AES_Free(&ctx->drbg.key);
+	memset(&ctx->drbg, 0, sizeof(ctx->drbg));
+}
@@ -14,36 +14,76 @@ static void HMAC_SHA256_Init(SHA256_CTX_ST *sha256_ctx, const BYTE* key, BYTE ke
 	SHA256_Update(sha256_ctx, ipad, SHA256_BLOCK_SIZE);
 }
 
-static void HMAC_SHA256_Final(SHA256_CTX_ST* sha256_ctx, const BYTE* key, BYTE key_size, BYTE digest[SHA256_DIGEST_SIZE])
+static void HMAC_SHA256_Final(SHA256_CTX_ST* sha256_ctx, const SHA256_CTX_ST* outer_ctx, BYTE digest[SHA256_DIGEST_SIZE])
+{
+	SHA256_Final(sha256_ctx, digest);
+
+	*sha256_ctx = *outer_ctx;
+	SHA256_Update(sha256_ctx, digest, SHA256_DIGEST_SIZE);
+	SHA256_Final(sha256_ctx, digest);
+}
+
+/*
+ * Hash the key XOR ipad and key XOR opad blocks once for all, so that the HMAC of
+ * a message only costs the message itself plus the two final blocks
+ */
+void HMAC_SHA256_Prepare(HMAC_CTX_ST* hmac_ctx, const BYTE* key, BYTE key_size)
 {
 	BYTE opad[SHA256_BLOCK_SIZE];
 	BYTE i;
 
-	SHA256_Final(sha256_ctx, digest);
+	HMAC_SHA256_Init(&hmac_ctx->inner, key, key_size);
+
 	memset(opad, 0x5c, SHA256_BLOCK_SIZE);
 	for (i = 0; i < key_size; i++)
 		opad[i] ^= key[i];
 
-	SHA256_Init(sha256_ctx);
-	SHA256_Update(sha256_ctx, opad, SHA256_BLOCK_SIZE);
-	SHA256_Update(sha256_ctx, digest, SHA256_DIGEST_SIZE);
-	SHA256_Final(sha256_ctx, digest);
+	SHA256_Init(&hmac_ctx->outer);
+	SHA256_Update(&hmac_ctx->outer, opad, SHA256_BLOCK_SIZE);
 }
 
-BOOL SSCP_HMAC(const BYTE keyValue[16], const BYTE buffer[], DWORD length, BYTE hmac[32])
+BOOL SSCP_HMACEx(const HMAC_CTX_ST* hmac_ctx, const BYTE buffer[], DWORD length, BYTE hmac[32])
 {
 	SHA256_CTX_ST sha256_ctx;
 
-	if (keyValue == NULL)
+	if (hmac_ctx == NULL)
 		return FALSE;
 	if ((buffer == NULL) && (length > 0))
 		return FALSE;
 	if (hmac == NULL)
 		return FALSE;
 
-	HMAC_SHA256_Init(&sha256_ctx, keyValue, 16);
+	sha256_ctx = hmac_ctx->inner;
 	SHA256_Update(&sha256_ctx, buffer, length);
-	HMAC_SHA256_Final(&sha256_ctx, keyValue, 16, hmac);
+	HMAC_SHA256_Final(&sha256_ctx, &hmac_ctx->outer, hmac);
 
 	return TRUE;
+}
+
+/* HMAC of a message given piece by piece: Begin, as many Update as needed, then End */
+void SSCP_HMACBegin(const HMAC_CTX_ST* hmac_ctx, SHA256_CTX_ST* sha256_ctx)
+{
+	*sha256_ctx = hmac_ctx->inner;
+}
+
+void SSCP_HMACUpdate(SHA256_CTX_ST* sha256_ctx, const BYTE buffer[], DWORD length)
+{
+	SHA256_Update(sha256_ctx, buffer, length);
+}
+
+void SSCP_HMACEnd(const HMAC_CTX_ST* hmac_ctx, SHA256_CTX_ST* sha256_ctx, BYTE hmac[32])
+{
+	HMAC_SHA256_Final(sha256_ctx, &hmac_ctx->outer, hmac);
+}
+
+BOOL SSCP_HMAC(const BYTE keyValue[16], const BYTE buffer[], DWORD length, BYTE hmac[32])
+{
+	HMAC_CTX_ST hmac_ctx;
+
+	if (keyValue == NULL)
+		return FALSE;
+
+	HMAC_SHA256_Prepare(&hmac_ctx, keyValue, 16);
+
+	return SSCP_HMACEx(&hmac_ctx, buffer, length, hmac);
 }
\ No newline at end of file
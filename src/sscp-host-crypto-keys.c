@@ -0,0 +1,253 @@
+/**
+ * @file sscp-host-crypto-keys.c
+ * @brief What the authentications derive from the authentication key alone, cached.
+ *
+ * Each authentication uses the authentication key K three ways: two HMACs keyed
+ * with K (the hB check and hA), and W = AES(K', rndB) with K' = AES(K, K). None of
+ * the key expansions depends on the reader: a site that authenticates hundreds of
+ * readers with the same key expands K, then K', and hashes the HMAC pads of K, once
+ * per reader for the same result.
+ *
+ * A key cache keeps, per authentication key, K', its key schedule and the HMAC
+ * midstates of K. It is shared by the contexts it is given to, from any thread:
+ * an entry is filled once by the first thread that needs it, and only read
+ * afterwards. The schedule of K' is used by one thread at a time (the OpenSSL
+ * backend keeps a state in it); a thread that finds it in use expands its own,
+ * instead of waiting. A cache holds SSCP_KEY_CACHE_SLOTS keys; once it is full, a
+ * new key replaces the least recently used one that no thread holds at the time (a
+ * use holds its entry, so that it is not replaced underneath), and is processed as
+ * if there was no cache if every entry is held.
+ *
+ * The entries are keys: they are wiped when the cache is freed.
+ */
+#include "sscp-host-crypto_i.h"
+
+/* K' = AES(K, K) */
+static void SSCP_KeyPrime(const BYTE key[16], BYTE keyPrime[16])
+{
+	AES_CTX_ST aes_ctx;
+
+	memcpy(keyPrime, key, 16);
+	AES_Init(&aes_ctx, keyPrime);
+	AES_Encrypt(&aes_ctx, keyPrime);
+	AES_Free(&aes_ctx);
+	memset(&aes_ctx, 0, sizeof(aes_ctx));
+}
+
+/* Fill the entry for the key, held by the caller, and publish it */
+static SSCP_KEY_CACHE_ENTRY_ST* SSCP_KeyCacheFill(SSCP_KEY_CACHE_ST* cache, SSCP_KEY_CACHE_ENTRY_ST* entry, const BYTE key[16])
+{
+	memcpy(entry->key, key, 16);
+	SSCP_KeyPrime(key, entry->keyPrime);
+	AES_Init(&entry->cipherPrime, entry->keyPrime);
+	HMAC_SHA256_Prepare(&entry->sign, key, 16);
+	SSCP_ATOMIC_STORE(&entry->lastUse, SSCP_ATOMIC_ADD(&cache->clock, 1));
+	SSCP_ATOMIC_ADD(&entry->refs, 1);
+	SSCP_ATOMIC_STORE(&entry->ready, 1);
+	return entry;
+}
+
+/* Take the least recently used entry that no thread holds, for another key; FALSE if there is none */
+static BOOL SSCP_KeyCacheReplace(SSCP_KEY_CACHE_ST* cache, SSCP_KEY_CACHE_ENTRY_ST** replaced)
+{
+	SSCP_KEY_CACHE_ENTRY_ST* entry = NULL;
+	DWORD i;
+
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+	{
+		SSCP_KEY_CACHE_ENTRY_ST* candidate = &cache->entries[i];
+
+		if (!SSCP_ATOMIC_LOAD(&candidate->ready) || (SSCP_ATOMIC_LOAD(&candidate->refs) != 0))
+			continue;
+		if ((entry == NULL) || ((LONG)(SSCP_ATOMIC_LOAD(&candidate->lastUse) - SSCP_ATOMIC_LOAD(&entry->lastUse)) < 0))
+			entry = candidate;
+	}
+	if (entry == NULL)
+		return FALSE;
+
+	if (SSCP_ATOMIC_ADD(&entry->replacing, 1) != 0)
+	{
+		SSCP_ATOMIC_ADD(&entry->replacing, -1);
+		return FALSE;
+	}
+
+	/* A thread that counts itself after this sees the entry is not ready, one that did before is seen here */
+	SSCP_ATOMIC_STORE(&entry->ready, 0);
+	if (SSCP_ATOMIC_LOAD(&entry->refs) != 0)
+	{
+		SSCP_ATOMIC_STORE(&entry->ready, 1);
+		SSCP_ATOMIC_ADD(&entry->replacing, -1);
+		return FALSE;
+	}
+
+	AES_Free(&entry->cipherPrime);
+	*replaced = entry;
+	return TRUE;
+}
+
+/* Entry of the key, filled if needed and held; NULL without a cache, or if all its entries are held */
+static SSCP_KEY_CACHE_ENTRY_ST* SSCP_KeyCacheEntry(SSCP_KEY_CACHE_ST* cache, const BYTE key[16])
+{
+	SSCP_KEY_CACHE_ENTRY_ST* entry;
+	DWORD i;
+
+	if (cache == NULL)
+		return NULL;
+
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+	{
+		entry = &cache->entries[i];
+
+		if (!SSCP_ATOMIC_LOAD(&entry->ready))
+			continue;
+		SSCP_ATOMIC_ADD(&entry->refs, 1);
+		if (SSCP_ATOMIC_LOAD(&entry->ready) && !memcmp(entry->key, key, 16))
+		{
+			SSCP_ATOMIC_STORE(&entry->lastUse, SSCP_ATOMIC_ADD(&cache->clock, 1));
+			return entry;
+		}
+		SSCP_ATOMIC_ADD(&entry->refs, -1);
+	}
+
+	/* Two threads that miss the same key at the same time may both fill a slot for it */
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+	{
+		entry = &cache->entries[i];
+
+		if ((SSCP_ATOMIC_LOAD(&entry->claimed) != 0) || (SSCP_ATOMIC_ADD(&entry->claimed, 1) != 0))
+			continue;
+
+		return SSCP_KeyCacheFill(cache, entry, key);
+	}
+
+	/* Full */
+	if (!SSCP_KeyCacheReplace(cache, &entry))
+		return NULL;
+
+	SSCP_KeyCacheFill(cache, entry, key);
+	SSCP_ATOMIC_ADD(&entry->replacing, -1);
+	return entry;
+}
+
+/* Done with the entry */
+static void SSCP_KeyCacheRelease(SSCP_KEY_CACHE_ENTRY_ST* entry)
+{
+	SSCP_ATOMIC_ADD(&entry->refs, -1);
+}
+
+/* HMAC keyed with the authentication key */
+BOOL SSCP_KeyCacheHMAC(SSCP_KEY_CACHE_ST* cache, const BYTE key[16], const BYTE buffer[], DWORD length, BYTE hmac[32])
+{
+	SSCP_KEY_CACHE_ENTRY_ST* entry;
+	BOOL done;
+
+	if (key == NULL)
+		return FALSE;
+
+	entry = SSCP_KeyCacheEntry(cache, key);
+	if (entry == NULL)
+		return SSCP_HMAC(key, buffer, length, hmac);
+
+	done = SSCP_HMACEx(&entry->sign, buffer, length, hmac);
+	SSCP_KeyCacheRelease(entry);
+	return done;
+}
+
+/*
+ * AES(K', block) for each of the blocks, in place, the blocks given at once to the
+ * backend; K' goes to keyPrime if it is not NULL (for the traces)
+ */
+void SSCP_KeyCacheEncrypt(SSCP_KEY_CACHE_ST* cache, const BYTE key[16], BYTE blocks[], DWORD blockCount, BYTE keyPrime[16])
+{
+	SSCP_KEY_CACHE_ENTRY_ST* entry = SSCP_KeyCacheEntry(cache, key);
+	AES_CTX_ST aes_ctx;
+	BYTE Kp[16];
+
+	if (entry != NULL)
+	{
+		if (keyPrime != NULL)
+			memcpy(keyPrime, entry->keyPrime, 16);
+
+		if (SSCP_ATOMIC_ADD(&entry->users, 1) == 0)
+		{
+			AES_EncryptBlocks(&entry->cipherPrime, blocks, blockCount);
+			SSCP_ATOMIC_ADD(&entry->users, -1);
+			SSCP_KeyCacheRelease(entry);
+			return;
+		}
+		SSCP_ATOMIC_ADD(&entry->users, -1);
+
+		/* In use by another thread: K' is known, its schedule is not shared */
+		memcpy(Kp, entry->keyPrime, 16);
+		SSCP_KeyCacheRelease(entry);
+	}
+	else
+	{
+		SSCP_KeyPrime(key, Kp);
+		if (keyPrime != NULL)
+			memcpy(keyPrime, Kp, 16);
+	}
+
+	AES_Init(&aes_ctx, Kp);
+	AES_EncryptBlocks(&aes_ctx, blocks, blockCount);
+	AES_Free(&aes_ctx);
+	memset(&aes_ctx, 0, sizeof(aes_ctx));
+	memset(Kp, 0, sizeof(Kp));
+}
+
+/**
+ * @brief Allocate a new key cache, empty.
+ *
+ * @return A pointer to a newly allocated cache on success, or NULL if memory
+ *         allocation fails.
+ *
+ * @note The returned cache must be released afterwards using SSCP_KeyCacheFree(),
+ *       once no context uses it anymore.
+ */
+SSCP_KEY_CACHE_ST* SSCP_KeyCacheAlloc(void)
+{
+	return (SSCP_KEY_CACHE_ST*) SSCP_MemAlloc(sizeof(SSCP_KEY_CACHE_ST));
+}
+
+/**
+ * @brief Wipe and free a key cache.
+ *
+ * @param[in,out] cache Cache to free (may be NULL). The contexts it has been given
+ *                to must not authenticate with it anymore (see SSCP_SetKeyCache()).
+ */
+void SSCP_KeyCacheFree(SSCP_KEY_CACHE_ST* cache)
+{
+	DWORD i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < SSCP_KEY_CACHE_SLOTS; i++)
+		if (cache->entries[i].ready)
+			AES_Free(&cache->entries[i].cipherPrime);
+
+	memset(cache, 0, sizeof(SSCP_KEY_CACHE_ST));
+	SSCP_MemFree(cache);
+}
+
+/**
+ * @brief Have the authentications of a context go through a key cache.
+ *
+ * The contexts that authenticate with the same keys (e.g. all the readers of a site)
+ * share a cache; SSCP_Authenticate() and SSCP_AuthenticateAll() then expand each
+ * authentication key once for all of them. The readers of a bus get the cache of
+ * the bus master when they are created.
+ *
+ * @param[in,out] ctx SSCP context.
+ * @param[in] cache Cache, NULL for none.
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_SetKeyCache(SSCP_CTX_ST* ctx, SSCP_KEY_CACHE_ST* cache)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	ctx->keyCache = cache;
+	return SSCP_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/*
+ * AES through OpenSSL's EVP interface, used when the CPU has no AES instructions
+ * the library knows about (OpenSSL may still have its own, e.g. VPAES or bit-sliced code,
+ * which unlike the portable T-tables does not leak timing through the cache).
+ * SHA-256 stays on the portable code: the HMAC midstates need the raw compression
+ * function, which EVP does not expose.
+ */
+#include "sscp-host-crypto_i.h"
+
+#if SSCP_WITH_OPENSSL
+
+#include <openssl/evp.h>
+
+static BOOL AES_InitOpenSSL(AES_CTX_ST* aes_ctx, const BYTE key_data[])
+{
+	const EVP_CIPHER* cipher;
+	EVP_CIPHER_CTX* enc = NULL;
+	EVP_CIPHER_CTX* dec = NULL;
+
+	switch (aes_ctx->key_bits)
+	{
+	case 128:
+		cipher = EVP_aes_128_ecb();
+		break;
+	case 192:
+		cipher = EVP_aes_192_ecb();
+		break;
+	case 256:
+		cipher = EVP_aes_256_ecb();
+		break;
+	default:
+		return FALSE;
+	}
+
+	enc = EVP_CIPHER_CTX_new();
+	dec = EVP_CIPHER_CTX_new();
+	if ((enc == NULL) || (dec == NULL))
+		goto failed;
+
+	if (EVP_EncryptInit_ex(enc, cipher, NULL, key_data, NULL) != 1)
+		goto failed;
+	if (EVP_DecryptInit_ex(dec, cipher, NULL, key_data, NULL) != 1)
+		goto failed;
+
+	/* One block at a time, the CBC chaining is done by the caller */
+	EVP_CIPHER_CTX_set_padding(enc, 0);
+	EVP_CIPHER_CTX_set_padding(dec, 0);
+
+	aes_ctx->backend_data[0] = enc;
+	aes_ctx->backend_data[1] = dec;
+	return TRUE;
+
+failed:
+	EVP_CIPHER_CTX_free(enc);
+	EVP_CIPHER_CTX_free(dec);
+	return FALSE;
+}
+
+static void AES_FreeOpenSSL(AES_CTX_ST* aes_ctx)
+{
+	EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*) aes_ctx->backend_data[0]);
+	EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*) aes_ctx->backend_data[1]);
+	aes_ctx->backend_data[0] = NULL;
+	aes_ctx->backend_data[1] = NULL;
+}
+
+static void AES_EncryptOpenSSL(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	int outl;
+	EVP_EncryptUpdate((EVP_CIPHER_CTX*) aes_ctx->backend_data[0], data, &outl, data, 16);
+}
+
+static void AES_DecryptOpenSSL(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	int outl;
+	EVP_DecryptUpdate((EVP_CIPHER_CTX*) aes_ctx->backend_data[1], data, &outl, data, 16);
+}
+
+/* Several blocks in a single call, OpenSSL interleaves them when its code can */
+static void AES_EncryptBlocksOpenSSL(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	int outl;
+	EVP_EncryptUpdate((EVP_CIPHER_CTX*) aes_ctx->backend_data[0], data, &outl, data, (int)(16 * blocks));
+}
+
+static void AES_DecryptBlocksOpenSSL(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	int outl;
+	EVP_DecryptUpdate((EVP_CIPHER_CTX*) aes_ctx->backend_data[1], data, &outl, data, (int)(16 * blocks));
+}
+
+const AES_BACKEND_ST AES_BACKEND_OPENSSL = { "openssl", AES_InitOpenSSL, AES_FreeOpenSSL, AES_EncryptOpenSSL, AES_DecryptOpenSSL, AES_EncryptBlocksOpenSSL, AES_DecryptBlocksOpenSSL, NULL, NULL };
+
+#endif
@@ -79,7 +79,7 @@ static const unsigned long K[64] = {
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 /* compress 512-bits */
-static int sha256_compress(SHA256_CTX_ST* ctx, unsigned char* buf)
+static void sha256_compress(DWORD state[8], const unsigned char* buf)
 {
 	DWORD S[8], W[64], t0, t1;
 	DWORD t;
@@ -88,7 +88,7 @@ static int sha256_compress(SHA256_CTX_ST* ctx, unsigned char* buf)
 	/* copy state into S */
 	for (i = 0; i < 8; i++)
 	{
-		S[i] = ctx->state[i];
+		S[i] = state[i];
 	}
 	/* copy the state into 512-bits into W[0..15] */
 	for (i = 0; i < 16; i++)
@@ -121,11 +121,21 @@ static int sha256_compress(SHA256_CTX_ST* ctx, unsigned char* buf)
 	/* feedback */
 	for (i = 0; i < 8; i++)
 	{
-		ctx->state[i] = ctx->state[i] + S[i];
+		state[i] = (state[i] + S[i]) & 0xFFFFFFFFUL;
 	}
-	return 0;
 }
 
+static void sha256_compress_blocks(DWORD state[8], const BYTE data[], size_t blocks)
+{
+	while (blocks--)
+	{
+		sha256_compress(state, data);
+		data += 64;
+	}
+}
+
+const SHA256_BACKEND_ST SHA256_BACKEND_C = { "c", sha256_compress_blocks };
+
 /* Initialize the hash state */
 void SHA256_Init(SHA256_CTX_ST* ctx)
 {
@@ -150,6 +160,7 @@ void SHA256_Init(SHA256_CTX_ST* ctx)
 */
 void SHA256_Update(SHA256_CTX_ST* ctx, const BYTE data[], size_t len)
 {
+	const SHA256_BACKEND_ST* backend = SHA256_GetBackend();
 	size_t n;
 
 #define block_size 64
@@ -159,11 +170,12 @@ void SHA256_Update(SHA256_CTX_ST* ctx, const BYTE data[], size_t len)
 	{
 		if (ctx->curlen == 0 && len >= block_size)
 		{
-			if (sha256_compress(ctx, (unsigned char*)data) < 0)
-				return;
-			ctx->length += block_size * 8;
-			data += block_size;
-			len -= block_size;
+			/* Feed all the full blocks to the backend at once */
+			n = len / block_size;
+			backend->compress(ctx->state, data, n);
+			ctx->length += (DWORD) (n * block_size * 8);
+			data += n * block_size;
+			len -= n * block_size;
 		}
 		else
 		{
@@ -174,8 +186,7 @@ void SHA256_Update(SHA256_CTX_ST* ctx, const BYTE data[], size_t len)
 			len -= n;
 			if (ctx->curlen == block_size)
 			{
-				if (sha256_compress(ctx, ctx->buf) < 0)
-					return;
+				backend->compress(ctx->state, ctx->buf, 1);
 				ctx->length += 8 * block_size;
 				ctx->curlen = 0;
 			}
@@ -191,6 +202,7 @@ void SHA256_Update(SHA256_CTX_ST* ctx, const BYTE data[], size_t len)
 */
 void SHA256_Final(SHA256_CTX_ST* ctx, BYTE hash[SHA256_DIGEST_SIZE])
 {
+	const SHA256_BACKEND_ST* backend = SHA256_GetBackend();
 	int i;
 
 	if (ctx->curlen >= sizeof(ctx->buf))
@@ -210,7 +222,7 @@ void SHA256_Final(SHA256_CTX_ST* ctx, BYTE hash[SHA256_DIGEST_SIZE])
 		{
 			ctx->buf[ctx->curlen++] = (unsigned char)0;
 		}
-		sha256_compress(ctx, ctx->buf);
+		backend->compress(ctx->state, ctx->buf, 1);
 		ctx->curlen = 0;
 	}
 	/* pad upto 56 bytes of zeroes */
@@ -221,7 +233,7 @@ void SHA256_Final(SHA256_CTX_ST* ctx, BYTE hash[SHA256_DIGEST_SIZE])
 	/* store length */
 	WPA_PUT_BE64(ctx->buf + 56, ctx->length);
 
-	sha256_compress(ctx, ctx->buf);
+	backend->compress(ctx->state, ctx->buf, 1);
 
 	/* copy output */
 	for (i = 0; i < 8; i++)
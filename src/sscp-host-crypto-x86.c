@@ -0,0 +1,458 @@
+/*
+ * AES and SHA-256 on x86 processors, using the AES-NI and SHA extensions.
+ * The code is compiled with per-function target attributes, so the rest of the library
+ * does not need -maes/-msha; it only runs when CPUID reports the instructions.
+ */
+#include "sscp-host-crypto_i.h"
+
+#ifdef SSCP_CRYPTO_X86
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SSCP_TARGET_AESNI
+#define SSCP_TARGET_SHANI
+#else
+#include <cpuid.h>
+#define SSCP_TARGET_AESNI __attribute__((target("sse4.1,aes")))
+#define SSCP_TARGET_SHANI __attribute__((target("sse4.1,sha")))
+#endif
+
+static void CPU_GetId(uint32_t leaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info, (int) leaf, 0);
+	regs[0] = (uint32_t) info[0];
+	regs[1] = (uint32_t) info[1];
+	regs[2] = (uint32_t) info[2];
+	regs[3] = (uint32_t) info[3];
+#else
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+	__cpuid_count(leaf, 0, a, b, c, d);
+	regs[0] = a;
+	regs[1] = b;
+	regs[2] = c;
+	regs[3] = d;
+#endif
+}
+
+static BOOL CPU_Has(BOOL wantSHA)
+{
+	uint32_t regs[4];
+
+	CPU_GetId(0, regs);
+	if (regs[0] < 1)
+		return FALSE;
+
+	/* Leaf 1: ECX bit 19 = SSE4.1, bit 25 = AES-NI */
+	CPU_GetId(1, regs);
+	if (!(regs[2] & (1UL << 19)))
+		return FALSE;
+	if (!wantSHA)
+		return (regs[2] & (1UL << 25)) ? TRUE : FALSE;
+
+	/* Leaf 7: EBX bit 29 = SHA */
+	CPU_GetId(0, regs);
+	if (regs[0] < 7)
+		return FALSE;
+	CPU_GetId(7, regs);
+	return (regs[1] & (1UL << 29)) ? TRUE : FALSE;
+}
+
+// ---------------------------------
+
+static BOOL AES_InitAESNI(AES_CTX_ST* aes_ctx, const BYTE key_data[])
+{
+	(void) key_data;
+	AES_ExportRoundKeys(aes_ctx);
+	return TRUE;
+}
+
+SSCP_TARGET_AESNI static void AES_EncryptAESNI(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	const BYTE* rk = aes_ctx->enc_keys;
+	DWORD r;
+	__m128i s;
+
+	s = _mm_xor_si128(_mm_loadu_si128((const __m128i*) data), _mm_loadu_si128((const __m128i*) rk));
+	for (r = 1; r < aes_ctx->rounds; r++)
+		s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i*) (rk + 16 * r)));
+	s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i*) (rk + 16 * r)));
+	_mm_storeu_si128((__m128i*) data, s);
+}
+
+SSCP_TARGET_AESNI static void AES_DecryptAESNI(AES_CTX_ST* aes_ctx, BYTE data[16])
+{
+	/* dec_keys is the equivalent inverse cipher schedule, which is what AESDEC expects */
+	const BYTE* rk = aes_ctx->dec_keys;
+	DWORD r;
+	__m128i s;
+
+	s = _mm_xor_si128(_mm_loadu_si128((const __m128i*) data), _mm_loadu_si128((const __m128i*) rk));
+	for (r = 1; r < aes_ctx->rounds; r++)
+		s = _mm_aesdec_si128(s, _mm_loadu_si128((const __m128i*) (rk + 16 * r)));
+	s = _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i*) (rk + 16 * r)));
+	_mm_storeu_si128((__m128i*) data, s);
+}
+
+/*
+ * Several blocks: the round keys are loaded once, and 4 independent blocks go through
+ * the rounds together, so that the latency of AESENC/AESDEC is hidden by the others.
+ */
+SSCP_TARGET_AESNI static void AES_LoadKeysAESNI(const BYTE rk[], DWORD rounds, __m128i k[AES_MAX_ROUNDS + 1])
+{
+	DWORD r;
+
+	for (r = 0; r <= rounds; r++)
+		k[r] = _mm_loadu_si128((const __m128i*) (rk + 16 * r));
+}
+
+SSCP_TARGET_AESNI static __m128i AES_EncryptOneAESNI(const __m128i k[AES_MAX_ROUNDS + 1], DWORD rounds, __m128i s)
+{
+	DWORD r;
+
+	s = _mm_xor_si128(s, k[0]);
+	for (r = 1; r < rounds; r++)
+		s = _mm_aesenc_si128(s, k[r]);
+	return _mm_aesenclast_si128(s, k[rounds]);
+}
+
+SSCP_TARGET_AESNI static __m128i AES_DecryptOneAESNI(const __m128i k[AES_MAX_ROUNDS + 1], DWORD rounds, __m128i s)
+{
+	DWORD r;
+
+	s = _mm_xor_si128(s, k[0]);
+	for (r = 1; r < rounds; r++)
+		s = _mm_aesdec_si128(s, k[r]);
+	return _mm_aesdeclast_si128(s, k[rounds]);
+}
+
+SSCP_TARGET_AESNI static void AES_EncryptFourAESNI(const __m128i k[AES_MAX_ROUNDS + 1], DWORD rounds, __m128i s[4])
+{
+	DWORD r;
+
+	s[0] = _mm_xor_si128(s[0], k[0]);
+	s[1] = _mm_xor_si128(s[1], k[0]);
+	s[2] = _mm_xor_si128(s[2], k[0]);
+	s[3] = _mm_xor_si128(s[3], k[0]);
+	for (r = 1; r < rounds; r++)
+	{
+		s[0] = _mm_aesenc_si128(s[0], k[r]);
+		s[1] = _mm_aesenc_si128(s[1], k[r]);
+		s[2] = _mm_aesenc_si128(s[2], k[r]);
+		s[3] = _mm_aesenc_si128(s[3], k[r]);
+	}
+	s[0] = _mm_aesenclast_si128(s[0], k[rounds]);
+	s[1] = _mm_aesenclast_si128(s[1], k[rounds]);
+	s[2] = _mm_aesenclast_si128(s[2], k[rounds]);
+	s[3] = _mm_aesenclast_si128(s[3], k[rounds]);
+}
+
+SSCP_TARGET_AESNI static void AES_DecryptFourAESNI(const __m128i k[AES_MAX_ROUNDS + 1], DWORD rounds, __m128i s[4])
+{
+	DWORD r;
+
+	s[0] = _mm_xor_si128(s[0], k[0]);
+	s[1] = _mm_xor_si128(s[1], k[0]);
+	s[2] = _mm_xor_si128(s[2], k[0]);
+	s[3] = _mm_xor_si128(s[3], k[0]);
+	for (r = 1; r < rounds; r++)
+	{
+		s[0] = _mm_aesdec_si128(s[0], k[r]);
+		s[1] = _mm_aesdec_si128(s[1], k[r]);
+		s[2] = _mm_aesdec_si128(s[2], k[r]);
+		s[3] = _mm_aesdec_si128(s[3], k[r]);
+	}
+	s[0] = _mm_aesdeclast_si128(s[0], k[rounds]);
+	s[1] = _mm_aesdeclast_si128(s[1], k[rounds]);
+	s[2] = _mm_aesdeclast_si128(s[2], k[rounds]);
+	s[3] = _mm_aesdeclast_si128(s[3], k[rounds]);
+}
+
+SSCP_TARGET_AESNI static void AES_EncryptBlocksAESNI(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	__m128i k[AES_MAX_ROUNDS + 1], s[4];
+	DWORD i;
+
+	AES_LoadKeysAESNI(aes_ctx->enc_keys, aes_ctx->rounds, k);
+
+	for (; blocks >= 4; blocks -= 4, data += 64)
+	{
+		for (i = 0; i < 4; i++)
+			s[i] = _mm_loadu_si128((const __m128i*) (data + 16 * i));
+		AES_EncryptFourAESNI(k, aes_ctx->rounds, s);
+		for (i = 0; i < 4; i++)
+			_mm_storeu_si128((__m128i*) (data + 16 * i), s[i]);
+	}
+	for (; blocks > 0; blocks--, data += 16)
+		_mm_storeu_si128((__m128i*) data, AES_EncryptOneAESNI(k, aes_ctx->rounds, _mm_loadu_si128((const __m128i*) data)));
+}
+
+SSCP_TARGET_AESNI static void AES_DecryptBlocksAESNI(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks)
+{
+	__m128i k[AES_MAX_ROUNDS + 1], s[4];
+	DWORD i;
+
+	AES_LoadKeysAESNI(aes_ctx->dec_keys, aes_ctx->rounds, k);
+
+	for (; blocks >= 4; blocks -= 4, data += 64)
+	{
+		for (i = 0; i < 4; i++)
+			s[i] = _mm_loadu_si128((const __m128i*) (data + 16 * i));
+		AES_DecryptFourAESNI(k, aes_ctx->rounds, s);
+		for (i = 0; i < 4; i++)
+			_mm_storeu_si128((__m128i*) (data + 16 * i), s[i]);
+	}
+	for (; blocks > 0; blocks--, data += 16)
+		_mm_storeu_si128((__m128i*) data, AES_DecryptOneAESNI(k, aes_ctx->rounds, _mm_loadu_si128((const __m128i*) data)));
+}
+
+/* CBC enciphering is serial, but the chaining stays in a register along with the keys */
+SSCP_TARGET_AESNI static void AES_EncryptCBCAESNI(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks)
+{
+	__m128i k[AES_MAX_ROUNDS + 1];
+	__m128i c = _mm_loadu_si128((const __m128i*) iv);
+
+	AES_LoadKeysAESNI(aes_ctx->enc_keys, aes_ctx->rounds, k);
+
+	for (; blocks > 0; blocks--, data += 16)
+	{
+		c = AES_EncryptOneAESNI(k, aes_ctx->rounds, _mm_xor_si128(_mm_loadu_si128((const __m128i*) data), c));
+		_mm_storeu_si128((__m128i*) data, c);
+	}
+	_mm_storeu_si128((__m128i*) iv, c);
+}
+
+SSCP_TARGET_AESNI static void AES_DecryptCBCAESNI(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks)
+{
+	__m128i k[AES_MAX_ROUNDS + 1], c[4], s[4];
+	__m128i prev = _mm_loadu_si128((const __m128i*) iv);
+	DWORD i;
+
+	AES_LoadKeysAESNI(aes_ctx->dec_keys, aes_ctx->rounds, k);
+
+	for (; blocks >= 4; blocks -= 4, data += 64)
+	{
+		for (i = 0; i < 4; i++)
+			s[i] = c[i] = _mm_loadu_si128((const __m128i*) (data + 16 * i));
+		AES_DecryptFourAESNI(k, aes_ctx->rounds, s);
+		_mm_storeu_si128((__m128i*) (data + 0), _mm_xor_si128(s[0], prev));
+		_mm_storeu_si128((__m128i*) (data + 16), _mm_xor_si128(s[1], c[0]));
+		_mm_storeu_si128((__m128i*) (data + 32), _mm_xor_si128(s[2], c[1]));
+		_mm_storeu_si128((__m128i*) (data + 48), _mm_xor_si128(s[3], c[2]));
+		prev = c[3];
+	}
+	for (; blocks > 0; blocks--, data += 16)
+	{
+		c[0] = _mm_loadu_si128((const __m128i*) data);
+		_mm_storeu_si128((__m128i*) data, _mm_xor_si128(AES_DecryptOneAESNI(k, aes_ctx->rounds, c[0]), prev));
+		prev = c[0];
+	}
+	_mm_storeu_si128((__m128i*) iv, prev);
+}
+
+static const AES_BACKEND_ST AES_BACKEND_AESNI = { "aes-ni", AES_InitAESNI, NULL, AES_EncryptAESNI, AES_DecryptAESNI, AES_EncryptBlocksAESNI, AES_DecryptBlocksAESNI, AES_EncryptCBCAESNI, AES_DecryptCBCAESNI };
+
+const AES_BACKEND_ST* AES_ProbeHardware(void)
+{
+	return CPU_Has(FALSE) ? &AES_BACKEND_AESNI : NULL;
+}
+
+// ---------------------------------
+
+static const uint32_t SHA256_K32[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+SSCP_TARGET_SHANI static void SHA256_CompressSHANI(DWORD state[8], const BYTE data[], size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save;
+	__m128i msg0, msg1, msg2, msg3, wk, tmp;
+	uint32_t s[8];
+	int i;
+
+	/* DWORD may be wider than 32 bits */
+	for (i = 0; i < 8; i++)
+		s[i] = (uint32_t) state[i];
+
+	/* The instructions work on the ABEF / CDGH word pairs */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &s[0]), 0xB1);	/* CDAB */
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &s[4]), 0x1B);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	while (blocks--)
+	{
+		abef_save = state0;
+		cdgh_save = state1;
+
+		/* Rounds 0-3 */
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 0)), mask);
+		wk = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*) &SHA256_K32[0]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+
+		/* Rounds 4-7 */
+		msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), mask);
+		wk = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*) &SHA256_K32[4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+		/* Rounds 8-11 */
+		msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), mask);
+		wk = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*) &SHA256_K32[8]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+		/* Rounds 12-15 */
+		msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), mask);
+		wk = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*) &SHA256_K32[12]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg3, msg2, 4);
+		msg0 = _mm_sha256msg2_epu32(_mm_add_epi32(msg0, tmp), msg3);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+		/* Rounds 16-19 */
+		wk = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*) &SHA256_K32[16]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg0, msg3, 4);
+		msg1 = _mm_sha256msg2_epu32(_mm_add_epi32(msg1, tmp), msg0);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+		/* Rounds 20-23 */
+		wk = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*) &SHA256_K32[20]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg1, msg0, 4);
+		msg2 = _mm_sha256msg2_epu32(_mm_add_epi32(msg2, tmp), msg1);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+		/* Rounds 24-27 */
+		wk = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*) &SHA256_K32[24]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg2, msg1, 4);
+		msg3 = _mm_sha256msg2_epu32(_mm_add_epi32(msg3, tmp), msg2);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+		/* Rounds 28-31 */
+		wk = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*) &SHA256_K32[28]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg3, msg2, 4);
+		msg0 = _mm_sha256msg2_epu32(_mm_add_epi32(msg0, tmp), msg3);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+		/* Rounds 32-35 */
+		wk = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*) &SHA256_K32[32]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg0, msg3, 4);
+		msg1 = _mm_sha256msg2_epu32(_mm_add_epi32(msg1, tmp), msg0);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+		/* Rounds 36-39 */
+		wk = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*) &SHA256_K32[36]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg1, msg0, 4);
+		msg2 = _mm_sha256msg2_epu32(_mm_add_epi32(msg2, tmp), msg1);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+		/* Rounds 40-43 */
+		wk = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*) &SHA256_K32[40]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg2, msg1, 4);
+		msg3 = _mm_sha256msg2_epu32(_mm_add_epi32(msg3, tmp), msg2);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+		/* Rounds 44-47 */
+		wk = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*) &SHA256_K32[44]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg3, msg2, 4);
+		msg0 = _mm_sha256msg2_epu32(_mm_add_epi32(msg0, tmp), msg3);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+		/* Rounds 48-51 */
+		wk = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i*) &SHA256_K32[48]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg0, msg3, 4);
+		msg1 = _mm_sha256msg2_epu32(_mm_add_epi32(msg1, tmp), msg0);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+
+		/* Rounds 52-55 */
+		wk = _mm_add_epi32(msg1, _mm_loadu_si128((const __m128i*) &SHA256_K32[52]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg1, msg0, 4);
+		msg2 = _mm_sha256msg2_epu32(_mm_add_epi32(msg2, tmp), msg1);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+
+		/* Rounds 56-59 */
+		wk = _mm_add_epi32(msg2, _mm_loadu_si128((const __m128i*) &SHA256_K32[56]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		tmp = _mm_alignr_epi8(msg2, msg1, 4);
+		msg3 = _mm_sha256msg2_epu32(_mm_add_epi32(msg3, tmp), msg2);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+
+		/* Rounds 60-63 */
+		wk = _mm_add_epi32(msg3, _mm_loadu_si128((const __m128i*) &SHA256_K32[60]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		wk = _mm_shuffle_epi32(wk, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);	/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i*) &s[0], state0);
+	_mm_storeu_si128((__m128i*) &s[4], state1);
+
+	for (i = 0; i < 8; i++)
+		state[i] = s[i];
+}
+
+static const SHA256_BACKEND_ST SHA256_BACKEND_SHANI = { "sha-ni", SHA256_CompressSHANI };
+
+const SHA256_BACKEND_ST* SHA256_ProbeHardware(void)
+{
+	return CPU_Has(TRUE) ? &SHA256_BACKEND_SHANI : NULL;
+}
+
+#endif
@@ -2,159 +2,193 @@
 
 BOOL SSCP_DEBUG_CRYPTO = FALSE;
 
-BOOL SSCP_ComputeSessionKeys(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16], const BYTE rndA[16], const BYTE rndB[16])
+/* Expand the session keys once for all, they are used by every exchange */
+void SSCP_ExpandSessionKeys(SSCP_CTX_ST* ctx)
 {
-    BYTE Kp[16];
-    BYTE W[16];
-    BYTE T[64];
+    AES_Free(&ctx->sessionCipherAB);
+    AES_Free(&ctx->sessionCipherBA);
+    AES_Init(&ctx->sessionCipherAB, ctx->sessionKeyCipherAB);
+    AES_Init(&ctx->sessionCipherBA, ctx->sessionKeyCipherBA);
+    HMAC_SHA256_Prepare(&ctx->sessionSignAB, ctx->sessionKeySignAB, 16);
+    HMAC_SHA256_Prepare(&ctx->sessionSignBA, ctx->sessionKeySignBA, 16);
+}
+
+/* Trace a value of the derivation, for debugCrypto */
+static void SSCP_TraceKey(const char* name, const BYTE value[], DWORD length)
+{
+#if SSCP_WITH_TRACE
     DWORD i;
 
-    if (ctx == NULL)
-        return FALSE;
-    if (authKeyValue == NULL)
-        return FALSE;
-    if (rndA == NULL)
-        return FALSE;
-    if (rndB == NULL)
-        return FALSE;
+    SSCP_Trace("%s", name);
+    for (i = 0; i < length; i++)
+        SSCP_Trace("%02X", value[i]);
+    SSCP_Trace("\n");
+#else
+    (void) name;
+    (void) value;
+    (void) length;
+#endif
+}
 
-    memcpy(Kp, authKeyValue, 16);
-    memcpy(W, rndB, 16);
+/* T = SHA256(0x00000000 | W | Info1) | SHA256(0x00000001 | W | Info2) with Info1 = 0x026A5382E653 and Info2 = 0x026A */
+static void SSCP_DeriveT(const BYTE W[16], BYTE T[64], BOOL debug)
+{
+    static const BYTE SSCP_INFO_1[] = { 0x02, 0x6A, 0x53, 0x82, 0xE6, 0x53 };
+    static const BYTE SSCP_INFO_2[] = { 0x02, 0x6A };
+    SHA256_CTX_ST sha256_ctx;
+    BYTE buffer[4 + 16 + sizeof(SSCP_INFO_1)];
 
-    /*
-     * DON'T REVEAL THE AUTHENTICATION KEY !!!
-    if (SSCP_DEBUG_CRYPTO)
-    {
-        SSCP_Trace("K =");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", Kp[i]);
-        SSCP_Trace("\n");
-    }
-     */
+    /* Buffer with Info1 (0x00000000 | W | Info1) */
+    memset(&buffer[0], 0, 4);
+    memcpy(&buffer[4], W, 16);
+    memcpy(&buffer[4 + 16], SSCP_INFO_1, sizeof(SSCP_INFO_1));
 
-    /* K' = AES (K, K) */
-    {
-        AES_CTX_ST aes_ctx;
-        AES_Init(&aes_ctx, Kp);
-        AES_Encrypt(&aes_ctx, Kp);
-    }
+    if (debug)
+        SSCP_TraceKey("B1=", buffer, 4 + 16 + sizeof(SSCP_INFO_1));
 
-    if (SSCP_DEBUG_CRYPTO)
-    {
-        SSCP_Trace("K'=");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", Kp[i]);
-        SSCP_Trace("\n");
-    }
+    SHA256_Init(&sha256_ctx);
+    SHA256_Update(&sha256_ctx, buffer, 4 + 16 + sizeof(SSCP_INFO_1));
+    SHA256_Final(&sha256_ctx, &T[0]);
 
-    /* W = AES (K', RndB) */
-    {
-        AES_CTX_ST aes_ctx;
-        AES_Init(&aes_ctx, Kp);
-        AES_Encrypt(&aes_ctx, W);
-    }
+    /* Buffer with Info2 (0x00000001 | W | Info2) */
+    buffer[3] = 0x01;
+    memcpy(&buffer[4 + 16], SSCP_INFO_2, sizeof(SSCP_INFO_2));
 
-    if (SSCP_DEBUG_CRYPTO)
+    if (debug)
+        SSCP_TraceKey("B2=", buffer, 4 + 16 + sizeof(SSCP_INFO_2));
+
+    SHA256_Init(&sha256_ctx);
+    SHA256_Update(&sha256_ctx, buffer, 4 + 16 + sizeof(SSCP_INFO_2));
+    SHA256_Final(&sha256_ctx, &T[32]);
+
+    memset(buffer, 0, sizeof(buffer));
+}
+
+/*
+ * Session keys of several authentications at once: the W = AES(K', RndB) of the
+ * authentications with the same key and the same cache go to the AES backend
+ * together (up to SSCP_DERIVE_LANES blocks), so that they are interleaved as the
+ * blocks of a frame are; K' comes from the cache when there is one.
+ */
+BOOL SSCP_DeriveSessionKeys(SSCP_SESSION_DERIVATION_ST items[], DWORD itemCount, BOOL debug)
+{
+    SSCP_SESSION_DERIVATION_ST* lane[SSCP_DERIVE_LANES];
+    BYTE W[SSCP_DERIVE_LANES * 16];
+    BYTE Kp[16];
+    DWORD done, i, j, laneCount;
+
+    if ((items == NULL) && (itemCount > 0))
+        return FALSE;
+    for (i = 0; i < itemCount; i++)
     {
-        SSCP_Trace("W=");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", W[i]);
-        SSCP_Trace("\n");
+        if ((items[i].authKeyValue == NULL) || (items[i].rndB == NULL) || (items[i].sessionKeys == NULL))
+            return FALSE;
+        items[i].derived = FALSE;
     }
 
-    /* Buffer with Info1 (0x00000000 | W | Info1) */
+    for (done = 0; done < itemCount; done += laneCount)
     {
-        SHA256_CTX_ST sha256_ctx;
-        static const BYTE SSCP_INFO_1[] = { 0x02, 0x6A, 0x53, 0x82, 0xE6, 0x53 };
-        BYTE buffer[4 + 16 + sizeof(SSCP_INFO_1)];
-
-        memset(&buffer[0], 0, 4);
-        memcpy(&buffer[4], W, 16);
-        memcpy(&buffer[4 + 16], SSCP_INFO_1, sizeof(SSCP_INFO_1));
+        SSCP_SESSION_DERIVATION_ST* first = NULL;
 
-        if (SSCP_DEBUG_CRYPTO)
+        /* Next item still to derive, with those that share its key */
+        laneCount = 0;
+        for (i = 0; (i < itemCount) && (laneCount < SSCP_DERIVE_LANES); i++)
         {
-            SSCP_Trace("B1=");
-            for (i = 0; i < sizeof(buffer); i++)
-                SSCP_Trace("%02X", buffer[i]);
-            SSCP_Trace("\n");
+            if (items[i].derived)
+                continue;
+            if (first == NULL)
+                first = &items[i];
+            else if ((items[i].cache != first->cache) || memcmp(items[i].authKeyValue, first->authKeyValue, 16))
+                continue;
+
+            items[i].derived = TRUE;
+            lane[laneCount] = &items[i];
+            memcpy(&W[16 * laneCount], items[i].rndB, 16);
+            laneCount++;
         }
 
-        SHA256_Init(&sha256_ctx);
-        SHA256_Update(&sha256_ctx, buffer, sizeof(buffer));
-        SHA256_Final(&sha256_ctx, &T[0]);
-    }
+        /*
+         * DON'T REVEAL THE AUTHENTICATION KEY !!!
+        if (debug)
+            SSCP_TraceKey("K =", first->authKeyValue, 16);
+         */
 
-    /* Buffer with Info2 (0x00000001 | W | Info2) */
-    {
-        SHA256_CTX_ST sha256_ctx;
-        static const BYTE SSCP_INFO_2[] = { 0x02, 0x6A };
-        BYTE buffer[4 + 16 + sizeof(SSCP_INFO_2)];
+        /* W = AES (K', RndB), K' = AES (K, K) */
+        SSCP_KeyCacheEncrypt(first->cache, first->authKeyValue, W, laneCount, Kp);
 
-        memset(&buffer[0], 0, 4);
-        buffer[3] = 0x01;
-        memcpy(&buffer[4], W, 16);
-        memcpy(&buffer[4 + 16], SSCP_INFO_2, sizeof(SSCP_INFO_2));
+        if (debug)
+            SSCP_TraceKey("K'=", Kp, 16);
 
-        if (SSCP_DEBUG_CRYPTO)
+        for (j = 0; j < laneCount; j++)
         {
-            SSCP_Trace("B2=");
-            for (i = 0; i < sizeof(buffer); i++)
-                SSCP_Trace("%02X", buffer[i]);
-            SSCP_Trace("\n");
-        }
-
-        SHA256_Init(&sha256_ctx);
-        SHA256_Update(&sha256_ctx, buffer, sizeof(buffer));
-        SHA256_Final(&sha256_ctx, &T[32]);
-    }
+            if (debug)
+                SSCP_TraceKey("W=", &W[16 * j], 16);
 
-    /* T = SHA256(0x00000000 | W | Info1) | Hash(0x00000001 | W | Info2) with Info1 = 0x026A5382E653 and Info2 = 0x026A */
+            SSCP_DeriveT(&W[16 * j], lane[j]->sessionKeys, debug);
 
-    if (SSCP_DEBUG_CRYPTO)
-    {
-        SSCP_Trace("T=");
-        for (i = 0; i < 64; i++)
-            SSCP_Trace("%02X", T[i]);
-        SSCP_Trace("\n");
+            if (debug)
+                SSCP_TraceKey("T=", lane[j]->sessionKeys, 64);
+        }
     }
 
+    memset(W, 0, sizeof(W));
+    memset(Kp, 0, sizeof(Kp));
+    return TRUE;
+}
+
+/* T, as derived, becomes the session of the context */
+void SSCP_SetSessionKeys(SSCP_CTX_ST* ctx, const BYTE T[64])
+{
     /* Gather subkeys */
     memcpy(ctx->sessionKeyCipherAB, &T[0], 16);
     memcpy(ctx->sessionKeyCipherBA, &T[16], 16);
     memcpy(ctx->sessionKeySignAB, &T[32], 16);
     memcpy(ctx->sessionKeySignBA, &T[48], 16);
 
-    if (SSCP_DEBUG_CRYPTO)
+    SSCP_ExpandSessionKeys(ctx);
+
+    if (ctx->settings.debugCrypto)
     {
-        SSCP_Trace("Kcab=");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", ctx->sessionKeyCipherAB[i]);
-        SSCP_Trace("\n");
-        SSCP_Trace("Kcba=");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", ctx->sessionKeyCipherBA[i]);
-        SSCP_Trace("\n");
-        SSCP_Trace("Ksab=");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", ctx->sessionKeySignAB[i]);
-        SSCP_Trace("\n");
-        SSCP_Trace("Ksba=");
-        for (i = 0; i < 16; i++)
-            SSCP_Trace("%02X", ctx->sessionKeySignBA[i]);
-        SSCP_Trace("\n");
+        SSCP_TraceKey("Kcab=", ctx->sessionKeyCipherAB, 16);
+        SSCP_TraceKey("Kcba=", ctx->sessionKeyCipherBA, 16);
+        SSCP_TraceKey("Ksab=", ctx->sessionKeySignAB, 16);
+        SSCP_TraceKey("Ksba=", ctx->sessionKeySignBA, 16);
     }
+}
+
+BOOL SSCP_ComputeSessionKeys(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16], const BYTE rndA[16], const BYTE rndB[16])
+{
+    SSCP_SESSION_DERIVATION_ST item;
+    BYTE T[64];
+
+    if (ctx == NULL)
+        return FALSE;
+    if (authKeyValue == NULL)
+        return FALSE;
+    if (rndA == NULL)
+        return FALSE;
+    if (rndB == NULL)
+        return FALSE;
+
+    item.cache = ctx->keyCache;
+    item.authKeyValue = authKeyValue;
+    item.rndB = rndB;
+    item.sessionKeys = T;
+
+    if (!SSCP_DeriveSessionKeys(&item, 1, ctx->settings.debugCrypto))
+        return FALSE;
+
+    SSCP_SetSessionKeys(ctx, T);
+    memset(T, 0, sizeof(T));
 
     return TRUE;
 }
 
-BOOL SSCP_Cipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer[], DWORD length)
+BOOL SSCP_CipherEx(AES_CTX_ST* aes_ctx, const BYTE initVector[16], BYTE buffer[], DWORD length)
 {
-    AES_CTX_ST aes_ctx;
     BYTE carry[16];
-    DWORD i, j;
 
-    if (keyValue == NULL)
+    if (aes_ctx == NULL)
         return FALSE;
     if (initVector == NULL)
         return FALSE;
@@ -163,33 +197,18 @@ BOOL SSCP_Cipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer
     if ((length % 16) != 0)
         return FALSE;
 
-    AES_Init(&aes_ctx, keyValue);
-
+    /* Cipher <- E ( Plain XOR IV ), IV <- Cipher */
     memcpy(carry, initVector, 16);
-
-    for (i = 0; i < length; i += 16)
-    {
-        /* Plain <- Plain XOR IV */
-        for (j = 0; j < 16; j++)
-            buffer[i + j] ^= carry[j];
-
-        /* Cipher <- E ( Plain XOR IV ) */
-        AES_Encrypt(&aes_ctx, &buffer[i]);
-
-        /* IV <- Cipher */
-        memcpy(carry, &buffer[i], 16);
-    }
+    AES_EncryptCBC(aes_ctx, carry, buffer, length / 16);
 
     return TRUE;
 }
 
-BOOL SSCP_Decipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer[], DWORD length)
+BOOL SSCP_DecipherEx(AES_CTX_ST* aes_ctx, const BYTE initVector[16], BYTE buffer[], DWORD length)
 {
-    AES_CTX_ST aes_ctx;
     BYTE carry[16];
-    DWORD i, j;
 
-    if (keyValue == NULL)
+    if (aes_ctx == NULL)
         return FALSE;
     if (initVector == NULL)
         return FALSE;
@@ -198,25 +217,39 @@ BOOL SSCP_Decipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buff
     if ((length % 16) != 0)
         return FALSE;
 
-    AES_Init(&aes_ctx, keyValue);
-
+    /* Plain <- D ( Cipher ) XOR IV, IV <- Cipher; the blocks are deciphered several at a time */
     memcpy(carry, initVector, 16);
+    AES_DecryptCBC(aes_ctx, carry, buffer, length / 16);
 
-    for (i = 0; i < length; i += 16)
-    {
-        BYTE next_carry[16];
-        memcpy(next_carry, &buffer[i], 16);
+    return TRUE;
+}
 
-        /* Plain XOR IV <- D ( Cipher ) */
-        AES_Decrypt(&aes_ctx, &buffer[i]);
+BOOL SSCP_Cipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer[], DWORD length)
+{
+    AES_CTX_ST aes_ctx;
+    BOOL rc;
 
-        /* Plain <- ( Plain XOR IV ) XOR IV */
-        for (j = 0; j < 16; j++)
-            buffer[i + j] ^= carry[j];
+    if (keyValue == NULL)
+        return FALSE;
 
-        /* IV <- Cipher */
-        memcpy(carry, next_carry, 16);
-    }
+    AES_Init(&aes_ctx, keyValue);
+    rc = SSCP_CipherEx(&aes_ctx, initVector, buffer, length);
+    AES_Free(&aes_ctx);
 
-    return TRUE;
+    return rc;
+}
+
+BOOL SSCP_Decipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer[], DWORD length)
+{
+    AES_CTX_ST aes_ctx;
+    BOOL rc;
+
+    if (keyValue == NULL)
+        return FALSE;
+
+    AES_Init(&aes_ctx, keyValue);
+    rc = SSCP_DecipherEx(&aes_ctx, initVector, buffer, length);
+    AES_Free(&aes_ctx);
+
+    return rc;
 }
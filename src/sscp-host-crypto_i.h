@@ -1,7 +1,32 @@
 #ifndef __SSCP_CRYPTO_I_H__
 #define __SSCP_CRYPTO_I_H__
 
-#include "sscp-host_i.h"
+#include <sscp-host.h>
+
+/* Hardware backends (AES-NI/SHA-NI, ARMv8 Crypto Extensions) are compiled in by default, */
+/* the fastest one supported by the CPU is picked at runtime */
+#ifndef SSCP_WITH_CRYPTO_HW
+#define SSCP_WITH_CRYPTO_HW 1
+#endif
+#ifndef SSCP_WITH_OPENSSL
+#define SSCP_WITH_OPENSSL 0
+#endif
+
+/* 128 keeps the schedules of AES-128 only, the size the protocol uses, and rejects the longer keys */
+#ifndef SSCP_AES_MAX_KEY_BITS
+#define SSCP_AES_MAX_KEY_BITS 256
+#endif
+
+#if SSCP_WITH_CRYPTO_HW && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define SSCP_CRYPTO_X86 1
+#elif SSCP_WITH_CRYPTO_HW && (defined(__aarch64__) || defined(_M_ARM64))
+#define SSCP_CRYPTO_ARMV8 1
+#endif
+
+/* libcrypto exports the same names; once both are linked its own digests would resolve to ours */
+#define SHA256_Init SSCP_SHA256_Init
+#define SHA256_Update SSCP_SHA256_Update
+#define SHA256_Final SSCP_SHA256_Final
 
 #define SHA256_BLOCK_SIZE 64  	// SHA256 works on 64 byte blocks
 #define SHA256_DIGEST_SIZE 32	// SHA256 outputs a 32 byte digest
@@ -18,18 +43,89 @@ void SHA256_Init(SHA256_CTX_ST* ctx);
 void SHA256_Update(SHA256_CTX_ST* ctx, const BYTE data[], size_t len);
 void SHA256_Final(SHA256_CTX_ST* ctx, BYTE hash[SHA256_DIGEST_SIZE]);
 
+typedef struct
+{
+	const char* name;
+	/* Run the compression function over 'blocks' consecutive 64-byte blocks */
+	void (*compress)(DWORD state[8], const BYTE data[], size_t blocks);
+} SHA256_BACKEND_ST;
+
+typedef struct _AES_BACKEND_ST AES_BACKEND_ST;
+
+#define AES_MAX_ROUNDS (SSCP_AES_MAX_KEY_BITS / 32 + 6)
+#define AES_SCHD_WORDS (4 * (AES_MAX_ROUNDS + 1))
+
 typedef struct
 {
 	DWORD key_bits;		/* Size of the key (bits)                */
 	DWORD rounds;		/* Key-length-dependent number of rounds */
-	DWORD enc_schd[60];	/* Key schedule                          */
-	DWORD dec_schd[60];	/* Key schedule                          */
+	DWORD enc_schd[AES_SCHD_WORDS];	/* Key schedule                          */
+	DWORD dec_schd[AES_SCHD_WORDS];	/* Key schedule                          */
+	BYTE enc_keys[(AES_MAX_ROUNDS + 1) * 16];	/* Key schedule, byte order, for the hardware backends */
+	BYTE dec_keys[(AES_MAX_ROUNDS + 1) * 16];	/* Key schedule, byte order, for the hardware backends */
+	const AES_BACKEND_ST* backend;	/* Implementation bound to this context  */
+	void* backend_data[2];	/* Private data of the backend           */
 } AES_CTX_ST;
 
+struct _AES_BACKEND_ST
+{
+	const char* name;
+	/* Bind the context (already expanded) to the backend, return FALSE to stay on the portable code */
+	BOOL (*init)(AES_CTX_ST* aes_ctx, const BYTE key_data[]);
+	void (*free)(AES_CTX_ST* aes_ctx);
+	void (*encrypt)(AES_CTX_ST* aes_ctx, BYTE data[16]);
+	void (*decrypt)(AES_CTX_ST* aes_ctx, BYTE data[16]);
+	/* Optional, NULL for one block at a time: 'blocks' independent blocks, in place */
+	void (*encrypt_blocks)(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks);
+	void (*decrypt_blocks)(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks);
+	/* Optional, NULL for the generic chaining: CBC in place, iv receives the last cipher block */
+	void (*encrypt_cbc)(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks);
+	void (*decrypt_cbc)(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks);
+};
+
 void AES_Init(AES_CTX_ST* aes_ctx, const BYTE key[16]);
+void AES_InitEx(AES_CTX_ST* aes_ctx, const BYTE key_data[], DWORD key_bits);
+void AES_Free(AES_CTX_ST* aes_ctx);
 void AES_Encrypt(AES_CTX_ST* aes_ctx, BYTE data[16]);
 void AES_Encrypt2(AES_CTX_ST* aes_ctx, BYTE outbuf[16], const BYTE inbuf[16]);
 void AES_Decrypt(AES_CTX_ST* aes_ctx, BYTE data[16]);
 void AES_Decrypt2(AES_CTX_ST* aes_ctx, BYTE outbuf[16], const BYTE inbuf[16]);
+void AES_EncryptBlocks(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks);
+void AES_DecryptBlocks(AES_CTX_ST* aes_ctx, BYTE data[], DWORD blocks);
+void AES_EncryptCBC(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks);
+void AES_DecryptCBC(AES_CTX_ST* aes_ctx, BYTE iv[16], BYTE data[], DWORD blocks);
+
+typedef struct
+{
+	SHA256_CTX_ST inner;	/* State after the key XOR ipad block */
+	SHA256_CTX_ST outer;	/* State after the key XOR opad block */
+} HMAC_CTX_ST;
+
+void HMAC_SHA256_Prepare(HMAC_CTX_ST* hmac_ctx, const BYTE* key, BYTE key_size);
+void SSCP_HMACBegin(const HMAC_CTX_ST* hmac_ctx, SHA256_CTX_ST* sha256_ctx);
+void SSCP_HMACUpdate(SHA256_CTX_ST* sha256_ctx, const BYTE buffer[], DWORD length);
+void SSCP_HMACEnd(const HMAC_CTX_ST* hmac_ctx, SHA256_CTX_ST* sha256_ctx, BYTE hmac[32]);
+
+/* Backend selection (sscp-host-crypto-backend.c) */
+const AES_BACKEND_ST* AES_GetBackend(void);
+const SHA256_BACKEND_ST* SHA256_GetBackend(void);
+
+/* Portable implementations, always available */
+extern const AES_BACKEND_ST AES_BACKEND_C;
+extern const SHA256_BACKEND_ST SHA256_BACKEND_C;
+
+/* Per-architecture probes, return NULL when the CPU lacks the instructions */
+const AES_BACKEND_ST* AES_ProbeHardware(void);
+const SHA256_BACKEND_ST* SHA256_ProbeHardware(void);
+
+#if SSCP_WITH_OPENSSL
+extern const AES_BACKEND_ST AES_BACKEND_OPENSSL;
+#endif
+
+/* Copy the key schedules in byte order into enc_keys/dec_keys */
+void AES_ExportRoundKeys(AES_CTX_ST* aes_ctx);
+
+/* The context structure embeds the types above */
+#include "sscp-host_i.h"
 
 #endif
@@ -0,0 +1,257 @@
+/**
+ * @file sscp-host-dispatch.c
+ * @brief Dispatcher of the requests of many ports, with a single completion queue.
+ *
+ * Each port of the dispatcher has the worker thread of its request queue (see
+ * sscp-host-queue.c), that runs the requests of its readers in order, the crypto of
+ * the exchanges included: the ports do not wait for each other, and a host with a
+ * dozen adapters keeps a dozen lines busy. With SSCP_DISPATCHER_PIN_WORKERS, each
+ * worker is kept on a core of its own (round robin when there are more ports than
+ * cores), so that the session keys and the frames of a port stay in the caches of
+ * one core.
+ *
+ * The requests are posted lock-free to the queue of their port; once over, the
+ * worker appends them, lock-free as well, to the completions of the dispatcher,
+ * where the application takes them one after the other with SSCP_DispatcherNext(),
+ * together with the port and the address they were for.
+ */
+#include "sscp-host_i.h"
+
+typedef struct
+{
+	SSCP_CTX_ST* ctx; /* Any context of the port */
+	BOOL ownQueue; /* The queue has been started by the dispatcher */
+} SSCP_DISPATCHER_PORT_ST;
+
+struct _SSCP_DISPATCHER_ST
+{
+	SSCP_QUEUE_ST* completions;
+	DWORD flags;
+	DWORD portCount;
+	SSCP_DISPATCHER_PORT_ST ports[SSCP_DISPATCHER_MAX_PORTS];
+	volatile LONG posted; /* Posted, and not taken from the completions yet */
+};
+
+/* Index of the port of the context, SSCP_DISPATCHER_MAX_PORTS if it is not one of the dispatcher */
+static DWORD SSCP_DispatcherFind(SSCP_DISPATCHER_ST* dispatcher, SSCP_CTX_ST* ctx)
+{
+	DWORD i;
+
+	for (i = 0; i < dispatcher->portCount; i++)
+		if (dispatcher->ports[i].ctx->port == ctx->port)
+			return i;
+
+	return SSCP_DISPATCHER_MAX_PORTS;
+}
+
+/* Nothing to do: once the worker runs it, what has been posted before is over */
+static LONG SSCP_DispatcherBarrierJob(SSCP_CTX_ST* ctx, void* userData)
+{
+	(void) ctx;
+	(void) userData;
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Allocate a new dispatcher, without any port yet.
+ *
+ * @param[in] flags 0, or SSCP_DISPATCHER_PIN_WORKERS to keep the worker of each port
+ *            on a core of its own.
+ *
+ * @return A pointer to a newly allocated dispatcher on success, or NULL if memory
+ *         allocation fails.
+ *
+ * @note The returned dispatcher must be released afterwards using SSCP_DispatcherFree().
+ */
+SSCP_DISPATCHER_ST* SSCP_DispatcherAlloc(DWORD flags)
+{
+	SSCP_DISPATCHER_ST* dispatcher = SSCP_MemAlloc(sizeof(SSCP_DISPATCHER_ST));
+	if (dispatcher == NULL)
+		return NULL;
+
+	dispatcher->completions = SSCP_QueueCompletionsAlloc();
+	if (dispatcher->completions == NULL)
+	{
+		SSCP_MemFree(dispatcher);
+		return NULL;
+	}
+
+	dispatcher->flags = flags;
+	return dispatcher;
+}
+
+/**
+ * @brief Free the dispatcher, once the requests posted through it are over.
+ *
+ * The queues that the dispatcher has started are stopped; those that were running
+ * before are left running. The contexts and the ports are left as they are.
+ * The requests that are over and have not been taken with SSCP_DispatcherNext()
+ * are released to their owner.
+ *
+ * @param[in,out] dispatcher Dispatcher to free (may be NULL). Not from a job or a
+ *                callback of one of its ports.
+ */
+void SSCP_DispatcherFree(SSCP_DISPATCHER_ST* dispatcher)
+{
+	DWORD i;
+
+	if (dispatcher == NULL)
+		return;
+
+	/* No worker may complete into the dispatcher once it is gone */
+	for (i = 0; i < dispatcher->portCount; i++)
+	{
+		SSCP_DISPATCHER_PORT_ST* port = &dispatcher->ports[i];
+
+		if (port->ownQueue)
+			SSCP_QueueStop(port->ctx);
+		else if (port->ctx->port->queue != NULL)
+			SSCP_QueueCallJob(port->ctx, SSCP_DispatcherBarrierJob, NULL);
+	}
+
+	SSCP_QueueCompletionsFree(dispatcher->completions);
+	memset(dispatcher, 0, sizeof(SSCP_DISPATCHER_ST));
+	SSCP_MemFree(dispatcher);
+}
+
+/**
+ * @brief Give a port to the dispatcher.
+ *
+ * The request queue of the port is started, unless it already runs; with
+ * SSCP_DISPATCHER_PIN_WORKERS, its worker is kept on the core that follows the one
+ * of the previous port. Add the ports before posting anything.
+ *
+ * @param[in,out] dispatcher Dispatcher.
+ * @param[in] ctx An open context of the port; on a bus, any reader of the bus (the
+ *            requests may then be posted for any of them).
+ * @param[out] portIndex Index of the port in the dispatcher, as SSCP_DispatcherNext()
+ *             gives it (may be NULL).
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT @p dispatcher or @p ctx is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The port is already one of the dispatcher.
+ * @retval SSCP_ERR_OUT_OF_MEMORY The dispatcher has SSCP_DISPATCHER_MAX_PORTS ports.
+ * @retval SSCP_ERR_IN_PROGRESS An asynchronous exchange is pending on the context, or
+ *         on another reader of its bus.
+ * @retval SSCP_ERR_INTERNAL_FAILURE The worker thread could not be created.
+ */
+LONG SSCP_DispatcherAddPort(SSCP_DISPATCHER_ST* dispatcher, SSCP_CTX_ST* ctx, DWORD* portIndex)
+{
+	SSCP_DISPATCHER_PORT_ST* port;
+	LONG rc;
+
+	if ((dispatcher == NULL) || (ctx == NULL))
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_DispatcherFind(dispatcher, ctx) < SSCP_DISPATCHER_MAX_PORTS)
+		return SSCP_ERR_INVALID_PARAMETER;
+	if (dispatcher->portCount >= SSCP_DISPATCHER_MAX_PORTS)
+		return SSCP_ERR_OUT_OF_MEMORY;
+
+	port = &dispatcher->ports[dispatcher->portCount];
+	port->ctx = ctx;
+	port->ownQueue = FALSE;
+
+	if (ctx->port->queue == NULL)
+	{
+		rc = SSCP_QueueStart(ctx);
+		if (rc)
+			return rc;
+		port->ownQueue = TRUE;
+	}
+
+	if ((dispatcher->flags & SSCP_DISPATCHER_PIN_WORKERS) && !SSCP_QueuePin(ctx, dispatcher->portCount % SSCP_CpuCount()))
+	{
+		if (ctx->settings.debugExchange)
+			SSCP_Trace("Dispatcher: the worker of port %lu is left on any core\n", (unsigned long) dispatcher->portCount);
+	}
+
+	if (portIndex != NULL)
+		*portIndex = dispatcher->portCount;
+	dispatcher->portCount++;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Post a request to the worker of its port, without waiting.
+ *
+ * The request is run as SSCP_QueuePost() would run it (its callback is called by
+ * the worker); once over, it goes to the completions of the dispatcher, and belongs
+ * to the caller again when SSCP_DispatcherNext() returns it. It must not be waited
+ * for with SSCP_QueueWait().
+ *
+ * @param[in,out] dispatcher Dispatcher.
+ * @param[in,out] ctx SSCP context (the reader the request is for), on one of the
+ *                ports of the dispatcher.
+ * @param[in,out] request Request, as for SSCP_QueuePost().
+ *
+ * @return SSCP_SUCCESS if the request has been posted, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT @p dispatcher or @p ctx is NULL, the port of
+ *         @p ctx is not one of the dispatcher, or its queue does not run anymore.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p request is NULL, or has no data but a size.
+ * @retval SSCP_ERR_COMMAND_TOO_LONG The command data are too long.
+ * @retval SSCP_ERR_IN_PROGRESS The request has been posted already, and is not over.
+ */
+LONG SSCP_DispatcherPost(SSCP_DISPATCHER_ST* dispatcher, SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request)
+{
+	LONG rc;
+
+	if ((dispatcher == NULL) || (ctx == NULL))
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_DispatcherFind(dispatcher, ctx) >= SSCP_DISPATCHER_MAX_PORTS)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	/* Counted first, so that SSCP_DispatcherNext() waits for it */
+	SSCP_ATOMIC_ADD(&dispatcher->posted, 1);
+	rc = SSCP_QueuePostTo(ctx, request, dispatcher->completions);
+	if (rc)
+		SSCP_ATOMIC_ADD(&dispatcher->posted, -1);
+
+	return rc;
+}
+
+/**
+ * @brief Take the oldest request that is over, whichever its port.
+ *
+ * @param[in,out] dispatcher Dispatcher.
+ * @param[in] timeoutMs Longest wait, 0 to only check, or SSCP_ASYNC_INFINITE.
+ * @param[out] request The request, that belongs to the caller again (its result is
+ *             in its result field); NULL if nothing posted is left to take.
+ * @param[out] portIndex Index of its port, as SSCP_DispatcherAddPort() gave it (may be NULL).
+ * @param[out] address Address of the reader it was for (may be NULL).
+ *
+ * @return SSCP_SUCCESS on success (also if nothing is left), otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p dispatcher parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p request parameter is NULL.
+ * @retval SSCP_ERR_IN_PROGRESS No request has come to an end within the timeout.
+ */
+LONG SSCP_DispatcherNext(SSCP_DISPATCHER_ST* dispatcher, DWORD timeoutMs, SSCP_REQUEST_ST** request, DWORD* portIndex, BYTE* address)
+{
+	SSCP_REQUEST_ST* done;
+
+	if (dispatcher == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (request == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*request = NULL;
+
+	if (SSCP_ATOMIC_LOAD(&dispatcher->posted) == 0)
+		return SSCP_SUCCESS;
+
+	done = SSCP_QueueTake(dispatcher->completions, timeoutMs);
+	if (done == NULL)
+		return SSCP_ERR_IN_PROGRESS;
+	SSCP_ATOMIC_ADD(&dispatcher->posted, -1);
+
+	if (portIndex != NULL)
+		*portIndex = SSCP_DispatcherFind(dispatcher, done->ctx);
+	if (address != NULL)
+		*address = done->ctx->address;
+
+	*request = done;
+	return SSCP_SUCCESS;
+}
@@ -3,64 +3,29 @@
 BOOL SSCP_DEBUG_EXCHANGE = FALSE;
 
 /**
-  * \brief compute CRC
+ * \brief first half of SSCP_ExchangeRaw: set the timeouts, then send the frame
+ *
+ * *sentAt receives the SSCP_GetTickMs() value once the frame is with the driver,
+ * for SSCP_ExchangeRawRecv.
  */
-static void SSCP_SCR16(const BYTE part1[], DWORD part1Sz, const BYTE part2[], DWORD part2Sz, BYTE pcrc[2])
-{
-    short crc = 0xFFFF;
-    DWORD i = 0;
-    unsigned char j = 0x00;
-    short dbyte = 0;
-    short mix = 0;
-
-    for (i = 0; i < part1Sz; ++i)
-    {
-        dbyte = part1[i];
-        crc ^= dbyte << 8;
-
-        for (j = 0; j < 8; ++j)
-        {
-            mix = crc & 0x8000;
-            crc = (crc << 1);
-            if (mix)
-                crc = crc ^ 0x1021;
-        }
-    }
-
-    for (i = 0; i < part2Sz; ++i)
-    {
-        dbyte = part2[i];
-        crc ^= dbyte << 8;
-
-        for (j = 0; j < 8; ++j)
-        {
-            mix = crc & 0x8000;
-            crc = (crc << 1);
-            if (mix)
-                crc = crc ^ 0x1021;
-        }
-    }
-
-	pcrc[0] = (BYTE)(crc >> 8);
-	pcrc[1] = (BYTE)(crc);
-}
-
-LONG SSCP_ExchangeRaw(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, const BYTE command[], DWORD commandSz, BYTE response[], DWORD maxResponseSz, DWORD* actResponseSz)
+LONG SSCP_ExchangeRawSend(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, BYTE timeoutClass, const BYTE command[], DWORD commandSz, DWORD* sentAt)
 {
+    SSCP_SERIAL_CHUNK_ST frame[3];
     BYTE header[5];
-    BYTE crcA[2], crcB[2];
-    DWORD length;
+    BYTE crc[2];
     LONG rc;
 
     if (ctx == NULL)
         return SSCP_ERR_INVALID_CONTEXT;
     if ((command == NULL) && (commandSz > 0))
         return SSCP_ERR_INVALID_PARAMETER;
-    if (commandSz > 4096)
+    if (commandSz > SSCP_MAX_PAYLOAD_SZ)
         return SSCP_ERR_COMMAND_TOO_LONG;
+    if (SSCP_AsyncPending(ctx))
+        return SSCP_ERR_IN_PROGRESS;
 
-    /* Set the timeouts */
-    rc = SSCP_SerialSetTimeouts(ctx, SSCP_RESPONSE_FIRST_TIMEOUT, SSCP_RESPONSE_NEXT_TIMEOUT);
+    /* Set the timeouts, from the class of the command and the size of the frame */
+    rc = SSCP_TransportSetTimeouts(ctx, SSCP_FirstByteTimeout(ctx, timeoutClass, sizeof(header) + commandSz + 2), SSCP_InterByteTimeout(ctx));
     if (rc)
         return rc;
 
@@ -73,66 +38,65 @@ LONG SSCP_ExchangeRaw(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, const BYTE
     header[3] = address;
     header[4] = protocol;
 
-    SSCP_SCR16(&header[1], 4, command, commandSz, crcA);
+    SSCP_SCR16(&header[1], 4, command, commandSz, crc);
 
     /* Send */
     /* ---- */
 
-    rc = SSCP_SerialSend(ctx, header, sizeof(header));
-    if (rc)
-        return rc;
+    /* Header, payload and CRC go to the driver as a single transmission */
+    frame[0].buffer = header;
+    frame[0].length = sizeof(header);
+    frame[1].buffer = command;
+    frame[1].length = commandSz;
+    frame[2].buffer = crc;
+    frame[2].length = sizeof(crc);
+
+    /* Whatever is left from a former exchange is not the response to this one */
+    SSCP_SerialFlushRing(ctx);
 
-    rc = SSCP_SerialSend(ctx, command, commandSz);
+    rc = SSCP_TransportSendV(ctx, frame, 3);
     if (rc)
         return rc;
 
-    rc = SSCP_SerialSend(ctx, crcA, sizeof(crcA));
-    if (rc)
-        return rc;    
+    if (SSCP_TRACE_ON(ctx))
+        SSCP_TraceFrame(ctx, SSCP_TRACE_TX, header, command, commandSz);
 
-    /* Recv */
-    /* ---- */
+    if (sentAt != NULL)
+        *sentAt = SSCP_GetTickMs();
 
-    rc = SSCP_SerialRecv(ctx, header, sizeof(header));
-    if (rc)
-        return rc;
-
-    if (header[0] != 0x02)
-        return SSCP_ERR_WRONG_RESPONSE_COMMAND;
-    length = header[1];
-    length <<= 8;
-    length |= header[2];
+    return SSCP_SUCCESS;
+}
 
-    if (length > maxResponseSz) /* Payload will not fit */
-        return SSCP_ERR_RESPONSE_TOO_LONG;
+/**
+ * \brief second half of SSCP_ExchangeRaw: receive the response frame (its CRC checked by the ring)
+ *
+ * commandSz and sentAt are the ones of the command, for the adaptive timeouts.
+ */
+LONG SSCP_ExchangeRawRecv(SSCP_CTX_ST* ctx, BYTE timeoutClass, DWORD commandSz, DWORD sentAt, BYTE response[], DWORD maxResponseSz, DWORD* actResponseSz)
+{
+    BYTE header[5];
+    BYTE crc[2];
+    DWORD length;
+    LONG rc;
 
-    /* Set the timeouts */
-    rc = SSCP_SerialSetTimeouts(ctx, SSCP_RESPONSE_NEXT_TIMEOUT, SSCP_RESPONSE_NEXT_TIMEOUT);
-    if (rc)
-        return rc;
+    if (ctx == NULL)
+        return SSCP_ERR_INVALID_CONTEXT;
 
-    rc = SSCP_SerialRecv(ctx, response, length);
-    if (rc)
+    rc = SSCP_SerialRecvFrame(ctx, header, response, maxResponseSz, crc);
+    if ((rc == SSCP_ERR_COMM_RECV_MUTE) || (rc == SSCP_ERR_COMM_RECV_STOPPED))
     {
-        if (rc == SSCP_ERR_COMM_RECV_MUTE)
-            rc = SSCP_ERR_COMM_RECV_STOPPED; /* We already have the header, right? */
-        return rc;
+        SSCP_TimeoutExpired(ctx, timeoutClass);
+        if (SSCP_TRACE_ON(ctx))
+            SSCP_TraceEvent(ctx, SSCP_TRACE_TIMEOUT, timeoutClass, 0, rc, 0);
     }
-
-    rc = SSCP_SerialRecv(ctx, crcB, sizeof(crcB));
     if (rc)
-    {
-        if (rc == SSCP_ERR_COMM_RECV_MUTE)
-            rc = SSCP_ERR_COMM_RECV_STOPPED; /* We already have the header and the payload, right? */
         return rc;
-    }
 
-    /* Check CRC */
-    /* --------- */
+    SSCP_TimeoutSample(ctx, timeoutClass, 5 + commandSz + 2, SSCP_GetTickMs() - sentAt);
 
-    SSCP_SCR16(&header[1], 4, response, length, crcA);
-    if (memcmp(crcA, crcB, 2))
-        return SSCP_ERR_WRONG_RESPONSE_CRC;
+    length = header[1];
+    length <<= 8;
+    length |= header[2];
 
     if (actResponseSz != NULL)
         *actResponseSz = length;
@@ -140,41 +104,45 @@ LONG SSCP_ExchangeRaw(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, const BYTE
     return SSCP_SUCCESS;
 }
 
-LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData[], DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+LONG SSCP_ExchangeRaw(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, BYTE timeoutClass, const BYTE command[], DWORD commandSz, BYTE response[], DWORD maxResponseSz, DWORD* actResponseSz)
+{
+    DWORD sentAt;
+    LONG rc;
+
+    rc = SSCP_ExchangeRawSend(ctx, address, protocol, timeoutClass, command, commandSz, &sentAt);
+    if (rc)
+        return rc;
+
+    return SSCP_ExchangeRawRecv(ctx, timeoutClass, commandSz, sentAt, response, maxResponseSz, actResponseSz);
+}
+
+/**
+ * \brief build the secure command in place: header, signature, padding, ciphering and IV
+ *
+ * The command data must be stored at command[SSCP_COMMAND_HEADROOM], and the buffer
+ * must be large enough to receive the HMAC, the padding and the IV after it
+ * (maxCommandSz >= SSCP_COMMAND_HEADROOM + commandDataSz + SSCP_COMMAND_TAILROOM).
+ * On success, command[0..*commandSz-1] is the payload of the SSCP_PROTOCOL_SECURE frame.
+ */
+LONG SSCP_ExchangePrepare(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE command[], DWORD maxCommandSz, DWORD commandDataSz, DWORD* actCommandSz)
 {
-    BYTE padding[16] = { 0 };
     BYTE initVector[16] = { 0 };
     BYTE commandType = (BYTE)(commandHeader >> 16);
     WORD commandCode = (WORD)(commandHeader);
-    DWORD maxCommandSz = 0;
     DWORD commandSz = 0;
-    BYTE* command = NULL;
-    const DWORD maxResponseSz = 4096;
-    DWORD responseSz = 0;
-    BYTE *response = NULL;
-    BYTE responseCode;
-    DWORD t, i;
+    DWORD i;
     LONG rc;
 
     if (ctx == NULL)
         return SSCP_ERR_INVALID_CONTEXT;
-    if ((commandData == NULL) && (commandDataSz > 0))
+    if ((command == NULL) || (actCommandSz == NULL))
         return SSCP_ERR_INVALID_PARAMETER;
-    if (commandDataSz > 4096)
+    if (commandDataSz > SSCP_MAX_PAYLOAD_SZ)
         return SSCP_ERR_COMMAND_TOO_LONG;
+    if (maxCommandSz < SSCP_COMMAND_HEADROOM + commandDataSz + SSCP_COMMAND_TAILROOM)
+        return SSCP_ERR_INVALID_PARAMETER;
 
-    maxCommandSz = 4 + 1 + 2 + 2 + commandDataSz + 32 + 16 + 16; /* 16 for padding + 16 for IV */
-
-    /* Allocated the two buffers */
-    command = calloc(1, maxCommandSz);
-    if (command == NULL)
-        return SSCP_ERR_OUT_OF_MEMORY;
-    response = calloc(1, maxResponseSz);
-    if (response == NULL)
-    {
-        free(command);
-        return SSCP_ERR_OUT_OF_MEMORY;
-    }
+    *actCommandSz = 0;
 
     /* Prepare the command */
     command[commandSz++] = (BYTE)(ctx->counter >> 24);
@@ -186,13 +154,9 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     command[commandSz++] = (BYTE)(commandCode);
     command[commandSz++] = (BYTE)(commandDataSz >> 8);
     command[commandSz++] = (BYTE)(commandDataSz);
-    if (commandData != NULL)
-    {
-        memcpy(&command[commandSz], commandData, commandDataSz);
-        commandSz += commandDataSz;
-    }
+    commandSz += commandDataSz; /* Data is already there */
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Command=");
         for (i = 0; i < commandSz; i++)
@@ -212,13 +176,13 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     }
 
     /* Compute the signature of the command */
-    if (!SSCP_HMAC(ctx->sessionKeySignAB, command, commandSz, &command[commandSz]))
+    if (!SSCP_HMACEx(&ctx->sessionSignAB, command, commandSz, &command[commandSz]))
     {
         rc = SSCP_ERR_INTERNAL_FAILURE;
         goto failed;
     }
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Sign=   ");
         for (i = 0; i < 32; i++)
@@ -228,24 +192,13 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
 
     commandSz += 32;
 
-    /* Padd the command to reach a multiple of 16 bytes */
-    if (SSCP_SELFTEST)
-    {
-        static const BYTE PADD[4] = { 0xBA, 0x40, 0x5E, 0xDD };
-        i = 0;
-        while ((commandSz % 16) != 0)
-            command[commandSz++] = PADD[i++ % sizeof(PADD)];
-    }
-    else
-    {
-        /* Standard padding */
-        if ((commandSz % 16) != 0)
-            command[commandSz++] = 0x80;
-        while ((commandSz % 16) != 0)
-            command[commandSz++] = 0x00;
-    }
+    /* Padd the command to reach a multiple of 16 bytes (standard padding) */
+    if ((commandSz % 16) != 0)
+        command[commandSz++] = 0x80;
+    while ((commandSz % 16) != 0)
+        command[commandSz++] = 0x00;
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Padded= ");
         for (i = 0; i < commandSz; i++)
@@ -253,29 +206,21 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
         SSCP_Trace("\n");
     }
 
-    if (SSCP_SELFTEST)
+    /* Randomize the Init Vector */
+    if (!SSCP_GetRandomEx(ctx, initVector, 16))
     {
-        static const BYTE IV[16] = { 0x7C, 0x3D, 0xE3, 0xF3, 0xE1, 0x91, 0xD3, 0xCD, 0x3A, 0x09, 0x3E, 0x64, 0x3B, 0xF0, 0x35, 0xCE };
-        memcpy(initVector, IV, 16);
-    }
-    else
-    {
-        /* Randomize the Init Vector */
-        if (!SSCP_GetRandom(initVector, 16))
-        {
-            rc = SSCP_ERR_INTERNAL_FAILURE;
-            goto failed;
-        }
+        rc = SSCP_ERR_INTERNAL_FAILURE;
+        goto failed;
     }
 
     /* Encrypt the command */
-    if (!SSCP_Cipher(ctx->sessionKeyCipherAB, initVector, command, commandSz))
+    if (!SSCP_CipherEx(&ctx->sessionCipherAB, initVector, command, commandSz))
     {
         rc = SSCP_ERR_INTERNAL_FAILURE;
         goto failed;
     }
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Crypted=");
         for (i = 0; i < commandSz; i++)
@@ -287,7 +232,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     memcpy(&command[commandSz], initVector, 16);
     commandSz += 16;
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Sending=");
         for (i = 0; i < commandSz; i++)
@@ -295,42 +240,31 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
         SSCP_Trace("\n");
     }
 
+    *actCommandSz = commandSz;
+    return SSCP_SUCCESS;
 
-    if (SSCP_SELFTEST)
-    {
-        static const BYTE R[] = {
-            0xEE, 0x3F, 0x77, 0x22, 0x6E, 0x77, 0xEF, 0xF3, 0x05, 0x89, 0xBB, 0x40, 0xF1, 0xA1, 0x7C, 0x8E,
-            0x6D, 0x7B, 0x5D, 0x89, 0xFB, 0x6D, 0x86, 0xF2, 0x52, 0x04, 0xFC, 0x4D, 0x31, 0x80, 0x0F, 0x17,
-            0x7F, 0xED, 0xA6, 0x42, 0x00, 0x8F, 0x0A, 0x60, 0x37, 0x01, 0xC4, 0x34, 0xC8, 0x56, 0x9B, 0xA9,
-            0xEC, 0x89, 0xEC, 0xA7, 0xB6, 0x33, 0xF3, 0x35, 0x77, 0xCE, 0xC2, 0x4A, 0x74, 0x85, 0x98, 0x5E
-        };
-        memcpy(response, R, sizeof(R));
-        responseSz = sizeof(R);
-        rc = SSCP_SUCCESS;
-    }
-    else
-    {
-        /* Send the command (and get the response) */
-        BYTE retry;
+failed:
+    return rc;
+}
 
-        for (retry = 0; retry < SSCP_MAX_TIMEOUT_RETRY; retry++)
-        {
-            rc = SSCP_ExchangeRaw(ctx, ctx->address, SSCP_PROTOCOL_SECURE, command, commandSz, response, maxResponseSz, &responseSz);
-            if (rc == SSCP_SUCCESS)
-            {
-                if (retry > 0)
-                    ctx->stats.errorCount++; /* We have recovered this error */
-                break;
-            }
-            if ((rc != SSCP_ERR_COMM_RECV_MUTE) && (rc != SSCP_ERR_COMM_RECV_STOPPED))
-                break; /* Not a timeout error? So fatal! */
-        }
-    }
+/**
+ * \brief decipher and check the payload of a SSCP_PROTOCOL_SECURE response frame
+ *
+ * The response is deciphered in place. On success, the response data are copied
+ * into responseData, and left at response[8] as well.
+ */
+LONG SSCP_ExchangeVerify(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE response[], DWORD responseSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+    BYTE initVector[16] = { 0 };
+    DWORD i;
+    LONG rc;
 
-    if (rc)
-        goto failed;
+    if (ctx == NULL)
+        return SSCP_ERR_INVALID_CONTEXT;
+    if (response == NULL)
+        return SSCP_ERR_INVALID_PARAMETER;
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Received=");
         for (i = 0; i < responseSz; i++)
@@ -350,13 +284,38 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     memcpy(initVector, &response[responseSz], 16);
 
     /* Decrypt the response */
-    if (!SSCP_Decipher(ctx->sessionKeyCipherBA, initVector, response, responseSz))
+    if (!SSCP_DecipherEx(&ctx->sessionCipherBA, initVector, response, responseSz))
     {
         rc = SSCP_ERR_INTERNAL_FAILURE;
         goto failed;
     }
 
-    if (SSCP_DEBUG_EXCHANGE)
+    return SSCP_ExchangeVerifyPlain(ctx, commandHeader, response, responseSz, responseData, maxResponseDataSz, actResponseDataSz);
+
+failed:
+    return rc;
+}
+
+/**
+ * \brief check the deciphered payload of a SSCP_PROTOCOL_SECURE response frame (IV removed)
+ *
+ * On success, the response data are copied into responseData, and left at response[8] as well.
+ */
+LONG SSCP_ExchangeVerifyPlain(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE response[], DWORD responseSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+    BYTE commandType = (BYTE)(commandHeader >> 16);
+    WORD commandCode = (WORD)(commandHeader);
+    BYTE responseCode;
+    DWORD t, i;
+    LONG rc;
+
+    if (responseSz < 8)
+    {
+        rc = SSCP_ERR_WRONG_RESPONSE_LENGTH;
+        goto failed;
+    }
+
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Decrypted=");
         for (i = 0; i < responseSz; i++)
@@ -381,7 +340,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     else
     {
         /* Counter has not been incremented by the device */
-        if (SSCP_DEBUG_EXCHANGE)
+        if (ctx->settings.debugExchange)
             SSCP_Trace("Invalid response, current counter is %d, received %d\n", ctx->counter, t);
         rc = SSCP_ERR_WRONG_RESPONSE_COUNTER;
         goto failed;
@@ -390,7 +349,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     /* Verify the opcode */
     if ((response[4] != (BYTE)(commandCode >> 8)) || (response[5] != (BYTE)(commandCode)))
     {
-        if (SSCP_DEBUG_EXCHANGE)
+        if (ctx->settings.debugExchange)
             SSCP_Trace("Invalid response, sent command %04X, received %02X%02X\n", commandCode, response[4], response[5]);
         rc = SSCP_ERR_WRONG_RESPONSE_COMMAND;
         goto failed;
@@ -404,7 +363,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     /* Is the length correct? */
     if ((responseSz < 4 + 2 + 2 + t + 2 + 32) || (responseSz > 4 + 2 + 2 + t + 2 + 32 + 16))
     {
-        if (SSCP_DEBUG_EXCHANGE)
+        if (ctx->settings.debugExchange)
             SSCP_Trace("Invalid response, expected length >= %d and < %d, received %d\n", 4 + 2 + 2 + t + 2 + 32, 4 + 2 + 2 + t + 2 + 32 + 16, responseSz);
         rc = SSCP_ERR_WRONG_RESPONSE_FORMAT;
         goto failed;
@@ -412,7 +371,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
 
     responseSz = 8 + t + 2;
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Counter+Data+Status=");
         for (i = 0; i < responseSz; i++)
@@ -423,9 +382,9 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     /* Check the HMAC */
     {
         BYTE hmac[32];
-        if (!SSCP_HMAC(ctx->sessionKeySignBA, response, responseSz, hmac))
+        if (!SSCP_HMACEx(&ctx->sessionSignBA, response, responseSz, hmac))
         {
-            if (SSCP_DEBUG_EXCHANGE)
+            if (ctx->settings.debugExchange)
                 SSCP_Trace("Failed to verify HMAC in Exchange\n");
             rc = SSCP_ERR_INTERNAL_FAILURE;
             goto failed;
@@ -433,7 +392,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
 
         if (memcmp(hmac, &response[responseSz], 32))
         {
-            if (SSCP_DEBUG_EXCHANGE)
+            if (ctx->settings.debugExchange)
             {
                 SSCP_Trace("Wrong HMAC in Exchange\n");
                 SSCP_Trace("Received: ");
@@ -454,7 +413,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     /* Verify the status type */
     if (response[responseSz - 2] != commandType)
     {
-        if (SSCP_DEBUG_EXCHANGE)
+        if (ctx->settings.debugExchange)
             SSCP_Trace("Wrong Response Type after Exchange\n");
         rc = SSCP_ERR_WRONG_RESPONSE_TYPE;
         goto failed;
@@ -463,7 +422,7 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     /* Remember the status code */
     responseCode = response[responseSz - 1];
 
-    if (SSCP_DEBUG_EXCHANGE)
+    if (ctx->settings.debugExchange)
     {
         SSCP_Trace("Response=");
         for (i = 0; i < t; i++)
@@ -489,15 +448,9 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
         }
     }
 
-    /* Done with both buffers */
-    if (response != NULL)
-        free(response);
-    if (command != NULL)
-        free(command);
-
     if (responseCode != 0)
     {
-        if (SSCP_DEBUG_EXCHANGE)
+        if (ctx->settings.debugExchange)
             SSCP_Trace("Exchange returns error %02X\n", responseCode);
         return responseCode;
     }
@@ -505,13 +458,97 @@ LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData
     return SSCP_SUCCESS;
 
 failed:
-    if (response != NULL)
-        free(response);
-    if (command != NULL)
-        free(command);
     return rc;
 }
 
+/**
+ * \brief secure exchange, with the command data already in place
+ *
+ * The command data must be stored at command[SSCP_COMMAND_HEADROOM], and the buffer
+ * must be large enough to receive the HMAC, the padding and the IV after it
+ * (maxCommandSz >= SSCP_COMMAND_HEADROOM + commandDataSz + SSCP_COMMAND_TAILROOM).
+ * The content of the buffer is overwritten by the ciphered frame.
+ */
+LONG SSCP_ExchangeInPlace(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE command[], DWORD maxCommandSz, DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+    DWORD commandSz = 0;
+    const DWORD maxResponseSz = sizeof(ctx->rxBuffer);
+    DWORD responseSz = 0;
+    BYTE *response = NULL;
+    BYTE retry = 0;
+    DWORD startUs;
+    LONG rc;
+
+    if (ctx == NULL)
+        return SSCP_ERR_INVALID_CONTEXT;
+    if (SSCP_AsyncPending(ctx))
+        return SSCP_ERR_IN_PROGRESS;
+
+    /* The ciphering goes along with the transmission, see sscp-host-stream.c */
+    if (ctx->settings.pipeline)
+        return SSCP_ExchangePipelined(ctx, commandHeader, command, maxCommandSz, commandDataSz, responseData, maxResponseDataSz, actResponseDataSz);
+
+    rc = SSCP_ExchangePrepare(ctx, commandHeader, command, maxCommandSz, commandDataSz, &commandSz);
+    if (rc)
+        return rc;
+
+    /* The response is received in the context's own buffer */
+    response = ctx->rxBuffer;
+    startUs = SSCP_GetTickUs();
+
+    /* Send the command (and get the response), again as the retry policy says */
+    for (retry = 0; ; retry++)
+    {
+        rc = SSCP_ExchangeRaw(ctx, ctx->address, SSCP_PROTOCOL_SECURE, SSCP_TimeoutClass(commandHeader), command, commandSz, response, maxResponseSz, &responseSz);
+        if (rc == SSCP_SUCCESS)
+            break;
+        if (!SSCP_RetryWait(ctx, retry, rc))
+            break;
+    }
+    SSCP_RetryEnd(ctx, retry, rc);
+
+    if (rc == SSCP_SUCCESS)
+        rc = SSCP_ExchangeVerify(ctx, commandHeader, response, responseSz, responseData, maxResponseDataSz, actResponseDataSz);
+
+    SSCP_StatsRecord(ctx, commandHeader, rc, retry, SSCP_GetTickUs() - startUs);
+    return rc;
+}
+
+LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData[], DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+    if (ctx == NULL)
+        return SSCP_ERR_INVALID_CONTEXT;
+    if ((commandData == NULL) && (commandDataSz > 0))
+        return SSCP_ERR_INVALID_PARAMETER;
+    if (commandDataSz > SSCP_MAX_PAYLOAD_SZ)
+        return SSCP_ERR_COMMAND_TOO_LONG;
+
+    /* The queue runs: only its worker touches the context */
+    if (SSCP_QueueForeign(ctx))
+    {
+        SSCP_REQUEST_ST request;
+        LONG rc;
+
+        memset(&request, 0, sizeof(request));
+        request.commandHeader = commandHeader;
+        request.commandData = commandData;
+        request.commandDataSz = commandDataSz;
+        request.responseData = responseData;
+        request.maxResponseDataSz = maxResponseDataSz;
+
+        rc = SSCP_QueueCall(ctx, &request);
+        if (actResponseDataSz != NULL)
+            *actResponseDataSz = request.actResponseDataSz;
+        return rc;
+    }
+
+    /* Copy the command data into the context's own buffer, leaving room for the header */
+    if (commandDataSz > 0)
+        memmove(&ctx->txBuffer[SSCP_COMMAND_HEADROOM], commandData, commandDataSz);
+
+    return SSCP_ExchangeInPlace(ctx, commandHeader, ctx->txBuffer, sizeof(ctx->txBuffer), commandDataSz, responseData, maxResponseDataSz, actResponseDataSz);
+}
+
 LONG SSCP_Exchange_NoDataIn(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
 {
     return SSCP_Exchange(ctx, commandHeader, NULL, 0, responseData, maxResponseDataSz, actResponseDataSz);
@@ -0,0 +1,392 @@
+/**
+ * @file sscp-host-fleet.c
+ * @brief Authentication of all the readers at once, at start-up.
+ *
+ * The readers on different ports are authenticated at the same time, each port by
+ * the worker of its request queue (see sscp-host-queue.c); the queues that are not
+ * running are started for the duration of the call.
+ *
+ * The readers of a same port share the line, and only one frame may be on its way
+ * at a time. They go through the steps together: the 1st step of the authentication
+ * is exchanged with all of them, then the 2nd one. While a reader works on its
+ * frame, the host checks the response of the previous reader and computes what goes
+ * next, so that only the wire and the readers remain between two frames.
+ *
+ * The session keys only depend on the 1st step: those of all the readers of a port
+ * are derived together (see SSCP_DeriveSessionKeys()) while the first reader works
+ * on its 2nd step, and only become the session of a reader once it has acknowledged.
+ *
+ * A reader that does not answer still costs a setup timeout at each step it is
+ * expected at; SSCP_SetTimeoutProfile() may shorten it for the bring-up.
+ */
+#include "sscp-host_i.h"
+
+/* Where a target is, across the steps */
+typedef struct
+{
+	SSCP_AUTH_TARGET_ST* target;
+	SSCP_AUTH_STATE_ST auth;
+	BYTE response[128];
+	DWORD responseSz;
+	BOOL concluded;
+} SSCP_FLEET_READER_ST;
+
+/* The targets of a port, authenticated by its worker */
+typedef struct
+{
+	SSCP_PORT_ST* port;
+	SSCP_FLEET_READER_ST* readers;
+	DWORD readerCount;
+	DWORD startUs;
+	BOOL ownQueue; /* The queue has been started for this call */
+	SSCP_REQUEST_ST request;
+} SSCP_FLEET_GROUP_ST;
+
+static void SSCP_FleetConclude(SSCP_FLEET_GROUP_ST* group, SSCP_FLEET_READER_ST* reader, LONG rc)
+{
+	reader->target->result = rc;
+	reader->target->elapsedUs = SSCP_GetTickUs() - group->startUs;
+	reader->concluded = TRUE;
+
+	/* Nothing of the authentication is needed anymore, the session keys included */
+	memset(&reader->auth, 0, sizeof(reader->auth));
+}
+
+/* Check the response to the 1st step of a reader, and prepare its 2nd step */
+static void SSCP_FleetContinue(SSCP_FLEET_GROUP_ST* group, SSCP_FLEET_READER_ST* reader)
+{
+	LONG rc;
+
+	if (reader->concluded)
+		return;
+
+	rc = SSCP_AuthenticateContinue(reader->target->ctx, &reader->auth, reader->response, reader->responseSz);
+	if (rc)
+		SSCP_FleetConclude(group, reader, rc);
+}
+
+/* The session keys of the readers still in the run, SSCP_DERIVE_LANES at a time */
+static void SSCP_FleetDerive(SSCP_FLEET_GROUP_ST* group, SSCP_FLEET_READER_ST* reader)
+{
+	SSCP_SESSION_DERIVATION_ST items[SSCP_DERIVE_LANES];
+	SSCP_FLEET_READER_ST* lanes[SSCP_DERIVE_LANES];
+	DWORD itemCount, i, j;
+
+	(void) reader; /* All of them */
+
+	for (i = 0; i < group->readerCount; )
+	{
+		for (itemCount = 0; (i < group->readerCount) && (itemCount < SSCP_DERIVE_LANES); i++)
+		{
+			SSCP_FLEET_READER_ST* candidate = &group->readers[i];
+
+			if (candidate->concluded)
+				continue;
+
+			items[itemCount].cache = candidate->target->ctx->keyCache;
+			items[itemCount].authKeyValue = candidate->auth.authKeyValue;
+			items[itemCount].rndB = candidate->auth.rndB;
+			items[itemCount].sessionKeys = candidate->auth.sessionKeys;
+			lanes[itemCount++] = candidate;
+		}
+
+		/* Otherwise, SSCP_AuthenticateEnd() derives them one by one */
+		if ((itemCount == 0) || !SSCP_DeriveSessionKeys(items, itemCount, lanes[0]->target->ctx->settings.debugCrypto))
+			continue;
+
+		for (j = 0; j < itemCount; j++)
+			lanes[j]->auth.derived = TRUE;
+	}
+}
+
+/* The 2nd step of a reader has been acknowledged */
+static void SSCP_FleetEnd(SSCP_FLEET_GROUP_ST* group, SSCP_FLEET_READER_ST* reader)
+{
+	if (reader->concluded)
+		return;
+
+	SSCP_FleetConclude(group, reader, SSCP_AuthenticateEnd(reader->target->ctx, &reader->auth));
+}
+
+/* The host's part of a step, run while the next reader works on its frame */
+#define SSCP_FLEET_CONTINUE 0 /* SSCP_FleetContinue() */
+#define SSCP_FLEET_DERIVE 1 /* SSCP_FleetDerive() */
+#define SSCP_FLEET_END 2 /* SSCP_FleetEnd() */
+
+/*
+ * Send the command of the step to a reader, run the host's part of the previous one meanwhile, then get the response.
+ * The host's part is called directly rather than through a pointer, so that the stack report bounds each of them.
+ */
+static void SSCP_FleetStep(SSCP_FLEET_GROUP_ST* group, SSCP_FLEET_READER_ST* reader, SSCP_FLEET_READER_ST* previous, BYTE meanwhile)
+{
+	SSCP_CTX_ST* ctx = reader->target->ctx;
+	DWORD sentAt;
+	LONG rc;
+
+	rc = SSCP_ExchangeRawSend(ctx, ctx->address, SSCP_PROTOCOL_AUTHENTICATE, SSCP_TIMEOUT_CLASS_SETUP, reader->auth.command, reader->auth.commandSz, &sentAt);
+
+	/* The reader is busy with its command: time to deal with the previous one */
+	if (previous != NULL)
+	{
+		switch (meanwhile)
+		{
+			case SSCP_FLEET_CONTINUE:
+				SSCP_FleetContinue(group, previous);
+			break;
+			case SSCP_FLEET_DERIVE:
+				SSCP_FleetDerive(group, previous);
+			break;
+			default:
+				SSCP_FleetEnd(group, previous);
+			break;
+		}
+	}
+
+	if (rc == SSCP_SUCCESS)
+		rc = SSCP_ExchangeRawRecv(ctx, SSCP_TIMEOUT_CLASS_SETUP, reader->auth.commandSz, sentAt, reader->response, sizeof(reader->response), &reader->responseSz);
+
+	if (rc)
+		SSCP_FleetConclude(group, reader, rc);
+}
+
+/* Job of the worker of a port: the readers of the group through both steps */
+static LONG SSCP_FleetJob(SSCP_CTX_ST* ctx, void* userData)
+{
+	SSCP_FLEET_GROUP_ST* group = (SSCP_FLEET_GROUP_ST*) userData;
+	SSCP_FLEET_READER_ST* previous;
+	DWORD i;
+
+	(void) ctx;
+
+	/* 1st step */
+	/* -------- */
+	previous = NULL;
+	for (i = 0; i < group->readerCount; i++)
+	{
+		SSCP_FLEET_READER_ST* reader = &group->readers[i];
+		LONG rc;
+
+		rc = SSCP_AuthenticateBegin(reader->target->ctx, &reader->auth, reader->target->authKeyValue);
+		if (rc)
+		{
+			SSCP_FleetConclude(group, reader, rc);
+			continue;
+		}
+
+		SSCP_FleetStep(group, reader, previous, SSCP_FLEET_CONTINUE);
+		previous = reader;
+	}
+	if (previous != NULL)
+		SSCP_FleetContinue(group, previous);
+
+	/* 2nd step */
+	/* -------- */
+	previous = NULL;
+	for (i = 0; i < group->readerCount; i++)
+	{
+		SSCP_FLEET_READER_ST* reader = &group->readers[i];
+
+		if (reader->concluded)
+			continue;
+
+		/* While the first reader checks hA, the session keys of all are derived */
+		if (previous == NULL)
+			SSCP_FleetStep(group, reader, reader, SSCP_FLEET_DERIVE);
+		else
+			SSCP_FleetStep(group, reader, previous, SSCP_FLEET_END);
+		previous = reader;
+	}
+	if (previous != NULL)
+		SSCP_FleetEnd(group, previous);
+
+	return SSCP_SUCCESS;
+}
+
+/* Targets of a pass: with a memory pool, each table of the pass must fit in a block */
+static DWORD SSCP_FleetPassSize(DWORD targetCount)
+{
+	size_t maxSize = SSCP_MemMaxSize();
+
+	if (targetCount > maxSize / sizeof(SSCP_FLEET_READER_ST))
+		targetCount = (DWORD)(maxSize / sizeof(SSCP_FLEET_READER_ST));
+	if (targetCount > maxSize / sizeof(SSCP_FLEET_GROUP_ST))
+		targetCount = (DWORD)(maxSize / sizeof(SSCP_FLEET_GROUP_ST));
+
+	return targetCount;
+}
+
+/* The targets of a pass, all their ports at work at the same time */
+static LONG SSCP_FleetPass(SSCP_AUTH_TARGET_ST targets[], DWORD targetCount, DWORD startUs)
+{
+	SSCP_FLEET_GROUP_ST* groups;
+	SSCP_FLEET_READER_ST* readers;
+	DWORD groupCount = 0;
+	DWORD i, j, k;
+
+	groups = SSCP_MemAlloc(targetCount * sizeof(SSCP_FLEET_GROUP_ST));
+	readers = SSCP_MemAlloc(targetCount * sizeof(SSCP_FLEET_READER_ST));
+	if ((groups == NULL) || (readers == NULL))
+	{
+		SSCP_MemFree(groups);
+		SSCP_MemFree(readers);
+		return SSCP_ERR_OUT_OF_MEMORY;
+	}
+
+	/* A group per port, the readers of a group next to each other, in the order of the targets */
+	for (i = 0; i < targetCount; i++)
+	{
+		for (j = 0; j < groupCount; j++)
+			if (groups[j].port == targets[i].ctx->port)
+				break;
+		if (j == groupCount)
+			groups[groupCount++].port = targets[i].ctx->port;
+		groups[j].readerCount++;
+	}
+	k = 0;
+	for (j = 0; j < groupCount; j++)
+	{
+		groups[j].readers = &readers[k];
+		groups[j].startUs = startUs;
+		k += groups[j].readerCount;
+		groups[j].readerCount = 0;
+	}
+	for (i = 0; i < targetCount; i++)
+	{
+		for (j = 0; j < groupCount; j++)
+			if (groups[j].port == targets[i].ctx->port)
+				break;
+		groups[j].readers[groups[j].readerCount++].target = &targets[i];
+	}
+
+	/* All the ports at work, then wait for them */
+	for (j = 0; j < groupCount; j++)
+	{
+		SSCP_CTX_ST* ctx = groups[j].readers[0].target->ctx;
+		LONG rc = SSCP_SUCCESS;
+
+		if (ctx->port->queue == NULL)
+		{
+			rc = SSCP_QueueStart(ctx);
+			groups[j].ownQueue = (rc == SSCP_SUCCESS);
+		}
+
+		if (rc == SSCP_SUCCESS)
+		{
+			groups[j].request.job = SSCP_FleetJob;
+			groups[j].request.userData = &groups[j];
+			rc = SSCP_QueuePost(ctx, &groups[j].request);
+		}
+
+		if (rc)
+		{
+			for (k = 0; k < groups[j].readerCount; k++)
+				SSCP_FleetConclude(&groups[j], &groups[j].readers[k], rc);
+			groups[j].readerCount = 0; /* Nothing to wait for */
+		}
+	}
+
+	for (j = 0; j < groupCount; j++)
+	{
+		SSCP_CTX_ST* ctx = groups[j].readers[0].target->ctx;
+
+		if (groups[j].readerCount > 0)
+			SSCP_QueueWait(ctx, &groups[j].request, SSCP_ASYNC_INFINITE);
+		if (groups[j].ownQueue)
+			SSCP_QueueStop(ctx);
+	}
+
+	/* The random challenges are of no use anymore */
+	memset(readers, 0, targetCount * sizeof(SSCP_FLEET_READER_ST));
+	SSCP_MemFree(readers);
+	SSCP_MemFree(groups);
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Authenticate a set of readers, as fast as their ports allow.
+ *
+ * Each target is authenticated as SSCP_Authenticate() would (the default key if its
+ * @p authKeyValue is NULL). The readers on different ports are brought up at the same
+ * time, by the workers of the ports' request queues; the readers of a same port (the
+ * readers of a bus) go through the 1st step one after the other, then through the 2nd
+ * one, the host's computations overlapping with the readers' ones.
+ *
+ * The request queues that are not running are started for the duration of the call,
+ * and stopped before it returns; those that run are left running, the other requests
+ * posted to them are run before or after the authentications, not in between.
+ *
+ * The state of the authentications, a little over 300 bytes per target, is allocated
+ * for the duration of the call. With a memory pool (SSCP_SetMemoryPool()), its tables
+ * must each fit in a block: the targets then go by passes of as many as a block holds
+ * (see SSCP_MemoryBlockSize()), the ports of a pass at the same time, and the passes
+ * one after the other, each one with the request queues it needs.
+ *
+ * Each target receives its outcome, and the time from the call to its outcome.
+ *
+ * @param[in,out] targets Readers to authenticate, each one with its own context
+ *                (several targets must not share a context).
+ * @param[in] targetCount Number of targets, up to SSCP_AUTH_MAX_TARGETS.
+ * @param[out] successCount Number of targets that have been authenticated (may be NULL).
+ *
+ * @return SSCP_SUCCESS if every target has been authenticated, otherwise the result
+ *         of the first target that has not been, or an SSCP_ERR_* code if none has
+ *         been tried.
+ *
+ * @retval SSCP_ERR_INVALID_PARAMETER @p targets is NULL, a target has no context, or
+ *         @p targetCount is above SSCP_AUTH_MAX_TARGETS.
+ * @retval SSCP_ERR_OUT_OF_MEMORY Allocation failure: the targets of the pass that
+ *         could not be allocated, and of the passes after it, are left untried.
+ */
+LONG SSCP_AuthenticateAll(SSCP_AUTH_TARGET_ST targets[], DWORD targetCount, DWORD* successCount)
+{
+	DWORD successes = 0;
+	LONG firstFailure = SSCP_SUCCESS;
+	DWORD startUs = SSCP_GetTickUs();
+	DWORD passSize, i, j;
+
+	if (successCount != NULL)
+		*successCount = 0;
+
+	if ((targets == NULL) && (targetCount > 0))
+		return SSCP_ERR_INVALID_PARAMETER;
+	if (targetCount > SSCP_AUTH_MAX_TARGETS)
+		return SSCP_ERR_INVALID_PARAMETER;
+	for (i = 0; i < targetCount; i++)
+	{
+		if (targets[i].ctx == NULL)
+			return SSCP_ERR_INVALID_PARAMETER;
+		targets[i].result = SSCP_ERR_IN_PROGRESS;
+		targets[i].elapsedUs = 0;
+	}
+
+	if (targetCount == 0)
+		return SSCP_SUCCESS;
+
+	passSize = SSCP_FleetPassSize(targetCount);
+	for (i = 0; i < targetCount; i += passSize)
+	{
+		DWORD count = (targetCount - i < passSize) ? targetCount - i : passSize;
+
+		if ((passSize == 0) || (SSCP_FleetPass(&targets[i], count, startUs) != SSCP_SUCCESS))
+		{
+			/* The targets left can't be tried */
+			for (j = i; j < targetCount; j++)
+				targets[j].result = SSCP_ERR_OUT_OF_MEMORY;
+			break;
+		}
+	}
+
+	for (i = 0; i < targetCount; i++)
+	{
+		if (targets[i].result == SSCP_SUCCESS)
+			successes++;
+		else if (firstFailure == SSCP_SUCCESS)
+			firstFailure = targets[i].result;
+	}
+
+	if (successCount != NULL)
+		*successCount = successes;
+
+	return firstFailure;
+}
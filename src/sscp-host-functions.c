@@ -21,7 +21,8 @@
  * @brief Enable extra trace output during SSCP_Authenticate().
  *
  * When set to TRUE, the authentication routine prints raw exchanged bytes and
- * intermediate values (A, B, nonces, HMAC checks).
+ * intermediate values (A, B, nonces, HMAC checks). This is the default of the
+ * contexts allocated afterwards, see SSCP_SetSettings().
  *
  * @warning Do not enable this in production builds: it can leak sensitive material
  *          to logs (even if keys are not printed, traffic and nonces still help
@@ -29,140 +30,53 @@
  */
 BOOL SSCP_DEBUG_AUTHENTICATE = FALSE;
 
-/**
- * @brief Perform SSCP mutual authentication and derive session keys.
- *
- * This function runs the SSCP mutual authentication procedure between the host
- * (control panel) and the reader, then derives the session keys used to protect
- * subsequent exchanges (HMAC and optional AES encryption, depending on the SSCP
- * profile/commands used).
- *
- * High-level sequence:
- * - The host initiates authentication by sending a fresh random challenge (rA).
- * - The reader replies with its own random challenge (rB) and an authentication
- *   proof (typically an HMAC computed with the shared long-term key).
- * - The host verifies the reader's proof, then replies with its own proof
- *   (typically an HMAC over the transcript and/or rB).
- * - Both sides derive session keys from the established material and reset/
- *   initialize the session state (counters, flags, etc.).
- *
- * On success, the SSCP context is updated with:
- * - Session keys (encryption/authentication)
- * - Session counters (typically reset to 1)
- * - Internal flags indicating an authenticated session is active
- *
- * @param[in,out] ctx
- *   SSCP context. Must be initialized before calling this function.
- *   On success, it is updated with derived session data and keys.
- *
- * @param[in] authKeyValue
- *   16-byte long-term authentication key shared with the reader.
- *   This key is not a session key: it is the static key used to authenticate
- *   and bootstrap the session.
- *   If this parameter is NULL, the default (transport) key is used.
- *
- * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
- *
- * @note This function performs network/transport exchanges with the reader.
- *       It may take a noticeable amount of time depending on the underlying
- *       transport and timeout configuration.
- *
- * @warning Never log or expose @p authKeyValue. If you enable debug traces for
- *          authentication, be aware that captured transcripts may help an attacker.
- */
-LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16])
-{
-	static const BYTE SSCP_DEFAULT_AUTH_KEY[16] = { 0xE7, 0x4A, 0x54, 0x0F, 0xA0, 0x7C, 0x4D, 0xB1, 0xB4, 0x64, 0x21, 0x12, 0x6D, 0xF7, 0xAD, 0x36 };	
-	BYTE command[256] = { 0 };
-	DWORD commandSz = 0;
-	BYTE response[256] = { 0 };
-	DWORD responseSz = 0;
-	BYTE rndA[16] = { 0 };
-	BYTE rndB[16] = { 0 };
-	BYTE rndAp[16] = { 0 };
-	BYTE A[4] = { 0 };
-	BYTE B[4] = { 0 };
-	BYTE hA[32] = { 0 };
-	BYTE hB[32] = { 0 };
-	LONG rc;
-	int offset;
+/* Default (transport) key of the readers */
+static const BYTE SSCP_DEFAULT_AUTH_KEY[16] = { 0xE7, 0x4A, 0x54, 0x0F, 0xA0, 0x7C, 0x4D, 0xB1, 0xB4, 0x64, 0x21, 0x12, 0x6D, 0xF7, 0xAD, 0x36 };
 
-	if (ctx == NULL)
-		return SSCP_ERR_INVALID_CONTEXT;
+/* 1st step of the authentication: draw rndA, and prepare the command */
+LONG SSCP_AuthenticateBegin(SSCP_CTX_ST* ctx, SSCP_AUTH_STATE_ST* auth, const BYTE authKeyValue[16])
+{
+	memset(auth, 0, sizeof(SSCP_AUTH_STATE_ST));
 
-	if (authKeyValue == NULL)
-		authKeyValue = SSCP_DEFAULT_AUTH_KEY;
-
-	if (SSCP_SELFTEST)
-	{
-		static const BYTE R[] = { 0x75, 0xCC, 0xF7, 0xB1, 0xF7, 0xFE, 0xA6, 0xF7, 0x58, 0x71, 0xFC, 0xF6, 0xDC, 0x75, 0x59, 0x23 };
-		memcpy(rndA, R, 16);
-	}
-	else
-	{
-		if (!SSCP_GetRandom(rndA, sizeof(rndA)))
-			return SSCP_ERR_INTERNAL_FAILURE;
-	}
+	auth->authKeyValue = (authKeyValue != NULL) ? authKeyValue : SSCP_DEFAULT_AUTH_KEY;
 
+	if (!SSCP_GetRandomEx(ctx, auth->rndA, sizeof(auth->rndA)))
+		return SSCP_ERR_INTERNAL_FAILURE;
 
-	/* 1st step */
-	/* -------- */
-	commandSz = 0;
-	command[commandSz++] = 0x00;
-	command[commandSz++] = 0x00;
-	memcpy(&command[commandSz], rndA, 16);
-	commandSz += 16;
+	auth->commandSz = 0;
+	auth->command[auth->commandSz++] = 0x00;
+	auth->command[auth->commandSz++] = 0x00;
+	memcpy(&auth->command[auth->commandSz], auth->rndA, 16);
+	auth->commandSz += 16;
 
-	if (SSCP_SELFTEST)
-	{
-		static const BYTE R[] = {
-			0x53, 0x77, 0x07, 0xAD, 0x48, 0x6F, 0x07, 0xAD, 0x75, 0xCC, 0xF7, 0xB1, 0xF7, 0xFE, 0xA6, 0xF7,
-			0x58, 0x71, 0xFC, 0xF6, 0xDC, 0x75, 0x59, 0x23, 0xC8, 0xEE, 0x7C, 0x37, 0x5C, 0x21, 0xEA, 0xC5,
-			0x1B, 0xD9, 0x7C, 0x51, 0xC6, 0x9F, 0x39, 0x5B, 0x69, 0xF6, 0x61, 0x77, 0x07, 0xD9, 0x44, 0x29,
-			0x40, 0xC3, 0x9B, 0xEB, 0xFA, 0x0B, 0x44, 0x59, 0xCE, 0xBF, 0x6C, 0xD5, 0xE6, 0x10, 0xEA, 0x1F,
-			0xF4, 0x4B, 0x34, 0x1E, 0x29, 0x16, 0x54, 0xA9
-		};
-
-		if (SSCP_DEBUG_AUTHENTICATE)
-		{
-			DWORD i;
-			SSCP_Trace("<");
-			for (i = 0; i < commandSz; i++)
-				SSCP_Trace("%02X", command[i]);
-			SSCP_Trace("\n");
-		}
+	return SSCP_SUCCESS;
+}
 
-		memcpy(response, R, sizeof(R));
-		responseSz = sizeof(R);
+/* Check the response to the 1st step, and prepare the command of the 2nd one */
+LONG SSCP_AuthenticateContinue(SSCP_CTX_ST* ctx, SSCP_AUTH_STATE_ST* auth, const BYTE response[], DWORD responseSz)
+{
+	BYTE B[4] = { 0 };
+	BYTE rndAp[16] = { 0 };
+	BYTE hA[32] = { 0 };
+	BYTE hB[32] = { 0 };
+	int offset;
 
-		if (SSCP_DEBUG_AUTHENTICATE)
-		{
-			DWORD i;
-			SSCP_Trace(">");
-			for (i = 0; i < responseSz; i++)
-				SSCP_Trace("%02X", response[i]);
-			SSCP_Trace("\n");
-		}
-	}
-	else
-	{
-		rc = SSCP_ExchangeRaw(ctx, ctx->address, SSCP_PROTOCOL_AUTHENTICATE, command, commandSz, response, sizeof(response), &responseSz);
-		if (rc)
-			return rc;
-	}
+	/* B, A, RndA', RndB, then hB */
+	if (responseSz < 4 + 4 + 16 + 16 + 32)
+		return SSCP_ERR_WRONG_RESPONSE_LENGTH;
 
 	offset = 0;
 	memcpy(B, &response[offset], 4);
 	offset += 4;
-	memcpy(A, &response[offset], 4);
+	memcpy(auth->A, &response[offset], 4);
 	offset += 4;
 	memcpy(rndAp, &response[offset], 16);
 	offset += 16;
-	memcpy(rndB, &response[offset], 16);
+	memcpy(auth->rndB, &response[offset], 16);
 	offset += 16;
 	/* Offset is now on hB */
 
-	if (SSCP_DEBUG_AUTHENTICATE)
+	if (ctx->settings.debugAuthenticate)
 	{
 		DWORD i;
 		SSCP_Trace("B ");
@@ -171,7 +85,7 @@ LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16])
 		SSCP_Trace("\n");
 		SSCP_Trace("A ");
 		for (i = 0; i < 4; i++)
-			SSCP_Trace("%02X", A[i]);
+			SSCP_Trace("%02X", auth->A[i]);
 		SSCP_Trace("\n");
 		SSCP_Trace("RndA' ");
 		for (i = 0; i < 16; i++)
@@ -179,18 +93,18 @@ LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16])
 		SSCP_Trace("\n");
 		SSCP_Trace("RndB  ");
 		for (i = 0; i < 16; i++)
-			SSCP_Trace("%02X", rndB[i]);
+			SSCP_Trace("%02X", auth->rndB[i]);
 		SSCP_Trace("\n");
 	}
 
 	/* Compute hB on our side */
-	if (!SSCP_HMAC(authKeyValue, response, offset, hB))
+	if (!SSCP_KeyCacheHMAC(ctx->keyCache, auth->authKeyValue, response, offset, hB))
 		return SSCP_ERR_INTERNAL_FAILURE;
 
 	/* Compare with received hB */
 	if (memcmp(hB, &response[offset], 32))
 	{
-		if (SSCP_DEBUG_AUTHENTICATE)
+		if (ctx->settings.debugAuthenticate)
 		{
 			DWORD i;
 			SSCP_Trace("Wrong HCMAC in Authenticate\n");
@@ -207,41 +121,39 @@ LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16])
 		return SSCP_ERR_WRONG_RESPONSE_SIGNATURE;
 	}
 
-	/* 2nd step */
-	/* -------- */
-	commandSz = 0;
-	memcpy(&command[commandSz], A, 4);
-	commandSz += 4;
-	memcpy(&command[commandSz], rndB, 16);
-	commandSz += 16;
+	auth->commandSz = 0;
+	memcpy(&auth->command[auth->commandSz], auth->A, 4);
+	auth->commandSz += 4;
+	memcpy(&auth->command[auth->commandSz], auth->rndB, 16);
+	auth->commandSz += 16;
 
 	/* Compute hA */
-	if (!SSCP_HMAC(authKeyValue, command, commandSz, hA))
+	if (!SSCP_KeyCacheHMAC(ctx->keyCache, auth->authKeyValue, auth->command, auth->commandSz, hA))
 		return SSCP_ERR_INTERNAL_FAILURE;
 
 	/* Append hA to the command */
-	memcpy(&command[commandSz], hA, 32);
-	commandSz += 32;
-
-	if (SSCP_SELFTEST)
-	{
-		static const BYTE R[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x08 };
-		memcpy(response, R, sizeof(R));
-		responseSz = sizeof(R);
-	}
-	else
-	{
-		rc = SSCP_ExchangeRaw(ctx, ctx->address, 0x20, command, commandSz, response, sizeof(response), &responseSz);
-		if (rc)
-			return rc;
-	}
+	memcpy(&auth->command[auth->commandSz], hA, 32);
+	auth->commandSz += 32;
 
-	/* Expected response is an ACK */
+	return SSCP_SUCCESS;
+}
 
+/* The 2nd step has been acknowledged: the session starts */
+LONG SSCP_AuthenticateEnd(SSCP_CTX_ST* ctx, SSCP_AUTH_STATE_ST* auth)
+{
 	/* Compute session keys */
 	/* -------------------- */
-	if (!SSCP_ComputeSessionKeys(ctx, authKeyValue, rndA, rndB))
+	/* SSCP_AuthenticateAll() derives them ahead, while the readers work */
+	if (auth->derived)
+	{
+		SSCP_SetSessionKeys(ctx, auth->sessionKeys);
+		memset(auth->sessionKeys, 0, sizeof(auth->sessionKeys));
+		auth->derived = FALSE;
+	}
+	else if (!SSCP_ComputeSessionKeys(ctx, auth->authKeyValue, auth->rndA, auth->rndB))
+	{
 		return SSCP_ERR_INTERNAL_FAILURE;
+	}
 
 	/* Initialize the counter to 1 */
 	ctx->counter = 1;
@@ -252,6 +164,92 @@ LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16])
 	return SSCP_SUCCESS;
 }
 
+/* SSCP_Authenticate() for the worker of the queue, the key (or NULL) as userData */
+static LONG SSCP_Authenticate_Job(SSCP_CTX_ST* ctx, void* userData)
+{
+	return SSCP_Authenticate(ctx, (const BYTE*) userData);
+}
+
+/**
+ * @brief Perform SSCP mutual authentication and derive session keys.
+ *
+ * This function runs the SSCP mutual authentication procedure between the host
+ * (control panel) and the reader, then derives the session keys used to protect
+ * subsequent exchanges (HMAC and optional AES encryption, depending on the SSCP
+ * profile/commands used).
+ *
+ * High-level sequence:
+ * - The host initiates authentication by sending a fresh random challenge (rA).
+ * - The reader replies with its own random challenge (rB) and an authentication
+ *   proof (typically an HMAC computed with the shared long-term key).
+ * - The host verifies the reader's proof, then replies with its own proof
+ *   (typically an HMAC over the transcript and/or rB).
+ * - Both sides derive session keys from the established material and reset/
+ *   initialize the session state (counters, flags, etc.).
+ *
+ * On success, the SSCP context is updated with:
+ * - Session keys (encryption/authentication)
+ * - Session counters (typically reset to 1)
+ * - Internal flags indicating an authenticated session is active
+ *
+ * @param[in,out] ctx
+ *   SSCP context. Must be initialized before calling this function.
+ *   On success, it is updated with derived session data and keys.
+ *
+ * @param[in] authKeyValue
+ *   16-byte long-term authentication key shared with the reader.
+ *   This key is not a session key: it is the static key used to authenticate
+ *   and bootstrap the session.
+ *   If this parameter is NULL, the default (transport) key is used.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
+ *
+ * @note This function performs network/transport exchanges with the reader.
+ *       It may take a noticeable amount of time depending on the underlying
+ *       transport and timeout configuration.
+ *
+ * @warning Never log or expose @p authKeyValue. If you enable debug traces for
+ *          authentication, be aware that captured transcripts may help an attacker.
+ */
+LONG SSCP_Authenticate(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16])
+{
+	SSCP_AUTH_STATE_ST auth;
+	BYTE response[256] = { 0 };
+	DWORD responseSz = 0;
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	/* The queue runs: the worker authenticates, the session is its */
+	if (SSCP_QueueForeign(ctx))
+		return SSCP_QueueCallJob(ctx, SSCP_Authenticate_Job, (void*) authKeyValue);
+
+	/* 1st step */
+	/* -------- */
+	rc = SSCP_AuthenticateBegin(ctx, &auth, authKeyValue);
+	if (rc)
+		return rc;
+
+	rc = SSCP_ExchangeRaw(ctx, ctx->address, SSCP_PROTOCOL_AUTHENTICATE, SSCP_TIMEOUT_CLASS_SETUP, auth.command, auth.commandSz, response, sizeof(response), &responseSz);
+	if (rc)
+		return rc;
+
+	rc = SSCP_AuthenticateContinue(ctx, &auth, response, responseSz);
+	if (rc)
+		return rc;
+
+	/* 2nd step */
+	/* -------- */
+	rc = SSCP_ExchangeRaw(ctx, ctx->address, SSCP_PROTOCOL_AUTHENTICATE, SSCP_TIMEOUT_CLASS_SETUP, auth.command, auth.commandSz, response, sizeof(response), &responseSz);
+	if (rc)
+		return rc;
+
+	/* Expected response is an ACK */
+
+	return SSCP_AuthenticateEnd(ctx, &auth);
+}
+
 /**
  * @brief Set the RS-485 address of the reader.
  *
@@ -298,6 +296,34 @@ LONG SSCP_SetAddress(SSCP_CTX_ST* ctx, BYTE address)
 	return rc;
 }
 
+/* Selector of SSCP_CMD_SET_BAUDRATE for a baudrate, FALSE if the reader has none */
+static BOOL SSCP_BaudrateSelector(DWORD baudrate, BYTE* selector)
+{
+	switch (baudrate)
+	{
+		case 9600:
+			*selector = 0x00;
+		break;
+		case 19200:
+			*selector = 0x01;
+		break;
+		case 38400:
+			*selector = 0x02;
+		break;
+		case 57600:
+			*selector = 0x03;
+		break;
+		case 115200:
+			*selector = 0x04;
+		break;
+
+		default:
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
 /**
  * @brief Set the RS-485 communication baudrate of the reader.
  *
@@ -339,33 +365,143 @@ LONG SSCP_SetBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate)
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
 
-	switch (baudrate)
+	if (!SSCP_BaudrateSelector(baudrate, &data[0]))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	rc = SSCP_Exchange(ctx, SSCP_CMD_SET_BAUDRATE, data, sizeof(data), NULL, 0, NULL);
+
+	return rc;
+}
+
+/*
+ * Switch all the readers of a port (one, or all the readers of a bus) to a new
+ * baudrate, then the port itself, and check that every reader still answers.
+ * Otherwise the readers that can be reached at the new baudrate are switched back,
+ * and so is the port. A reader that could not be switched back (unreachable, or a
+ * former baudrate that SSCP_SetBaudrate() can't select, e.g. 230400) is named in the
+ * debug output, and the result is then SSCP_ERR_COMM_CONTROL_FAILED. The switch
+ * delay is only waited for when at least one reader has changed its baudrate.
+ */
+LONG SSCP_NegotiateReaders(SSCP_CTX_ST* readers[], DWORD readerCount, DWORD baudrate)
+{
+	SSCP_CTX_ST* ctx = readers[0];
+	DWORD oldBaudrate = ctx->port->baudrate;
+	DWORD switched, i;
+	BYTE selector;
+	LONG rc = SSCP_SUCCESS;
+	LONG rcLocal;
+
+	if (!SSCP_BaudrateSelector(baudrate, &selector))
+		return SSCP_ERR_INVALID_PARAMETER;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	/* The baudrate of the line behind a gateway can't be changed from here */
+	if (SSCP_TransportBase(ctx) == &SSCP_TRANSPORT_TCP)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (baudrate == oldBaudrate)
+		return SSCP_SUCCESS;
+
+	for (switched = 0; switched < readerCount; switched++)
 	{
-		case 9600:
-			data[0] = 0x00;
-		break;
-		case 19200:
-			data[0] = 0x01;
-		break;
-		case 38400:
-			data[0] = 0x02;
-		break;
-		case 57600:
-			data[0] = 0x03;
-		break;
-		case 115200:
-			data[0] = 0x04;
-		break;
+		rc = SSCP_SetBaudrate(readers[switched], baudrate);
+		if (rc)
+			break;
+	}
 
-		default:
-			return SSCP_ERR_INVALID_PARAMETER;
+	/* No reader took the new baudrate: the line is still at the former one */
+	if (switched == 0)
+		return rc;
+
+	/* The readers answer at the current baudrate, then switch */
+	SSCP_SleepMs(SSCP_BAUDRATE_SWITCH_DELAY);
+
+	rcLocal = SSCP_TransportConfigure(ctx, baudrate);
+	if ((rc == SSCP_SUCCESS) && (rcLocal == SSCP_SUCCESS))
+	{
+		/* A secure exchange with each reader at the new baudrate */
+		for (i = 0; i < readerCount; i++)
+		{
+			rc = SSCP_GetInfos(readers[i], NULL, NULL, NULL, NULL);
+			if (rc)
+				break;
+		}
+
+		if (rc == SSCP_SUCCESS)
+			return SSCP_SUCCESS;
 	}
 
-	rc = SSCP_Exchange(ctx, SSCP_CMD_SET_BAUDRATE, data, sizeof(data), NULL, 0, NULL);
+	/* Fall back to the former baudrate */
+	if (rc == SSCP_SUCCESS)
+		rc = rcLocal;
+
+	if ((rcLocal == SSCP_SUCCESS) && (switched > 0))
+	{
+		DWORD stranded = 0;
+
+		/* Best effort: a reader that can't be reached any more stays where it is */
+		for (i = 0; i < switched; i++)
+		{
+			rcLocal = SSCP_SetBaudrate(readers[i], oldBaudrate);
+			if (rcLocal == SSCP_SUCCESS)
+				continue;
+
+			stranded++;
+			if (readers[i]->settings.debugExchange)
+				SSCP_Trace("NegotiateBaudrate: reader %u could not be switched back to %lu bauds (%ld), it stays at %lu\n",
+					(unsigned) readers[i]->address, (unsigned long) oldBaudrate, (long) rcLocal, (unsigned long) baudrate);
+		}
+		if (stranded < switched)
+			SSCP_SleepMs(SSCP_BAUDRATE_SWITCH_DELAY);
+
+		if (stranded > 0)
+			rc = SSCP_ERR_COMM_CONTROL_FAILED;
+	}
+
+	SSCP_TransportConfigure(ctx, oldBaudrate);
 
 	return rc;
 }
 
+/**
+ * @brief Switch the reader and the local port to a faster (or slower) baudrate.
+ *
+ * The reader is told to change its baudrate (SSCP_SetBaudrate()), then the local
+ * port follows (as SSCP_SelectBaudrate() does) and a GetInfos exchange checks the
+ * link. If anything fails, the reader and the port are both brought back to the
+ * baudrate the port was using before the call.
+ *
+ * @param[in,out] ctx
+ *   SSCP context, authenticated.
+ *
+ * @param[in] baudrate
+ *   Desired baudrate in bits per second, one of the values supported by
+ *   SSCP_SetBaudrate().
+ *
+ * @return SSCP_SUCCESS if the link works at @p baudrate, otherwise an SSCP_ERR_*
+ *         error code (the link is then back to the former baudrate, if the reader
+ *         could be reached).
+ *
+ * @retval SSCP_ERR_COMM_CONTROL_FAILED
+ *   The link did not work at @p baudrate, and the reader could not be switched
+ *   back: it stays at @p baudrate while the port is back to the former one.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT
+ *   The @p ctx parameter is NULL, is a bus reader (use SSCP_BusNegotiateBaudrate()),
+ *   or the port is a TCP connection.
+ *
+ * @retval SSCP_ERR_INVALID_PARAMETER
+ *   The requested baudrate is not supported.
+ */
+LONG SSCP_NegotiateBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->bus != NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	return SSCP_NegotiateReaders(&ctx, 1, baudrate);
+}
+
 /**
  * @brief Change the reader long-term authentication key.
  *
@@ -885,55 +1021,32 @@ LONG SSCP_ScanARaw(SSCP_CTX_ST* ctx, WORD *protocol, BYTE uid[], BYTE maxUidSz,
 	return SSCP_SUCCESS;
 }
 
-/**
- * @brief Exchange an APDU with the currently selected contactless card.
- *
- * This issues the SSCP "TransceiveAPDU" command (00h 5Fh), which lets the host
- * send a command APDU to the card and receive the response APDU.
- *
- * @param[in,out] ctx SSCP context.
- * @param[in] commandApdu APDU command bytes to send (may be NULL if size is 0).
- * @param[in] commandApduSz Size of @p commandApdu in bytes.
- * @param[out] responseApdu Buffer receiving the APDU response bytes (excluding status byte).
- * @param[in] maxResponseApduSz Size of @p responseApdu in bytes.
- * @param[out] actResponseApduSz Receives the actual response APDU length.
- *
- * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
- *
- * @retval SSCP_ERR_NFC_CARD_MUTE_OR_REMOVED The card did not answer (timeout).
- * @retval SSCP_ERR_NFC_CARD_COMM_ERROR RF communication error (CRC/parity/framing...).
- *
+/*
+ * The in-place buffer layout required by SSCP_TransceiveNFCInPlace() is the one of
+ * SSCP_ExchangeInPlace(), plus the reserved byte that precedes the APDU.
  */
-LONG SSCP_TransceiveNFC(SSCP_CTX_ST* ctx, const BYTE commandApdu[], DWORD commandApduSz, BYTE responseApdu[], DWORD maxResponseApduSz, DWORD* actResponseApduSz)
+#if (SSCP_APDU_HEADROOM != SSCP_COMMAND_HEADROOM + 1) || (SSCP_APDU_TAILROOM != SSCP_COMMAND_TAILROOM)
+#error SSCP_APDU_HEADROOM/SSCP_APDU_TAILROOM do not match the exchange layer
+#endif
+
+/*
+ * Exchange the APDU found at buffer[SSCP_APDU_HEADROOM]; the response APDU is left
+ * in the context's receive buffer, *responseApdu points to it until the next exchange.
+ */
+LONG SSCP_TransceiveNFC_Exchange(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz, DWORD commandApduSz, const BYTE** responseApdu, DWORD* responseApduSz)
 {
-	BYTE *commandFull = NULL;
-	BYTE responseData[256] = { 0 };
+	const BYTE* responseData = &ctx->rxBuffer[8]; /* See SSCP_ExchangeVerify() */
 	DWORD responseDataSz = 0;
 	BYTE responseStatus = 0;
 	LONG rc;
 
-	if (ctx == NULL)
-		return SSCP_ERR_INVALID_CONTEXT;
-
-	if (commandApdu == NULL && commandApduSz > 0)
-		return SSCP_ERR_INVALID_PARAMETER;
-
-    /* Allocated the two buffers */
-    commandFull = calloc(commandApduSz, 1);
-    if (commandFull == NULL)
-        return SSCP_ERR_OUT_OF_MEMORY;
-	commandFull[0] = 0x00; /* Reserved */
-	memcpy(&commandFull[1], commandApdu, commandApduSz);
-
-	if (actResponseApduSz != NULL)
-		*actResponseApduSz = 0;
-
-	/* Command is TRANSCEIVE APDU */
-	rc = SSCP_Exchange(ctx, SSCP_CMD_TRANSCEIVE_APDU, commandFull, 1 + commandApduSz, responseData, sizeof(responseData), &responseDataSz);
+	buffer[SSCP_APDU_HEADROOM - 1] = 0x00; /* Reserved */
 
-	/* Free the allocated buffer ASAP */
-	free(commandFull);
+	*responseApdu = NULL;
+	*responseApduSz = 0;
 
+	/* Command is TRANSCEIVE APDU, the response is not copied out of the receive buffer */
+	rc = SSCP_ExchangeInPlace(ctx, SSCP_CMD_TRANSCEIVE_APDU, buffer, bufferSz, 1 + commandApduSz, NULL, SSCP_MAX_PAYLOAD_SZ, &responseDataSz);
 	if (rc)
 		return rc;
 
@@ -946,11 +1059,8 @@ LONG SSCP_TransceiveNFC(SSCP_CTX_ST* ctx, const BYTE commandApdu[], DWORD comman
 	{
 		case 0x00:
 			/* No error */
-			if (actResponseApduSz != NULL)
-				*actResponseApduSz = responseDataSz - 1;
-			if (responseDataSz - 1 > maxResponseApduSz)
-				return SSCP_ERR_OUTPUT_BUFFER_OVERFLOW;
-			memcpy(responseApdu, &responseData[1], responseDataSz - 1);
+			*responseApdu = &responseData[1];
+			*responseApduSz = responseDataSz - 1;
 		break;
 
 		case 0x01:
@@ -970,6 +1080,140 @@ LONG SSCP_TransceiveNFC(SSCP_CTX_ST* ctx, const BYTE commandApdu[], DWORD comman
 	return SSCP_SUCCESS;
 }
 
+static LONG SSCP_TransceiveNFC_Core(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz, DWORD commandApduSz, BYTE responseApdu[], DWORD maxResponseApduSz, DWORD* actResponseApduSz)
+{
+	const BYTE* response;
+	DWORD responseSz;
+	LONG rc;
+
+	if (actResponseApduSz != NULL)
+		*actResponseApduSz = 0;
+
+	rc = SSCP_TransceiveNFC_Exchange(ctx, buffer, bufferSz, commandApduSz, &response, &responseSz);
+	if (rc)
+		return rc;
+
+	if (actResponseApduSz != NULL)
+		*actResponseApduSz = responseSz;
+	if (responseSz > maxResponseApduSz)
+		return SSCP_ERR_OUTPUT_BUFFER_OVERFLOW;
+	if ((responseApdu != NULL) && (responseSz > 0))
+		memcpy(responseApdu, response, responseSz);
+
+	return SSCP_SUCCESS;
+}
+
+/* Arguments of SSCP_TransceiveNFC() (buffer NULL) or SSCP_TransceiveNFCInPlace(), for the worker of the queue */
+typedef struct
+{
+	const BYTE* commandApdu;
+	BYTE* buffer;
+	DWORD bufferSz;
+	DWORD commandApduSz;
+	BYTE* responseApdu;
+	DWORD maxResponseApduSz;
+	DWORD* actResponseApduSz;
+} SSCP_TRANSCEIVE_NFC_ARGS_ST;
+
+static LONG SSCP_TransceiveNFC_Job(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_TRANSCEIVE_NFC_ARGS_ST* args = (const SSCP_TRANSCEIVE_NFC_ARGS_ST*) userData;
+
+	if (args->buffer != NULL)
+		return SSCP_TransceiveNFCInPlace(ctx, args->buffer, args->bufferSz, args->commandApduSz, args->responseApdu, args->maxResponseApduSz, args->actResponseApduSz);
+
+	return SSCP_TransceiveNFC(ctx, args->commandApdu, args->commandApduSz, args->responseApdu, args->maxResponseApduSz, args->actResponseApduSz);
+}
+
+/**
+ * @brief Exchange an APDU with the currently selected contactless card.
+ *
+ * This issues the SSCP "TransceiveAPDU" command (00h 5Fh), which lets the host
+ * send a command APDU to the card and receive the response APDU.
+ *
+ * @param[in,out] ctx SSCP context.
+ * @param[in] commandApdu APDU command bytes to send (may be NULL if size is 0).
+ * @param[in] commandApduSz Size of @p commandApdu in bytes.
+ * @param[out] responseApdu Buffer receiving the APDU response bytes (excluding status byte).
+ * @param[in] maxResponseApduSz Size of @p responseApdu in bytes.
+ * @param[out] actResponseApduSz Receives the actual response APDU length.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_NFC_CARD_MUTE_OR_REMOVED The card did not answer (timeout).
+ * @retval SSCP_ERR_NFC_CARD_COMM_ERROR RF communication error (CRC/parity/framing...).
+ *
+ */
+LONG SSCP_TransceiveNFC(SSCP_CTX_ST* ctx, const BYTE commandApdu[], DWORD commandApduSz, BYTE responseApdu[], DWORD maxResponseApduSz, DWORD* actResponseApduSz)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	/* The queue runs: the worker builds and exchanges the APDU, in the context's buffers */
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_TRANSCEIVE_NFC_ARGS_ST args = { commandApdu, NULL, 0, commandApduSz, responseApdu, maxResponseApduSz, actResponseApduSz };
+		return SSCP_QueueCallJob(ctx, SSCP_TransceiveNFC_Job, &args);
+	}
+
+	if (commandApdu == NULL && commandApduSz > 0)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	if (1 + commandApduSz > SSCP_MAX_PAYLOAD_SZ)
+		return SSCP_ERR_COMMAND_TOO_LONG;
+
+	/* Build the command in the context's own buffer */
+	if (commandApduSz > 0)
+		memcpy(&ctx->txBuffer[SSCP_APDU_HEADROOM], commandApdu, commandApduSz);
+
+	return SSCP_TransceiveNFC_Core(ctx, ctx->txBuffer, sizeof(ctx->txBuffer), commandApduSz, responseApdu, maxResponseApduSz, actResponseApduSz);
+}
+
+/**
+ * @brief Exchange an APDU that has been built directly in a caller-supplied buffer.
+ *
+ * Same as SSCP_TransceiveNFC(), but without any copy of the command APDU: the
+ * APDU is expected at @p buffer[SSCP_APDU_HEADROOM], and the buffer must have
+ * at least SSCP_APDU_TAILROOM bytes available after the APDU. The SSCP header,
+ * the signature, the padding and the IV are added around the APDU in place.
+ *
+ * @param[in,out] ctx SSCP context.
+ * @param[in,out] buffer Buffer holding the APDU at offset SSCP_APDU_HEADROOM.
+ *   Its content is overwritten by the ciphered frame.
+ * @param[in] bufferSz Size of @p buffer in bytes.
+ * @param[in] commandApduSz Size of the APDU in bytes.
+ * @param[out] responseApdu Buffer receiving the APDU response bytes (excluding status byte).
+ * @param[in] maxResponseApduSz Size of @p responseApdu in bytes.
+ * @param[out] actResponseApduSz Receives the actual response APDU length.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_PARAMETER @p buffer is too small for the APDU and the
+ *   required headroom/tailroom.
+ */
+LONG SSCP_TransceiveNFCInPlace(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz, DWORD commandApduSz, BYTE responseApdu[], DWORD maxResponseApduSz, DWORD* actResponseApduSz)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	if (SSCP_QueueForeign(ctx) && (buffer != NULL))
+	{
+		SSCP_TRANSCEIVE_NFC_ARGS_ST args = { NULL, buffer, bufferSz, commandApduSz, responseApdu, maxResponseApduSz, actResponseApduSz };
+		return SSCP_QueueCallJob(ctx, SSCP_TransceiveNFC_Job, &args);
+	}
+
+	if (buffer == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	if (1 + commandApduSz > SSCP_MAX_PAYLOAD_SZ)
+		return SSCP_ERR_COMMAND_TOO_LONG;
+
+	if (bufferSz < SSCP_APDU_HEADROOM + commandApduSz + SSCP_APDU_TAILROOM)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	return SSCP_TransceiveNFC_Core(ctx, buffer, bufferSz, commandApduSz, responseApdu, maxResponseApduSz, actResponseApduSz);
+}
+
 /**
  * @brief Release the RF field / card context on the reader.
  *
@@ -12,7 +12,8 @@ void SSCP_InitGuardTime(SSCP_CTX_ST* ctx, DWORD guardTimeMs)
     ctx->guardRunning = TRUE;
 }
 
-void SSCP_WaitGuardTime(SSCP_CTX_ST* ctx)
+/* Milliseconds left before the guard time is over, 0 if it is not running */
+DWORD SSCP_GuardRemaining(SSCP_CTX_ST* ctx)
 {
 #ifdef _WIN32    
     LARGE_INTEGER now;
@@ -23,8 +24,7 @@ void SSCP_WaitGuardTime(SSCP_CTX_ST* ctx)
 #endif
 
     if (!ctx->guardRunning)
-        return;
-    ctx->guardRunning = FALSE;
+        return 0;
 
 #ifdef _WIN32    
     QueryPerformanceCounter(&now);
@@ -33,22 +33,39 @@ void SSCP_WaitGuardTime(SSCP_CTX_ST* ctx)
     if (ticksElapsed < ticksToWait)
     {
         DWORD remainingMs = (DWORD)((ticksToWait - ticksElapsed) * 1000 / ctx->guardFreq.QuadPart);
-        if (remainingMs > 1)
-            Sleep(remainingMs);
-        else
-            Sleep(1);
+        return (remainingMs > 1) ? remainingMs : 1;
     }
 #else
     clock_gettime(CLOCK_MONOTONIC, &now);
-    elapsedMs = 1000UL * (now.tv_sec - ctx->guardStart.tv_sec) + (now.tv_nsec - ctx->guardStart.tv_nsec) * 1000000UL;
+    elapsedMs = 1000UL * (now.tv_sec - ctx->guardStart.tv_sec) + (now.tv_nsec - ctx->guardStart.tv_nsec) / 1000000L;
     if (elapsedMs < ctx->guardValue)
-    {
-        struct timespec ts;
-        DWORD remainingMs = ctx->guardValue - elapsedMs;
-        ts.tv_sec = remainingMs / 1000;
-        ts.tv_nsec  = (remainingMs % 1000UL) * 1000000UL;
-        nanosleep(&ts, NULL);
-    }
+        return ctx->guardValue - elapsedMs;
+#endif
+
+    return 0;
+}
+
+void SSCP_WaitGuardTime(SSCP_CTX_ST* ctx)
+{
+    DWORD remainingMs = SSCP_GuardRemaining(ctx);
+
+    ctx->guardRunning = FALSE;
+
+    if (remainingMs == 0)
+        return;
+
+    SSCP_SleepMs(remainingMs);
+}
+
+void SSCP_SleepMs(DWORD delayMs)
+{
+#ifdef _WIN32    
+    Sleep(delayMs);
+#else
+    struct timespec ts;
+    ts.tv_sec = delayMs / 1000;
+    ts.tv_nsec  = (delayMs % 1000UL) * 1000000UL;
+    nanosleep(&ts, NULL);
 #endif
 }
 
@@ -58,3 +75,32 @@ void SSCP_GuardTime(SSCP_CTX_ST* ctx, DWORD guardTimeMs)
         SSCP_WaitGuardTime(ctx);
     SSCP_InitGuardTime(ctx, guardTimeMs);
 }
+
+/* Monotonic clock, in milliseconds; only differences are meaningful */
+DWORD SSCP_GetTickMs(void)
+{
+#ifdef _WIN32
+    return GetTickCount();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (DWORD)(now.tv_sec * 1000UL + now.tv_nsec / 1000000L);
+#endif
+}
+
+/* Same clock, in microseconds; wraps, only differences are meaningful */
+DWORD SSCP_GetTickUs(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (DWORD)((now.QuadPart / freq.QuadPart) * 1000000 + ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (DWORD)(now.tv_sec * 1000000UL + now.tv_nsec / 1000L);
+#endif
+}
@@ -0,0 +1,410 @@
+/**
+ * @file sscp-host-health.c
+ * @brief Health of the readers: heartbeats in the idle slots of the port, and the
+ *        sessions recovered before the next badge.
+ *
+ * A reader that has restarted (power blip, watchdog) has lost its session: the next
+ * secure command fails with a wrong signature or counter, and the application would
+ * find out while a user waits at the door. Here, a reader that has been silent for
+ * a while gets a GetInfos heartbeat, taken in a slot where the port has been idle
+ * for a moment; the outcome of the heartbeats, and of all the other exchanges with
+ * the reader, is classified:
+ *
+ * - the reader answers within its session: SSCP_HEALTH_OK;
+ * - no valid frame from the reader (mute, stopped, CRC, format): SSCP_HEALTH_LINK_DOWN,
+ *   and the heartbeats go on every retry period until it answers again, each one
+ *   followed by an authentication while it does not (a reader that has restarted
+ *   may be mute to the frames of a session it does not know);
+ * - the reader answers, but out of the session (signature, counter): SSCP_HEALTH_SESSION_LOST,
+ *   and the reader is authenticated again at once, which also brings the counter
+ *   back in step.
+ *
+ * The voltage the reader reports and the round trip of the heartbeats are smoothed
+ * (1/8 per heartbeat, as the response times of sscp-host-timeouts.c), so that a
+ * sagging supply or a link that gets slower shows before it fails.
+ *
+ * SSCP_HealthStep() never sleeps and tells when to call it again, for applications
+ * with their own event loop or timer; SSCP_BusHealthStep() steps all the readers of
+ * a bus, a heartbeat at a time.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_HEALTH_DEFAULT_INTERVAL 5000
+#define SSCP_HEALTH_DEFAULT_IDLE_GAP 50
+#define SSCP_HEALTH_DEFAULT_RETRY 1000
+
+/* What an exchange tells about the reader, SSCP_HEALTH_STOPPED when it tells nothing */
+static BYTE SSCP_HealthClassify(LONG rc)
+{
+	if (rc >= 0)
+		return SSCP_HEALTH_OK; /* A status of the reader is an answer as well */
+
+	switch (rc)
+	{
+		case SSCP_ERR_WRONG_RESPONSE_SIGNATURE:
+		case SSCP_ERR_WRONG_RESPONSE_COUNTER:
+			return SSCP_HEALTH_SESSION_LOST;
+
+		case SSCP_ERR_COMM_SEND_FAILED:
+		case SSCP_ERR_COMM_RECV_FAILED:
+		case SSCP_ERR_COMM_RECV_STOPPED:
+		case SSCP_ERR_COMM_RECV_MUTE:
+		case SSCP_ERR_WRONG_RESPONSE_LENGTH:
+		case SSCP_ERR_WRONG_RESPONSE_CRC:
+		case SSCP_ERR_WRONG_RESPONSE_TYPE:
+		case SSCP_ERR_WRONG_RESPONSE_COMMAND:
+		case SSCP_ERR_WRONG_RESPONSE_FORMAT:
+			return SSCP_HEALTH_LINK_DOWN;
+
+		case SSCP_ERR_NFC_CARD_ABSENT:
+		case SSCP_ERR_NFC_CARD_MUTE_OR_REMOVED:
+		case SSCP_ERR_NFC_CARD_COMM_ERROR:
+		case SSCP_ERR_NFC_CARD_UNEXPECTED_SW:
+		case SSCP_ERR_UNSUPPORTED_RESPONSE_STATUS:
+		case SSCP_ERR_UNSUPPORTED_RESPONSE_VALUE:
+		case SSCP_ERR_UNSUPPORTED_RESPONSE_LENGTH:
+			return SSCP_HEALTH_OK; /* The card or the application, the reader has answered */
+
+		default:
+			return (BYTE) SSCP_HEALTH_STOPPED; /* Errors of the caller: nothing has been exchanged */
+	}
+}
+
+/* Secure exchange over, with rc: what it tells about the reader, for the next step */
+void SSCP_HealthRecord(SSCP_CTX_ST* ctx, LONG rc)
+{
+	BYTE state = SSCP_HealthClassify(rc);
+
+	if (state == (BYTE) SSCP_HEALTH_STOPPED)
+		return;
+
+	if (state != SSCP_HEALTH_LINK_DOWN)
+		ctx->health.lastAnswer = SSCP_GetTickMs();
+
+	/* Only worse news: the next step recovers and tells the application */
+	if (state > ctx->health.observed)
+	{
+		ctx->health.observed = state;
+		ctx->health.observedRc = rc;
+	}
+}
+
+/* New state, told to the application */
+static void SSCP_HealthChange(SSCP_CTX_ST* ctx, BYTE state, LONG rc)
+{
+	ctx->health.report.lastResult = rc;
+	if (ctx->health.report.state == state)
+		return;
+
+	if (state == SSCP_HEALTH_LINK_DOWN)
+		ctx->health.report.linkLosses++;
+	if (state == SSCP_HEALTH_SESSION_LOST)
+		ctx->health.report.sessionLosses++;
+	ctx->health.report.state = state;
+
+	if (ctx->health.callback != NULL)
+		ctx->health.callback(ctx, state, &ctx->health.report, ctx->health.userData);
+}
+
+/* Smoothed value, x8 */
+static DWORD SSCP_HealthSmooth(DWORD average8, DWORD value, DWORD samples)
+{
+	if (samples == 0)
+		return value * 8;
+
+	return average8 - average8 / 8 + value;
+}
+
+/* GetInfos, and the trends it gives */
+static LONG SSCP_HealthHeartbeat(SSCP_CTX_ST* ctx)
+{
+	SSCP_HEALTH_ST* report = &ctx->health.report;
+	DWORD startUs = SSCP_GetTickUs();
+	DWORD latencyUs;
+	WORD voltage = 0;
+	LONG rc;
+
+	rc = SSCP_GetInfos(ctx, NULL, NULL, NULL, &voltage);
+	latencyUs = SSCP_GetTickUs() - startUs;
+	report->heartbeats++;
+
+	if (rc != SSCP_SUCCESS)
+	{
+		report->heartbeatFailures++;
+		return rc;
+	}
+
+	if (report->voltageMin == 0 || voltage < report->voltageMin)
+		report->voltageMin = voltage;
+	if (voltage > report->voltageMax)
+		report->voltageMax = voltage;
+	report->voltage = voltage;
+	ctx->health.voltage8 = SSCP_HealthSmooth(ctx->health.voltage8, voltage, ctx->health.samples);
+	report->voltageAvg = (WORD)(ctx->health.voltage8 / 8);
+
+	if (latencyUs > report->latencyMaxUs)
+		report->latencyMaxUs = latencyUs;
+	report->latencyUs = latencyUs;
+	ctx->health.latency8 = SSCP_HealthSmooth(ctx->health.latency8, latencyUs, ctx->health.samples);
+	report->latencyAvgUs = ctx->health.latency8 / 8;
+
+	ctx->health.samples++;
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Start watching the health of a reader.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in] config Periods and key of the re-authentication (may be NULL for the
+ *            defaults); the key is copied.
+ * @param[in] callback Function called when the state of the reader changes (may be NULL).
+ *            It may use @p ctx.
+ * @param[in] userData Passed to the callback.
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_HealthStart(SSCP_CTX_ST* ctx, const SSCP_HEALTH_CONFIG_ST* config, SSCP_HEALTH_CALLBACK callback, void* userData)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	memset(&ctx->health, 0, sizeof(ctx->health));
+	if (config != NULL)
+	{
+		ctx->health.config = *config;
+		if (config->authKeyValue != NULL)
+		{
+			memcpy(ctx->health.authKey, config->authKeyValue, sizeof(ctx->health.authKey));
+			ctx->health.config.authKeyValue = ctx->health.authKey;
+		}
+	}
+
+	if (ctx->health.config.intervalMs == 0)
+		ctx->health.config.intervalMs = SSCP_HEALTH_DEFAULT_INTERVAL;
+	if (ctx->health.config.idleGapMs == 0)
+		ctx->health.config.idleGapMs = SSCP_HEALTH_DEFAULT_IDLE_GAP;
+	if (ctx->health.config.retryMs == 0)
+		ctx->health.config.retryMs = SSCP_HEALTH_DEFAULT_RETRY;
+
+	ctx->health.callback = callback;
+	ctx->health.userData = userData;
+	ctx->health.lastAnswer = SSCP_GetTickMs();
+	ctx->health.lastAttempt = ctx->health.lastAnswer;
+	ctx->health.report.state = SSCP_HEALTH_OK;
+	ctx->health.running = TRUE;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Send a heartbeat, or recover the reader, if it is time to.
+ *
+ * A reader in order gets a heartbeat once it has been silent for the interval,
+ * as soon as the port has been idle for the gap; a reader that is down gets one
+ * every retry period. A lost session is established again at once, unless the
+ * configuration leaves it to the application.
+ *
+ * @param[in,out] ctx SSCP context, prepared by SSCP_HealthStart().
+ * @param[out] nextStepMs Delay before the next call (0: at once), or SSCP_HEALTH_STOPPED
+ *             if the health of the reader is not watched (may be NULL).
+ *
+ * @return SSCP_SUCCESS when the step has been taken, whatever the state of the reader
+ *         (see SSCP_GetHealth()), otherwise the SSCP_ERR_* code of a call error
+ *         (the port is closed, for instance).
+ */
+LONG SSCP_HealthStep(SSCP_CTX_ST* ctx, DWORD* nextStepMs)
+{
+	DWORD now, due, portIdle;
+	BYTE state;
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	if (!ctx->health.running)
+	{
+		if (nextStepMs != NULL)
+			*nextStepMs = SSCP_HEALTH_STOPPED;
+		return SSCP_SUCCESS;
+	}
+
+	now = SSCP_GetTickMs();
+
+	/* What the exchanges of the application have found meanwhile */
+	if (ctx->health.observed != SSCP_HEALTH_OK)
+	{
+		state = ctx->health.observed;
+		rc = ctx->health.observedRc;
+		ctx->health.observed = SSCP_HEALTH_OK;
+		if (state > ctx->health.report.state)
+		{
+			SSCP_HealthChange(ctx, state, rc);
+			ctx->health.lastAttempt = now - ctx->health.config.retryMs; /* Recover at once */
+		}
+	}
+
+	if (ctx->health.report.state == SSCP_HEALTH_OK)
+		due = ctx->health.lastAnswer + ctx->health.config.intervalMs;
+	else
+		due = ctx->health.lastAttempt + ctx->health.config.retryMs;
+
+	/* Only in an idle slot of the port */
+	portIdle = ctx->port->lastExchange + ctx->health.config.idleGapMs;
+	if ((LONG)(portIdle - due) > 0)
+		due = portIdle;
+
+	if ((LONG)(due - now) > 0)
+	{
+		if (nextStepMs != NULL)
+			*nextStepMs = due - now;
+		return SSCP_SUCCESS;
+	}
+
+	ctx->health.lastAttempt = now;
+	state = ctx->health.report.state;
+
+	if ((state != SSCP_HEALTH_SESSION_LOST) || ctx->health.config.manualRecovery)
+	{
+		rc = SSCP_HealthHeartbeat(ctx);
+		state = SSCP_HealthClassify(rc);
+		ctx->health.observed = SSCP_HEALTH_OK; /* The heartbeat has just said it */
+		if (state == (BYTE) SSCP_HEALTH_STOPPED)
+			return rc;
+
+		/*
+		 * A reader that has restarted may also be mute to the frames of a session it
+		 * does not know: once the link is down, the authentication tells a lost
+		 * session from a dead reader.
+		 */
+		if ((state == SSCP_HEALTH_LINK_DOWN) && (ctx->health.report.state == SSCP_HEALTH_LINK_DOWN) && !ctx->health.config.manualRecovery)
+			state = SSCP_HEALTH_SESSION_LOST;
+		else
+			SSCP_HealthChange(ctx, state, rc);
+	}
+
+	if ((state == SSCP_HEALTH_SESSION_LOST) && !ctx->health.config.manualRecovery)
+	{
+		/* A new session, and the counter that goes with it */
+		rc = SSCP_Authenticate(ctx, ctx->health.config.authKeyValue);
+		ctx->health.observed = SSCP_HEALTH_OK;
+		if (rc == SSCP_SUCCESS)
+		{
+			if (ctx->health.report.state == SSCP_HEALTH_LINK_DOWN)
+				ctx->health.report.sessionLosses++; /* It was a lost session after all */
+			ctx->health.report.reauthentications++;
+			SSCP_HealthChange(ctx, SSCP_HEALTH_OK, rc);
+		}
+		else
+		{
+			state = SSCP_HealthClassify(rc);
+			if (state == (BYTE) SSCP_HEALTH_STOPPED)
+				return rc;
+			/* A reader that does not take the key stays lost, and is tried again later */
+			SSCP_HealthChange(ctx, (state == SSCP_HEALTH_LINK_DOWN) ? SSCP_HEALTH_LINK_DOWN : SSCP_HEALTH_SESSION_LOST, rc);
+		}
+	}
+
+	if (nextStepMs != NULL)
+	{
+		if (!ctx->health.running) /* The callback may have called SSCP_HealthStop() */
+			*nextStepMs = SSCP_HEALTH_STOPPED;
+		else if (ctx->health.report.state == SSCP_HEALTH_OK)
+			*nextStepMs = ctx->health.config.intervalMs;
+		else
+			*nextStepMs = ctx->health.config.retryMs;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Step the health of all the readers of a bus.
+ *
+ * Each reader whose health is watched (SSCP_HealthStart()) gets its step; since a
+ * heartbeat makes the port busy, the readers that are due at the same time take
+ * the next idle slots, one after the other.
+ *
+ * @param[in,out] bus Bus object.
+ * @param[out] nextStepMs Delay before the next call (0: at once), or SSCP_HEALTH_STOPPED
+ *             if no reader of the bus is watched (may be NULL).
+ *
+ * @return SSCP_SUCCESS, or the first SSCP_ERR_* code a reader's step has returned.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p bus parameter is NULL.
+ */
+LONG SSCP_BusHealthStep(SSCP_BUS_ST* bus, DWORD* nextStepMs)
+{
+	DWORD next = SSCP_HEALTH_STOPPED;
+	LONG rc = SSCP_SUCCESS;
+	DWORD i;
+
+	if (bus == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	for (i = 0; i < SSCP_BUS_MAX_READERS; i++)
+	{
+		SSCP_CTX_ST* reader = bus->readers[i];
+		DWORD readerNext;
+		LONG readerRc;
+
+		if ((reader == NULL) || !reader->health.running)
+			continue;
+
+		readerRc = SSCP_HealthStep(reader, &readerNext);
+		if ((readerRc != SSCP_SUCCESS) && (rc == SSCP_SUCCESS))
+			rc = readerRc;
+		if (readerNext < next)
+			next = readerNext;
+	}
+
+	if (nextStepMs != NULL)
+		*nextStepMs = next;
+
+	return rc;
+}
+
+/**
+ * @brief Stop watching the health of a reader (for instance from the callback).
+ *
+ * @param[in,out] ctx SSCP context.
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_HealthStop(SSCP_CTX_ST* ctx)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	ctx->health.running = FALSE;
+
+	/* Don't leave the key behind */
+	memset(ctx->health.authKey, 0, sizeof(ctx->health.authKey));
+	ctx->health.config.authKeyValue = NULL;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Retrieve the health of a reader.
+ *
+ * @param[in] ctx SSCP context.
+ * @param[out] health State, counters and trends since SSCP_HealthStart().
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p health parameter is NULL.
+ */
+LONG SSCP_GetHealth(SSCP_CTX_ST* ctx, SSCP_HEALTH_ST* health)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (health == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*health = ctx->health.report;
+	health->silenceMs = SSCP_GetTickMs() - ctx->health.lastAnswer;
+
+	return SSCP_SUCCESS;
+}
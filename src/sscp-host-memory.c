@@ -0,0 +1,168 @@
+/**
+ * @file sscp-host-memory.c
+ * @brief Memory of the library: the heap, or fixed-size blocks of a pool given by the application.
+ *
+ * Everything the library allocates (contexts, buses, queues, trace rings, the
+ * scratch tables of SSCP_AuthenticateAll()) goes through SSCP_MemAlloc(). Once the
+ * application has given a pool with SSCP_SetMemoryPool(), the allocations are
+ * served from it; built without heap (SSCP_WITH_HEAP set to 0, the embedded
+ * profile), the pool is the only memory there is and malloc() is never called.
+ *
+ * The pool is cut into blocks of SSCP_MemoryBlockSize() bytes, each one large
+ * enough for a context, and an allocation takes a whole block: there is no
+ * fragmentation, and the pool of an application that allocates everything at
+ * startup is sized once and for all. The blocks are claimed with an atomic
+ * exchange, so that the threads of the queues may allocate concurrently.
+ */
+#include "sscp-host_i.h"
+
+#if !SSCP_WITH_HEAP && SSCP_WITH_OPENSSL
+#error "The OpenSSL backend allocates its cipher contexts, it needs SSCP_WITH_HEAP"
+#endif
+
+/* Largest object allocated at once, rounded up so that the blocks stay aligned */
+#define SSCP_MEMORY_ALIGN 64
+#define SSCP_MEMORY_OBJECT_SZ ((sizeof(struct _SSCP_CTX_ST) > sizeof(SSCP_BUS_ST)) ? sizeof(struct _SSCP_CTX_ST) : sizeof(SSCP_BUS_ST))
+#define SSCP_MEMORY_BLOCK_SZ ((SSCP_MEMORY_OBJECT_SZ + SSCP_MEMORY_ALIGN - 1) & ~(size_t)(SSCP_MEMORY_ALIGN - 1))
+
+/* Header of each block of the pool, NULL when the block is free */
+typedef struct
+{
+	void* volatile owner;
+	BYTE reserved[SSCP_MEMORY_ALIGN - sizeof(void*)];
+} SSCP_MEMORY_HEADER_ST;
+
+static BYTE* SSCP_MemoryPool = NULL;
+static DWORD SSCP_MemoryBlocks = 0;
+
+#define SSCP_MEMORY_STRIDE (sizeof(SSCP_MEMORY_HEADER_ST) + SSCP_MEMORY_BLOCK_SZ)
+
+static SSCP_MEMORY_HEADER_ST* SSCP_MemoryHeader(DWORD block)
+{
+	return (SSCP_MEMORY_HEADER_ST*) &SSCP_MemoryPool[block * SSCP_MEMORY_STRIDE];
+}
+
+/**
+ * @brief Size of a block of the memory pool.
+ *
+ * A context, a bus, a running queue and a trace ring (for its events, another block)
+ * take a block each. SSCP_AuthenticateAll() takes two blocks while it runs, and
+ * authenticates as many targets at a time as the tables of a block hold (a little
+ * over 300 bytes per target, e.g. 42 targets in the embedded profile with 1 KB
+ * payloads); a larger set of targets goes through in several passes.
+ *
+ * @return The size, in bytes, that a pool needs per block, its bookkeeping included.
+ */
+DWORD SSCP_MemoryBlockSize(void)
+{
+	return (DWORD) SSCP_MEMORY_STRIDE;
+}
+
+/**
+ * @brief Give the library a pool to allocate its objects from, instead of the heap.
+ *
+ * Call this function before anything is allocated, typically with a static array of
+ * blockCount * SSCP_MemoryBlockSize() bytes, plus 63 if the array is not aligned on
+ * 64 bytes. When the library is built without heap (SSCP_WITH_HEAP set to 0),
+ * nothing can be allocated before a pool has been given.
+ *
+ * @param[in] pool Memory of the pool, that must outlive all the objects of the library;
+ *            NULL to go back to the heap.
+ * @param[in] poolSz Size of the pool, in bytes.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_PARAMETER The pool does not hold a single block.
+ * @retval SSCP_ERR_IN_PROGRESS Blocks of the previous pool are still allocated.
+ */
+LONG SSCP_SetMemoryPool(void* pool, DWORD poolSz)
+{
+	size_t skew;
+	DWORD i;
+
+	for (i = 0; i < SSCP_MemoryBlocks; i++)
+		if (SSCP_ATOMIC_LOAD_PTR(&SSCP_MemoryHeader(i)->owner) != NULL)
+			return SSCP_ERR_IN_PROGRESS;
+
+	if (pool == NULL)
+	{
+		SSCP_MemoryPool = NULL;
+		SSCP_MemoryBlocks = 0;
+		return SSCP_SUCCESS;
+	}
+
+	/* The blocks start on the next 64-byte boundary */
+	skew = (SSCP_MEMORY_ALIGN - ((size_t) pool & (SSCP_MEMORY_ALIGN - 1))) & (SSCP_MEMORY_ALIGN - 1);
+	if (poolSz < skew + SSCP_MEMORY_STRIDE)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	SSCP_MemoryPool = (BYTE*) pool + skew;
+	SSCP_MemoryBlocks = (DWORD)((poolSz - skew) / SSCP_MEMORY_STRIDE);
+	for (i = 0; i < SSCP_MemoryBlocks; i++)
+		SSCP_ATOMIC_STORE_PTR(&SSCP_MemoryHeader(i)->owner, NULL);
+
+	return SSCP_SUCCESS;
+}
+
+/* Zeroed memory for an object of the library, NULL if there is none left */
+void* SSCP_MemAlloc(size_t size)
+{
+	DWORD i;
+
+	if (SSCP_MemoryPool == NULL)
+	{
+#if SSCP_WITH_HEAP
+		return calloc(size, 1);
+#else
+		return NULL;
+#endif
+	}
+
+	if (size > SSCP_MEMORY_BLOCK_SZ)
+		return NULL;
+
+	for (i = 0; i < SSCP_MemoryBlocks; i++)
+	{
+		SSCP_MEMORY_HEADER_ST* header = SSCP_MemoryHeader(i);
+
+		/* Claimed by whoever swaps the NULL out */
+		if (SSCP_ATOMIC_LOAD_PTR(&header->owner) != NULL)
+			continue;
+		if (SSCP_ATOMIC_XCHG_PTR(&header->owner, (void*) header) != NULL)
+			continue;
+
+		memset(&header[1], 0, size);
+		return &header[1];
+	}
+
+	return NULL;
+}
+
+/* Largest size SSCP_MemAlloc() serves at once: a block once there is a pool */
+size_t SSCP_MemMaxSize(void)
+{
+	if (SSCP_MemoryPool == NULL)
+		return (size_t) -1;
+
+	return SSCP_MEMORY_BLOCK_SZ;
+}
+
+/* Give back what SSCP_MemAlloc() has returned (may be NULL) */
+void SSCP_MemFree(void* memory)
+{
+	BYTE* p = (BYTE*) memory;
+
+	if (p == NULL)
+		return;
+
+	if ((SSCP_MemoryPool != NULL) && (p > SSCP_MemoryPool) && (p < SSCP_MemoryPool + SSCP_MemoryBlocks * SSCP_MEMORY_STRIDE))
+	{
+		SSCP_MEMORY_HEADER_ST* header = (SSCP_MEMORY_HEADER_ST*) p - 1;
+		SSCP_ATOMIC_STORE_PTR(&header->owner, NULL);
+		return;
+	}
+
+#if SSCP_WITH_HEAP
+	free(p);
+#endif
+}
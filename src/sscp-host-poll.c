@@ -0,0 +1,225 @@
+/**
+ * @file sscp-host-poll.c
+ * @brief Card presence polling engine.
+ *
+ * The scans are scheduled against the guard time of the context instead of sleeping
+ * in front of each one: the guard time starts when a scan command is sent, so when
+ * the exchange (or the application's callback) already took longer than the period,
+ * the next scan goes at once.
+ *
+ * While there is no card in the field for a while, the period doubles at each scan,
+ * up to the idle period; it falls back to the active period as soon as a card shows up.
+ *
+ * SSCP_PollStep() never sleeps and tells when to call it again, for applications with
+ * their own event loop; SSCP_PollRun() is the blocking loop around it.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_POLL_DEFAULT_IDLE_INTERVAL 1000
+#define SSCP_POLL_DEFAULT_IDLE_AFTER 5000
+
+static BOOL SSCP_PollSameCard(const SSCP_CARD_ST* a, const SSCP_CARD_ST* b)
+{
+	if (a->protocol != b->protocol)
+		return FALSE;
+	if (a->uidSz != b->uidSz)
+		return FALSE;
+	return memcmp(a->uid, b->uid, a->uidSz) ? FALSE : TRUE;
+}
+
+/* Back to the plain guard time, for the scans the application makes itself */
+static void SSCP_PollEnd(SSCP_CTX_ST* ctx)
+{
+	ctx->poll.running = FALSE;
+	if (ctx->guardValue > SSCP_SCAN_GLOBAL_GUARD_TIME)
+		ctx->guardValue = SSCP_SCAN_GLOBAL_GUARD_TIME;
+}
+
+/**
+ * @brief Prepare the polling engine of a context.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in] config Poll periods (may be NULL for the defaults).
+ * @param[in] callback Function called on the arrival and on the removal of a card.
+ *            It may use @p ctx, for instance to exchange APDUs with the card.
+ * @param[in] userData Passed to the callback.
+ *
+ * @return SSCP_SUCCESS, or an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p callback parameter is NULL.
+ */
+LONG SSCP_PollStart(SSCP_CTX_ST* ctx, const SSCP_POLL_CONFIG_ST* config, SSCP_POLL_CALLBACK callback, void* userData)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (callback == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	memset(&ctx->poll, 0, sizeof(ctx->poll));
+	if (config != NULL)
+		ctx->poll.config = *config;
+
+	/* The reader does not accept the scans faster than the guard time */
+	if (ctx->poll.config.activeIntervalMs < SSCP_SCAN_GLOBAL_GUARD_TIME)
+		ctx->poll.config.activeIntervalMs = SSCP_SCAN_GLOBAL_GUARD_TIME;
+	if (ctx->poll.config.idleIntervalMs == 0)
+		ctx->poll.config.idleIntervalMs = SSCP_POLL_DEFAULT_IDLE_INTERVAL;
+	if (ctx->poll.config.idleIntervalMs < ctx->poll.config.activeIntervalMs)
+		ctx->poll.config.idleIntervalMs = ctx->poll.config.activeIntervalMs;
+	if (ctx->poll.config.idleAfterMs == 0)
+		ctx->poll.config.idleAfterMs = SSCP_POLL_DEFAULT_IDLE_AFTER;
+
+	ctx->poll.callback = callback;
+	ctx->poll.userData = userData;
+	ctx->poll.intervalMs = ctx->poll.config.activeIntervalMs;
+	ctx->poll.lastActivity = SSCP_GetTickMs();
+	ctx->poll.running = TRUE;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Scan for a card if it is time to, and report the changes.
+ *
+ * @param[in,out] ctx SSCP context, prepared by SSCP_PollStart().
+ * @param[out] nextPollMs Delay before the next call (0: at once), or SSCP_POLL_STOPPED
+ *             once the callback has asked to stop (may be NULL).
+ *
+ * @return SSCP_SUCCESS, or the SSCP_ERR_* code of the scan. The card errors
+ *         (SSCP_ERR_NFC_*) are not reported: they leave the card state unchanged.
+ */
+LONG SSCP_PollStep(SSCP_CTX_ST* ctx, DWORD* nextPollMs)
+{
+	SSCP_CARD_ST card;
+	BOOL keepOn = TRUE;
+	DWORD remainingMs;
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	if (!ctx->poll.running)
+	{
+		if (nextPollMs != NULL)
+			*nextPollMs = SSCP_POLL_STOPPED;
+		return SSCP_SUCCESS;
+	}
+
+	remainingMs = SSCP_GuardRemaining(ctx);
+	if (remainingMs > 0)
+	{
+		if (nextPollMs != NULL)
+			*nextPollMs = remainingMs;
+		return SSCP_SUCCESS;
+	}
+
+	memset(&card, 0, sizeof(card));
+
+	/* The guard time is over, so the scan does not wait; it restarts the guard time */
+	if (ctx->poll.config.scanARaw)
+		rc = SSCP_ScanARaw(ctx, &card.protocol, card.uid, sizeof(card.uid), &card.uidSz, card.ats, sizeof(card.ats), &card.atsSz);
+	else
+		rc = SSCP_ScanNFC(ctx, &card.protocol, card.uid, sizeof(card.uid), &card.uidSz, card.ats, sizeof(card.ats), &card.atsSz);
+
+	if (rc == SSCP_SUCCESS)
+	{
+		BOOL present = (card.protocol != 0) ? TRUE : FALSE;
+
+		if (ctx->poll.cardPresent && (!present || !SSCP_PollSameCard(&ctx->poll.card, &card)))
+		{
+			ctx->poll.cardPresent = FALSE;
+			ctx->poll.lastActivity = SSCP_GetTickMs();
+			keepOn = ctx->poll.callback(ctx, SSCP_POLL_CARD_REMOVED, &ctx->poll.card, ctx->poll.userData);
+		}
+
+		if (keepOn && present && !ctx->poll.cardPresent)
+		{
+			ctx->poll.card = card;
+			ctx->poll.cardPresent = TRUE;
+			ctx->poll.lastActivity = SSCP_GetTickMs();
+			keepOn = ctx->poll.callback(ctx, SSCP_POLL_CARD_ARRIVED, &ctx->poll.card, ctx->poll.userData);
+		}
+	}
+	else if ((rc <= SSCP_ERR_NFC_CARD_ABSENT) && (rc >= SSCP_ERR_NFC_CARD_COMM_ERROR))
+	{
+		/* A card leaving the field at the wrong time, don't change anything */
+		rc = SSCP_SUCCESS;
+	}
+
+	/* Adapt the period: back off while the field stays empty */
+	if (ctx->poll.cardPresent || ((SSCP_GetTickMs() - ctx->poll.lastActivity) < ctx->poll.config.idleAfterMs))
+	{
+		ctx->poll.intervalMs = ctx->poll.config.activeIntervalMs;
+	}
+	else if (ctx->poll.intervalMs < ctx->poll.config.idleIntervalMs)
+	{
+		ctx->poll.intervalMs *= 2;
+		if (ctx->poll.intervalMs > ctx->poll.config.idleIntervalMs)
+			ctx->poll.intervalMs = ctx->poll.config.idleIntervalMs;
+	}
+
+	/* Stretch the guard time started by the scan to the period: the next scan is due
+	   intervalMs after this one has been sent, whatever happened since */
+	ctx->guardValue = ctx->poll.intervalMs;
+
+	if (!keepOn || !ctx->poll.running) /* The callback may also have called SSCP_PollStop() */
+		SSCP_PollEnd(ctx);
+
+	if (nextPollMs != NULL)
+		*nextPollMs = ctx->poll.running ? SSCP_GuardRemaining(ctx) : SSCP_POLL_STOPPED;
+
+	return rc;
+}
+
+/**
+ * @brief Poll for cards until the callback returns FALSE.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in] config Poll periods (may be NULL for the defaults).
+ * @param[in] callback Function called on the arrival and on the removal of a card.
+ * @param[in] userData Passed to the callback.
+ *
+ * @return SSCP_SUCCESS when the callback has stopped the polling, otherwise the
+ *         SSCP_ERR_* code that has interrupted it.
+ */
+LONG SSCP_PollRun(SSCP_CTX_ST* ctx, const SSCP_POLL_CONFIG_ST* config, SSCP_POLL_CALLBACK callback, void* userData)
+{
+	LONG rc;
+
+	rc = SSCP_PollStart(ctx, config, callback, userData);
+	if (rc)
+		return rc;
+
+	for (;;)
+	{
+		DWORD nextPollMs;
+
+		rc = SSCP_PollStep(ctx, &nextPollMs);
+		if (rc)
+		{
+			SSCP_PollEnd(ctx);
+			return rc;
+		}
+		if (nextPollMs == SSCP_POLL_STOPPED)
+			return SSCP_SUCCESS;
+		if (nextPollMs > 0)
+			SSCP_SleepMs(nextPollMs);
+	}
+}
+
+/**
+ * @brief Stop the polling engine (for instance from the callback).
+ *
+ * @param[in,out] ctx SSCP context.
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_PollStop(SSCP_CTX_ST* ctx)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	SSCP_PollEnd(ctx);
+	return SSCP_SUCCESS;
+}
@@ -0,0 +1,723 @@
+/**
+ * @file sscp-host-queue.c
+ * @brief Request queue of a port, drained by a single worker thread.
+ *
+ * The application threads post requests (a secure command, or a job that runs on
+ * the worker with the context) into a multi-producer single-consumer queue: a post
+ * is an atomic exchange of the head of an intrusive list (the request is the node,
+ * there is no allocation), the worker is the only one to take the requests from
+ * the tail. The threads never wait for each other to post, whatever the worker is
+ * busy with; the worker runs the requests one after the other, in the order they
+ * have been posted, for all the readers of the port.
+ *
+ * A mutex is only taken to put the worker to sleep when there is nothing to do, and
+ * to wake the threads that wait for their request to be over, if there are any.
+ *
+ * While the queue runs, the worker is the only thread that uses the port and the
+ * contexts of the port: the exchange functions called from another thread (see
+ * SSCP_QueueForeign()) post themselves, and wait for the worker to run them.
+ *
+ * The same queue, without a worker, collects the requests of the dispatcher once
+ * they are over (see sscp-host-dispatch.c): the workers of the ports are the
+ * producers, the thread that takes the completions plays the worker.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
+
+#include "sscp-host_i.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+/* States of a request */
+#define SSCP_REQUEST_IDLE 0 /* Never posted */
+#define SSCP_REQUEST_QUEUED 1 /* Posted, not over yet */
+#define SSCP_REQUEST_DONE 2 /* Over, the caller's again */
+
+struct _SSCP_QUEUE_ST
+{
+	SSCP_REQUEST_ST* volatile head; /* Last posted, exchanged by the producers */
+	SSCP_REQUEST_ST* tail; /* Next to run, the worker's only */
+	SSCP_REQUEST_ST stub; /* Keeps the list non-empty */
+	volatile LONG queued; /* Posted and not taken yet */
+	volatile LONG sleeping; /* The worker waits for wake (completions: the takers that wait for it) */
+	volatile LONG waiters; /* Threads in SSCP_QueueWait() */
+	volatile LONG stopping;
+	BOOL started; /* The worker knows who it is, under the lock */
+#ifdef _WIN32
+	HANDLE thread;
+	DWORD workerId;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE wake;
+	CONDITION_VARIABLE done;
+#else
+	pthread_t thread;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+#endif
+};
+
+static void SSCP_QueueLock(SSCP_QUEUE_ST* queue)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&queue->lock);
+#else
+	pthread_mutex_lock(&queue->lock);
+#endif
+}
+
+static void SSCP_QueueUnlock(SSCP_QUEUE_ST* queue)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&queue->lock);
+#else
+	pthread_mutex_unlock(&queue->lock);
+#endif
+}
+
+#ifdef _WIN32
+#define SSCP_QueueSignal(c) WakeConditionVariable(c)
+#define SSCP_QueueBroadcast(c) WakeAllConditionVariable(c)
+#else
+#define SSCP_QueueSignal(c) pthread_cond_signal(c)
+#define SSCP_QueueBroadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/* Wait on the condition, with the lock held, up to timeoutMs (SSCP_ASYNC_INFINITE: no limit) */
+static void SSCP_QueueSleep(SSCP_QUEUE_ST* queue, void* cond, DWORD timeoutMs)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS((CONDITION_VARIABLE*) cond, &queue->lock, (timeoutMs == SSCP_ASYNC_INFINITE) ? INFINITE : timeoutMs);
+#else
+	struct timeval now;
+	struct timespec until;
+
+	if (timeoutMs == SSCP_ASYNC_INFINITE)
+	{
+		pthread_cond_wait((pthread_cond_t*) cond, &queue->lock);
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	until.tv_sec = now.tv_sec + timeoutMs / 1000;
+	until.tv_nsec = (now.tv_usec + (timeoutMs % 1000) * 1000) * 1000;
+	if (until.tv_nsec >= 1000000000)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait((pthread_cond_t*) cond, &queue->lock, &until);
+#endif
+}
+
+static BOOL SSCP_QueueIsWorker(SSCP_QUEUE_ST* queue)
+{
+#ifdef _WIN32
+	return queue->workerId == GetCurrentThreadId();
+#else
+	return pthread_equal(queue->worker, pthread_self()) != 0;
+#endif
+}
+
+/* Append a request, from any thread */
+static void SSCP_QueuePush(SSCP_QUEUE_ST* queue, SSCP_REQUEST_ST* request)
+{
+	SSCP_REQUEST_ST* prev;
+
+	SSCP_ATOMIC_STORE_PTR(&request->next, NULL);
+	prev = (SSCP_REQUEST_ST*) SSCP_ATOMIC_XCHG_PTR(&queue->head, request);
+	/* Until this store, the list is cut after prev: the worker waits for the link */
+	SSCP_ATOMIC_STORE_PTR(&prev->next, request);
+}
+
+/* Take the oldest request, from the worker; NULL if there is none, or if its post is not complete yet */
+static SSCP_REQUEST_ST* SSCP_QueuePop(SSCP_QUEUE_ST* queue)
+{
+	SSCP_REQUEST_ST* tail = queue->tail;
+	SSCP_REQUEST_ST* next = (SSCP_REQUEST_ST*) SSCP_ATOMIC_LOAD_PTR(&tail->next);
+
+	if (tail == &queue->stub)
+	{
+		if (next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = (SSCP_REQUEST_ST*) SSCP_ATOMIC_LOAD_PTR(&tail->next);
+	}
+
+	if (next != NULL)
+	{
+		queue->tail = next;
+		return tail;
+	}
+
+	if (tail != (SSCP_REQUEST_ST*) SSCP_ATOMIC_LOAD_PTR(&queue->head))
+		return NULL; /* Another request is being linked after this one */
+
+	/* The last one: the stub goes behind it, so that the list never gets empty */
+	SSCP_QueuePush(queue, &queue->stub);
+	next = (SSCP_REQUEST_ST*) SSCP_ATOMIC_LOAD_PTR(&tail->next);
+	if (next != NULL)
+	{
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+/* Run a request on the worker, then hand it back */
+static void SSCP_QueueExecute(SSCP_QUEUE_ST* queue, SSCP_REQUEST_ST* request)
+{
+	SSCP_CTX_ST* ctx = request->ctx;
+
+	if (request->job != NULL)
+		request->result = request->job(ctx, request->userData);
+	else
+		request->result = SSCP_Exchange(ctx, request->commandHeader, request->commandData, request->commandDataSz, request->responseData, request->maxResponseDataSz, &request->actResponseDataSz);
+
+	if (request->callback != NULL)
+		request->callback(ctx, request, request->userData);
+
+	/* A dispatched request is done once it has been taken from the completions */
+	if (request->completions != NULL)
+	{
+		SSCP_QueueComplete(request->completions, request);
+		return;
+	}
+
+	/* The request may be released as soon as it is done: not a word after this */
+	SSCP_ATOMIC_STORE(&request->state, SSCP_REQUEST_DONE);
+
+	if (SSCP_ATOMIC_LOAD(&queue->waiters) > 0)
+	{
+		SSCP_QueueLock(queue);
+		SSCP_QueueBroadcast(&queue->done);
+		SSCP_QueueUnlock(queue);
+	}
+}
+
+static void SSCP_QueueWorker(SSCP_QUEUE_ST* queue)
+{
+	/* SSCP_QueueStart() returns once the worker can tell itself from the other threads */
+	SSCP_QueueLock(queue);
+#ifdef _WIN32
+	queue->workerId = GetCurrentThreadId();
+#else
+	queue->worker = pthread_self();
+#endif
+	queue->started = TRUE;
+	SSCP_QueueBroadcast(&queue->done);
+	SSCP_QueueUnlock(queue);
+
+	for (;;)
+	{
+		SSCP_REQUEST_ST* request = SSCP_QueuePop(queue);
+
+		if (request != NULL)
+		{
+			SSCP_ATOMIC_ADD(&queue->queued, -1);
+			SSCP_QueueExecute(queue, request);
+			continue;
+		}
+
+		if (SSCP_ATOMIC_LOAD(&queue->queued) > 0)
+		{
+			/* Posted, but not linked yet: a matter of a few instructions */
+#ifdef _WIN32
+			SwitchToThread();
+#else
+			sched_yield();
+#endif
+			continue;
+		}
+
+		/* Nothing to do; a post after the flag is set sees it, and wakes us up */
+		SSCP_QueueLock(queue);
+		SSCP_ATOMIC_STORE(&queue->sleeping, 1);
+		while ((SSCP_ATOMIC_LOAD(&queue->queued) == 0) && !SSCP_ATOMIC_LOAD(&queue->stopping))
+			SSCP_QueueSleep(queue, &queue->wake, SSCP_ASYNC_INFINITE);
+		SSCP_ATOMIC_STORE(&queue->sleeping, 0);
+		SSCP_QueueUnlock(queue);
+
+		/* The requests posted before the stop are run first */
+		if ((SSCP_ATOMIC_LOAD(&queue->queued) == 0) && SSCP_ATOMIC_LOAD(&queue->stopping))
+			break;
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI SSCP_QueueThread(LPVOID param)
+{
+	SSCP_QueueWorker((SSCP_QUEUE_ST*) param);
+	return 0;
+}
+#else
+static void* SSCP_QueueThread(void* param)
+{
+	SSCP_QueueWorker((SSCP_QUEUE_ST*) param);
+	return NULL;
+}
+#endif
+
+/* Queue with its lock and conditions, no worker yet */
+static SSCP_QUEUE_ST* SSCP_QueueNew(void)
+{
+	SSCP_QUEUE_ST* queue;
+
+	queue = SSCP_MemAlloc(sizeof(SSCP_QUEUE_ST));
+	if (queue == NULL)
+		return NULL;
+
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+
+#ifdef _WIN32
+	InitializeCriticalSection(&queue->lock);
+	InitializeConditionVariable(&queue->wake);
+	InitializeConditionVariable(&queue->done);
+#else
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->wake, NULL);
+	pthread_cond_init(&queue->done, NULL);
+#endif
+
+	return queue;
+}
+
+/* Release a queue that nobody uses anymore */
+static void SSCP_QueueDelete(SSCP_QUEUE_ST* queue)
+{
+	/* The last waiters may not have left the lock yet */
+	while (SSCP_ATOMIC_LOAD(&queue->waiters) > 0)
+#ifdef _WIN32
+		SwitchToThread();
+	DeleteCriticalSection(&queue->lock);
+#else
+		sched_yield();
+	pthread_cond_destroy(&queue->done);
+	pthread_cond_destroy(&queue->wake);
+	pthread_mutex_destroy(&queue->lock);
+#endif
+
+	SSCP_MemFree(queue);
+}
+
+/* TRUE if the port has a worker, and the calling thread is another one */
+BOOL SSCP_QueueForeign(SSCP_CTX_ST* ctx)
+{
+	SSCP_QUEUE_ST* queue = ctx->port->queue;
+
+	if (queue == NULL)
+		return FALSE;
+
+	return !SSCP_QueueIsWorker(queue);
+}
+
+/* Post the request, and wait until it is over */
+LONG SSCP_QueueCall(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request)
+{
+	LONG rc;
+
+	rc = SSCP_QueuePost(ctx, request);
+	if (rc)
+		return rc;
+
+	return SSCP_QueueWait(ctx, request, SSCP_ASYNC_INFINITE);
+}
+
+/* Have the worker run a job, and wait for its outcome */
+LONG SSCP_QueueCallJob(SSCP_CTX_ST* ctx, SSCP_REQUEST_JOB job, void* userData)
+{
+	SSCP_REQUEST_ST request;
+
+	memset(&request, 0, sizeof(request));
+	request.job = job;
+	request.userData = userData;
+
+	return SSCP_QueueCall(ctx, &request);
+}
+
+/**
+ * @brief Start the worker thread of the port of a context.
+ *
+ * From now on, the worker is the only thread that exchanges with the readers of
+ * the port. The requests are posted with SSCP_QueuePost(); the exchange functions
+ * (SSCP_Outputs(), SSCP_GetInfos(), SSCP_ScanNFC(), SSCP_Authenticate(),
+ * SSCP_TransceiveNFC(), SSCP_RunApduScript(), SSCP_ExchangeBatch()...) may also be
+ * called from any thread: they are posted, and wait for the worker to run them.
+ *
+ * The functions that change the port or the context (SSCP_SelectBaudrate(),
+ * SSCP_NegotiateBaudrate(), SSCP_SetTimeoutProfile(), SSCP_SetSettings()...) are
+ * not posted: call them from a job, or while the queue is stopped. The
+ * non-blocking exchange (SSCP_AsyncSubmit()) is not available while the queue runs.
+ *
+ * @param[in,out] ctx SSCP context; on a bus, any reader of the bus (the worker
+ *                runs the requests of all of them).
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_IN_PROGRESS The queue of the port already runs, or an
+ *         asynchronous exchange is pending on the port.
+ * @retval SSCP_ERR_OUT_OF_MEMORY The queue could not be allocated.
+ * @retval SSCP_ERR_INTERNAL_FAILURE The thread could not be created.
+ */
+LONG SSCP_QueueStart(SSCP_CTX_ST* ctx)
+{
+	SSCP_QUEUE_ST* queue;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((ctx->port->queue != NULL) || (SSCP_AsyncPending(ctx)))
+		return SSCP_ERR_IN_PROGRESS;
+
+	queue = SSCP_QueueNew();
+	if (queue == NULL)
+		return SSCP_ERR_OUT_OF_MEMORY;
+
+#ifdef _WIN32
+	queue->thread = CreateThread(NULL, 0, SSCP_QueueThread, queue, 0, NULL);
+	if (queue->thread == NULL)
+	{
+		SSCP_QueueDelete(queue);
+		return SSCP_ERR_INTERNAL_FAILURE;
+	}
+#else
+	if (pthread_create(&queue->thread, NULL, SSCP_QueueThread, queue) != 0)
+	{
+		SSCP_QueueDelete(queue);
+		return SSCP_ERR_INTERNAL_FAILURE;
+	}
+#endif
+
+	SSCP_QueueLock(queue);
+	while (!queue->started)
+		SSCP_QueueSleep(queue, &queue->done, SSCP_ASYNC_INFINITE);
+	SSCP_QueueUnlock(queue);
+
+	ctx->port->queue = queue;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Stop the worker thread of the port of a context.
+ *
+ * The requests already posted are run, then the worker ends. Nothing may be posted
+ * meanwhile. SSCP_Close() and SSCP_BusClose() stop the queue of the port.
+ *
+ * @param[in,out] ctx SSCP context; on a bus, any reader of the bus.
+ *
+ * @return SSCP_SUCCESS on success (also if the queue does not run), otherwise an
+ *         SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL, or the function is
+ *         called by the worker itself (from a job or a callback).
+ */
+LONG SSCP_QueueStop(SSCP_CTX_ST* ctx)
+{
+	SSCP_QUEUE_ST* queue;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	queue = ctx->port->queue;
+	if (queue == NULL)
+		return SSCP_SUCCESS;
+	if (SSCP_QueueIsWorker(queue))
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	SSCP_QueueLock(queue);
+	SSCP_ATOMIC_STORE(&queue->stopping, 1);
+	SSCP_QueueSignal(&queue->wake);
+	SSCP_QueueUnlock(queue);
+
+#ifdef _WIN32
+	WaitForSingleObject(queue->thread, INFINITE);
+	CloseHandle(queue->thread);
+#else
+	pthread_join(queue->thread, NULL);
+#endif
+
+	ctx->port->queue = NULL;
+	SSCP_QueueDelete(queue);
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Post a request to the worker of the port, without waiting.
+ *
+ * The request is run after the ones already posted by any thread, for any reader
+ * of the port. Its callback, if any, is called by the worker once it is over; the
+ * response and the result may also be waited for with SSCP_QueueWait(). A request
+ * that is only posted and never waited for (e.g. to blink a LED without blocking
+ * the caller) must stay valid until it is over.
+ *
+ * @param[in,out] ctx SSCP context (the reader the request is for).
+ * @param[in,out] request Request; commandHeader, commandData and the response buffer
+ *                for a command, or job, and callback and userData if needed. The
+ *                private fields must be zero before the first post.
+ *
+ * @return SSCP_SUCCESS if the request has been posted, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL, or the queue of
+ *         the port does not run.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p request is NULL, or has no data but a size.
+ * @retval SSCP_ERR_COMMAND_TOO_LONG The command data are too long.
+ * @retval SSCP_ERR_IN_PROGRESS The request has been posted already, and is not over.
+ */
+LONG SSCP_QueuePost(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request)
+{
+	return SSCP_QueuePostTo(ctx, request, NULL);
+}
+
+/* SSCP_QueuePost(), the request going to the given completions once over (NULL: done at once) */
+LONG SSCP_QueuePostTo(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request, SSCP_QUEUE_ST* completions)
+{
+	SSCP_QUEUE_ST* queue;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	queue = ctx->port->queue;
+	if ((queue == NULL) || SSCP_ATOMIC_LOAD(&queue->stopping))
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (request == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+	if (SSCP_ATOMIC_LOAD(&request->state) == SSCP_REQUEST_QUEUED)
+		return SSCP_ERR_IN_PROGRESS;
+	if (request->job == NULL)
+	{
+		if ((request->commandData == NULL) && (request->commandDataSz > 0))
+			return SSCP_ERR_INVALID_PARAMETER;
+		if (request->commandDataSz > SSCP_MAX_PAYLOAD_SZ)
+			return SSCP_ERR_COMMAND_TOO_LONG;
+	}
+
+	request->ctx = ctx;
+	request->completions = completions;
+	request->actResponseDataSz = 0;
+	request->result = SSCP_ERR_IN_PROGRESS;
+	SSCP_ATOMIC_STORE(&request->state, SSCP_REQUEST_QUEUED);
+
+	/* Counted first, so that the worker does not go to sleep while it is linked */
+	SSCP_ATOMIC_ADD(&queue->queued, 1);
+	SSCP_QueuePush(queue, request);
+
+	if (SSCP_ATOMIC_LOAD(&queue->sleeping))
+	{
+		SSCP_QueueLock(queue);
+		SSCP_QueueSignal(&queue->wake);
+		SSCP_QueueUnlock(queue);
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Wait for a posted request to be over.
+ *
+ * @param[in,out] ctx SSCP context the request has been posted to.
+ * @param[in] request Request.
+ * @param[in] timeoutMs Longest wait, 0 to only check, or SSCP_ASYNC_INFINITE.
+ *
+ * @return The result of the request once it is over (what SSCP_Exchange() or the
+ *         job returned), otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p request is NULL, or has never been posted.
+ * @retval SSCP_ERR_IN_PROGRESS The request is not over yet. The worker itself never
+ *         waits (from a job or a callback), since it is the one to run the request.
+ */
+LONG SSCP_QueueWait(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request, DWORD timeoutMs)
+{
+	SSCP_QUEUE_ST* queue;
+	DWORD startMs;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (request == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	switch (SSCP_ATOMIC_LOAD(&request->state))
+	{
+		case SSCP_REQUEST_DONE:
+			return request->result;
+		case SSCP_REQUEST_QUEUED:
+		break;
+		default:
+			return SSCP_ERR_INVALID_PARAMETER;
+	}
+
+	/* Queued, so the worker runs until it is over */
+	queue = ctx->port->queue;
+	if ((queue == NULL) || (timeoutMs == 0) || SSCP_QueueIsWorker(queue))
+		return SSCP_ERR_IN_PROGRESS;
+
+	startMs = SSCP_GetTickMs();
+
+	SSCP_ATOMIC_ADD(&queue->waiters, 1);
+	SSCP_QueueLock(queue);
+	while (SSCP_ATOMIC_LOAD(&request->state) != SSCP_REQUEST_DONE)
+	{
+		DWORD elapsedMs = SSCP_GetTickMs() - startMs;
+
+		if (timeoutMs == SSCP_ASYNC_INFINITE)
+		{
+			SSCP_QueueSleep(queue, &queue->done, SSCP_ASYNC_INFINITE);
+			continue;
+		}
+		if (elapsedMs >= timeoutMs)
+			break;
+		SSCP_QueueSleep(queue, &queue->done, timeoutMs - elapsedMs);
+	}
+	SSCP_QueueUnlock(queue);
+	SSCP_ATOMIC_ADD(&queue->waiters, -1);
+
+	if (SSCP_ATOMIC_LOAD(&request->state) != SSCP_REQUEST_DONE)
+		return SSCP_ERR_IN_PROGRESS;
+
+	return request->result;
+}
+
+/* Completions */
+/* ----------- */
+
+/* Queue without a worker, that collects requests once they are over */
+SSCP_QUEUE_ST* SSCP_QueueCompletionsAlloc(void)
+{
+	return SSCP_QueueNew();
+}
+
+/* Release the completions; the requests that have not been taken are done */
+void SSCP_QueueCompletionsFree(SSCP_QUEUE_ST* completions)
+{
+	SSCP_REQUEST_ST* request;
+
+	if (completions == NULL)
+		return;
+
+	while ((request = SSCP_QueueTake(completions, 0)) != NULL)
+		;
+
+	SSCP_QueueDelete(completions);
+}
+
+/* Append a request that is over, from the worker of its port */
+void SSCP_QueueComplete(SSCP_QUEUE_ST* completions, SSCP_REQUEST_ST* request)
+{
+	SSCP_ATOMIC_ADD(&completions->queued, 1);
+	SSCP_QueuePush(completions, request);
+
+	/* Several threads may take the completions: they all have a look */
+	if (SSCP_ATOMIC_LOAD(&completions->sleeping) > 0)
+	{
+		SSCP_QueueLock(completions);
+		SSCP_QueueBroadcast(&completions->wake);
+		SSCP_QueueUnlock(completions);
+	}
+}
+
+/* Oldest request that is over, waiting up to timeoutMs (SSCP_ASYNC_INFINITE: no limit); NULL if none */
+SSCP_REQUEST_ST* SSCP_QueueTake(SSCP_QUEUE_ST* completions, DWORD timeoutMs)
+{
+	SSCP_REQUEST_ST* request;
+	DWORD startMs = SSCP_GetTickMs();
+
+	/* The lock makes the takers a single consumer */
+	SSCP_QueueLock(completions);
+	for (;;)
+	{
+		DWORD elapsedMs;
+
+		request = SSCP_QueuePop(completions);
+		if (request != NULL)
+		{
+			SSCP_ATOMIC_ADD(&completions->queued, -1);
+			break;
+		}
+
+		if (SSCP_ATOMIC_LOAD(&completions->queued) > 0)
+		{
+			/* Completed, but not linked yet */
+			SSCP_QueueUnlock(completions);
+#ifdef _WIN32
+			SwitchToThread();
+#else
+			sched_yield();
+#endif
+			SSCP_QueueLock(completions);
+			continue;
+		}
+
+		elapsedMs = SSCP_GetTickMs() - startMs;
+		if ((timeoutMs != SSCP_ASYNC_INFINITE) && (elapsedMs >= timeoutMs))
+			break;
+
+		/*
+		 * A completion after we are counted sees it, and wakes us up; the takers are
+		 * counted, not flagged, since one that times out must not hide another one
+		 * that still waits
+		 */
+		SSCP_ATOMIC_ADD(&completions->sleeping, 1);
+		if (SSCP_ATOMIC_LOAD(&completions->queued) == 0)
+			SSCP_QueueSleep(completions, &completions->wake, (timeoutMs == SSCP_ASYNC_INFINITE) ? SSCP_ASYNC_INFINITE : timeoutMs - elapsedMs);
+		SSCP_ATOMIC_ADD(&completions->sleeping, -1);
+	}
+	SSCP_QueueUnlock(completions);
+
+	if (request != NULL)
+		SSCP_ATOMIC_STORE(&request->state, SSCP_REQUEST_DONE);
+
+	return request;
+}
+
+/* Cores */
+/* ----- */
+
+/* Cores the system runs the threads on */
+DWORD SSCP_CpuCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (count > 0) ? (DWORD) count : 1;
+#endif
+}
+
+/* Keep the worker of the port on a core; FALSE if the queue does not run, or if the system does not let it */
+BOOL SSCP_QueuePin(SSCP_CTX_ST* ctx, DWORD core)
+{
+	SSCP_QUEUE_ST* queue = ctx->port->queue;
+
+	if (queue == NULL)
+		return FALSE;
+
+#ifdef _WIN32
+	return (SetThreadAffinityMask(queue->thread, (DWORD_PTR) 1 << (core % (8 * sizeof(DWORD_PTR)))) != 0) ? TRUE : FALSE;
+#elif defined(__linux__)
+	{
+		cpu_set_t cores;
+
+		CPU_ZERO(&cores);
+		CPU_SET(core % CPU_SETSIZE, &cores);
+		return (pthread_setaffinity_np(queue->thread, sizeof(cores), &cores) == 0) ? TRUE : FALSE;
+	}
+#else
+	(void) core;
+	return FALSE;
+#endif
+}
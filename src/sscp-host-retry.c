@@ -0,0 +1,216 @@
+/**
+ * @file sscp-host-retry.c
+ * @brief Retry policy of the secure exchanges: what is sent again, when, and how the counter follows.
+ *
+ * A command is sent again when its response did not come (timeout) and, unless the
+ * policy restricts it to the timeouts, when the response came corrupted (wrong CRC,
+ * impossible length): on a noisy RS-485 line, a frame hit by a glitch is not a broken
+ * session. Before a corrupted response is answered with a resending, the line is
+ * drained until it stays quiet, so that the tail of the bad frame is not taken for
+ * the beginning of the next one.
+ *
+ * The resendings wait for the response as long as the reader usually takes (the
+ * adaptive estimate of sscp-host-timeouts.c, once known, even if the profile is
+ * not adaptive), not the full timeout of the class: the first attempt has already
+ * covered a reader that is slow for once. When several hosts share a bus, a random
+ * wait before each resending, growing with each one, keeps them from colliding again.
+ *
+ * A resending is the same frame, with the same counter: whichever copy the reader
+ * answers, the response is the one expected. When the exchange fails after the frame
+ * has been sent, the reader may have processed it nevertheless; the counter of the
+ * context then skips the counter the reader would have answered with, so that the next
+ * command is never taken for a replay.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_RETRY_DEFAULT_ATTEMPTS 3
+#define SSCP_RETRY_DRAIN_MAX_MS 250 /* A line that keeps talking is not drained forever */
+
+/* Response that came, but corrupted */
+static BOOL SSCP_RetryCorrupted(LONG rc)
+{
+	return ((rc == SSCP_ERR_WRONG_RESPONSE_CRC) || (rc == SSCP_ERR_RESPONSE_TOO_LONG)) ? TRUE : FALSE;
+}
+
+/* Response that did not come */
+static BOOL SSCP_RetryTimeout(LONG rc)
+{
+	return ((rc == SSCP_ERR_COMM_RECV_MUTE) || (rc == SSCP_ERR_COMM_RECV_STOPPED)) ? TRUE : FALSE;
+}
+
+/* Read and drop whatever comes, until the line has been quiet for the inter byte timeout */
+static void SSCP_RetryDrain(SSCP_CTX_ST* ctx)
+{
+	DWORD startMs = SSCP_GetTickMs();
+	DWORD received;
+
+	do
+	{
+		SSCP_SerialFlushRing(ctx);
+		if (SSCP_SerialFillRing(ctx, SSCP_InterByteTimeout(ctx), &received) != SSCP_SUCCESS)
+			break;
+	}
+	while ((received > 0) && (SSCP_GetTickMs() - startMs < SSCP_RETRY_DRAIN_MAX_MS));
+
+	SSCP_SerialFlushRing(ctx);
+}
+
+/* Random wait before the given resending (1 for the first one) */
+static DWORD SSCP_RetryBackoff(SSCP_CTX_ST* ctx, BYTE resending)
+{
+	DWORD window = ctx->retry.policy.backoffMs;
+	DWORD limit = ctx->retry.policy.backoffMaxMs;
+	BYTE r[4];
+
+	if (window == 0)
+		return 0;
+	if (limit == 0)
+		limit = 8 * window;
+
+	while ((--resending > 0) && (window < limit))
+		window *= 2;
+	if (window > limit)
+		window = limit;
+
+	if (!SSCP_GetRandomEx(ctx, r, sizeof(r)))
+		return window / 2;
+
+	return (((DWORD) r[0] << 24) | ((DWORD) r[1] << 16) | ((DWORD) r[2] << 8) | r[3]) % (window + 1);
+}
+
+/* Transmissions of a command, the first one included */
+BYTE SSCP_RetryAttempts(SSCP_CTX_ST* ctx)
+{
+	return (ctx->retry.policy.maxAttempts > 0) ? ctx->retry.policy.maxAttempts : SSCP_RETRY_DEFAULT_ATTEMPTS;
+}
+
+/*
+ * Attempt attempt (0 for the first transmission) has failed with rc: TRUE if the frame
+ * is to be sent again, after *backoffMs. The line is not drained, see SSCP_RetryWait().
+ */
+BOOL SSCP_RetryNext(SSCP_CTX_ST* ctx, BYTE attempt, LONG rc, DWORD* backoffMs)
+{
+	SSCP_STATS_COUNTERS_ST* counters = &ctx->statsEx;
+
+	*backoffMs = 0;
+
+	if (SSCP_RetryTimeout(rc))
+	{
+		if (attempt + 1 >= SSCP_RetryAttempts(ctx))
+			return FALSE;
+		counters->timeouts++;
+	}
+	else if (SSCP_RetryCorrupted(rc) && !ctx->retry.policy.timeoutsOnly)
+	{
+		if (attempt + 1 >= SSCP_RetryAttempts(ctx))
+			return FALSE;
+		if (rc == SSCP_ERR_WRONG_RESPONSE_CRC)
+			counters->crcErrors++;
+		else
+			counters->formatErrors++;
+		counters->corruptedRetries++;
+	}
+	else
+	{
+		return FALSE; /* The link is gone, or the reader has answered */
+	}
+
+	*backoffMs = SSCP_RetryBackoff(ctx, (BYTE)(attempt + 1));
+	counters->backoffMs += *backoffMs;
+
+	if (ctx->settings.debugExchange)
+		SSCP_Trace("Exchange failed with %ld, sent again in %lu ms\n", rc, *backoffMs);
+
+	ctx->retry.resending = TRUE;
+	return TRUE;
+}
+
+/* SSCP_RetryNext() for the blocking exchanges: the line is drained and the backoff waited */
+BOOL SSCP_RetryWait(SSCP_CTX_ST* ctx, BYTE attempt, LONG rc)
+{
+	DWORD backoffMs;
+
+	if (!SSCP_RetryNext(ctx, attempt, rc, &backoffMs))
+		return FALSE;
+
+	if (SSCP_RetryCorrupted(rc))
+		SSCP_RetryDrain(ctx);
+	if (backoffMs > 0)
+		SSCP_SleepMs(backoffMs);
+
+	return TRUE;
+}
+
+/* Transmissions over after retries resendings, rc being the outcome of the last one */
+void SSCP_RetryEnd(SSCP_CTX_ST* ctx, DWORD retries, LONG rc)
+{
+	ctx->retry.resending = FALSE;
+
+	if (rc == SSCP_SUCCESS)
+	{
+		if (retries > 0)
+		{
+			ctx->stats.errorCount++; /* We have recovered this error */
+			ctx->statsEx.recoveries++;
+		}
+		return;
+	}
+
+	/* The frame may have reached the reader: the next command gets a counter it has not seen */
+	if ((SSCP_RetryTimeout(rc) || SSCP_RetryCorrupted(rc) || (rc == SSCP_ERR_COMM_RECV_FAILED)) && !ctx->retry.policy.keepCounter)
+	{
+		ctx->counter += 2;
+		ctx->statsEx.counterResyncs++;
+	}
+}
+
+/**
+ * @brief Set the retry policy of the secure exchanges of a context.
+ *
+ * By default, a command is transmitted up to 3 times, after a timeout or a corrupted
+ * response; the resendings wait for the response as long as the reader usually takes
+ * to answer, and are sent at once.
+ *
+ * @param[in,out] ctx SSCP context (a reader of a bus has its own policy).
+ * @param[in] policy Policy, 0 for the defaults (may be NULL for all the defaults).
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_SetRetryPolicy(SSCP_CTX_ST* ctx, const SSCP_RETRY_POLICY_ST* policy)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	memset(&ctx->retry, 0, sizeof(ctx->retry));
+	if (policy != NULL)
+		ctx->retry.policy = *policy;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Get the retry policy of a context.
+ *
+ * @param[in] ctx SSCP context.
+ * @param[out] policy Policy in use; the number of attempts and the longest backoff
+ *             are given as their actual value.
+ *
+ * @return SSCP_SUCCESS, or an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p policy parameter is NULL.
+ */
+LONG SSCP_GetRetryPolicy(SSCP_CTX_ST* ctx, SSCP_RETRY_POLICY_ST* policy)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (policy == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*policy = ctx->retry.policy;
+	policy->maxAttempts = SSCP_RetryAttempts(ctx);
+	if ((policy->backoffMs > 0) && (policy->backoffMaxMs == 0))
+		policy->backoffMaxMs = 8 * policy->backoffMs;
+
+	return SSCP_SUCCESS;
+}
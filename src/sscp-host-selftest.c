@@ -0,0 +1,264 @@
+/**
+ * @file sscp-host-selftest.c
+ * @brief Loopback transport of the self test, with the canned responses of a reader.
+ *
+ * A context with the selfTest setting (SSCP_SELFTEST when it is allocated, see
+ * SSCP_SetSettings()) is on this transport instead of a port: the frames the host
+ * sends are parsed as a reader would, and answered with the responses recorded
+ * with the default authentication key, and the random values of the exchanges are
+ * the ones of that session. The whole stack above the transport (framing, CRC,
+ * authentication, ciphering and checks of the responses, synchronous, asynchronous,
+ * streamed or batched) thus runs as it does with a reader, without any branch of
+ * its own.
+ *
+ * The vectors cover one session: an authentication, then a single secure exchange
+ * (the counter of the canned response is the one of the first command).
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_SELFTEST_RX_SZ 512 /* Responses not read yet, a few frames */
+
+typedef struct
+{
+	/* Frame being received from the host */
+	BYTE header[5];
+	BYTE start[2 + 16]; /* First bytes of the payload, the whole 1st step of an authentication */
+	DWORD received; /* Bytes of the frame so far */
+	/* Responses, for SSCP_SelfTestRecvWait() */
+	BYTE rx[SSCP_SELFTEST_RX_SZ];
+	DWORD rxHead;
+	DWORD rxCount;
+	DWORD draws; /* Random values drawn since the port has been opened */
+} SSCP_SELFTEST_ST;
+
+/* rndA of the authentication, then the IV of the commands */
+static const BYTE SSCP_SELFTEST_RNDA[16] = { 0x75, 0xCC, 0xF7, 0xB1, 0xF7, 0xFE, 0xA6, 0xF7, 0x58, 0x71, 0xFC, 0xF6, 0xDC, 0x75, 0x59, 0x23 };
+static const BYTE SSCP_SELFTEST_IV[16] = { 0x7C, 0x3D, 0xE3, 0xF3, 0xE1, 0x91, 0xD3, 0xCD, 0x3A, 0x09, 0x3E, 0x64, 0x3B, 0xF0, 0x35, 0xCE };
+
+/* B, A, RndA', RndB and hB, for the rndA above */
+static const BYTE SSCP_SELFTEST_AUTH_RESPONSE[] = {
+	0x53, 0x77, 0x07, 0xAD, 0x48, 0x6F, 0x07, 0xAD, 0x75, 0xCC, 0xF7, 0xB1, 0xF7, 0xFE, 0xA6, 0xF7,
+	0x58, 0x71, 0xFC, 0xF6, 0xDC, 0x75, 0x59, 0x23, 0xC8, 0xEE, 0x7C, 0x37, 0x5C, 0x21, 0xEA, 0xC5,
+	0x1B, 0xD9, 0x7C, 0x51, 0xC6, 0x9F, 0x39, 0x5B, 0x69, 0xF6, 0x61, 0x77, 0x07, 0xD9, 0x44, 0x29,
+	0x40, 0xC3, 0x9B, 0xEB, 0xFA, 0x0B, 0x44, 0x59, 0xCE, 0xBF, 0x6C, 0xD5, 0xE6, 0x10, 0xEA, 0x1F,
+	0xF4, 0x4B, 0x34, 0x1E, 0x29, 0x16, 0x54, 0xA9
+};
+
+/* ACK of the 2nd step of the authentication */
+static const BYTE SSCP_SELFTEST_AUTH_ACK[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x08 };
+
+/* Ciphered response to the first command of the session (SSCP_Outputs(ctx, 0x02, 0x0A, 0x00)) */
+static const BYTE SSCP_SELFTEST_SECURE_RESPONSE[] = {
+	0xEE, 0x3F, 0x77, 0x22, 0x6E, 0x77, 0xEF, 0xF3, 0x05, 0x89, 0xBB, 0x40, 0xF1, 0xA1, 0x7C, 0x8E,
+	0x6D, 0x7B, 0x5D, 0x89, 0xFB, 0x6D, 0x86, 0xF2, 0x52, 0x04, 0xFC, 0x4D, 0x31, 0x80, 0x0F, 0x17,
+	0x7F, 0xED, 0xA6, 0x42, 0x00, 0x8F, 0x0A, 0x60, 0x37, 0x01, 0xC4, 0x34, 0xC8, 0x56, 0x9B, 0xA9,
+	0xEC, 0x89, 0xEC, 0xA7, 0xB6, 0x33, 0xF3, 0x35, 0x77, 0xCE, 0xC2, 0x4A, 0x74, 0x85, 0x98, 0x5E
+};
+
+static SSCP_SELFTEST_ST* SSCP_SelfTestOf(SSCP_CTX_ST* ctx)
+{
+	return (SSCP_SELFTEST_ST*) ctx->port->transportData;
+}
+
+static void SSCP_SelfTestTrace(const char* direction, const BYTE data[], DWORD length)
+{
+	DWORD i;
+
+	SSCP_Trace("%s", direction);
+	for (i = 0; i < length; i++)
+		SSCP_Trace("%02X", data[i]);
+	SSCP_Trace("\n");
+}
+
+/* Queue the response frame, from the reader at the address of the command */
+static void SSCP_SelfTestAnswer(SSCP_SELFTEST_ST* selfTest, const BYTE payload[], DWORD payloadSz)
+{
+	BYTE header[5];
+	BYTE crc[2];
+	DWORD i;
+
+	if (selfTest->rxCount + sizeof(header) + payloadSz + sizeof(crc) > sizeof(selfTest->rx))
+		return; /* The host does not read its responses: they are lost, as on a line */
+
+	header[0] = 0x02; /* SOF */
+	header[1] = (BYTE)(payloadSz >> 8);
+	header[2] = (BYTE)(payloadSz);
+	header[3] = selfTest->header[3];
+	header[4] = selfTest->header[4];
+	SSCP_SCR16(&header[1], 4, payload, payloadSz, crc);
+
+	for (i = 0; i < sizeof(header) + payloadSz + sizeof(crc); i++)
+	{
+		BYTE b = (i < sizeof(header)) ? header[i] : (i < sizeof(header) + payloadSz) ? payload[i - sizeof(header)] : crc[i - sizeof(header) - payloadSz];
+		selfTest->rx[(selfTest->rxHead + selfTest->rxCount++) % sizeof(selfTest->rx)] = b;
+	}
+}
+
+/* A whole frame has been sent by the host */
+static void SSCP_SelfTestFrame(SSCP_CTX_ST* ctx, SSCP_SELFTEST_ST* selfTest, DWORD payloadSz)
+{
+	switch (selfTest->header[4])
+	{
+		case SSCP_PROTOCOL_AUTHENTICATE:
+			/* 1st step: 0x0000 then rndA; 2nd step: A, rndB and hA */
+			if ((payloadSz == 2 + 16) && (selfTest->start[0] == 0x00) && (selfTest->start[1] == 0x00))
+			{
+				if (ctx->settings.debugAuthenticate)
+				{
+					SSCP_SelfTestTrace("<", selfTest->start, payloadSz);
+					SSCP_SelfTestTrace(">", SSCP_SELFTEST_AUTH_RESPONSE, sizeof(SSCP_SELFTEST_AUTH_RESPONSE));
+				}
+				SSCP_SelfTestAnswer(selfTest, SSCP_SELFTEST_AUTH_RESPONSE, sizeof(SSCP_SELFTEST_AUTH_RESPONSE));
+			}
+			else
+			{
+				SSCP_SelfTestAnswer(selfTest, SSCP_SELFTEST_AUTH_ACK, sizeof(SSCP_SELFTEST_AUTH_ACK));
+			}
+		break;
+		case SSCP_PROTOCOL_SECURE:
+			SSCP_SelfTestAnswer(selfTest, SSCP_SELFTEST_SECURE_RESPONSE, sizeof(SSCP_SELFTEST_SECURE_RESPONSE));
+		break;
+		default:
+			/* Not a reader's protocol: no answer */
+		break;
+	}
+}
+
+static LONG SSCP_SelfTestOpen(SSCP_CTX_ST* ctx, const char* commName)
+{
+	SSCP_SELFTEST_ST* selfTest;
+
+	(void) commName;
+
+	selfTest = (SSCP_SELFTEST_ST*) SSCP_MemAlloc(sizeof(SSCP_SELFTEST_ST));
+	if (selfTest == NULL)
+		return SSCP_ERR_OUT_OF_MEMORY;
+
+	ctx->port->transportData = selfTest;
+
+	/* Nothing to wait on, see SSCP_AsyncGetPollInfo() */
+#ifdef _WIN32
+	ctx->port->commHandle = INVALID_HANDLE_VALUE;
+#else
+	ctx->port->commFd = -1;
+#endif
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_SelfTestClose(SSCP_CTX_ST* ctx)
+{
+	SSCP_MemFree(SSCP_SelfTestOf(ctx));
+	ctx->port->transportData = NULL;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_SelfTestConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+{
+	(void) ctx;
+	(void) baudrate;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_SelfTestSetTimeouts(SSCP_CTX_ST* ctx, DWORD firstByte, DWORD interByte)
+{
+	ctx->port->firstByteTimeout = firstByte;
+	ctx->port->interByteTimeout = interByte;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_SelfTestSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
+{
+	SSCP_SELFTEST_ST* selfTest = SSCP_SelfTestOf(ctx);
+	DWORD total = 0, i, j;
+
+	for (i = 0; i < chunkCount; i++)
+	{
+		for (j = 0; j < chunks[i].length; j++)
+		{
+			BYTE b = chunks[i].buffer[j];
+			DWORD payloadSz;
+
+			/* Anything before a SOF is noise on the line */
+			if ((selfTest->received == 0) && (b != 0x02))
+				continue;
+
+			if (selfTest->received < sizeof(selfTest->header))
+				selfTest->header[selfTest->received] = b;
+			else if (selfTest->received < sizeof(selfTest->header) + sizeof(selfTest->start))
+				selfTest->start[selfTest->received - sizeof(selfTest->header)] = b;
+			selfTest->received++;
+
+			if (selfTest->received < sizeof(selfTest->header))
+				continue;
+
+			payloadSz = ((DWORD) selfTest->header[1] << 8) | selfTest->header[2];
+			if (selfTest->received == sizeof(selfTest->header) + payloadSz + 2)
+			{
+				SSCP_SelfTestFrame(ctx, selfTest, payloadSz);
+				selfTest->received = 0;
+			}
+		}
+		total += chunks[i].length;
+	}
+
+	ctx->stats.bytesSent += total;
+	*sent = total;
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_SelfTestSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	DWORD sent;
+
+	return SSCP_SelfTestSendSomeV(ctx, chunks, chunkCount, &sent);
+}
+
+static LONG SSCP_SelfTestRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
+{
+	SSCP_SELFTEST_ST* selfTest = SSCP_SelfTestOf(ctx);
+	DWORD count = 0;
+
+	if (selfTest->rxCount == 0)
+	{
+		/* No command to answer */
+		if (timeoutMs > 0)
+			SSCP_SleepMs(timeoutMs);
+		*received = 0;
+		return SSCP_SUCCESS;
+	}
+
+	while ((count < length) && (selfTest->rxCount > 0))
+	{
+		buffer[count++] = selfTest->rx[selfTest->rxHead];
+		selfTest->rxHead = (selfTest->rxHead + 1) % sizeof(selfTest->rx);
+		selfTest->rxCount--;
+	}
+
+	ctx->stats.bytesReceived += count;
+	*received = count;
+	return SSCP_SUCCESS;
+}
+
+static BOOL SSCP_SelfTestRandom(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz)
+{
+	SSCP_SELFTEST_ST* selfTest = SSCP_SelfTestOf(ctx);
+	const BYTE* value = (selfTest->draws++ == 0) ? SSCP_SELFTEST_RNDA : SSCP_SELFTEST_IV;
+	DWORD i;
+
+	for (i = 0; i < bufferSz; i++)
+		buffer[i] = value[i % 16];
+
+	return TRUE;
+}
+
+const SSCP_TRANSPORT_ST SSCP_TRANSPORT_SELFTEST = {
+	"selftest",
+	SSCP_SelfTestOpen,
+	SSCP_SelfTestClose,
+	SSCP_SelfTestConfigure,
+	SSCP_SelfTestSetTimeouts,
+	SSCP_SelfTestSendV,
+	SSCP_SelfTestSendSomeV,
+	SSCP_SelfTestRecvWait,
+	SSCP_SelfTestRandom
+};
@@ -0,0 +1,384 @@
+/**
+ * @file sscp-host-serial-frame.c
+ * @brief Buffered reception of the SSCP frames.
+ *
+ * Every read takes all that the driver has (up to the free room in the port's ring),
+ * and the frames are then parsed out of the ring. The timeouts are deadlines kept in
+ * user space, so an exchange costs one wait and one read per burst of bytes, whatever
+ * the way the response is split between the header, the payload and the CRC.
+ *
+ * Bytes that can't be the start of a frame (anything but SOF) are dropped, so that
+ * the reception resynchronises on a stray byte instead of failing. A SOF in the noise
+ * is not taken for a frame either: a header that is not for the context (address,
+ * protocol), and a frame of the ring whose CRC is wrong while another frame may start
+ * within it, only cost their SOF, and the search goes on from the next byte. When that
+ * other frame would start in the last bytes received, the rest is waited for: if the
+ * line goes quiet instead, the frame was the response, corrupted.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_RING_MASK (SSCP_RX_RING_SZ - 1)
+
+#define SSCP_RING_NO_NEXT 0
+#define SSCP_RING_NEXT 1 /* A SOF and a plausible header */
+#define SSCP_RING_NEXT_PARTIAL 2 /* A SOF, its header not all there yet */
+
+static BYTE SSCP_RingPeek(const SSCP_PORT_ST* port, DWORD offset)
+{
+	return port->rxRing[(port->rxHead + offset) & SSCP_RING_MASK];
+}
+
+static void SSCP_RingCopy(const SSCP_PORT_ST* port, DWORD offset, BYTE buffer[], DWORD length)
+{
+	DWORD start = (port->rxHead + offset) & SSCP_RING_MASK;
+	DWORD first = SSCP_RX_RING_SZ - start;
+
+	if (first > length)
+		first = length;
+	memcpy(buffer, &port->rxRing[start], first);
+	if (length > first)
+		memcpy(&buffer[first], port->rxRing, length - first);
+}
+
+static void SSCP_RingConsume(SSCP_PORT_ST* port, DWORD length)
+{
+	port->rxHead = (port->rxHead + length) & SSCP_RING_MASK;
+	port->rxCount -= length;
+}
+
+/* CRC of the frame at the head of the ring (header after SOF, then the payload), checked against the one that follows */
+static BOOL SSCP_RingCheckCRC(const SSCP_PORT_ST* port, DWORD length)
+{
+	DWORD start = (port->rxHead + 1) & SSCP_RING_MASK;
+	DWORD total = 4 + length;
+	DWORD first = SSCP_RX_RING_SZ - start;
+	WORD crc;
+
+	if (first > total)
+		first = total;
+	crc = SSCP_CRC16_Update(0xFFFF, &port->rxRing[start], first);
+	if (total > first)
+		crc = SSCP_CRC16_Update(crc, port->rxRing, total - first);
+
+	return ((SSCP_RingPeek(port, 5 + length) == (BYTE)(crc >> 8)) && (SSCP_RingPeek(port, 5 + length + 1) == (BYTE) crc)) ? TRUE : FALSE;
+}
+
+/* Drop what comes before the next SOF; *dropped counts it */
+static void SSCP_RingSeekSOF(SSCP_PORT_ST* port, DWORD* dropped)
+{
+	while ((port->rxCount > 0) && (SSCP_RingPeek(port, 0) != 0x02))
+	{
+		SSCP_RingConsume(port, 1);
+		(*dropped)++;
+	}
+}
+
+/* The 5 bytes at offset in the ring may be the header of a response to the context */
+static BOOL SSCP_RingHeaderPlausible(SSCP_CTX_ST* ctx, DWORD offset, DWORD* length)
+{
+	SSCP_PORT_ST* port = ctx->port;
+	BYTE protocol = SSCP_RingPeek(port, offset + 4);
+
+	*length = SSCP_RingPeek(port, offset + 1);
+	*length <<= 8;
+	*length |= SSCP_RingPeek(port, offset + 2);
+
+	if (SSCP_RingPeek(port, offset + 3) != ctx->address)
+		return FALSE;
+	if ((protocol != SSCP_PROTOCOL_AUTHENTICATE) && (protocol != SSCP_PROTOCOL_SECURE))
+		return FALSE;
+
+	return TRUE;
+}
+
+/* Whether another frame may start after the head of the ring, one of the SSCP_RING_* values */
+static BYTE SSCP_RingNextFrame(SSCP_CTX_ST* ctx)
+{
+	SSCP_PORT_ST* port = ctx->port;
+	DWORD offset, length;
+
+	for (offset = 1; offset < port->rxCount; offset++)
+	{
+		if (SSCP_RingPeek(port, offset) != 0x02)
+			continue;
+		if (port->rxCount - offset < 5)
+			return SSCP_RING_NEXT_PARTIAL;
+		if (SSCP_RingHeaderPlausible(ctx, offset, &length))
+			return SSCP_RING_NEXT;
+	}
+
+	return SSCP_RING_NO_NEXT;
+}
+
+/* Forget what has been received so far (called before a command is sent) */
+void SSCP_SerialFlushRing(SSCP_CTX_ST* ctx)
+{
+	ctx->port->rxHead = 0;
+	ctx->port->rxCount = 0;
+}
+
+/*
+ * One read into the ring, after waiting up to timeoutMs for some bytes (0: no wait).
+ * *received is 0 if nothing came.
+ */
+LONG SSCP_SerialFillRing(SSCP_CTX_ST* ctx, DWORD timeoutMs, DWORD* received)
+{
+	SSCP_PORT_ST* port = ctx->port;
+	DWORD tail = (port->rxHead + port->rxCount) & SSCP_RING_MASK;
+	DWORD room = SSCP_RX_RING_SZ - port->rxCount;
+	LONG rc;
+
+	*received = 0;
+
+	/* Contiguous free part only, the next call gets the part at the beginning */
+	if (room > SSCP_RX_RING_SZ - tail)
+		room = SSCP_RX_RING_SZ - tail;
+	if (room == 0)
+		return SSCP_SUCCESS;
+
+	rc = SSCP_TransportRecvWait(ctx, &port->rxRing[tail], room, timeoutMs, received);
+	if (rc == SSCP_SUCCESS)
+		port->rxCount += *received;
+
+	return rc;
+}
+
+/*
+ * Extract a complete frame from the ring, its CRC checked.
+ * Returns SSCP_ERR_IN_PROGRESS if it is not all there yet.
+ */
+LONG SSCP_SerialRingFrame(SSCP_CTX_ST* ctx, BYTE header[5], BYTE payload[], DWORD maxPayloadSz, BYTE crc[2])
+{
+	SSCP_PORT_ST* port = ctx->port;
+	DWORD length, dropped = 0;
+	BYTE next;
+
+	/* Resynchronise on SOF, and on the next one if that was not a frame */
+	for (;;)
+	{
+		SSCP_RingSeekSOF(port, &dropped);
+		if (port->rxCount < 5)
+			break;
+
+		/* A frame of the ring is never longer than the ring */
+		if (!SSCP_RingHeaderPlausible(ctx, 0, &length) || (5 + length + 2 > SSCP_RX_RING_SZ))
+		{
+			SSCP_RingConsume(port, 1);
+			dropped++;
+			continue;
+		}
+		if (port->rxCount < 5 + length + 2)
+			break;
+
+		if (SSCP_RingCheckCRC(port, length))
+			break;
+		next = SSCP_RingNextFrame(ctx);
+		if (next == SSCP_RING_NO_NEXT)
+		{
+			/* Nothing else came: the frame itself is corrupted */
+			if (dropped && ctx->settings.debugExchange)
+				SSCP_Trace("Dropped %lu byte(s) before SOF\n", (unsigned long) dropped);
+			SSCP_RingCopy(port, 0, header, 5);
+			SSCP_RingCopy(port, 5 + length, crc, 2);
+			SSCP_RingConsume(port, 5 + length + 2);
+			return SSCP_ERR_WRONG_RESPONSE_CRC;
+		}
+		if (next == SSCP_RING_NEXT_PARTIAL)
+		{
+			/* The frame is kept until that SOF is known better, see SSCP_SerialRingSettle() */
+			if (dropped && ctx->settings.debugExchange)
+				SSCP_Trace("Dropped %lu byte(s) before SOF\n", (unsigned long) dropped);
+			return SSCP_ERR_IN_PROGRESS;
+		}
+		SSCP_RingConsume(port, 1);
+		dropped++;
+	}
+	if (dropped && ctx->settings.debugExchange)
+		SSCP_Trace("Dropped %lu byte(s) before SOF\n", (unsigned long) dropped);
+
+	if ((port->rxCount < 5) || (port->rxCount < 5 + length + 2))
+		return SSCP_ERR_IN_PROGRESS;
+
+	if (length > maxPayloadSz) /* Payload will not fit */
+	{
+		SSCP_RingConsume(port, 5 + length + 2);
+		return SSCP_ERR_RESPONSE_TOO_LONG;
+	}
+
+	SSCP_RingCopy(port, 0, header, 5);
+	SSCP_RingCopy(port, 5, payload, length);
+	SSCP_RingCopy(port, 5 + length, crc, 2);
+	SSCP_RingConsume(port, 5 + length + 2);
+
+	if (SSCP_TRACE_ON(ctx))
+		SSCP_TraceFrame(ctx, SSCP_TRACE_RX, header, payload, length);
+
+	return SSCP_SUCCESS;
+}
+
+/*
+ * The line has gone quiet: a frame at the head of the ring whose CRC is wrong, kept
+ * while a SOF in its last bytes was waited on, is the response, corrupted. Returns
+ * TRUE if so (the frame is consumed, its header and CRC copied).
+ */
+BOOL SSCP_SerialRingSettle(SSCP_CTX_ST* ctx, BYTE header[5], BYTE crc[2])
+{
+	SSCP_PORT_ST* port = ctx->port;
+	DWORD length;
+
+	if ((port->rxCount < 5) || (SSCP_RingPeek(port, 0) != 0x02) || !SSCP_RingHeaderPlausible(ctx, 0, &length))
+		return FALSE;
+	if ((port->rxCount < 5 + length + 2) || SSCP_RingCheckCRC(port, length))
+		return FALSE;
+
+	SSCP_RingCopy(port, 0, header, 5);
+	SSCP_RingCopy(port, 5 + length, crc, 2);
+	SSCP_RingConsume(port, 5 + length + 2);
+	return TRUE;
+}
+
+/*
+ * Receive a complete frame, waiting up to the port's first byte timeout for the
+ * beginning of it, then up to the inter byte timeout between two bursts.
+ */
+LONG SSCP_SerialRecvFrame(SSCP_CTX_ST* ctx, BYTE header[5], BYTE payload[], DWORD maxPayloadSz, BYTE crc[2])
+{
+	DWORD deadline = SSCP_GetTickMs() + ctx->port->firstByteTimeout;
+	BOOL started = (ctx->port->rxCount > 0) ? TRUE : FALSE;
+	LONG rc;
+
+	for (;;)
+	{
+		DWORD received;
+		LONG left;
+
+		rc = SSCP_SerialRingFrame(ctx, header, payload, maxPayloadSz, crc);
+		if (rc != SSCP_ERR_IN_PROGRESS)
+			return rc;
+
+		left = (LONG)(deadline - SSCP_GetTickMs());
+		if (left <= 0)
+		{
+			if (SSCP_SerialRingSettle(ctx, header, crc))
+				return SSCP_ERR_WRONG_RESPONSE_CRC;
+			return started ? SSCP_ERR_COMM_RECV_STOPPED : SSCP_ERR_COMM_RECV_MUTE;
+		}
+
+		rc = SSCP_SerialFillRing(ctx, (DWORD) left, &received);
+		if (rc)
+			return rc;
+
+		if (received > 0)
+		{
+			started = TRUE;
+			deadline = SSCP_GetTickMs() + ctx->port->interByteTimeout;
+		}
+	}
+}
+
+/* Wait for more bytes, up to the deadline; the next deadline is the inter byte one */
+static LONG SSCP_SerialStreamWait(SSCP_CTX_ST* ctx, DWORD* deadline, BOOL* started)
+{
+	for (;;)
+	{
+		DWORD received;
+		LONG left, rc;
+
+		left = (LONG)(*deadline - SSCP_GetTickMs());
+		if (left <= 0)
+			return *started ? SSCP_ERR_COMM_RECV_STOPPED : SSCP_ERR_COMM_RECV_MUTE;
+
+		rc = SSCP_SerialFillRing(ctx, (DWORD) left, &received);
+		if (rc)
+			return rc;
+
+		if (received > 0)
+		{
+			*started = TRUE;
+			*deadline = SSCP_GetTickMs() + ctx->port->interByteTimeout;
+			return SSCP_SUCCESS;
+		}
+	}
+}
+
+/*
+ * Receive a frame straight into payload as it comes, whatever its length (the ring
+ * only holds what has not been taken yet). progress, if not NULL, is called each
+ * time more of the payload is there, with the number of bytes received so far and
+ * the length of the payload.
+ */
+LONG SSCP_SerialRecvStream(SSCP_CTX_ST* ctx, BYTE header[5], BYTE payload[], DWORD maxPayloadSz, BYTE crc[2], SSCP_SERIAL_PROGRESS progress, void* userData)
+{
+	SSCP_PORT_ST* port = ctx->port;
+	DWORD deadline = SSCP_GetTickMs() + port->firstByteTimeout;
+	BOOL started = (port->rxCount > 0) ? TRUE : FALSE;
+	DWORD length, offset = 0, dropped = 0;
+	LONG rc;
+
+	/* Header, after SOF; the payload is taken as it comes, so only the header tells a stray SOF */
+	for (;;)
+	{
+		SSCP_RingSeekSOF(port, &dropped);
+		if (port->rxCount >= 5)
+		{
+			if (SSCP_RingHeaderPlausible(ctx, 0, &length))
+				break;
+			SSCP_RingConsume(port, 1);
+			dropped++;
+			continue;
+		}
+
+		rc = SSCP_SerialStreamWait(ctx, &deadline, &started);
+		if (rc)
+			return rc;
+	}
+	if (dropped && ctx->settings.debugExchange)
+		SSCP_Trace("Dropped %lu byte(s) before SOF\n", (unsigned long) dropped);
+
+	SSCP_RingCopy(port, 0, header, 5);
+	SSCP_RingConsume(port, 5);
+
+	length = header[1];
+	length <<= 8;
+	length |= header[2];
+
+	if (length > maxPayloadSz) /* Payload will not fit */
+		return SSCP_ERR_RESPONSE_TOO_LONG;
+
+	/* Payload, piece by piece */
+	while (offset < length)
+	{
+		DWORD count = port->rxCount;
+
+		if (count > length - offset)
+			count = length - offset;
+		if (count > 0)
+		{
+			SSCP_RingCopy(port, 0, &payload[offset], count);
+			SSCP_RingConsume(port, count);
+			offset += count;
+			if (progress != NULL)
+				progress(ctx, payload, offset, length, userData);
+			continue;
+		}
+
+		rc = SSCP_SerialStreamWait(ctx, &deadline, &started);
+		if (rc)
+			return rc;
+	}
+
+	/* CRC */
+	while (port->rxCount < 2)
+	{
+		rc = SSCP_SerialStreamWait(ctx, &deadline, &started);
+		if (rc)
+			return rc;
+	}
+	SSCP_RingCopy(port, 0, crc, 2);
+	SSCP_RingConsume(port, 2);
+
+	if (SSCP_TRACE_ON(ctx))
+		SSCP_TraceFrame(ctx, SSCP_TRACE_RX, header, payload, length);
+
+	return SSCP_SUCCESS;
+}
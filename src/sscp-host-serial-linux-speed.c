@@ -0,0 +1,37 @@
+/**
+ * @file sscp-host-serial-linux-speed.c
+ * @brief Baudrates that have no Bxxxx constant, through termios2 and BOTHER (Linux only).
+ *
+ * <asm/termbits.h> can't be included together with <termios.h>, hence this separate
+ * file, called by SSCP_SerialConfigure() once the rest of the line settings are in place.
+ */
+#include "sscp-host-serial_i.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+LONG SSCP_SerialSetOtherSpeed(int fd, DWORD baudrate)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return SSCP_ERR_COMM_CONTROL_FAILED;
+
+	/* Same speed both ways: the input speed follows the output one when CIBAUD is 0 */
+	tio.c_cflag &= ~CBAUD;
+#ifdef CIBAUD
+	tio.c_cflag &= ~CIBAUD;
+#endif
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = (speed_t) baudrate;
+	tio.c_ospeed = (speed_t) baudrate;
+
+	if (ioctl(fd, TCSETS2, &tio) != 0)
+		return SSCP_ERR_COMM_CONTROL_FAILED;
+
+	return SSCP_SUCCESS;
+}
+
+#endif
@@ -7,63 +7,64 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <errno.h>
 
 BOOL SSCP_DEBUG_SERIAL = FALSE;
 
-LONG SSCP_SerialOpen(SSCP_CTX_ST* ctx, const char* commName)
+static LONG SSCP_SerialOpen(SSCP_CTX_ST* ctx, const char* commName)
 {
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
 	if (commName == NULL)
 		return SSCP_ERR_INVALID_PARAMETER;
 
-	/* Don't forget to close in case of it were previously open */
-	SSCP_SerialClose(ctx);
-
 	/* Start-up here */
-	if (SSCP_DEBUG_SERIAL)
+	if (ctx->settings.debugSerial)
 		SSCP_Trace("Opening device %s...\n", commName);
 
-    ctx->commFd = open(commName, O_RDWR | O_NOCTTY);
+	/* Non-blocking, so that the asynchronous API never stalls; the blocking functions select() first */
+    ctx->port->commFd = open(commName, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
-	if (ctx->commFd < 0)
+	if (ctx->port->commFd < 0)
 	{
-		if (SSCP_DEBUG_SERIAL)
+		if (ctx->settings.debugSerial)
 			SSCP_Trace("open (%d)\n", errno);
         return SSCP_ERR_COMM_NOT_AVAILABLE;
 	}
 
 	/* Clear UART */
-	tcflush(ctx->commFd, TCIFLUSH);
+	tcflush(ctx->port->commFd, TCIFLUSH);
+	SSCP_SerialFlushRing(ctx);
     
     return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialClose(SSCP_CTX_ST* ctx)
+static LONG SSCP_SerialClose(SSCP_CTX_ST* ctx)
 {
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-    if (ctx->commFd < 0)
+    if (ctx->port->commFd < 0)
 		return SSCP_ERR_COMM_NOT_OPEN;
 
-	if (SSCP_DEBUG_SERIAL)
+	if (ctx->settings.debugSerial)
 		SSCP_Trace("Closing device\n");
 
-	close(ctx->commFd);
+	close(ctx->port->commFd);
 
-	ctx->commFd = -1;
+	ctx->port->commFd = -1;
 
 	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+static LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
 {
     struct termios newtio;
+	BOOL otherSpeed = FALSE;
 
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commFd < 0)
+	if (ctx->port->commFd < 0)
 		return SSCP_ERR_COMM_NOT_OPEN;
 
 	bzero(&newtio, sizeof(newtio));
@@ -94,8 +95,35 @@ LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
 		case 1200:
 			newtio.c_cflag |= B1200;
 		break;
+		case 57600:
+			newtio.c_cflag |= B57600;
+		break;
+#ifdef B230400
+		case 230400:
+			newtio.c_cflag |= B230400;
+		break;
+#endif
+#ifdef B460800
+		case 460800:
+			newtio.c_cflag |= B460800;
+		break;
+#endif
+#ifdef B921600
+		case 921600:
+			newtio.c_cflag |= B921600;
+		break;
+#endif
+		case 0:
+			return SSCP_ERR_INVALID_PARAMETER;
 		default:
-			return FALSE;
+#ifdef __linux__
+			/* Any other rate is set afterwards, see sscp-host-serial-linux-speed.c */
+			newtio.c_cflag |= B38400;
+			otherSpeed = TRUE;
+		break;
+#else
+			return SSCP_ERR_INVALID_PARAMETER;
+#endif
 	}
 	newtio.c_iflag = IGNPAR | IGNBRK;
 	newtio.c_oflag = 0;
@@ -106,150 +134,218 @@ LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
 	newtio.c_cc[VTIME] = 0;	// inter-character timer unused
 	newtio.c_cc[VMIN] = 1;	// blocking read until 1 chars received
 
-	tcflush(ctx->commFd, TCIFLUSH);
+	tcflush(ctx->port->commFd, TCIFLUSH);
 
-	if (tcsetattr(ctx->commFd, TCSANOW, &newtio))
+	if (tcsetattr(ctx->port->commFd, TCSANOW, &newtio))
 	{
-		if (SSCP_DEBUG_SERIAL)
+		if (ctx->settings.debugSerial)
 			SSCP_Trace("tcsetattr failed (%d)\n", errno);
 		return SSCP_ERR_COMM_CONTROL_FAILED;
 	}
 
+#ifdef __linux__
+	if (otherSpeed && (SSCP_SerialSetOtherSpeed(ctx->port->commFd, baudrate) != SSCP_SUCCESS))
+	{
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("TCSETS2(%lu) failed (%d)\n", (unsigned long) baudrate, errno);
+		return SSCP_ERR_COMM_CONTROL_FAILED;
+	}
+#endif
+
     return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialSetTimeouts(SSCP_CTX_ST* ctx, DWORD first_byte, DWORD inter_byte)
+static LONG SSCP_SerialSetTimeouts(SSCP_CTX_ST* ctx, DWORD first_byte, DWORD inter_byte)
 {
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commFd < 0)
+	if (ctx->port->commFd < 0)
 		return SSCP_ERR_COMM_NOT_OPEN;
 
-	ctx->firstByteTimeout = first_byte;
-	ctx->interByteTimeout = inter_byte;
+	ctx->port->firstByteTimeout = first_byte;
+	ctx->port->interByteTimeout = inter_byte;
 
     return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length)
+/* One writev(), without waiting; *sent is 0 if the driver's buffer is full */
+static LONG SSCP_SerialSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
 {
-	DWORD remainingLen = length;
-	DWORD offset = 0;
+	struct iovec iov[SSCP_SERIAL_MAX_CHUNKS];
+	ssize_t written;
+	DWORD i;
 
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commFd < 0)
+	if (ctx->port->commFd < 0)
 		return SSCP_ERR_COMM_NOT_OPEN;
-	if (buffer == NULL)
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS) || (sent == NULL))
 		return SSCP_ERR_INVALID_PARAMETER;
 
-	while (remainingLen)
+	*sent = 0;
+
+	for (i = 0; i < chunkCount; i++)
 	{
-        DWORD writeLen = remainingLen;
-        int i;        
-		int written = write(ctx->commFd, &buffer[offset], writeLen);
+		iov[i].iov_base = (void*) chunks[i].buffer;
+		iov[i].iov_len = chunks[i].length;
+	}
 
-		if (written <= 0)
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("write(%d) error (%d)\n", writeLen, errno);
-			return SSCP_ERR_COMM_SEND_FAILED;
-		}
+	written = writev(ctx->port->commFd, iov, (int) chunkCount);
+	if (written < 0)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return SSCP_SUCCESS; /* Try again later */
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("writev(%lu) error (%d)\n", (unsigned long) chunkCount, errno);
+		return SSCP_ERR_COMM_SEND_FAILED;
+	}
 
-		if (SSCP_DEBUG_SERIAL)
-		{
-			SSCP_Trace("<");
-			for (i = 0; i < written; i++)
-				SSCP_Trace("%02X", buffer[offset + i]);
-			SSCP_Trace("\n");
-		}
+	if (ctx->settings.debugSerial)
+	{
+		DWORD left = (DWORD) written;
+		DWORD j;
+		SSCP_Trace("<");
+		for (i = 0; (i < chunkCount) && left; i++)
+			for (j = 0; (j < chunks[i].length) && left; j++, left--)
+				SSCP_Trace("%02X", chunks[i].buffer[j]);
+		SSCP_Trace("\n");
+	}
+
+	ctx->stats.bytesSent += (DWORD) written;
+	*sent = (DWORD) written;
+	return SSCP_SUCCESS;
+}
+
+/* Send all the chunks, with as few writev() as the driver allows (one, usually) */
+static LONG SSCP_SerialSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	SSCP_SERIAL_CHUNK_ST pending[SSCP_SERIAL_MAX_CHUNKS];
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->commFd < 0)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS))
+		return SSCP_ERR_INVALID_PARAMETER;
 
-		if (written < writeLen)
+	memcpy(pending, chunks, chunkCount * sizeof(SSCP_SERIAL_CHUNK_ST));
+	chunkCount = SSCP_SerialSkipChunks(pending, chunkCount, 0);
+
+	while (chunkCount)
+	{
+		DWORD written;
+
+		rc = SSCP_SerialSendSomeV(ctx, pending, chunkCount, &written);
+		if (rc)
+			return rc;
+
+		if (written == 0)
 		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("write(%d/%d) failed (%d)\n", written, writeLen, errno);
-			return SSCP_ERR_COMM_SEND_FAILED;
+			/* Driver's buffer is full, wait until it accepts more */
+			struct timeval timeout;
+			fd_set write_fds;
+
+			FD_ZERO(&write_fds);
+			FD_SET(ctx->port->commFd, &write_fds);
+			timeout.tv_sec = 1;
+			timeout.tv_usec = 0;
+
+			if (select(ctx->port->commFd + 1, NULL, &write_fds, NULL, &timeout) <= 0)
+			{
+				if (ctx->settings.debugSerial)
+					SSCP_Trace("select on write failed (%d)\n", errno);
+				return SSCP_ERR_COMM_SEND_FAILED;
+			}
+			continue;
 		}
 
-		remainingLen -= written;
-		offset += written;
+		/* A partial write is not an error on a non-blocking port, the loop sends the rest */
+		chunkCount = SSCP_SerialSkipChunks(pending, chunkCount, written);
 	}
 
-	return SSCP_SUCCESS;        
+	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialRecv(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length)
+/* Wait up to timeoutMs for some bytes (0: don't wait), then read all that is there */
+static LONG SSCP_SerialRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
 {
-	size_t received = 0;
+	int done;
 
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commFd < 0)
+	if (ctx->port->commFd < 0)
 		return SSCP_ERR_COMM_NOT_OPEN;
-	if (buffer == NULL)
+	if ((buffer == NULL) || (received == NULL))
 		return SSCP_ERR_INVALID_PARAMETER;
 
-    while (received < length)
+	*received = 0;
+
+	if (timeoutMs > 0)
 	{
 		struct timeval timeout;
 		fd_set read_fds;
-		int done;
-
-        FD_ZERO(&read_fds);
-        FD_SET(ctx->commFd, &read_fds);
-
-        if (received == 0)
-		{
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 500000; // 1500ms
-        }
-		else
-		{
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 50000; // 50ms
-        }
-
-        int sel = select(ctx->commFd + 1, &read_fds, NULL, NULL, &timeout);
-        if (sel < 0)
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("select on read(%d/%d) failed (%d) [%d]\n", received, length, errno, sel);
-            return SSCP_ERR_COMM_RECV_FAILED;
-        }
-		else if (sel == 0)
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("select on read(%d/%d) failed (%d)\n", received, length, errno);
-            return (received == 0) ? SSCP_ERR_COMM_RECV_MUTE : SSCP_ERR_COMM_RECV_STOPPED;
-        }
+		int sel;
 
-        done = read(ctx->commFd, &buffer[received], length - received);
-        if (done < 0)
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("read(%d/%d) failed (%d) [%d]\n", received, length, errno, done);
-            return SSCP_ERR_COMM_RECV_FAILED;
-        } 
-		else if (done == 0)
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("read(%d/%d) failed (%d)\n", received, length, errno);
-            return SSCP_ERR_COMM_RECV_FAILED; // Shouldn’t happen, select said ready
-        }
+		FD_ZERO(&read_fds);
+		FD_SET(ctx->port->commFd, &read_fds);
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_usec = (timeoutMs % 1000) * 1000;
 
-		if (SSCP_DEBUG_SERIAL)
+		sel = select(ctx->port->commFd + 1, &read_fds, NULL, NULL, &timeout);
+		if (sel < 0)
 		{
-			int i;
-			SSCP_Trace(">");
-			for (i = 0; i < done; i++)
-				SSCP_Trace("%02X", buffer[received + i]);
-			SSCP_Trace("\n");
+			if (errno == EINTR)
+				return SSCP_SUCCESS; /* The caller checks its deadline and waits again */
+			if (ctx->settings.debugSerial)
+				SSCP_Trace("select on read(%lu) failed (%d)\n", (unsigned long) length, errno);
+			return SSCP_ERR_COMM_RECV_FAILED;
 		}
+		if (sel == 0)
+			return SSCP_SUCCESS; /* Timeout */
+	}
 
-        received += done;
-    }    
+	done = read(ctx->port->commFd, buffer, length);
+	if (done < 0)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return SSCP_SUCCESS; /* Nothing yet */
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("read(%lu) failed (%d)\n", (unsigned long) length, errno);
+		return SSCP_ERR_COMM_RECV_FAILED;
+	}
+	if (done == 0)
+	{
+		/* End of file: the device is gone */
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("read(%lu) failed, end of file\n", (unsigned long) length);
+		return SSCP_ERR_COMM_RECV_FAILED;
+	}
 
+	if (ctx->settings.debugSerial)
+	{
+		int i;
+		SSCP_Trace(">");
+		for (i = 0; i < done; i++)
+			SSCP_Trace("%02X", buffer[i]);
+		SSCP_Trace("\n");
+	}
+
+	ctx->stats.bytesReceived += (DWORD) done;
+	*received = done;
 	return SSCP_SUCCESS;
 }
 
+const SSCP_TRANSPORT_ST SSCP_TRANSPORT_SERIAL = {
+	"serial",
+	SSCP_SerialOpen,
+	SSCP_SerialClose,
+	SSCP_SerialConfigure,
+	SSCP_SerialSetTimeouts,
+	SSCP_SerialSendV,
+	SSCP_SerialSendSomeV,
+	SSCP_SerialRecvWait,
+	NULL
+};
+
 #endif
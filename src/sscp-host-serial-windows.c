@@ -4,69 +4,71 @@
 
 BOOL SSCP_DEBUG_SERIAL = FALSE;
 
-LONG SSCP_SerialOpen(SSCP_CTX_ST* ctx, const char* commName)
+static LONG SSCP_SerialOpen(SSCP_CTX_ST* ctx, const char* commName)
 {
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
 	if (commName == NULL)
 		return SSCP_ERR_INVALID_PARAMETER;
 
-	/* Don't forget to close in case of it were previously open */
-	SSCP_SerialClose(ctx);
-
 	/* Start-up here */
-	if (SSCP_DEBUG_SERIAL)
+	if (ctx->settings.debugSerial)
 		SSCP_Trace("Opening device %s...\n", commName);
 
-	ctx->commHandle = CreateFile(commName, GENERIC_READ | GENERIC_WRITE, 0,	// comm devices must be opened w/exclusive- 
+	ctx->port->commHandle = CreateFile(commName, GENERIC_READ | GENERIC_WRITE, 0,	// comm devices must be opened w/exclusive- 
 		NULL,		// no security attributes
 		OPEN_EXISTING,	// comm devices must use OPEN_EXISTING
 		0,		// not overlapped I/O
 		NULL		// hTemplate must be NULL for comm devices
 	);
 
-	if (ctx->commHandle == INVALID_HANDLE_VALUE)
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
 		return SSCP_ERR_COMM_NOT_AVAILABLE;
 
-	SetupComm(ctx->commHandle, 512, 512);
+	SetupComm(ctx->port->commHandle, 512, 512);
+
+	ctx->port->timeoutsApplied = FALSE;
+	SSCP_SerialFlushRing(ctx);
 
 	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialClose(SSCP_CTX_ST* ctx)
+static LONG SSCP_SerialClose(SSCP_CTX_ST* ctx)
 {
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commHandle == INVALID_HANDLE_VALUE)
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
 		return SSCP_ERR_COMM_NOT_OPEN;
 
-	if (SSCP_DEBUG_SERIAL)
+	if (ctx->settings.debugSerial)
 		SSCP_Trace("Closing device\n");
 
-	CloseHandle(ctx->commHandle);
+	CloseHandle(ctx->port->commHandle);
 
-	ctx->commHandle = INVALID_HANDLE_VALUE;
+	ctx->port->commHandle = INVALID_HANDLE_VALUE;
 
 	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+static LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
 {
 	DCB dcb;
 
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commHandle == INVALID_HANDLE_VALUE)
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
 		return SSCP_ERR_COMM_NOT_OPEN;
+	if (baudrate == 0)
+		return SSCP_ERR_INVALID_PARAMETER;
 
-	if (!GetCommState(ctx->commHandle, &dcb))
+	if (!GetCommState(ctx->port->commHandle, &dcb))
 	{
-		if (SSCP_DEBUG_SERIAL)
+		if (ctx->settings.debugSerial)
 			SSCP_Trace("GetCommState failed (%d)\n", GetLastError());
 		return SSCP_ERR_COMM_CONTROL_FAILED;
 	}
 
-	dcb.BaudRate = baudrate;
+	dcb.BaudRate = baudrate; /* Any rate the driver accepts, not only the CBR_xxx ones */
 
 	dcb.fBinary = TRUE;
 	dcb.fParity = FALSE;
@@ -85,9 +87,9 @@ LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
 	dcb.fAbortOnError = TRUE;
 	dcb.fTXContinueOnXoff = TRUE;
 
-	if (!SetCommState(ctx->commHandle, &dcb))
+	if (!SetCommState(ctx->port->commHandle, &dcb))
 	{
-		if (SSCP_DEBUG_SERIAL)
+		if (ctx->settings.debugSerial)
 			SSCP_Trace("SetCommState failed (%d)\n", GetLastError());
 		return SSCP_ERR_COMM_CONTROL_FAILED;
 	}
@@ -95,39 +97,66 @@ LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
 	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialSetTimeouts(SSCP_CTX_ST* ctx, DWORD first_byte, DWORD inter_byte)
+/*
+ * Program the COMMTIMEOUTS so that ReadFile returns as soon as a byte is there, or
+ * after readWaitMs (0: at once). They are only changed when needed, SetCommTimeouts
+ * is a round trip to the driver.
+ */
+static LONG SSCP_SerialApplyTimeouts(SSCP_CTX_ST* ctx, DWORD readWaitMs)
 {
 	COMMTIMEOUTS stTimeout = { 0 };
 
-	if (ctx == NULL)
-		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commHandle == INVALID_HANDLE_VALUE)
-		return SSCP_ERR_COMM_NOT_OPEN;
+	if (ctx->port->timeoutsApplied
+		&& (ctx->port->appliedReadWait == readWaitMs)
+		&& (ctx->port->appliedWriteTimeout == ctx->port->interByteTimeout))
+		return SSCP_SUCCESS;
 
-	stTimeout.ReadIntervalTimeout = inter_byte;
-	stTimeout.ReadTotalTimeoutConstant = first_byte;
-	stTimeout.ReadTotalTimeoutMultiplier = inter_byte;
-	stTimeout.WriteTotalTimeoutConstant = inter_byte;
-	stTimeout.WriteTotalTimeoutMultiplier = inter_byte;
+	stTimeout.ReadIntervalTimeout = MAXDWORD;
+	if (readWaitMs > 0)
+	{
+		stTimeout.ReadTotalTimeoutMultiplier = MAXDWORD;
+		stTimeout.ReadTotalTimeoutConstant = readWaitMs;
+	}
+	stTimeout.WriteTotalTimeoutConstant = ctx->port->interByteTimeout;
+	stTimeout.WriteTotalTimeoutMultiplier = ctx->port->interByteTimeout;
 
-	if (!SetCommTimeouts(ctx->commHandle, &stTimeout))
+	if (!SetCommTimeouts(ctx->port->commHandle, &stTimeout))
 	{
-		if (SSCP_DEBUG_SERIAL)
+		if (ctx->settings.debugSerial)
 			SSCP_Trace("SetCommTimeouts failed (%d)\n", GetLastError());
+		ctx->port->timeoutsApplied = FALSE;
 		return SSCP_ERR_COMM_CONTROL_FAILED;
 	}
 
+	ctx->port->timeoutsApplied = TRUE;
+	ctx->port->appliedReadWait = readWaitMs;
+	ctx->port->appliedWriteTimeout = ctx->port->interByteTimeout;
+
 	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length)
+static LONG SSCP_SerialSetTimeouts(SSCP_CTX_ST* ctx, DWORD first_byte, DWORD inter_byte)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	ctx->port->firstByteTimeout = first_byte;
+	ctx->port->interByteTimeout = inter_byte;
+
+	/* The read timeouts are deadlines in sscp-host-serial-frame.c, only the write timeout matters here */
+	return SSCP_SerialApplyTimeouts(ctx, ctx->port->timeoutsApplied ? ctx->port->appliedReadWait : first_byte);
+}
+
+static LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length)
 {
 	const BYTE* pSendBuffer;
 	DWORD dwTotalLen;
 
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commHandle == INVALID_HANDLE_VALUE)
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
 		return SSCP_ERR_COMM_NOT_OPEN;
 	if (buffer == NULL)
 		return SSCP_ERR_INVALID_PARAMETER;
@@ -146,16 +175,16 @@ LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length)
 		else
 			dwWriteLen = 256;
 
-		if (!WriteFile(ctx->commHandle, pSendBuffer, dwWriteLen, &dwWritten, 0))
+		if (!WriteFile(ctx->port->commHandle, pSendBuffer, dwWriteLen, &dwWritten, 0))
 		{
-			if (SSCP_DEBUG_SERIAL)
+			if (ctx->settings.debugSerial)
 				SSCP_Trace("WriteFile(%d) error (%d)\n", dwWriteLen, GetLastError());
 			return SSCP_ERR_COMM_SEND_FAILED;
 		}
 
 		ctx->stats.bytesSent += dwWritten;
 
-		if (SSCP_DEBUG_SERIAL)
+		if (ctx->settings.debugSerial)
 		{
 			SSCP_Trace("<");
 			for (i = 0; i < dwWritten; i++)
@@ -165,7 +194,7 @@ LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length)
 
 		if (dwWritten < dwWriteLen)
 		{
-			if (SSCP_DEBUG_SERIAL)
+			if (ctx->settings.debugSerial)
 				SSCP_Trace("WriteFile(%d/%d) failed (%d)\n", dwWritten, dwWriteLen, GetLastError());
 			return SSCP_ERR_COMM_SEND_FAILED;
 		}
@@ -177,69 +206,137 @@ LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length)
 	return SSCP_SUCCESS;
 }
 
-LONG SSCP_SerialRecv(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length)
+/* The chunks are coalesced, so that a frame is one WriteFile (one USB transfer) */
+static LONG SSCP_SerialSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	DWORD length;
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	rc = SSCP_SerialCoalesceChunks(ctx->port->txFrame, sizeof(ctx->port->txFrame), chunks, chunkCount, &length);
+	if (rc)
+		return rc;
+
+	return SSCP_SerialSend(ctx, ctx->port->txFrame, length);
+}
+
+static LONG SSCP_SerialSendSome(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length, DWORD* sent)
 {
-	BYTE* pRecvBuffer;
-	DWORD dwRemainingLen = length;
-	DWORD dwReceivedLen = 0;
+	DWORD dwWritten = 0;
 	DWORD i;
 
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
-	if (ctx->commHandle == INVALID_HANDLE_VALUE)
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
 		return SSCP_ERR_COMM_NOT_OPEN;
-	if (buffer == NULL)
+	if ((buffer == NULL) || (sent == NULL))
 		return SSCP_ERR_INVALID_PARAMETER;
 
-	pRecvBuffer = buffer;
+	*sent = 0;
 
-	while (dwRemainingLen)
+	/* The driver queues the bytes, WriteFile returns before they are on the wire */
+	if (!WriteFile(ctx->port->commHandle, buffer, length, &dwWritten, 0))
 	{
-		DWORD dwWantLen, dwGotLen;
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("WriteFile(%d) error (%d)\n", length, GetLastError());
+		return SSCP_ERR_COMM_SEND_FAILED;
+	}
 
-		if (dwRemainingLen < 32)
-			dwWantLen = dwRemainingLen;
-		else
-			dwWantLen = 32;
+	ctx->stats.bytesSent += dwWritten;
 
-		if (!ReadFile(ctx->commHandle, pRecvBuffer, dwWantLen, &dwGotLen, 0))
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("ReadFile failed (%d)\n", GetLastError());
-			return SSCP_ERR_COMM_RECV_FAILED;
-		}
+	if (ctx->settings.debugSerial)
+	{
+		SSCP_Trace("<");
+		for (i = 0; i < dwWritten; i++)
+			SSCP_Trace("%02X", buffer[i]);
+		SSCP_Trace("\n");
+	}
 
-		ctx->stats.bytesReceived += dwGotLen;
+	*sent = dwWritten;
+	return SSCP_SUCCESS;
+}
 
-		if (SSCP_DEBUG_SERIAL)
-		{
-			SSCP_Trace(">");
-			for (i = 0; i < dwGotLen; i++)
-				SSCP_Trace("%02X", pRecvBuffer[i]);
-			SSCP_Trace("\n");
-		}
+static LONG SSCP_SerialSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
+{
+	DWORD length;
+	LONG rc;
 
-		dwRemainingLen -= dwGotLen;
-		dwReceivedLen += dwGotLen;
-		pRecvBuffer += dwGotLen;
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS) || (sent == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
 
-		if (dwGotLen < dwWantLen)
-		{
-			if (SSCP_DEBUG_SERIAL)
-				SSCP_Trace("ReadFile timeout (%d<%d, total %d/%d, code %d)\n", dwGotLen, dwWantLen, dwReceivedLen, length, GetLastError());
-			break;
-		}
+	rc = SSCP_SerialCoalesceChunks(ctx->port->txFrame, sizeof(ctx->port->txFrame), chunks, chunkCount, &length);
+	if (rc)
+		return rc;
+
+	return SSCP_SerialSendSome(ctx, ctx->port->txFrame, length, sent);
+}
+
+/*
+ * Wait for some bytes (0: don't wait), then read all that is there.
+ * The handle is not overlapped: the wait is bounded by the first byte timeout rather
+ * than by timeoutMs exactly (this keeps SetCommTimeouts out of the exchange loop);
+ * the caller checks its own deadline.
+ */
+static LONG SSCP_SerialRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
+{
+	DWORD dwGotLen = 0;
+	DWORD i;
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->commHandle == INVALID_HANDLE_VALUE)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((buffer == NULL) || (received == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*received = 0;
+
+	rc = SSCP_SerialApplyTimeouts(ctx, (timeoutMs > 0) ? ctx->port->firstByteTimeout : 0);
+	if (rc)
+		return rc;
+
+	if (!ReadFile(ctx->port->commHandle, buffer, length, &dwGotLen, 0))
+	{
+		if (ctx->settings.debugSerial)
+			SSCP_Trace("ReadFile(%d) error (%d)\n", length, GetLastError());
+		return SSCP_ERR_COMM_RECV_FAILED;
 	}
 
-	if (dwRemainingLen)	/* A timeout has occured */
+	ctx->stats.bytesReceived += dwGotLen;
+
+	if (ctx->settings.debugSerial && dwGotLen)
 	{
-		if (dwReceivedLen == 0)
-			return SSCP_ERR_COMM_RECV_MUTE;
-		else
-			return SSCP_ERR_COMM_RECV_STOPPED;
+		SSCP_Trace(">");
+		for (i = 0; i < dwGotLen; i++)
+			SSCP_Trace("%02X", buffer[i]);
+		SSCP_Trace("\n");
 	}
 
+	*received = dwGotLen;
 	return SSCP_SUCCESS;
 }
 
+const SSCP_TRANSPORT_ST SSCP_TRANSPORT_SERIAL = {
+	"serial",
+	SSCP_SerialOpen,
+	SSCP_SerialClose,
+	SSCP_SerialConfigure,
+	SSCP_SerialSetTimeouts,
+	SSCP_SerialSendV,
+	SSCP_SerialSendSomeV,
+	SSCP_SerialRecvWait,
+	NULL
+};
+
 #endif
@@ -7,9 +7,10 @@
  * - open/close the communication channel
  * - select the reader address (RS-485) and configure the serial line baudrate
  *
- * The actual platform-specific I/O primitives are implemented by the lower-level
- * serial backend (SSCP_SerialOpen/Close/Configure/SetTimeouts), which typically
- * maps to a COM port on Windows and a POSIX TTY file descriptor on Linux.
+ * The actual I/O primitives are implemented by the transports (see
+ * sscp-host-transport.c): the serial backend, which maps to a COM port on Windows
+ * and a POSIX TTY file descriptor on Linux, and the TCP backend for the
+ * Ethernet-to-RS485 gateways.
  *
  * @note This module is transport-facing. SSCP protocol commands (authentication,
  *       NFC scan, APDU transceive, LEDs, buzzer, etc.) are implemented in higher
@@ -32,54 +33,154 @@ BOOL SSCP_SELFTEST = FALSE;
  */
 SSCP_CTX_ST* SSCP_Alloc(void)
 {
-	struct _SSCP_CTX_ST* ctx = calloc(sizeof(struct _SSCP_CTX_ST), 1);
+	struct _SSCP_CTX_ST* ctx = SSCP_MemAlloc(sizeof(struct _SSCP_CTX_ST));
 	if (ctx == NULL)
 		return NULL;
 
 #ifdef _WIN32
-	ctx->commHandle = INVALID_HANDLE_VALUE;
+	ctx->ownPort.commHandle = INVALID_HANDLE_VALUE;
+	ctx->ownPort.commSocket = (UINT_PTR) ~0; /* INVALID_SOCKET */
 #else
-	ctx->commFd = -1;
+	ctx->ownPort.commFd = -1;
 #endif
+	ctx->port = &ctx->ownPort;
+
+	ctx->settings.selfTest = SSCP_SELFTEST;
+	ctx->settings.debugExchange = SSCP_DEBUG_EXCHANGE;
+	ctx->settings.debugAuthenticate = SSCP_DEBUG_AUTHENTICATE;
+	ctx->settings.debugCrypto = SSCP_DEBUG_CRYPTO;
+	ctx->settings.debugSerial = SSCP_DEBUG_SERIAL;
+	ctx->settings.debugTcp = SSCP_DEBUG_TCP;
+
+	/* No reader: the canned responses come from the loopback, see sscp-host-selftest.c */
+	if (ctx->settings.selfTest && SSCP_TransportOpen(ctx, &SSCP_TRANSPORT_SELFTEST, "selftest", 0))
+	{
+		SSCP_MemFree(ctx);
+		return NULL;
+	}
 
 	return ctx;
 }
 
+/**
+ * @brief Change the debug and self test settings of a context.
+ *
+ * A context starts with the process-wide SSCP_SELFTEST and SSCP_DEBUG_* flags as
+ * they are when it is allocated; changing them afterwards has no effect on it.
+ * Each context (each reader of a bus) has its own settings, so that a thread may
+ * trace the exchanges with a reader without affecting the others.
+ * Setting selfTest puts a context without an open port on the loopback of the self
+ * test; clearing it closes that loopback.
+ *
+ * @param[in,out] ctx SSCP context.
+ * @param[in] settings New settings.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p settings parameter is NULL.
+ */
+LONG SSCP_SetSettings(SSCP_CTX_ST* ctx, const SSCP_SETTINGS_ST* settings)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (settings == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	ctx->settings = *settings;
+
+	if (settings->selfTest && (ctx->port->transport == NULL) && (ctx->bus == NULL))
+		return SSCP_TransportOpen(ctx, &SSCP_TRANSPORT_SELFTEST, "selftest", 0);
+	if (!settings->selfTest && (ctx->port->transport == &SSCP_TRANSPORT_SELFTEST))
+		return SSCP_TransportClose(ctx);
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Get the debug and self test settings of a context.
+ *
+ * @param[in] ctx SSCP context.
+ * @param[out] settings Settings in use.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p settings parameter is NULL.
+ */
+LONG SSCP_GetSettings(SSCP_CTX_ST* ctx, SSCP_SETTINGS_ST* settings)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (settings == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*settings = ctx->settings;
+
+	return SSCP_SUCCESS;
+}
+
 /**
  * @brief Close (if needed) and free an SSCP context.
  *
  * This function first calls SSCP_Close() to ensure the communication channel is
  * closed, then releases the memory associated with the context.
+ * A reader context obtained from SSCP_BusGetReader() is removed from its bus,
+ * whose port remains open.
  *
  * @param[in,out] ctx SSCP context to free (may be NULL).
  */
 void SSCP_Free(SSCP_CTX_ST *ctx)
 {
-	/* Just in case... */
-	SSCP_Close(ctx);
+	if ((ctx != NULL) && (ctx->bus != NULL))
+	{
+		/* A reader leaves the bus, the port stays open for the others */
+		SSCP_BusDetachReader(ctx);
+	}
+	else
+	{
+		/* Just in case... */
+		SSCP_Close(ctx);
+	}
 
 	if (ctx != NULL)
-		free(ctx);
+	{
+		/* Release what the crypto backend may hold outside of the context */
+		AES_Free(&ctx->sessionCipherAB);
+		AES_Free(&ctx->sessionCipherBA);
+		SSCP_DrbgFree(ctx);
+
+		/* Don't leave the session keys behind */
+		memset(ctx, 0, sizeof(struct _SSCP_CTX_ST));
+		SSCP_MemFree(ctx);
+	}
 }
 
 /**
- * @brief Open and configure the serial/RS-485 communication channel.
+ * @brief Open and configure the serial/RS-485 or TCP communication channel.
  *
- * This function opens the underlying serial device/port and applies the initial
- * communication settings:
+ * This function opens the underlying serial device/port, or connects to the
+ * gateway, and applies the initial communication settings:
  * - Baudrate configuration
  * - Default receive timeouts (first byte / subsequent bytes)
  * - Default SSCP address selection (0x00, meaning RS-232 by convention)
  *
  * @param[in,out] ctx SSCP context.
  * @param[in] commName Platform-specific port identifier (e.g. "COM3" on Windows,
- *                     "/dev/ttyUSB0" on Linux).
- * @param[in] commBaudrate Initial baudrate in bits per second (e.g. 115200).
+ *                     "/dev/ttyUSB0" on Linux), or "tcp://host:port" for a
+ *                     reader behind an Ethernet-to-RS485 gateway.
+ *                     "capture:<file>|<port>" records the session with the reader
+ *                     of <port> into <file>; "replay:<file>" plays a recorded
+ *                     session back without a reader ("replay:<file>|max" without
+ *                     the recorded latency).
+ * @param[in] commBaudrate Initial baudrate in bits per second (e.g. 115200),
+ *                     ignored over TCP (the gateway sets the line's baudrate).
  * @param[in] commFlags Reserved for future use (currently ignored).
  *
  * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
  *
- * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL, or is a bus reader
+ *         (use SSCP_BusOpen()).
  * @retval SSCP_ERR_INVALID_PARAMETER The @p commName parameter is NULL.
  *
  */
@@ -93,24 +194,14 @@ LONG SSCP_Open(SSCP_CTX_ST* ctx, const char* commName, DWORD commBaudrate, DWORD
 	if (commName == NULL)
 		return SSCP_ERR_INVALID_PARAMETER;
 
-	rc = SSCP_SerialOpen(ctx, commName);
-	if (rc)
-		return rc;
-
-	rc = SSCP_SerialConfigure(ctx, commBaudrate);
-	if (rc)
-	{
-		SSCP_SerialClose(ctx);
-		return rc;
-	}
+	/* The port of a bus reader is opened through SSCP_BusOpen() */
+	if (ctx->bus != NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
 
-	/* Default timeouts */
-	rc = SSCP_SerialSetTimeouts(ctx, SSCP_RESPONSE_FIRST_TIMEOUT, SSCP_RESPONSE_NEXT_TIMEOUT);
+	/* In self test, whatever the port, the loopback answers */
+	rc = SSCP_TransportOpen(ctx, ctx->settings.selfTest ? &SSCP_TRANSPORT_SELFTEST : SSCP_TransportFromName(commName), commName, commBaudrate);
 	if (rc)
-	{
-		SSCP_SerialClose(ctx);
 		return rc;
-	}
 
 	ctx->address = 0x00; /* Default is RS232 */
 
@@ -122,12 +213,16 @@ LONG SSCP_Open(SSCP_CTX_ST* ctx, const char* commName, DWORD commBaudrate, DWORD
 /**
  * @brief Close the communication channel associated with an SSCP context.
  *
+ * If the request queue of the port runs, the requests already posted are run and
+ * the worker thread ends first (see SSCP_QueueStop()).
+ *
  * @param[in,out] ctx SSCP context.
  *
  * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code returned
- *         by the serial backend.
+ *         by the transport.
  *
- * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL, is a bus reader
+ *         (use SSCP_BusClose()), or is called by the worker of the queue.
  */
 LONG SSCP_Close(SSCP_CTX_ST* ctx)
 {
@@ -136,7 +231,16 @@ LONG SSCP_Close(SSCP_CTX_ST* ctx)
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
 
-	rc = SSCP_SerialClose(ctx);
+	/* The port of a bus reader is closed through SSCP_BusClose() */
+	if (ctx->bus != NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	/* The worker runs what has been posted, then leaves */
+	rc = SSCP_QueueStop(ctx);
+	if (rc)
+		return rc;
+
+	rc = SSCP_TransportClose(ctx);
 	
 	return rc;
 }
@@ -154,6 +258,7 @@ LONG SSCP_Close(SSCP_CTX_ST* ctx)
  * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
  *
  * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER On a bus, another reader already uses @p address.
  *
  * @note Address 0x00 is the broadcast address, commonly used on RS-232
  *       (point-to-point) connections, where addressing is not required.
@@ -163,6 +268,10 @@ LONG SSCP_SelectAddress(SSCP_CTX_ST* ctx, BYTE address)
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
 
+	/* On a bus, the reader's slot follows its address */
+	if (ctx->bus != NULL)
+		return SSCP_BusMoveReader(ctx, address);
+
 	ctx->address = address;
 
 	return SSCP_SUCCESS;
@@ -177,12 +286,17 @@ LONG SSCP_SelectAddress(SSCP_CTX_ST* ctx, BYTE address)
  * SSCP_SetBaudrate()).
  *
  * @param[in,out] ctx SSCP context.
- * @param[in] baudrate Desired baudrate in bits per second.
+ * @param[in] baudrate Desired baudrate in bits per second: 1200 to 921600, or any
+ *                     other rate the UART accepts (on Linux, through BOTHER).
  *
  * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* error code.
  *
  * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The baudrate is not supported by the platform.
  *
+ * @note To change the baudrate of the reader and of the port together, with a
+ *       fall back if the link does not work, see SSCP_NegotiateBaudrate().
+ * @note On a bus reader, the shared port is reconfigured, for all the readers.
  */
 LONG SSCP_SelectBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate)
 {
@@ -191,13 +305,57 @@ LONG SSCP_SelectBaudrate(SSCP_CTX_ST* ctx, DWORD baudrate)
 	if (ctx == NULL)
 		return SSCP_ERR_INVALID_CONTEXT;
 
-	rc = SSCP_SerialConfigure(ctx, baudrate);
+	rc = SSCP_TransportConfigure(ctx, baudrate);
 	if (rc)
 	{
-		SSCP_SerialClose(ctx);
+		SSCP_TransportClose(ctx);
 		return rc;
 	}
 
 	return SSCP_SUCCESS;
 }
 
+/*
+ * Drop the first @p skip bytes of a chunk list (the part already sent), and the empty
+ * chunks. The list is updated in place; returns the number of chunks left.
+ */
+DWORD SSCP_SerialSkipChunks(SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD skip)
+{
+	DWORD i, j = 0;
+
+	for (i = 0; i < chunkCount; i++)
+	{
+		SSCP_SERIAL_CHUNK_ST chunk = chunks[i];
+
+		if (skip >= chunk.length)
+		{
+			skip -= chunk.length;
+			continue;
+		}
+
+		chunk.buffer += skip;
+		chunk.length -= skip;
+		skip = 0;
+		chunks[j++] = chunk;
+	}
+
+	return j;
+}
+
+/* Copy a chunk list into a contiguous buffer */
+LONG SSCP_SerialCoalesceChunks(BYTE buffer[], DWORD maxBufferSz, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* length)
+{
+	DWORD i, total = 0;
+
+	for (i = 0; i < chunkCount; i++)
+	{
+		if (chunks[i].length > maxBufferSz - total)
+			return SSCP_ERR_COMMAND_TOO_LONG;
+		if (chunks[i].length > 0)
+			memcpy(&buffer[total], chunks[i].buffer, chunks[i].length);
+		total += chunks[i].length;
+	}
+
+	*length = total;
+	return SSCP_SUCCESS;
+}
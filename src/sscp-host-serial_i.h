@@ -4,10 +4,21 @@
 #include "sscp-host_i.h"
 
 #define SSCP_RESPONSE_FIRST_TIMEOUT 1000
-#define SSCP_RESPONSE_NEXT_TIMEOUT  50
+#define SSCP_RESPONSE_NEXT_TIMEOUT  50 /* When the baudrate is not known */
 
-#define SSCP_MAX_TIMEOUT_RETRY 3
+/* Defaults of the timeout profile, see sscp-host-timeouts.c */
+#define SSCP_RESPONSE_CONTROL_TIMEOUT 250
+#define SSCP_RESPONSE_CARD_TIMEOUT SSCP_RESPONSE_FIRST_TIMEOUT
+#define SSCP_RESPONSE_SETUP_TIMEOUT SSCP_RESPONSE_FIRST_TIMEOUT
+#define SSCP_RESPONSE_NEXT_MIN_TIMEOUT 20 /* Latency of the USB adapters */
+#define SSCP_RESPONSE_NEXT_CHARS 32 /* Characters the inter byte timeout covers at the baudrate */
 
 #define SSCP_SCAN_GLOBAL_GUARD_TIME 125
 
+#define SSCP_BAUDRATE_SWITCH_DELAY 20 /* Let the reader send its response and switch, before the host does */
+
+#ifdef __linux__
+LONG SSCP_SerialSetOtherSpeed(int fd, DWORD baudrate);
+#endif
+
 #endif
@@ -0,0 +1,319 @@
+/**
+ * @file sscp-host-session.c
+ * @brief Export of the session of a reader, and its import by another process.
+ *
+ * The session of a reader is its address, the counter and the four session keys.
+ * A host process that restarts (or a watchdog that restarts it) may carry on with
+ * the sessions of its predecessor, instead of authenticating every reader again.
+ *
+ * The session goes out sealed with a key of the application: the plain session is
+ * ciphered (AES-128 CBC, with a random IV) then signed (HMAC-SHA256 of the IV and
+ * the cipher), each with a key derived from the sealing key. The blob may then be
+ * kept in a file or a shared memory; it is only as secret as the sealing key.
+ *
+ * Blob: IV (16) | cipher (80) | HMAC (32). Plain session: version (1), address (1),
+ * RFU (2), counter (4), start of the session (8), then the keys Kcab, Kcba, Ksab and
+ * Ksba (16 each); the numbers are MSB first.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_SESSION_VERSION 1
+#define SSCP_SESSION_PLAIN_SZ 80
+#define SSCP_SESSION_MAC_OFFSET (16 + SSCP_SESSION_PLAIN_SZ)
+
+/* Keys of the seal: cipher, then signature */
+static BOOL SSCP_SessionSealKeys(const BYTE sealKeyValue[16], BYTE keys[32])
+{
+	static const BYTE label[] = { 'S', 'S', 'C', 'P', ' ', 's', 'e', 's', 's', 'i', 'o', 'n' };
+
+	return SSCP_HMAC(sealKeyValue, label, sizeof(label), keys);
+}
+
+/* Same outcome, whatever byte differs */
+static BOOL SSCP_SessionSameMac(const BYTE a[32], const BYTE b[32])
+{
+	BYTE diff = 0;
+	DWORD i;
+
+	for (i = 0; i < 32; i++)
+		diff |= a[i] ^ b[i];
+
+	return (diff == 0);
+}
+
+/* Arguments of the session functions, for the worker of the queue */
+typedef struct
+{
+	const BYTE* sealKeyValue;
+	BYTE* exportBlob;
+	const BYTE* importBlob;
+	DWORD blobSz;
+	const BYTE* authKeyValue;
+	BOOL* resumed;
+} SSCP_SESSION_ARGS_ST;
+
+static LONG SSCP_ExportSession_Job(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_SESSION_ARGS_ST* args = (const SSCP_SESSION_ARGS_ST*) userData;
+
+	return SSCP_ExportSession(ctx, args->sealKeyValue, args->exportBlob);
+}
+
+static LONG SSCP_ImportSession_Job(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_SESSION_ARGS_ST* args = (const SSCP_SESSION_ARGS_ST*) userData;
+
+	return SSCP_ImportSession(ctx, args->sealKeyValue, args->importBlob, args->blobSz);
+}
+
+static LONG SSCP_ResumeSession_Job(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_SESSION_ARGS_ST* args = (const SSCP_SESSION_ARGS_ST*) userData;
+
+	return SSCP_ResumeSession(ctx, args->sealKeyValue, args->importBlob, args->blobSz, args->authKeyValue, args->resumed);
+}
+
+/**
+ * @brief Export the session of a reader, sealed.
+ *
+ * The blob holds the counter as it is now: the reader only accepts the counters it
+ * has not seen yet, so the session should be exported again after the exchanges that
+ * follow, at least before the process stops, for the blob to remain of use.
+ *
+ * @param[in] ctx SSCP context, with an authenticated session.
+ * @param[in] sealKeyValue Key of the application to seal the session with.
+ * @param[out] blob Sealed session, SSCP_SESSION_BLOB_SZ bytes.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL, or the context has no session.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p sealKeyValue or @p blob is NULL.
+ * @retval SSCP_ERR_INTERNAL_FAILURE No random IV, or a cryptographic failure.
+ */
+LONG SSCP_ExportSession(SSCP_CTX_ST* ctx, const BYTE sealKeyValue[16], BYTE blob[SSCP_SESSION_BLOB_SZ])
+{
+	BYTE keys[32];
+	BYTE* plain;
+	DWORD offset;
+	unsigned long long whenSession;
+	LONG rc = SSCP_ERR_INTERNAL_FAILURE;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((sealKeyValue == NULL) || (blob == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_SESSION_ARGS_ST args = { sealKeyValue, blob, NULL, 0, NULL, NULL };
+		return SSCP_QueueCallJob(ctx, SSCP_ExportSession_Job, &args);
+	}
+
+	/* The counter starts at 1 with the session */
+	if (ctx->counter == 0)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	memset(blob, 0, SSCP_SESSION_BLOB_SZ);
+
+	if (!SSCP_GetRandom(blob, 16))
+		goto done;
+	if (!SSCP_SessionSealKeys(sealKeyValue, keys))
+		goto done;
+
+	plain = &blob[16];
+	offset = 0;
+	plain[offset++] = SSCP_SESSION_VERSION;
+	plain[offset++] = ctx->address;
+	plain[offset++] = 0x00;
+	plain[offset++] = 0x00;
+	plain[offset++] = (BYTE)(ctx->counter >> 24);
+	plain[offset++] = (BYTE)(ctx->counter >> 16);
+	plain[offset++] = (BYTE)(ctx->counter >> 8);
+	plain[offset++] = (BYTE)(ctx->counter);
+	whenSession = (unsigned long long) ctx->stats.whenSession;
+	for (; offset < 16; offset++)
+		plain[offset] = (BYTE)(whenSession >> (8 * (15 - offset)));
+	memcpy(&plain[offset], ctx->sessionKeyCipherAB, 16);
+	offset += 16;
+	memcpy(&plain[offset], ctx->sessionKeyCipherBA, 16);
+	offset += 16;
+	memcpy(&plain[offset], ctx->sessionKeySignAB, 16);
+	offset += 16;
+	memcpy(&plain[offset], ctx->sessionKeySignBA, 16);
+
+	/* Cipher, then sign the IV and the cipher */
+	if (!SSCP_Cipher(keys, blob, plain, SSCP_SESSION_PLAIN_SZ))
+		goto done;
+	if (!SSCP_HMAC(&keys[16], blob, SSCP_SESSION_MAC_OFFSET, &blob[SSCP_SESSION_MAC_OFFSET]))
+		goto done;
+
+	rc = SSCP_SUCCESS;
+
+done:
+	memset(keys, 0, sizeof(keys));
+	if (rc)
+		memset(blob, 0, SSCP_SESSION_BLOB_SZ);
+	return rc;
+}
+
+/**
+ * @brief Import a session exported by SSCP_ExportSession().
+ *
+ * The context takes the counter and the keys of the session, without anything being
+ * exchanged with the reader: the first secure exchange tells whether the reader still
+ * has the session (see SSCP_ResumeSession()).
+ *
+ * @param[in,out] ctx SSCP context, with the address of the reader the session is of.
+ * @param[in] sealKeyValue Key the session has been sealed with.
+ * @param[in] blob Sealed session.
+ * @param[in] blobSz Size of @p blob, SSCP_SESSION_BLOB_SZ.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code; the context is
+ *         left untouched.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p sealKeyValue or @p blob is NULL, the blob has
+ *         not been sealed with this key or has been altered, or is not a session of
+ *         the reader at the address of the context.
+ * @retval SSCP_ERR_IN_PROGRESS An asynchronous exchange is pending on the context, or
+ *         on another reader of its bus.
+ */
+LONG SSCP_ImportSession(SSCP_CTX_ST* ctx, const BYTE sealKeyValue[16], const BYTE blob[], DWORD blobSz)
+{
+	BYTE keys[32];
+	BYTE mac[32];
+	BYTE plain[SSCP_SESSION_PLAIN_SZ];
+	DWORD offset, counter;
+	unsigned long long whenSession = 0;
+	LONG rc = SSCP_ERR_INVALID_PARAMETER;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((sealKeyValue == NULL) || (blob == NULL) || (blobSz != SSCP_SESSION_BLOB_SZ))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_SESSION_ARGS_ST args = { sealKeyValue, NULL, blob, blobSz, NULL, NULL };
+		return SSCP_QueueCallJob(ctx, SSCP_ImportSession_Job, &args);
+	}
+
+	if (SSCP_AsyncPending(ctx))
+		return SSCP_ERR_IN_PROGRESS;
+
+	if (!SSCP_SessionSealKeys(sealKeyValue, keys))
+	{
+		rc = SSCP_ERR_INTERNAL_FAILURE;
+		goto done;
+	}
+
+	/* Check the signature before anything else */
+	if (!SSCP_HMAC(&keys[16], blob, SSCP_SESSION_MAC_OFFSET, mac))
+	{
+		rc = SSCP_ERR_INTERNAL_FAILURE;
+		goto done;
+	}
+	if (!SSCP_SessionSameMac(mac, &blob[SSCP_SESSION_MAC_OFFSET]))
+		goto done;
+
+	memcpy(plain, &blob[16], SSCP_SESSION_PLAIN_SZ);
+	if (!SSCP_Decipher(keys, blob, plain, SSCP_SESSION_PLAIN_SZ))
+	{
+		rc = SSCP_ERR_INTERNAL_FAILURE;
+		goto done;
+	}
+
+	if (plain[0] != SSCP_SESSION_VERSION)
+		goto done;
+	if (plain[1] != ctx->address)
+		goto done;
+
+	counter = ((DWORD) plain[4] << 24) | ((DWORD) plain[5] << 16) | ((DWORD) plain[6] << 8) | plain[7];
+	if (counter == 0)
+		goto done;
+	for (offset = 8; offset < 16; offset++)
+		whenSession = (whenSession << 8) | plain[offset];
+
+	memcpy(ctx->sessionKeyCipherAB, &plain[offset], 16);
+	offset += 16;
+	memcpy(ctx->sessionKeyCipherBA, &plain[offset], 16);
+	offset += 16;
+	memcpy(ctx->sessionKeySignAB, &plain[offset], 16);
+	offset += 16;
+	memcpy(ctx->sessionKeySignBA, &plain[offset], 16);
+	SSCP_ExpandSessionKeys(ctx);
+
+	ctx->counter = counter;
+	ctx->stats.whenSession = (time_t) whenSession;
+
+	rc = SSCP_SUCCESS;
+
+done:
+	memset(keys, 0, sizeof(keys));
+	memset(plain, 0, sizeof(plain));
+	return rc;
+}
+
+/**
+ * @brief Carry on with an exported session, or authenticate again.
+ *
+ * The session is imported, then tried with GetInfos. If the reader does not take it
+ * (it has been restarted, or the counter of the blob is behind), or if the blob
+ * cannot be imported, a new session is opened as SSCP_Authenticate() does. A reader
+ * stays mute on a session it does not know: the fallback costs the timeout of
+ * GetInfos, still less than an authentication.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel.
+ * @param[in] sealKeyValue Key the session has been sealed with.
+ * @param[in] blob Sealed session (may be NULL if there is none).
+ * @param[in] blobSz Size of @p blob.
+ * @param[in] authKeyValue Authentication key, for a new session (may be NULL for the default key).
+ * @param[out] resumed TRUE if the exported session goes on, FALSE if a new one has
+ *             been opened (may be NULL).
+ *
+ * @return SSCP_SUCCESS if the context has a session, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ */
+LONG SSCP_ResumeSession(SSCP_CTX_ST* ctx, const BYTE sealKeyValue[16], const BYTE blob[], DWORD blobSz, const BYTE authKeyValue[16], BOOL* resumed)
+{
+	LONG rc;
+
+	if (resumed != NULL)
+		*resumed = FALSE;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	/* The import, the probe and the authentication, with no other request in between */
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_SESSION_ARGS_ST args = { sealKeyValue, NULL, blob, blobSz, authKeyValue, resumed };
+		return SSCP_QueueCallJob(ctx, SSCP_ResumeSession_Job, &args);
+	}
+
+	rc = SSCP_ImportSession(ctx, sealKeyValue, blob, blobSz);
+	if (rc == SSCP_SUCCESS)
+	{
+		rc = SSCP_GetInfos(ctx, NULL, NULL, NULL, NULL);
+		if (rc == SSCP_SUCCESS)
+		{
+			if (resumed != NULL)
+				*resumed = TRUE;
+			return SSCP_SUCCESS;
+		}
+	}
+
+	/* Nothing can be exchanged: there is no point in authenticating */
+	switch (rc)
+	{
+		case SSCP_ERR_IN_PROGRESS:
+		case SSCP_ERR_COMM_NOT_AVAILABLE:
+		case SSCP_ERR_COMM_NOT_OPEN:
+			return rc;
+		default:
+		break;
+	}
+
+	return SSCP_Authenticate(ctx, authKeyValue);
+}
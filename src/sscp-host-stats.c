@@ -0,0 +1,245 @@
+/**
+ * @file sscp-host-stats.c
+ * @brief Per-command counters and round-trip latency histogram of the secure exchanges.
+ *
+ * Every secure exchange, blocking or not, is recorded once it is over: its command,
+ * how it ended, how many times it has been sent again after a timeout, and how long
+ * it took from the first transmission to the verified response, with the monotonic
+ * clock of sscp-host-guard.c.
+ *
+ * The latencies go into log-linear buckets: 4 buckets per power of two, so that a
+ * percentile is known within 25%, from 1 us to about 30 s in 100 buckets.
+ *
+ * Only the exchanges write the counters, and SSCP_GetStatisticsEx() only writes the
+ * baseline a reset leaves behind: a monitoring thread may take snapshots while the
+ * exchanges run, without stopping them. The maximal latency of a command is not a
+ * difference with the baseline: a reset is counted, and the first exchange of the
+ * command after it restarts the maximum.
+ */
+#include "sscp-host_i.h"
+
+static DWORD SSCP_LatencyBucket(DWORD us)
+{
+	DWORD e = 0, bucket;
+
+	if (us < 4)
+		return us;
+
+	while ((us >> e) > 1)
+		e++;
+
+	/* e >= 2: the power of two, then the 2 bits after the leading one */
+	bucket = 4 * (e - 1) + ((us >> (e - 2)) & 3);
+	return (bucket < SSCP_STATS_LATENCY_BUCKETS) ? bucket : SSCP_STATS_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @brief Lower bound of a bucket of the latency histogram.
+ *
+ * @param[in] bucket Index, from 0 to SSCP_STATS_LATENCY_BUCKETS - 1.
+ *
+ * @return The smallest latency, in microseconds, that goes into @p bucket; the
+ *         bucket holds the latencies below the bound of the next one.
+ */
+DWORD SSCP_LatencyBucketUs(DWORD bucket)
+{
+	DWORD e;
+
+	if (bucket < 4)
+		return bucket;
+	if (bucket >= SSCP_STATS_LATENCY_BUCKETS)
+		bucket = SSCP_STATS_LATENCY_BUCKETS - 1;
+
+	e = bucket / 4 + 1;
+	return (4 + (bucket % 4)) << (e - 2);
+}
+
+/* Secure exchange over, after retries resendings; rc is what the caller gets */
+void SSCP_StatsRecord(SSCP_CTX_ST* ctx, DWORD commandHeader, LONG rc, DWORD retries, DWORD elapsedUs)
+{
+	SSCP_STATS_COUNTERS_ST* counters = &ctx->statsEx;
+	SSCP_STATS_COMMAND_ST* command = NULL;
+	LONG resets = SSCP_ATOMIC_LOAD(&ctx->statsResets);
+	DWORD i;
+
+	if (SSCP_TRACE_ON(ctx))
+		SSCP_TraceEvent(ctx, SSCP_TRACE_EXCHANGE, commandHeader, retries, rc, elapsedUs);
+
+	/* The heartbeats of sscp-host-health.c wait for an idle slot */
+	ctx->port->lastExchange = SSCP_GetTickMs();
+	if (ctx->health.running)
+		SSCP_HealthRecord(ctx, rc);
+
+	counters->exchanges++;
+	counters->retries += retries; /* The failed attempts are counted by sscp-host-retry.c */
+	counters->latency[SSCP_LatencyBucket(elapsedUs)]++;
+
+	switch (rc)
+	{
+		case SSCP_SUCCESS:
+		break;
+		case SSCP_ERR_COMM_RECV_MUTE:
+		case SSCP_ERR_COMM_RECV_STOPPED:
+			counters->timeouts++;
+		break;
+		case SSCP_ERR_WRONG_RESPONSE_CRC:
+			counters->crcErrors++;
+		break;
+		case SSCP_ERR_WRONG_RESPONSE_SIGNATURE:
+			counters->signatureErrors++;
+		break;
+		case SSCP_ERR_WRONG_RESPONSE_COUNTER:
+			counters->counterErrors++;
+		break;
+		case SSCP_ERR_WRONG_RESPONSE_LENGTH:
+		case SSCP_ERR_WRONG_RESPONSE_TYPE:
+		case SSCP_ERR_WRONG_RESPONSE_COMMAND:
+		case SSCP_ERR_WRONG_RESPONSE_FORMAT:
+			counters->formatErrors++;
+		break;
+		default:
+		break;
+	}
+	if (rc < 0)
+		counters->failures++;
+
+	/* The entry of the command, or the first free one */
+	for (i = 0; i < SSCP_STATS_MAX_COMMANDS; i++)
+	{
+		if (counters->commands[i].count == 0)
+			counters->commands[i].commandHeader = commandHeader;
+		if (counters->commands[i].commandHeader == commandHeader)
+		{
+			command = &counters->commands[i];
+			break;
+		}
+	}
+	if (command == NULL)
+		return; /* More distinct commands than the table holds, only the totals count them */
+
+	command->count++;
+	command->retries += retries;
+	if (rc < 0)
+		command->failures++;
+	command->totalUs += elapsedUs;
+	if ((command->maxResets != resets) || (elapsedUs > command->maxUs))
+		command->maxUs = elapsedUs;
+	command->maxResets = resets;
+}
+
+/* Upper bound of the bucket where p% of the round trips are reached, 0 without any */
+static DWORD SSCP_LatencyPercentile(const DWORD latency[], DWORD total, DWORD percent)
+{
+	DWORD rank, sum = 0, i;
+
+	if (total == 0)
+		return 0;
+
+	/* Rank of the percentile, rounded up */
+	rank = (total * percent + 99) / 100;
+
+	for (i = 0; i < SSCP_STATS_LATENCY_BUCKETS - 1; i++)
+	{
+		sum += latency[i];
+		if (sum >= rank)
+			return SSCP_LatencyBucketUs(i + 1) - 1;
+	}
+
+	return SSCP_LatencyBucketUs(SSCP_STATS_LATENCY_BUCKETS - 1);
+}
+
+/**
+ * @brief Retrieve the detailed statistics of the secure exchanges.
+ *
+ * The counters, the histogram and the per-command figures cover the exchanges
+ * since the last reset (or since the context has been allocated); @p stats->basic
+ * is what SSCP_GetStatistics() returns, and is never reset.
+ *
+ * This function does not lock anything, and a reset only records where the next
+ * snapshot starts from: it may be called by a monitoring thread while another one
+ * runs the exchanges on the context. A snapshot taken during an exchange may then
+ * miss some of it, it is in the next one.
+ *
+ * @param[in,out] ctx SSCP context.
+ * @param[out] stats Output structure filled with the statistics.
+ * @param[in] reset If TRUE, the next snapshot starts from this one.
+ *
+ * @return SSCP_SUCCESS on success, otherwise an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p stats parameter is NULL.
+ */
+LONG SSCP_GetStatisticsEx(SSCP_CTX_ST* ctx, SSCP_STATISTICS_EX_ST* stats, BOOL reset)
+{
+	SSCP_STATS_COUNTERS_ST now;
+	const SSCP_STATS_COUNTERS_ST* base;
+	LONG resets;
+	DWORD i, total = 0;
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (stats == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	memset(stats, 0, sizeof(SSCP_STATISTICS_EX_ST));
+
+	rc = SSCP_GetStatistics(ctx, &stats->basic);
+	if (rc)
+		return rc;
+
+	/* One copy, then everything is computed from it */
+	resets = SSCP_ATOMIC_LOAD(&ctx->statsResets);
+	now = ctx->statsEx;
+	base = &ctx->statsBase;
+
+	stats->exchanges = now.exchanges - base->exchanges;
+	stats->failures = now.failures - base->failures;
+	stats->retries = now.retries - base->retries;
+	stats->timeouts = now.timeouts - base->timeouts;
+	stats->crcErrors = now.crcErrors - base->crcErrors;
+	stats->signatureErrors = now.signatureErrors - base->signatureErrors;
+	stats->counterErrors = now.counterErrors - base->counterErrors;
+	stats->formatErrors = now.formatErrors - base->formatErrors;
+	stats->corruptedRetries = now.corruptedRetries - base->corruptedRetries;
+	stats->recoveries = now.recoveries - base->recoveries;
+	stats->backoffMs = now.backoffMs - base->backoffMs;
+	stats->counterResyncs = now.counterResyncs - base->counterResyncs;
+
+	for (i = 0; i < SSCP_STATS_LATENCY_BUCKETS; i++)
+	{
+		stats->latency[i] = now.latency[i] - base->latency[i];
+		total += stats->latency[i];
+	}
+	stats->latencyP50Us = SSCP_LatencyPercentile(stats->latency, total, 50);
+	stats->latencyP95Us = SSCP_LatencyPercentile(stats->latency, total, 95);
+	stats->latencyP99Us = SSCP_LatencyPercentile(stats->latency, total, 99);
+
+	for (i = 0; i < SSCP_STATS_MAX_COMMANDS; i++)
+	{
+		const SSCP_STATS_COMMAND_ST* c = &now.commands[i];
+		DWORD count;
+
+		if (c->count == 0)
+			break;
+
+		/* The entries are never given to another command, the baseline one is the same or empty */
+		count = c->count - base->commands[i].count;
+		stats->commands[i].commandHeader = c->commandHeader;
+		stats->commands[i].count = count;
+		stats->commands[i].failures = c->failures - base->commands[i].failures;
+		stats->commands[i].retries = c->retries - base->commands[i].retries;
+		if (count > 0)
+			stats->commands[i].meanUs = (DWORD)((c->totalUs - base->commands[i].totalUs) / count);
+		if (c->maxResets == resets)
+			stats->commands[i].maxUs = c->maxUs; /* Otherwise no exchange of the command since the reset */
+	}
+
+	if (reset)
+	{
+		ctx->statsBase = now;
+		SSCP_ATOMIC_ADD(&ctx->statsResets, 1);
+	}
+
+	return SSCP_SUCCESS;
+}
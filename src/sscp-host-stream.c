@@ -0,0 +1,482 @@
+/**
+ * @file sscp-host-stream.c
+ * @brief Secure exchanges ciphered and sent piece by piece, large commands and pipeline mode.
+ *
+ * SSCP_Exchange() prepares the whole frame in the context's buffer, so a command is
+ * limited to SSCP_MAX_PAYLOAD_SZ and is only sent once it has been signed and
+ * ciphered. Here the command data are read from the application as the frame goes:
+ * each piece is added to the signature, ciphered (CBC carries on from the last block
+ * of the previous piece) and handed to the transport, while the next one is read. The
+ * IV is drawn first, as it only goes on the line after the cipher; the signature then
+ * the padding close the plain text.
+ *
+ * The response is received straight into the application's buffer, and deciphered
+ * block by block as it comes in, but for its first block: the IV of the response is
+ * its last 16 bytes. The signature covers the plain text from its first block, so
+ * the response can only be checked once it is complete.
+ *
+ * The pipeline mode of the settings runs SSCP_Exchange() the same way, on the frame
+ * in place and in smaller pieces: the signature and the ciphering of the next piece
+ * take place while the driver puts the previous one on the line, and the response
+ * is deciphered while the rest of it is still arriving. The frame is left ciphered
+ * in the buffer, to be sent again as is after a timeout.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_STREAM_CHUNK_SZ 1024 /* Command bytes ciphered and sent at a time, multiple of 16 */
+#define SSCP_PIPELINE_CHUNK_SZ 64 /* The same in pipeline mode, about 6 ms on the line at 115200 bps */
+
+/* Plain text of the command, from its parts */
+typedef struct
+{
+	SSCP_CTX_ST* ctx;
+	SSCP_STREAM_SOURCE source;
+	void* sourceData;
+	BYTE* frame; /* In place, the data already at frame[SSCP_COMMAND_HEADROOM]; NULL for the source */
+	DWORD chunkSz;
+	DWORD dataSz;
+	BYTE head[SSCP_COMMAND_HEADROOM]; /* Counter, type, code and length */
+	SHA256_CTX_ST sign;
+	BYTE hmac[32];
+} SSCP_STREAM_TX_ST;
+
+/* Deciphering of the response, as it comes */
+typedef struct
+{
+	const BYTE* header; /* Received before the payload */
+	WORD crc; /* Of the header and the cipher received so far */
+	DWORD crcDone;
+	DWORD done; /* Bytes of the cipher that have been deciphered, or kept for later */
+	BYTE carry[16]; /* Cipher of the previous block */
+} SSCP_STREAM_RX_ST;
+
+/* Plain text of the command from position on, length bytes */
+static LONG SSCP_StreamFill(SSCP_STREAM_TX_ST* tx, BYTE plain[], DWORD position, DWORD length)
+{
+	DWORD dataEnd = SSCP_COMMAND_HEADROOM + tx->dataSz;
+	LONG rc;
+
+	while (length > 0)
+	{
+		DWORD count;
+
+		if (position < SSCP_COMMAND_HEADROOM)
+		{
+			count = SSCP_COMMAND_HEADROOM - position;
+			if (count > length)
+				count = length;
+			memcpy(plain, &tx->head[position], count);
+			SSCP_HMACUpdate(&tx->sign, plain, count);
+		}
+		else if (position < dataEnd)
+		{
+			count = dataEnd - position;
+			if (count > length)
+				count = length;
+			if (tx->frame == NULL)
+			{
+				rc = tx->source(tx->sourceData, position - SSCP_COMMAND_HEADROOM, plain, count);
+				if (rc)
+					return rc;
+			}
+			SSCP_HMACUpdate(&tx->sign, plain, count);
+		}
+		else if (position < dataEnd + 32)
+		{
+			/* All the data are in the signature */
+			if (position == dataEnd)
+				SSCP_HMACEnd(&tx->ctx->sessionSignAB, &tx->sign, tx->hmac);
+			count = dataEnd + 32 - position;
+			if (count > length)
+				count = length;
+			memcpy(plain, &tx->hmac[position - dataEnd], count);
+		}
+		else
+		{
+			/* Standard padding */
+			*plain = (position == dataEnd + 32) ? 0x80 : 0x00;
+			count = 1;
+		}
+
+		plain += count;
+		position += count;
+		length -= count;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/* The frame is partly sent: the reader gets the whole length, with a wrong CRC, and drops it */
+static void SSCP_StreamAbort(SSCP_CTX_ST* ctx, DWORD remaining)
+{
+	SSCP_SERIAL_CHUNK_ST chunk;
+
+	memset(ctx->txBuffer, 0, SSCP_STREAM_CHUNK_SZ);
+	while (remaining > 0)
+	{
+		chunk.buffer = ctx->txBuffer;
+		chunk.length = (remaining > SSCP_STREAM_CHUNK_SZ) ? SSCP_STREAM_CHUNK_SZ : remaining;
+		if (SSCP_TransportSendV(ctx, &chunk, 1))
+			return;
+		remaining -= chunk.length;
+	}
+}
+
+/* Sign, cipher and send the command, piece by piece */
+static LONG SSCP_StreamSend(SSCP_CTX_ST* ctx, SSCP_STREAM_TX_ST* tx, BYTE timeoutClass, DWORD* sentAt)
+{
+	SSCP_SERIAL_CHUNK_ST chunks[4];
+	BYTE* staging;
+	BYTE initVector[16];
+	BYTE carry[16];
+	BYTE header[5];
+	BYTE crc[2];
+	WORD crcValue;
+	DWORD paddedSz, payloadSz, position, count;
+	LONG rc;
+
+	paddedSz = (SSCP_COMMAND_HEADROOM + tx->dataSz + 32 + 15) & ~(DWORD) 15;
+	payloadSz = paddedSz + 16;
+
+	rc = SSCP_TransportSetTimeouts(ctx, SSCP_FirstByteTimeout(ctx, timeoutClass, sizeof(header) + payloadSz + 2), SSCP_InterByteTimeout(ctx));
+	if (rc)
+		return rc;
+
+	if (!SSCP_GetRandomEx(ctx, initVector, sizeof(initVector)))
+		return SSCP_ERR_INTERNAL_FAILURE;
+	memcpy(carry, initVector, 16);
+
+	header[0] = 0x02; /* SOF */
+	header[1] = (BYTE)(payloadSz >> 8);
+	header[2] = (BYTE)(payloadSz);
+	header[3] = ctx->address;
+	header[4] = SSCP_PROTOCOL_SECURE;
+	crcValue = SSCP_CRC16_Update(0xFFFF, &header[1], 4);
+
+	SSCP_HMACBegin(&ctx->sessionSignAB, &tx->sign);
+
+	/* Whatever is left from a former exchange is not the response to this one */
+	SSCP_SerialFlushRing(ctx);
+
+	for (position = 0; position < paddedSz; position += count)
+	{
+		DWORD chunkCount = 0;
+
+		count = paddedSz - position;
+		if (count > tx->chunkSz)
+			count = tx->chunkSz;
+		staging = (tx->frame != NULL) ? &tx->frame[position] : ctx->txBuffer;
+
+		rc = SSCP_StreamFill(tx, staging, position, count);
+		if (rc)
+		{
+			if (position > 0)
+				SSCP_StreamAbort(ctx, payloadSz + 2 - position);
+			return rc;
+		}
+
+		if (!SSCP_CipherEx(&ctx->sessionCipherAB, carry, staging, count))
+			return SSCP_ERR_INTERNAL_FAILURE;
+		memcpy(carry, &staging[count - 16], 16);
+		crcValue = SSCP_CRC16_Update(crcValue, staging, count);
+
+		if (position == 0)
+		{
+			chunks[chunkCount].buffer = header;
+			chunks[chunkCount++].length = sizeof(header);
+		}
+		chunks[chunkCount].buffer = staging;
+		chunks[chunkCount++].length = count;
+		if (position + count == paddedSz)
+		{
+			/* The IV closes the payload, then the CRC */
+			if (tx->frame != NULL)
+				memcpy(&tx->frame[paddedSz], initVector, 16); /* The whole frame, for a resending */
+			crcValue = SSCP_CRC16_Update(crcValue, initVector, 16);
+			crc[0] = (BYTE)(crcValue >> 8);
+			crc[1] = (BYTE)(crcValue);
+			chunks[chunkCount].buffer = initVector;
+			chunks[chunkCount++].length = sizeof(initVector);
+			chunks[chunkCount].buffer = crc;
+			chunks[chunkCount++].length = sizeof(crc);
+		}
+
+		rc = SSCP_TransportSendV(ctx, chunks, chunkCount);
+		if (rc)
+			return rc;
+
+		if ((position == 0) && SSCP_TRACE_ON(ctx))
+			SSCP_TraceFrame(ctx, SSCP_TRACE_TX, header, staging, payloadSz);
+	}
+
+	*sentAt = SSCP_GetTickMs();
+	return SSCP_SUCCESS;
+}
+
+/* More of the response is there: into the CRC, then decipher its complete blocks, but the first one and the IV */
+static void SSCP_StreamProgress(SSCP_CTX_ST* ctx, BYTE payload[], DWORD received, DWORD length, void* userData)
+{
+	SSCP_STREAM_RX_ST* rx = (SSCP_STREAM_RX_ST*) userData;
+	DWORD end;
+
+	if (rx->crcDone == 0)
+		rx->crc = SSCP_CRC16_Update(0xFFFF, &rx->header[1], 4);
+	rx->crc = SSCP_CRC16_Update(rx->crc, &payload[rx->crcDone], received - rx->crcDone);
+	rx->crcDone = received;
+
+	if ((length < 32) || ((length % 16) != 0))
+		return; /* Not a secure response, SSCP_ExchangeVerify() tells */
+
+	/* Complete blocks, the IV excluded */
+	end = (received < length - 16) ? received : length - 16;
+	end &= ~(DWORD) 15;
+
+	if ((rx->done == 0) && (end >= 16))
+	{
+		/* The first block waits for the IV, its cipher is the IV of the second one */
+		memcpy(rx->carry, payload, 16);
+		rx->done = 16;
+	}
+	if (end > rx->done)
+	{
+		BYTE cipher[16];
+
+		/* All the blocks that are there at once */
+		memcpy(cipher, &payload[end - 16], 16);
+		SSCP_DecipherEx(&ctx->sessionCipherBA, rx->carry, &payload[rx->done], end - rx->done);
+		memcpy(rx->carry, cipher, 16);
+		rx->done = end;
+	}
+}
+
+/* Receive the response into response, and check it as SSCP_ExchangeVerify() does */
+static LONG SSCP_StreamRecv(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE timeoutClass, DWORD frameSz, DWORD sentAt, BYTE response[], DWORD maxResponseSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+	SSCP_STREAM_RX_ST rx;
+	BYTE header[5];
+	BYTE crc[2];
+	DWORD length;
+	LONG rc;
+
+	memset(&rx, 0, sizeof(rx));
+	rx.header = header;
+
+	rc = SSCP_SerialRecvStream(ctx, header, response, maxResponseSz, crc, SSCP_StreamProgress, &rx);
+	if ((rc == SSCP_ERR_COMM_RECV_MUTE) || (rc == SSCP_ERR_COMM_RECV_STOPPED))
+	{
+		SSCP_TimeoutExpired(ctx, timeoutClass);
+		if (SSCP_TRACE_ON(ctx))
+			SSCP_TraceEvent(ctx, SSCP_TRACE_TIMEOUT, timeoutClass, 0, rc, 0);
+	}
+	if (rc)
+		return rc;
+
+	SSCP_TimeoutSample(ctx, timeoutClass, frameSz, SSCP_GetTickMs() - sentAt);
+
+	length = header[1];
+	length <<= 8;
+	length |= header[2];
+
+	/* The CRC has been computed on the cipher as it came */
+	if (rx.crcDone == 0)
+		rx.crc = SSCP_CRC16_Update(0xFFFF, &header[1], 4);
+	if ((crc[0] != (BYTE)(rx.crc >> 8)) || (crc[1] != (BYTE)(rx.crc)))
+		return SSCP_ERR_WRONG_RESPONSE_CRC;
+
+	if ((header[4] != SSCP_PROTOCOL_SECURE) || (length < 32) || ((length % 16) != 0))
+		return SSCP_ERR_WRONG_RESPONSE_LENGTH;
+
+	/* The first block, now that its IV is there */
+	if (!SSCP_DecipherEx(&ctx->sessionCipherBA, &response[length - 16], response, 16))
+		return SSCP_ERR_INTERNAL_FAILURE;
+
+	return SSCP_ExchangeVerifyPlain(ctx, commandHeader, response, length - 16, responseData, maxResponseDataSz, actResponseDataSz);
+}
+
+/* Plain text of the command, its data either from the source or already in the frame */
+static void SSCP_StreamBegin(SSCP_STREAM_TX_ST* tx, SSCP_CTX_ST* ctx, DWORD commandHeader, DWORD commandDataSz)
+{
+	memset(tx, 0, sizeof(SSCP_STREAM_TX_ST));
+	tx->ctx = ctx;
+	tx->dataSz = commandDataSz;
+	tx->head[0] = (BYTE)(ctx->counter >> 24);
+	tx->head[1] = (BYTE)(ctx->counter >> 16);
+	tx->head[2] = (BYTE)(ctx->counter >> 8);
+	tx->head[3] = (BYTE)(ctx->counter);
+	tx->head[4] = (BYTE)(commandHeader >> 16);
+	tx->head[5] = (BYTE)(commandHeader >> 8);
+	tx->head[6] = (BYTE)(commandHeader);
+	tx->head[7] = (BYTE)(commandDataSz >> 8);
+	tx->head[8] = (BYTE)(commandDataSz);
+}
+
+/* Size of the secure frame, header and CRC included */
+static DWORD SSCP_StreamFrameSz(DWORD commandDataSz)
+{
+	return 5 + ((SSCP_COMMAND_HEADROOM + commandDataSz + 32 + 15) & ~(DWORD) 15) + 16 + 2;
+}
+
+/* Arguments of SSCP_ExchangeStream(), for the worker of the queue */
+typedef struct
+{
+	DWORD commandHeader;
+	DWORD commandDataSz;
+	SSCP_STREAM_SOURCE source;
+	void* sourceData;
+	BYTE* response;
+	DWORD maxResponseSz;
+	DWORD* actResponseDataSz;
+} SSCP_STREAM_ARGS_ST;
+
+static LONG SSCP_StreamJob(SSCP_CTX_ST* ctx, void* userData)
+{
+	const SSCP_STREAM_ARGS_ST* args = (const SSCP_STREAM_ARGS_ST*) userData;
+
+	return SSCP_ExchangeStream(ctx, args->commandHeader, args->commandDataSz, args->source, args->sourceData, args->response, args->maxResponseSz, args->actResponseDataSz);
+}
+
+/**
+ * @brief Secure exchange of a large command, read from the application as it is sent.
+ *
+ * The command data are asked to @p source in order, in pieces of up to 1 KB: while
+ * the reader receives a piece, the next one is read, signed and ciphered. Only the
+ * 16-bit lengths of the protocol limit the command (SSCP_STREAM_MAX_DATA_SZ), though
+ * the reader may accept less.
+ *
+ * The response frame is received into @p response, deciphered as it comes, then
+ * checked once complete; the response data are then at the beginning of @p response.
+ * The buffer must hold the whole response frame: the response data, plus
+ * SSCP_STREAM_RESPONSE_OVERHEAD bytes.
+ *
+ * The command is not sent again after a timeout: the error is returned.
+ *
+ * @param[in,out] ctx SSCP context, with an open channel and an authenticated session.
+ * @param[in] commandHeader Command, one of the SSCP_CMD_* constants.
+ * @param[in] commandDataSz Size of the command data.
+ * @param[in] source Function that stores @p length bytes of the command data, from
+ *            @p offset on, into @p buffer, and returns SSCP_SUCCESS; any other value
+ *            stops the exchange and is returned (the rest of the frame is sent as
+ *            zeros, so that the reader drops it).
+ * @param[in] sourceData For @p source.
+ * @param[out] response Response frame, then response data.
+ * @param[in] maxResponseSz Size of @p response.
+ * @param[out] actResponseDataSz Size of the response data (may be NULL).
+ *
+ * @return SSCP_SUCCESS on success, the status of the reader if it is not, otherwise
+ *         an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER @p source or @p response is NULL.
+ * @retval SSCP_ERR_COMMAND_TOO_LONG @p commandDataSz is more than SSCP_STREAM_MAX_DATA_SZ.
+ * @retval SSCP_ERR_RESPONSE_TOO_LONG The response frame does not fit in @p response.
+ * @retval SSCP_ERR_IN_PROGRESS An asynchronous exchange is pending on the context, or
+ *         on another reader of its bus.
+ */
+LONG SSCP_ExchangeStream(SSCP_CTX_ST* ctx, DWORD commandHeader, DWORD commandDataSz, SSCP_STREAM_SOURCE source, void* sourceData, BYTE response[], DWORD maxResponseSz, DWORD* actResponseDataSz)
+{
+	SSCP_STREAM_TX_ST tx;
+	BYTE timeoutClass;
+	DWORD frameSz, sentAt = 0, dataSz = 0;
+	DWORD startUs;
+	LONG rc;
+
+	if (actResponseDataSz != NULL)
+		*actResponseDataSz = 0;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((source == NULL) || (response == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+	if (commandDataSz > SSCP_STREAM_MAX_DATA_SZ)
+		return SSCP_ERR_COMMAND_TOO_LONG;
+
+	/* The queue runs: the exchange is a single job, the worker reads the source */
+	if (SSCP_QueueForeign(ctx))
+	{
+		SSCP_STREAM_ARGS_ST args = { commandHeader, commandDataSz, source, sourceData, response, maxResponseSz, actResponseDataSz };
+		return SSCP_QueueCallJob(ctx, SSCP_StreamJob, &args);
+	}
+
+	if (SSCP_AsyncPending(ctx))
+		return SSCP_ERR_IN_PROGRESS;
+
+	SSCP_StreamBegin(&tx, ctx, commandHeader, commandDataSz);
+	tx.source = source;
+	tx.sourceData = sourceData;
+	tx.chunkSz = SSCP_STREAM_CHUNK_SZ;
+
+	timeoutClass = SSCP_TimeoutClass(commandHeader);
+	frameSz = SSCP_StreamFrameSz(commandDataSz);
+	startUs = SSCP_GetTickUs();
+
+	rc = SSCP_StreamSend(ctx, &tx, timeoutClass, &sentAt);
+	if (rc == SSCP_SUCCESS)
+	{
+		/* The response data are checked in place, then moved to the beginning */
+		rc = SSCP_StreamRecv(ctx, commandHeader, timeoutClass, frameSz, sentAt, response, maxResponseSz, NULL, maxResponseSz, &dataSz);
+		if (rc >= 0)
+		{
+			memmove(response, &response[8], dataSz);
+			if (actResponseDataSz != NULL)
+				*actResponseDataSz = dataSz;
+		}
+	}
+	SSCP_RetryEnd(ctx, 0, (rc >= 0) ? SSCP_SUCCESS : rc);
+
+	SSCP_StatsRecord(ctx, commandHeader, rc, 0, SSCP_GetTickUs() - startUs);
+
+	memset(&tx, 0, sizeof(tx));
+	return rc;
+}
+
+/**
+ * \brief SSCP_ExchangeInPlace() in pipeline mode, see SSCP_SETTINGS_ST
+ *
+ * The command data must be stored at command[SSCP_COMMAND_HEADROOM], as for
+ * SSCP_ExchangePrepare(); the frame is signed and ciphered there as it is sent, the
+ * response is received and deciphered in the context's buffer as it comes.
+ */
+LONG SSCP_ExchangePipelined(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE command[], DWORD maxCommandSz, DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz)
+{
+	SSCP_STREAM_TX_ST tx;
+	BYTE timeoutClass = SSCP_TimeoutClass(commandHeader);
+	DWORD frameSz, sentAt = 0;
+	DWORD startUs;
+	BYTE retry;
+	LONG rc = SSCP_SUCCESS;
+
+	if (commandDataSz > SSCP_MAX_PAYLOAD_SZ)
+		return SSCP_ERR_COMMAND_TOO_LONG;
+	if (maxCommandSz < SSCP_COMMAND_HEADROOM + commandDataSz + SSCP_COMMAND_TAILROOM)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	SSCP_StreamBegin(&tx, ctx, commandHeader, commandDataSz);
+	tx.frame = command;
+	tx.chunkSz = SSCP_PIPELINE_CHUNK_SZ;
+
+	frameSz = SSCP_StreamFrameSz(commandDataSz);
+	startUs = SSCP_GetTickUs();
+
+	for (retry = 0; ; retry++)
+	{
+		/* Sent again as it is, the frame is complete in place */
+		if (retry == 0)
+			rc = SSCP_StreamSend(ctx, &tx, timeoutClass, &sentAt);
+		else
+			rc = SSCP_ExchangeRawSend(ctx, ctx->address, SSCP_PROTOCOL_SECURE, timeoutClass, command, frameSz - 7, &sentAt);
+		if (rc)
+			break;
+
+		rc = SSCP_StreamRecv(ctx, commandHeader, timeoutClass, frameSz, sentAt, ctx->rxBuffer, sizeof(ctx->rxBuffer), responseData, maxResponseDataSz, actResponseDataSz);
+		if (rc >= 0)
+			break;
+		if (!SSCP_RetryWait(ctx, retry, rc))
+			break;
+	}
+	SSCP_RetryEnd(ctx, retry, (rc >= 0) ? SSCP_SUCCESS : rc);
+
+	SSCP_StatsRecord(ctx, commandHeader, rc, retry, SSCP_GetTickUs() - startUs);
+
+	memset(&tx, 0, sizeof(tx));
+	return rc;
+}
@@ -0,0 +1,437 @@
+/**
+ * @file sscp-host-tcp.c
+ * @brief TCP transport, for the readers behind an Ethernet-to-RS485 gateway.
+ *
+ * The port name is "tcp://host:port" (an IPv6 address goes between brackets, as in
+ * "tcp://[fe80::1]:4001"). The gateway forwards the bytes to the serial line as is,
+ * so the SSCP framing is the same as on a serial port.
+ *
+ * Nagle's algorithm is disabled and every frame is handed over to the stack in a
+ * single call, so that a command leaves in one segment (or in as few as the MSS
+ * allows) without waiting for the acknowledgement of the previous one. On the
+ * receive side, a read takes the whole segment into the port's ring.
+ *
+ * The socket is non-blocking, like the serial port on Linux: the waits are done
+ * with select(), and the timeouts are the ones of the serial transport.
+ */
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include "sscp-host_i.h"
+
+#ifdef _WIN32
+typedef SOCKET SSCP_SOCKET;
+#define SSCP_SOCKET_OF(ctx) ((SOCKET) (ctx)->port->commSocket)
+#define SSCP_SOCKET_SET(ctx, s) ((ctx)->port->commSocket = (UINT_PTR) (s))
+#define SSCP_SOCKET_CLOSE closesocket
+#define SSCP_SOCKET_ERRNO WSAGetLastError()
+#define SSCP_SOCKET_WOULDBLOCK(e) (((e) == WSAEWOULDBLOCK) || ((e) == WSAEINTR))
+#define SSCP_SOCKET_INPROGRESS(e) ((e) == WSAEWOULDBLOCK)
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+typedef int SSCP_SOCKET;
+#define INVALID_SOCKET (-1)
+#define SSCP_SOCKET_OF(ctx) ((ctx)->port->commFd)
+#define SSCP_SOCKET_SET(ctx, s) ((ctx)->port->commFd = (s))
+#define SSCP_SOCKET_CLOSE close
+#define SSCP_SOCKET_ERRNO errno
+#define SSCP_SOCKET_WOULDBLOCK(e) (((e) == EAGAIN) || ((e) == EWOULDBLOCK) || ((e) == EINTR))
+#define SSCP_SOCKET_INPROGRESS(e) ((e) == EINPROGRESS)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is set instead */
+#endif
+#endif
+
+#define SSCP_TCP_CONNECT_TIMEOUT 3000
+
+BOOL SSCP_DEBUG_TCP = FALSE;
+
+/* Wait until the socket is readable (or writable), FALSE on timeout or error */
+static BOOL SSCP_TcpSelect(SSCP_SOCKET s, BOOL forWrite, DWORD timeoutMs)
+{
+	struct timeval timeout;
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(s, &fds);
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+	return (select((int) s + 1, forWrite ? NULL : &fds, forWrite ? &fds : NULL, NULL, &timeout) > 0) ? TRUE : FALSE;
+}
+
+static BOOL SSCP_TcpSetNonBlocking(SSCP_SOCKET s)
+{
+#ifdef _WIN32
+	u_long mode = 1;
+	return (ioctlsocket(s, FIONBIO, &mode) == 0) ? TRUE : FALSE;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	return ((flags >= 0) && (fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0)) ? TRUE : FALSE;
+#endif
+}
+
+/* Split "tcp://host:port" (or "tcp://[v6]:port") */
+static BOOL SSCP_TcpParseName(const char* commName, char host[], DWORD maxHostSz, char service[], DWORD maxServiceSz)
+{
+	const char* p = commName + strlen(SSCP_TCP_PREFIX);
+	const char* end;
+	size_t length;
+
+	if (*p == '[')
+	{
+		p++;
+		end = strchr(p, ']');
+		if ((end == NULL) || (end[1] != ':'))
+			return FALSE;
+	}
+	else
+	{
+		end = strrchr(p, ':');
+		if (end == NULL)
+			return FALSE;
+	}
+
+	length = end - p;
+	if ((length == 0) || (length >= maxHostSz))
+		return FALSE;
+	memcpy(host, p, length);
+	host[length] = '\0';
+
+	end = strchr(end, ':') + 1;
+	if ((*end == '\0') || (strlen(end) >= maxServiceSz))
+		return FALSE;
+	strcpy(service, end);
+
+	return TRUE;
+}
+
+/* Connect without blocking for more than SSCP_TCP_CONNECT_TIMEOUT, INVALID_SOCKET on failure */
+static SSCP_SOCKET SSCP_TcpConnect(const struct addrinfo* ai)
+{
+	SSCP_SOCKET s;
+	int error = 0;
+	socklen_t errorSz = sizeof(error);
+	int one = 1;
+
+	s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (s == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	/* A frame must leave at once, not wait for the ACK of the previous one */
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof(one));
+	/* Find out when the gateway is gone, even between the exchanges */
+	setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const char*) &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+	setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const char*) &one, sizeof(one));
+#endif
+
+	if (!SSCP_TcpSetNonBlocking(s))
+		goto failed;
+
+	if (connect(s, ai->ai_addr, (int) ai->ai_addrlen) != 0)
+	{
+		if (!SSCP_SOCKET_INPROGRESS(SSCP_SOCKET_ERRNO))
+			goto failed;
+		if (!SSCP_TcpSelect(s, TRUE, SSCP_TCP_CONNECT_TIMEOUT))
+			goto failed;
+		if ((getsockopt(s, SOL_SOCKET, SO_ERROR, (char*) &error, &errorSz) != 0) || (error != 0))
+			goto failed;
+	}
+
+	return s;
+
+failed:
+	SSCP_SOCKET_CLOSE(s);
+	return INVALID_SOCKET;
+}
+
+static LONG SSCP_TcpOpen(SSCP_CTX_ST* ctx, const char* commName)
+{
+	struct addrinfo hints;
+	struct addrinfo* list = NULL;
+	struct addrinfo* ai;
+	SSCP_SOCKET s = INVALID_SOCKET;
+	char host[256];
+	char service[32];
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((commName == NULL) || !SSCP_TcpParseName(commName, host, sizeof(host), service, sizeof(service)))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	if (ctx->settings.debugTcp)
+		SSCP_Trace("Connecting to %s port %s...\n", host, service);
+
+#ifdef _WIN32
+	{
+		WSADATA wsaData;
+		if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+			return SSCP_ERR_COMM_NOT_AVAILABLE;
+	}
+#endif
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(host, service, &hints, &list) == 0)
+	{
+		for (ai = list; (ai != NULL) && (s == INVALID_SOCKET); ai = ai->ai_next)
+			s = SSCP_TcpConnect(ai);
+		freeaddrinfo(list);
+	}
+
+	if (s == INVALID_SOCKET)
+	{
+		if (ctx->settings.debugTcp)
+			SSCP_Trace("connect failed (%d)\n", SSCP_SOCKET_ERRNO);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		return SSCP_ERR_COMM_NOT_AVAILABLE;
+	}
+
+	SSCP_SOCKET_SET(ctx, s);
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_TcpClose(SSCP_CTX_ST* ctx)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_SOCKET_OF(ctx) == INVALID_SOCKET)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	if (ctx->settings.debugTcp)
+		SSCP_Trace("Closing connection\n");
+
+	SSCP_SOCKET_CLOSE(SSCP_SOCKET_OF(ctx));
+	SSCP_SOCKET_SET(ctx, INVALID_SOCKET);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return SSCP_SUCCESS;
+}
+
+/* The baudrate of the serial line is a setting of the gateway */
+static LONG SSCP_TcpConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+{
+	(void) baudrate;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_SOCKET_OF(ctx) == INVALID_SOCKET)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	return SSCP_SUCCESS;
+}
+
+static LONG SSCP_TcpSetTimeouts(SSCP_CTX_ST* ctx, DWORD first_byte, DWORD inter_byte)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_SOCKET_OF(ctx) == INVALID_SOCKET)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	ctx->port->firstByteTimeout = first_byte;
+	ctx->port->interByteTimeout = inter_byte;
+
+	return SSCP_SUCCESS;
+}
+
+/* One send of all the chunks, without waiting; *sent is 0 if the socket's buffer is full */
+static LONG SSCP_TcpSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
+{
+	DWORD i, written;
+	int error;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_SOCKET_OF(ctx) == INVALID_SOCKET)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS) || (sent == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*sent = 0;
+
+#ifdef _WIN32
+	{
+		WSABUF buffers[SSCP_SERIAL_MAX_CHUNKS];
+		DWORD done = 0;
+
+		for (i = 0; i < chunkCount; i++)
+		{
+			buffers[i].buf = (CHAR*) chunks[i].buffer;
+			buffers[i].len = (ULONG) chunks[i].length;
+		}
+
+		if (WSASend(SSCP_SOCKET_OF(ctx), buffers, chunkCount, &done, 0, NULL, NULL) != 0)
+			goto failed;
+		written = done;
+	}
+#else
+	{
+		struct iovec iov[SSCP_SERIAL_MAX_CHUNKS];
+		struct msghdr msg;
+		ssize_t done;
+
+		for (i = 0; i < chunkCount; i++)
+		{
+			iov[i].iov_base = (void*) chunks[i].buffer;
+			iov[i].iov_len = chunks[i].length;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = chunkCount;
+
+		/* A closed connection is an error, not a SIGPIPE */
+		done = sendmsg(SSCP_SOCKET_OF(ctx), &msg, MSG_NOSIGNAL);
+		if (done < 0)
+			goto failed;
+		written = (DWORD) done;
+	}
+#endif
+
+	ctx->stats.bytesSent += written;
+
+	if (ctx->settings.debugTcp)
+	{
+		DWORD left = written;
+		DWORD j;
+		SSCP_Trace("<");
+		for (i = 0; (i < chunkCount) && left; i++)
+			for (j = 0; (j < chunks[i].length) && left; j++, left--)
+				SSCP_Trace("%02X", chunks[i].buffer[j]);
+		SSCP_Trace("\n");
+	}
+
+	*sent = written;
+	return SSCP_SUCCESS;
+
+failed:
+	error = SSCP_SOCKET_ERRNO;
+	if (SSCP_SOCKET_WOULDBLOCK(error))
+		return SSCP_SUCCESS; /* Try again later */
+	if (ctx->settings.debugTcp)
+		SSCP_Trace("send(%lu) error (%d)\n", (unsigned long) chunkCount, error);
+	return SSCP_ERR_COMM_SEND_FAILED;
+}
+
+/* Send all the chunks, in a single call unless the socket's buffer is full */
+static LONG SSCP_TcpSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	SSCP_SERIAL_CHUNK_ST pending[SSCP_SERIAL_MAX_CHUNKS];
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_SOCKET_OF(ctx) == INVALID_SOCKET)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	memcpy(pending, chunks, chunkCount * sizeof(SSCP_SERIAL_CHUNK_ST));
+	chunkCount = SSCP_SerialSkipChunks(pending, chunkCount, 0);
+
+	while (chunkCount)
+	{
+		DWORD written;
+
+		rc = SSCP_TcpSendSomeV(ctx, pending, chunkCount, &written);
+		if (rc)
+			return rc;
+
+		if (written == 0)
+		{
+			if (!SSCP_TcpSelect(SSCP_SOCKET_OF(ctx), TRUE, SSCP_RESPONSE_FIRST_TIMEOUT))
+			{
+				if (ctx->settings.debugTcp)
+					SSCP_Trace("select on send failed (%d)\n", SSCP_SOCKET_ERRNO);
+				return SSCP_ERR_COMM_SEND_FAILED;
+			}
+			continue;
+		}
+
+		chunkCount = SSCP_SerialSkipChunks(pending, chunkCount, written);
+	}
+
+	return SSCP_SUCCESS;
+}
+
+/* Wait up to timeoutMs for some bytes (0: don't wait), then read all that is there */
+static LONG SSCP_TcpRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
+{
+	int done, error;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (SSCP_SOCKET_OF(ctx) == INVALID_SOCKET)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((buffer == NULL) || (received == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*received = 0;
+
+	if ((timeoutMs > 0) && !SSCP_TcpSelect(SSCP_SOCKET_OF(ctx), FALSE, timeoutMs))
+		return SSCP_SUCCESS; /* Timeout, or interrupted: the caller checks its deadline */
+
+	done = recv(SSCP_SOCKET_OF(ctx), (char*) buffer, (int) length, 0);
+	if (done < 0)
+	{
+		error = SSCP_SOCKET_ERRNO;
+		if (SSCP_SOCKET_WOULDBLOCK(error))
+			return SSCP_SUCCESS; /* Nothing yet */
+		if (ctx->settings.debugTcp)
+			SSCP_Trace("recv(%lu) failed (%d)\n", (unsigned long) length, error);
+		return SSCP_ERR_COMM_RECV_FAILED;
+	}
+	if (done == 0)
+	{
+		/* The gateway has closed the connection */
+		if (ctx->settings.debugTcp)
+			SSCP_Trace("recv(%lu) failed, connection closed\n", (unsigned long) length);
+		return SSCP_ERR_COMM_RECV_FAILED;
+	}
+
+	ctx->stats.bytesReceived += done;
+
+	if (ctx->settings.debugTcp)
+	{
+		int i;
+		SSCP_Trace(">");
+		for (i = 0; i < done; i++)
+			SSCP_Trace("%02X", buffer[i]);
+		SSCP_Trace("\n");
+	}
+
+	*received = done;
+	return SSCP_SUCCESS;
+}
+
+const SSCP_TRANSPORT_ST SSCP_TRANSPORT_TCP = {
+	"tcp",
+	SSCP_TcpOpen,
+	SSCP_TcpClose,
+	SSCP_TcpConfigure,
+	SSCP_TcpSetTimeouts,
+	SSCP_TcpSendV,
+	SSCP_TcpSendSomeV,
+	SSCP_TcpRecvWait,
+	NULL
+};
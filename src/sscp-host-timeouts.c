@@ -0,0 +1,213 @@
+/**
+ * @file sscp-host-timeouts.c
+ * @brief Response timeouts, per context and per class of command.
+ *
+ * The first byte timeout of an exchange is the timeout of its class (a reader command
+ * such as GetInfos answers at once, a command that involves the card or writes the
+ * reader's configuration does not), plus the time the command frame takes on the
+ * line at the port's baudrate: the write returns as soon as the driver has the frame,
+ * not when the reader has received it. The inter byte timeout covers a few characters
+ * at the baudrate, plus the latency of the USB adapters.
+ *
+ * When the profile is adaptive, each class keeps a smoothed response time and its
+ * mean deviation (as TCP does for its retransmission timeout, RFC 6298) and the first
+ * byte timeout shrinks to srtt + 4 * rttvar. It never goes beyond the configured value,
+ * and doubles after each timeout, so that a reader that got slower is waited for again.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_ADAPTIVE_MIN_SAMPLES 4 /* Responses to observe before the timeout adapts */
+#define SSCP_ADAPTIVE_MIN_TIMEOUT 20
+
+/* Timeout class of a secure command */
+BYTE SSCP_TimeoutClass(DWORD commandHeader)
+{
+	switch (commandHeader)
+	{
+		case SSCP_CMD_OUTPUTS:
+		case SSCP_CMD_GET_INFOS:
+		case SSCP_CMD_GET_SERIAL_NUMBER:
+		case SSCP_CMD_OUTPUT_RGB:
+		case SSCP_CMD_GET_READER_TYPE:
+		case SSCP_CMD_EXTERNAL_LED_COLORS:
+			return SSCP_TIMEOUT_CLASS_CONTROL;
+
+		case SSCP_CMD_CHANGE_READER_KEYS:
+		case SSCP_CMD_SET_BAUDRATE:
+		case SSCP_CMD_SET_RS485_ADDRESS:
+			return SSCP_TIMEOUT_CLASS_SETUP;
+
+		default:
+			/* The card commands, and whatever we don't know about */
+			return SSCP_TIMEOUT_CLASS_CARD;
+	}
+}
+
+/* Configured timeout of the class, the default one if 0 */
+static DWORD SSCP_ClassTimeout(SSCP_CTX_ST* ctx, BYTE timeoutClass)
+{
+	DWORD value;
+
+	switch (timeoutClass)
+	{
+		case SSCP_TIMEOUT_CLASS_CONTROL:
+			value = ctx->timeouts.profile.controlMs;
+			return (value > 0) ? value : SSCP_RESPONSE_CONTROL_TIMEOUT;
+		case SSCP_TIMEOUT_CLASS_SETUP:
+			value = ctx->timeouts.profile.setupMs;
+			return (value > 0) ? value : SSCP_RESPONSE_SETUP_TIMEOUT;
+		default:
+			value = ctx->timeouts.profile.cardMs;
+			return (value > 0) ? value : SSCP_RESPONSE_CARD_TIMEOUT;
+	}
+}
+
+/* Time a frame takes on the line, 10 bits per byte, rounded up */
+DWORD SSCP_TransmitTimeMs(SSCP_CTX_ST* ctx, DWORD frameSz)
+{
+	DWORD baudrate = ctx->port->baudrate;
+
+	if (baudrate == 0)
+		return 0;
+
+	return (frameSz * 10 * 1000 + baudrate - 1) / baudrate;
+}
+
+/* Delay allowed between the end of the command frame (frameSz bytes) and the beginning of the response */
+DWORD SSCP_FirstByteTimeout(SSCP_CTX_ST* ctx, BYTE timeoutClass, DWORD frameSz)
+{
+	DWORD timeout = SSCP_ClassTimeout(ctx, timeoutClass);
+	BOOL adaptive = ctx->timeouts.profile.adaptive;
+
+	/* A resending waits as long as the reader usually takes, see sscp-host-retry.c */
+	if (ctx->retry.resending)
+	{
+		adaptive = TRUE;
+		if ((ctx->retry.policy.resendTimeoutMs > 0) && (ctx->retry.policy.resendTimeoutMs < timeout))
+			timeout = ctx->retry.policy.resendTimeoutMs;
+	}
+
+	if (adaptive && (ctx->timeouts.samples[timeoutClass] >= SSCP_ADAPTIVE_MIN_SAMPLES))
+	{
+		DWORD rto = ctx->timeouts.srtt8[timeoutClass] / 8 + ctx->timeouts.rttvar4[timeoutClass];
+
+		if (rto < SSCP_ADAPTIVE_MIN_TIMEOUT)
+			rto = SSCP_ADAPTIVE_MIN_TIMEOUT;
+		if (rto < timeout)
+			timeout = rto;
+	}
+
+	return timeout + SSCP_TransmitTimeMs(ctx, frameSz);
+}
+
+/* Delay allowed between two bursts of the response */
+DWORD SSCP_InterByteTimeout(SSCP_CTX_ST* ctx)
+{
+	if (ctx->timeouts.profile.interByteMs > 0)
+		return ctx->timeouts.profile.interByteMs;
+	if (ctx->port->baudrate == 0)
+		return SSCP_RESPONSE_NEXT_TIMEOUT;
+
+	return SSCP_RESPONSE_NEXT_MIN_TIMEOUT + SSCP_TransmitTimeMs(ctx, SSCP_RESPONSE_NEXT_CHARS);
+}
+
+/* A response came elapsedMs after the command frame (frameSz bytes) has been handed to the transport */
+void SSCP_TimeoutSample(SSCP_CTX_ST* ctx, BYTE timeoutClass, DWORD frameSz, DWORD elapsedMs)
+{
+	DWORD transmitMs = SSCP_TransmitTimeMs(ctx, frameSz);
+	LONG delta;
+
+	if (timeoutClass >= SSCP_TIMEOUT_CLASS_COUNT)
+		return;
+
+	/* Only the reader's latency is learnt, the transmission time is added back per frame */
+	elapsedMs = (elapsedMs > transmitMs) ? elapsedMs - transmitMs : 0;
+
+	if (ctx->timeouts.samples[timeoutClass] == 0)
+	{
+		ctx->timeouts.srtt8[timeoutClass] = elapsedMs * 8;
+		ctx->timeouts.rttvar4[timeoutClass] = elapsedMs * 2;
+	}
+	else
+	{
+		delta = (LONG) elapsedMs - (LONG)(ctx->timeouts.srtt8[timeoutClass] / 8);
+		ctx->timeouts.srtt8[timeoutClass] += delta;
+		if (delta < 0)
+			delta = -delta;
+		ctx->timeouts.rttvar4[timeoutClass] += delta - (LONG)(ctx->timeouts.rttvar4[timeoutClass] / 4);
+	}
+
+	if (ctx->timeouts.samples[timeoutClass] < SSCP_ADAPTIVE_MIN_SAMPLES)
+		ctx->timeouts.samples[timeoutClass]++;
+}
+
+/* No response in time: back off, up to the configured timeout */
+void SSCP_TimeoutExpired(SSCP_CTX_ST* ctx, BYTE timeoutClass)
+{
+	DWORD limit, rto;
+
+	if (timeoutClass >= SSCP_TIMEOUT_CLASS_COUNT)
+		return;
+
+	/* The smoothed time takes the doubled timeout, the next responses bring it down again */
+	limit = SSCP_ClassTimeout(ctx, timeoutClass);
+	rto = ctx->timeouts.srtt8[timeoutClass] / 8 + ctx->timeouts.rttvar4[timeoutClass];
+	if (rto < SSCP_ADAPTIVE_MIN_TIMEOUT)
+		rto = SSCP_ADAPTIVE_MIN_TIMEOUT;
+	rto *= 2;
+	ctx->timeouts.srtt8[timeoutClass] = ((rto < limit) ? rto : limit) * 8;
+}
+
+/**
+ * @brief Set the response timeouts of a context.
+ *
+ * The first byte timeout of each exchange is the one of the command's class, plus
+ * the time the command takes on the line at the port's baudrate. With
+ * @p profile->adaptive, it shrinks towards the response time observed for the
+ * class once a few responses have been received, within the configured value.
+ * The observed response times are forgotten.
+ *
+ * @param[in,out] ctx SSCP context (a reader of a bus has its own profile).
+ * @param[in] profile Timeouts, 0 for the defaults (may be NULL for all the defaults).
+ *
+ * @return SSCP_SUCCESS, or SSCP_ERR_INVALID_CONTEXT if @p ctx is NULL.
+ */
+LONG SSCP_SetTimeoutProfile(SSCP_CTX_ST* ctx, const SSCP_TIMEOUT_PROFILE_ST* profile)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+	memset(&ctx->timeouts, 0, sizeof(ctx->timeouts));
+	if (profile != NULL)
+		ctx->timeouts.profile = *profile;
+
+	return SSCP_SUCCESS;
+}
+
+/**
+ * @brief Get the response timeouts of a context.
+ *
+ * @param[in] ctx SSCP context.
+ * @param[out] profile Timeouts in use; the defaults are given as their actual
+ *             value, except the inter byte timeout that remains 0 when it follows
+ *             the baudrate.
+ *
+ * @return SSCP_SUCCESS, or an SSCP_ERR_* code.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_INVALID_PARAMETER The @p profile parameter is NULL.
+ */
+LONG SSCP_GetTimeoutProfile(SSCP_CTX_ST* ctx, SSCP_TIMEOUT_PROFILE_ST* profile)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (profile == NULL)
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	*profile = ctx->timeouts.profile;
+	profile->controlMs = SSCP_ClassTimeout(ctx, SSCP_TIMEOUT_CLASS_CONTROL);
+	profile->cardMs = SSCP_ClassTimeout(ctx, SSCP_TIMEOUT_CLASS_CARD);
+	profile->setupMs = SSCP_ClassTimeout(ctx, SSCP_TIMEOUT_CLASS_SETUP);
+
+	return SSCP_SUCCESS;
+}
@@ -0,0 +1,259 @@
+/**
+ * @file sscp-host-trace.c
+ * @brief Binary trace of the frames and of the secure exchanges.
+ *
+ * The debug output (SSCP_SetSettings()) formats every byte it shows as it goes, and
+ * slows the exchanges down enough to change what happens on a bus. The trace only
+ * copies a few fixed-size fields: each frame sent or received, each timeout and the
+ * outcome of each secure exchange becomes an event, timestamped with the monotonic
+ * clock of sscp-host-guard.c, that goes into a ring and/or to a sink of the
+ * application. Nothing is formatted until the application reads the ring.
+ *
+ * The ring is lock-free: any number of contexts, on any number of threads, may
+ * record into the same ring, and a single thread reads it. A writer takes a position
+ * with an atomic increment, then fills the slot under a sequence number (odd while
+ * it is written, even once it is complete); the reader checks the sequence number
+ * before and after its copy, and skips the slots that have been written again
+ * in between. When the reader does not keep up, the oldest events are overwritten
+ * and counted as lost.
+ *
+ * With SSCP_WITH_TRACE set to 0 the debug output and the trace are compiled out:
+ * the exchanges carry no trace code at all.
+ */
+#include "sscp-host_i.h"
+
+#define SSCP_TRACE_MIN_EVENTS 16
+
+typedef struct
+{
+	volatile LONG sequence; /* 2 * position + 1 while written, 2 * position + 2 once complete */
+	SSCP_TRACE_EVENT_ST event;
+} SSCP_TRACE_SLOT_ST;
+
+struct _SSCP_TRACE_ST
+{
+	volatile LONG head; /* Next position to write, taken by the writers */
+	LONG tail; /* Next position to read, the reader's only */
+	DWORD mask;
+	SSCP_TRACE_SLOT_ST* slots;
+};
+
+static void SSCP_TraceRecord(SSCP_CTX_ST* ctx, SSCP_TRACE_EVENT_ST* event)
+{
+	SSCP_TRACE_ST* trace = ctx->trace.ring;
+
+	event->timeUs = SSCP_GetTickUs();
+	event->address = ctx->address;
+
+	if (trace != NULL)
+	{
+		LONG position = SSCP_ATOMIC_ADD(&trace->head, 1);
+		SSCP_TRACE_SLOT_ST* slot = &trace->slots[(DWORD) position & trace->mask];
+
+		event->sequence = (DWORD) position;
+
+		SSCP_ATOMIC_STORE(&slot->sequence, (LONG)(2 * (DWORD) position + 1));
+		slot->event = *event;
+		SSCP_ATOMIC_STORE(&slot->sequence, (LONG)(2 * (DWORD) position + 2));
+	}
+
+	if (ctx->trace.sink != NULL)
+		ctx->trace.sink(ctx, event, ctx->trace.userData);
+}
+
+/* A frame (header, then payload) has been sent or received */
+void SSCP_TraceFrame(SSCP_CTX_ST* ctx, BYTE type, const BYTE header[5], const BYTE payload[], DWORD payloadSz)
+{
+	SSCP_TRACE_EVENT_ST event;
+	DWORD dataSz = 5;
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.info = 5 + payloadSz + 2;
+
+	/* Only the secure payloads, they are ciphered; the authentication ones are the seed of the session keys */
+	memcpy(event.data, header, 5);
+	if (header[4] == SSCP_PROTOCOL_SECURE)
+	{
+		dataSz += payloadSz;
+		if (dataSz > SSCP_TRACE_DATA_SZ)
+			dataSz = SSCP_TRACE_DATA_SZ;
+		memcpy(&event.data[5], payload, dataSz - 5);
+	}
+	event.dataSz = (WORD) dataSz;
+
+	SSCP_TraceRecord(ctx, &event);
+}
+
+/* Anything else than a frame */
+void SSCP_TraceEvent(SSCP_CTX_ST* ctx, BYTE type, DWORD info, DWORD retries, LONG result, DWORD durationUs)
+{
+	SSCP_TRACE_EVENT_ST event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.info = info;
+	event.retries = retries;
+	event.result = result;
+	event.durationUs = durationUs;
+
+	SSCP_TraceRecord(ctx, &event);
+}
+
+/**
+ * @brief Allocate a trace ring.
+ *
+ * @param[in] eventCount Number of events the ring holds, rounded up to a power of 2
+ *            (at least 16).
+ *
+ * @return The ring, or NULL on allocation failure.
+ */
+SSCP_TRACE_ST* SSCP_TraceAlloc(DWORD eventCount)
+{
+	SSCP_TRACE_ST* trace;
+	DWORD capacity = SSCP_TRACE_MIN_EVENTS;
+
+	while ((capacity < eventCount) && (capacity < 0x40000000))
+		capacity <<= 1;
+
+	trace = SSCP_MemAlloc(sizeof(SSCP_TRACE_ST));
+	if (trace == NULL)
+		return NULL;
+
+	trace->slots = SSCP_MemAlloc(capacity * sizeof(SSCP_TRACE_SLOT_ST));
+	if (trace->slots == NULL)
+	{
+		SSCP_MemFree(trace);
+		return NULL;
+	}
+	trace->mask = capacity - 1;
+
+	return trace;
+}
+
+/**
+ * @brief Free a trace ring.
+ *
+ * The ring must be detached from all the contexts first (see SSCP_TraceAttach()).
+ *
+ * @param[in] trace Ring (may be NULL).
+ */
+void SSCP_TraceFree(SSCP_TRACE_ST* trace)
+{
+	if (trace == NULL)
+		return;
+
+	SSCP_MemFree(trace->slots);
+	SSCP_MemFree(trace);
+}
+
+/**
+ * @brief Trace the frames and the secure exchanges of a context.
+ *
+ * From now on, the events of the context go into @p trace and/or to @p sink. The
+ * sink is called by the thread of the exchange, as the event happens: it should do
+ * no more than store the event, or the exchanges wait for it.
+ *
+ * The frames are recorded as they are on the line, up to SSCP_TRACE_DATA_SZ bytes:
+ * the header, then the payload if it is a secure one (ciphered). The payloads of the
+ * authentication are left out, as the session keys derive from them; no key is ever
+ * recorded.
+ *
+ * The readers of a bus obtained afterwards (SSCP_BusGetReader()) are traced as their
+ * master is; the others have to be attached one by one.
+ *
+ * @param[in,out] ctx SSCP context; not while an exchange runs on it.
+ * @param[in] trace Ring to record into (may be NULL).
+ * @param[in] sink Function to give the events to (may be NULL).
+ * @param[in] userData For the sink.
+ *
+ * @return SSCP_SUCCESS, or an SSCP_ERR_* code. Both @p trace and @p sink NULL stop
+ *         the trace of the context.
+ *
+ * @retval SSCP_ERR_INVALID_CONTEXT The @p ctx parameter is NULL.
+ * @retval SSCP_ERR_NOT_YET_IMPLEMENTED The library has been built without the trace
+ *         (SSCP_WITH_TRACE set to 0).
+ */
+LONG SSCP_TraceAttach(SSCP_CTX_ST* ctx, SSCP_TRACE_ST* trace, SSCP_TRACE_SINK sink, void* userData)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+
+#if SSCP_WITH_TRACE
+	ctx->trace.ring = trace;
+	ctx->trace.sink = sink;
+	ctx->trace.userData = userData;
+
+	return SSCP_SUCCESS;
+#else
+	(void) trace;
+	(void) sink;
+	(void) userData;
+
+	return SSCP_ERR_NOT_YET_IMPLEMENTED;
+#endif
+}
+
+/**
+ * @brief Take the oldest events out of a trace ring.
+ *
+ * Only one thread may read a ring, while any number of them record into it.
+ *
+ * @param[in,out] trace Ring.
+ * @param[out] events Events, oldest first.
+ * @param[in] maxEvents Size of @p events.
+ * @param[out] lostEvents Number of events overwritten before they could be read,
+ *             since the previous call (may be NULL).
+ *
+ * @return The number of events stored in @p events, 0 if there is none (or if
+ *         @p trace or @p events is NULL).
+ */
+DWORD SSCP_TraceRead(SSCP_TRACE_ST* trace, SSCP_TRACE_EVENT_ST events[], DWORD maxEvents, DWORD* lostEvents)
+{
+	DWORD count = 0, lost = 0;
+
+	if (lostEvents != NULL)
+		*lostEvents = 0;
+
+	if ((trace == NULL) || (events == NULL))
+		return 0;
+
+	while (count < maxEvents)
+	{
+		LONG position = trace->tail;
+		SSCP_TRACE_SLOT_ST* slot = &trace->slots[(DWORD) position & trace->mask];
+		LONG before, after, ahead;
+
+		before = SSCP_ATOMIC_LOAD(&slot->sequence);
+		ahead = (LONG)((DWORD) before - (2 * (DWORD) position + 2)); /* The positions wrap */
+		if (ahead < 0)
+			break; /* Not written yet, or being written */
+
+		if (ahead == 0)
+		{
+			events[count] = slot->event;
+			after = SSCP_ATOMIC_LOAD(&slot->sequence);
+			if (after == before)
+			{
+				count++;
+				trace->tail = position + 1;
+				continue;
+			}
+		}
+
+		/* Overwritten: carry on with the oldest event the ring still holds */
+		{
+			LONG oldest = SSCP_ATOMIC_LOAD(&trace->head) - (LONG) trace->mask;
+
+			if ((LONG)((DWORD) oldest - (DWORD) position) <= 0)
+				oldest = (LONG)((DWORD) position + 1);
+			lost += (DWORD) oldest - (DWORD) position;
+			trace->tail = oldest;
+		}
+	}
+
+	if (lostEvents != NULL)
+		*lostEvents = lost;
+
+	return count;
+}
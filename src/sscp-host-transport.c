@@ -0,0 +1,143 @@
+/**
+ * @file sscp-host-transport.c
+ * @brief Dispatch of the port I/O to the transport the port has been opened with.
+ *
+ * A transport is a table of I/O primitives (see SSCP_TRANSPORT_ST): the serial
+ * backend (sscp-host-serial-windows.c, sscp-host-serial-linux.c) and the TCP backend
+ * (sscp-host-tcp.c), the capture and replay of sessions (sscp-host-capture.c), and
+ * the loopback of the self test (sscp-host-selftest.c). The exchange, the framing and the asynchronous state machine only see the
+ * functions below, whatever the transport.
+ */
+#include "sscp-host_i.h"
+
+/* Transport matching the name of the port: "tcp://host:port", a capture or a replay, otherwise a serial device */
+const SSCP_TRANSPORT_ST* SSCP_TransportFromName(const char* commName)
+{
+	if ((commName != NULL) && !strncmp(commName, SSCP_TCP_PREFIX, strlen(SSCP_TCP_PREFIX)))
+		return &SSCP_TRANSPORT_TCP;
+#if SSCP_WITH_CAPTURE
+	if ((commName != NULL) && !strncmp(commName, SSCP_CAPTURE_PREFIX, strlen(SSCP_CAPTURE_PREFIX)))
+		return &SSCP_TRANSPORT_CAPTURE;
+	if ((commName != NULL) && !strncmp(commName, SSCP_REPLAY_PREFIX, strlen(SSCP_REPLAY_PREFIX)))
+		return &SSCP_TRANSPORT_REPLAY;
+#endif
+
+	return &SSCP_TRANSPORT_SERIAL;
+}
+
+/* Open the port with the given transport, then apply the baudrate and the default timeouts */
+LONG SSCP_TransportOpen(SSCP_CTX_ST* ctx, const SSCP_TRANSPORT_ST* transport, const char* commName, DWORD baudrate)
+{
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if ((transport == NULL) || (commName == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	/* Don't forget to close in case of it were previously open */
+	if (ctx->port->transport != NULL)
+		SSCP_TransportClose(ctx);
+
+	rc = transport->open(ctx, commName);
+	if (rc)
+		return rc;
+
+	ctx->port->transport = transport;
+	SSCP_SerialFlushRing(ctx);
+
+	rc = SSCP_TransportConfigure(ctx, baudrate);
+	if (rc)
+	{
+		SSCP_TransportClose(ctx);
+		return rc;
+	}
+
+	/* Default timeouts */
+	rc = transport->setTimeouts(ctx, SSCP_RESPONSE_FIRST_TIMEOUT, SSCP_RESPONSE_NEXT_TIMEOUT);
+	if (rc)
+	{
+		SSCP_TransportClose(ctx);
+		return rc;
+	}
+
+	return SSCP_SUCCESS;
+}
+
+LONG SSCP_TransportClose(SSCP_CTX_ST* ctx)
+{
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	rc = ctx->port->transport->close(ctx);
+	ctx->port->transport = NULL;
+	ctx->port->asyncOwner = NULL;
+
+	return rc;
+}
+
+LONG SSCP_TransportConfigure(SSCP_CTX_ST* ctx, DWORD baudrate)
+{
+	LONG rc;
+
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	rc = ctx->port->transport->configure(ctx, baudrate);
+	if (rc == SSCP_SUCCESS)
+		ctx->port->baudrate = baudrate;
+
+	return rc;
+}
+
+LONG SSCP_TransportSetTimeouts(SSCP_CTX_ST* ctx, DWORD firstByte, DWORD interByte)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+
+	return ctx->port->transport->setTimeouts(ctx, firstByte, interByte);
+}
+
+LONG SSCP_TransportSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	return ctx->port->transport->sendV(ctx, chunks, chunkCount);
+}
+
+LONG SSCP_TransportSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((chunks == NULL) || (chunkCount > SSCP_SERIAL_MAX_CHUNKS) || (sent == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	return ctx->port->transport->sendSomeV(ctx, chunks, chunkCount, sent);
+}
+
+LONG SSCP_TransportRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received)
+{
+	if (ctx == NULL)
+		return SSCP_ERR_INVALID_CONTEXT;
+	if (ctx->port->transport == NULL)
+		return SSCP_ERR_COMM_NOT_OPEN;
+	if ((buffer == NULL) || (received == NULL))
+		return SSCP_ERR_INVALID_PARAMETER;
+
+	return ctx->port->transport->recvWait(ctx, buffer, length, timeoutMs, received);
+}
@@ -4,15 +4,172 @@
 #include <sscp-host.h>
 #include <sscp-consts.h>
 
-struct _SSCP_CTX_ST
+#include "sscp-host-crypto_i.h"
+
+#ifndef SSCP_WITH_TRACE
+#define SSCP_WITH_TRACE 1 /* 0 compiles out the debug output and the binary trace */
+#endif
+
+#ifndef SSCP_WITH_HEAP
+#define SSCP_WITH_HEAP 1 /* 0: no malloc(), the objects come from the pool of SSCP_SetMemoryPool() */
+#endif
+
+#ifndef SSCP_MAX_PAYLOAD_SZ
+#define SSCP_MAX_PAYLOAD_SZ 4096 /* Largest payload of a single SSCP frame */
+#endif
+
+#define SSCP_DRBG_POOL_SZ 256 /* Random bytes generated at a time for the exchanges */
+#ifndef SSCP_KEY_CACHE_SLOTS
+#define SSCP_KEY_CACHE_SLOTS 4 /* Authentication keys a key cache holds, see sscp-host-crypto-keys.c */
+#endif
+#define SSCP_DERIVE_LANES 16 /* Session keys derived at a time by SSCP_DeriveSessionKeys() */
+
+#define SSCP_COMMAND_HEADROOM 9 /* Counter (4) + type (1) + code (2) + length (2) */
+#define SSCP_COMMAND_TAILROOM (32 + 16 + 16) /* HMAC (32) + padding (up to 16) + IV (16) */
+
+#define SSCP_BUS_MAX_READERS 128 /* RS-485 addresses are 0..127 */
+
+#define SSCP_FRAME_MAX_SZ (5 + SSCP_COMMAND_HEADROOM + SSCP_MAX_PAYLOAD_SZ + SSCP_COMMAND_TAILROOM + 2) /* Header + payload + CRC */
+#define SSCP_SERIAL_MAX_CHUNKS 4
+#if SSCP_FRAME_MAX_SZ < 1024
+#define SSCP_RX_RING_SZ 1024 /* Power of 2, holds more than one frame */
+#elif SSCP_FRAME_MAX_SZ < 2048
+#define SSCP_RX_RING_SZ 2048
+#elif SSCP_FRAME_MAX_SZ < 4096
+#define SSCP_RX_RING_SZ 4096
+#else
+#define SSCP_RX_RING_SZ 8192
+#endif
+#define SSCP_TCP_PREFIX "tcp://" /* Port names of the TCP transport start with this */
+#define SSCP_CAPTURE_PREFIX "capture:" /* "capture:<file>|<port>", see sscp-host-capture.c */
+#define SSCP_REPLAY_PREFIX "replay:" /* "replay:<file>", or "replay:<file>|max" */
+
+#ifndef SSCP_WITH_CAPTURE
+#define SSCP_WITH_CAPTURE SSCP_WITH_HEAP /* The capture files go through stdio */
+#endif
+
+/* One piece of a frame, the pieces are sent by SSCP_TransportSendV() as a single transmission */
+typedef struct
+{
+	const BYTE* buffer;
+	DWORD length;
+} SSCP_SERIAL_CHUNK_ST;
+
+typedef struct _SSCP_TRANSPORT_ST SSCP_TRANSPORT_ST;
+typedef struct _SSCP_QUEUE_ST SSCP_QUEUE_ST;
+
+/* Communication port, shared by all the readers of a bus */
+typedef struct
 {
+	const SSCP_TRANSPORT_ST* transport; /* NULL when the port is closed */
+	void* transportData; /* Private to a transport that has no field here */
+	SSCP_QUEUE_ST* queue; /* Worker of sscp-host-queue.c, NULL when it does not run */
+	struct _SSCP_CTX_ST* asyncOwner; /* Reader whose asynchronous exchange holds the line, NULL if none */
 #ifdef _WIN32
+	UINT_PTR commSocket; /* SOCKET of the TCP transport, winsock2.h is only included by sscp-host-tcp.c */
 	HANDLE commHandle;
+	BOOL timeoutsApplied; /* COMMTIMEOUTS below are the ones of the handle */
+	DWORD appliedReadWait;
+	DWORD appliedWriteTimeout;
+	BYTE txFrame[SSCP_FRAME_MAX_SZ]; /* The chunks are coalesced here, for a single WriteFile */
 #else
-	int commFd;
+	int commFd; /* Serial device, or socket of the TCP transport */
+#endif
+	DWORD baudrate; /* Last one successfully applied by the transport */
 	DWORD firstByteTimeout;
 	DWORD interByteTimeout;
+	/* Received bytes not parsed yet, see sscp-host-serial-frame.c */
+	BYTE rxRing[SSCP_RX_RING_SZ];
+	DWORD rxHead;
+	DWORD rxCount;
+	DWORD lastExchange; /* SSCP_GetTickMs() value of the end of the last secure exchange */
+} SSCP_PORT_ST;
+
+/*
+ * I/O primitives of a port. SSCP_Open() selects the transport from the name of the
+ * port, the rest of the library goes through the SSCP_Transport*() functions.
+ */
+struct _SSCP_TRANSPORT_ST
+{
+	const char* name;
+	LONG (*open)(SSCP_CTX_ST* ctx, const char* commName);
+	LONG (*close)(SSCP_CTX_ST* ctx);
+	LONG (*configure)(SSCP_CTX_ST* ctx, DWORD baudrate);
+	LONG (*setTimeouts)(SSCP_CTX_ST* ctx, DWORD firstByte, DWORD interByte);
+	LONG (*sendV)(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount); /* All of it, a single transmission if possible */
+	LONG (*sendSomeV)(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent); /* Without waiting */
+	LONG (*recvWait)(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received); /* Wait up to timeoutMs (0: don't), then read what is there */
+	BOOL (*random)(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz); /* Random values of the exchanges, NULL for the DRBG of the context */
+};
+
+extern const SSCP_TRANSPORT_ST SSCP_TRANSPORT_SERIAL;
+extern const SSCP_TRANSPORT_ST SSCP_TRANSPORT_TCP;
+extern const SSCP_TRANSPORT_ST SSCP_TRANSPORT_SELFTEST;
+#if SSCP_WITH_CAPTURE
+extern const SSCP_TRANSPORT_ST SSCP_TRANSPORT_CAPTURE;
+extern const SSCP_TRANSPORT_ST SSCP_TRANSPORT_REPLAY;
 #endif
+
+/* Classes of commands, for the response timeouts */
+#define SSCP_TIMEOUT_CLASS_CONTROL 0
+#define SSCP_TIMEOUT_CLASS_CARD 1
+#define SSCP_TIMEOUT_CLASS_SETUP 2
+#define SSCP_TIMEOUT_CLASS_COUNT 3
+
+/* Counters of sscp-host-stats.c, only ever incremented (a reset moves the baseline) */
+typedef struct
+{
+	DWORD commandHeader;
+	DWORD count;
+	DWORD failures;
+	DWORD retries;
+	unsigned long long totalUs;
+	DWORD maxUs; /* A maximum cannot be taken from a baseline: it restarts after a reset */
+	LONG maxResets; /* Value of statsResets when maxUs has been restarted */
+} SSCP_STATS_COMMAND_ST;
+
+typedef struct
+{
+	DWORD exchanges;
+	DWORD failures;
+	DWORD retries;
+	DWORD timeouts;
+	DWORD crcErrors;
+	DWORD signatureErrors;
+	DWORD counterErrors;
+	DWORD formatErrors;
+	DWORD corruptedRetries;
+	DWORD recoveries;
+	DWORD backoffMs;
+	DWORD counterResyncs;
+	DWORD latency[SSCP_STATS_LATENCY_BUCKETS];
+	SSCP_STATS_COMMAND_ST commands[SSCP_STATS_MAX_COMMANDS];
+} SSCP_STATS_COUNTERS_ST;
+
+/* States of the non-blocking exchange */
+#define SSCP_ASYNC_IDLE 0
+#define SSCP_ASYNC_GUARD 1 /* Waiting for the guard time to elapse */
+#define SSCP_ASYNC_SEND 2
+#define SSCP_ASYNC_RECV 3
+#define SSCP_ASYNC_DONE 4
+#define SSCP_ASYNC_BACKOFF 5 /* Waiting before a resending, see sscp-host-retry.c */
+
+struct _SSCP_CTX_ST
+{
+	SSCP_PORT_ST* port; /* Either ownPort, or the port of the bus master */
+	SSCP_PORT_ST ownPort;
+	SSCP_BUS_ST* bus; /* Bus the context is a reader of, NULL for a standalone context */
+
+	SSCP_SETTINGS_ST settings; /* Debug and self test flags, see SSCP_SetSettings() */
+
+	/* Binary trace (sscp-host-trace.c), see SSCP_TraceAttach() */
+	struct
+	{
+		SSCP_TRACE_ST* ring;
+		SSCP_TRACE_SINK sink;
+		void* userData;
+	} trace;
+
 	BYTE address;
 	DWORD counter;
 	BYTE sessionKeyCipherAB[16];
@@ -20,6 +177,14 @@ struct _SSCP_CTX_ST
 	BYTE sessionKeySignAB[16];
 	BYTE sessionKeySignBA[16];
 
+	/* Session keys, ready to use (expanded AES keys and HMAC midstates) */
+	AES_CTX_ST sessionCipherAB;
+	AES_CTX_ST sessionCipherBA;
+	HMAC_CTX_ST sessionSignAB;
+	HMAC_CTX_ST sessionSignBA;
+
+	SSCP_KEY_CACHE_ST* keyCache; /* Shared with other contexts, see SSCP_SetKeyCache() (may be NULL) */
+
 	BOOL guardRunning;
 #ifdef _WIN32	
 	LARGE_INTEGER guardFreq;
@@ -38,11 +203,140 @@ struct _SSCP_CTX_ST
 		DWORD bytesSent;
 		DWORD bytesReceived;
 	} stats;
+
+	/* Detailed statistics (sscp-host-stats.c), the counters and where the last reset left them */
+	SSCP_STATS_COUNTERS_ST statsEx;
+	SSCP_STATS_COUNTERS_ST statsBase;
+	volatile LONG statsResets;
+
+	/* Non-blocking exchange (sscp-host-async.c), the frame is in txBuffer and rxBuffer */
+	struct
+	{
+		BYTE state;
+		BYTE retry;
+		BYTE timeoutClass;
+		DWORD commandHeader;
+		DWORD commandSz;
+		DWORD guardTimeMs; /* Guard time to start before sending, 0 if none */
+		BYTE txHeader[5];
+		BYTE txCrc[2];
+		DWORD txOffset; /* Bytes of the frame already sent */
+		BYTE rxHeader[5];
+		BYTE rxCrc[2];
+		DWORD rxOffset; /* Bytes received since the command has been sent */
+		DWORD rxLength; /* Length of the payload, from rxHeader */
+		DWORD deadline; /* SSCP_GetTickMs() value */
+		DWORD sentAt; /* SSCP_GetTickMs() value when the command has been sent */
+		DWORD startUs; /* SSCP_GetTickUs() value of the first transmission, for the statistics */
+		LONG result;
+		DWORD responseDataSz;
+	} async;
+
+	/* Response timeouts (sscp-host-timeouts.c) */
+	struct
+	{
+		SSCP_TIMEOUT_PROFILE_ST profile; /* As given by the application, 0 for the defaults */
+		BYTE samples[SSCP_TIMEOUT_CLASS_COUNT]; /* Responses observed, up to SSCP_ADAPTIVE_MIN_SAMPLES */
+		DWORD srtt8[SSCP_TIMEOUT_CLASS_COUNT]; /* Smoothed response time, x8 */
+		DWORD rttvar4[SSCP_TIMEOUT_CLASS_COUNT]; /* Its mean deviation, x4 */
+	} timeouts;
+
+	/* Retry policy of the exchanges (sscp-host-retry.c) */
+	struct
+	{
+		SSCP_RETRY_POLICY_ST policy; /* As given by the application, 0 for the defaults */
+		BOOL resending; /* The frame being sent is a resending, see SSCP_FirstByteTimeout() */
+	} retry;
+
+	/* Card presence polling (sscp-host-poll.c) */
+	struct
+	{
+		BOOL running;
+		SSCP_POLL_CONFIG_ST config;
+		SSCP_POLL_CALLBACK callback;
+		void* userData;
+		DWORD intervalMs; /* Current poll period */
+		DWORD lastActivity; /* SSCP_GetTickMs() value of the last arrival or removal */
+		BOOL cardPresent;
+		SSCP_CARD_ST card;
+	} poll;
+
+	/* Health of the reader (sscp-host-health.c) */
+	struct
+	{
+		BOOL running;
+		SSCP_HEALTH_CONFIG_ST config;
+		BYTE authKey[16]; /* Copy of config.authKeyValue, if given */
+		SSCP_HEALTH_CALLBACK callback;
+		void* userData;
+		SSCP_HEALTH_ST report;
+		BYTE observed; /* Worst state the exchanges have seen since the last step */
+		LONG observedRc;
+		DWORD lastAnswer; /* SSCP_GetTickMs() value of the last answer of the reader */
+		DWORD lastAttempt; /* Of the last heartbeat or re-authentication */
+		DWORD samples; /* Heartbeats in the averages */
+		DWORD voltage8; /* Smoothed voltage, x8 */
+		DWORD latency8; /* Smoothed round trip, x8 */
+	} health;
+
+	/* Random IVs and rndA (sscp-host-crypto-drbg.c), a CTR_DRBG and the pool it fills */
+	struct
+	{
+		AES_CTX_ST key;
+		BYTE v[16];
+		DWORD pools; /* Filled since the last seeding, plus 1; 0 before the first one */
+		DWORD available; /* Bytes left at the beginning of the pool */
+		BYTE pool[SSCP_DRBG_POOL_SZ];
+	} drbg;
+
+	/* Scratch buffers for the secure exchange, so that no allocation takes place per exchange */
+	BYTE txBuffer[SSCP_COMMAND_HEADROOM + SSCP_MAX_PAYLOAD_SZ + SSCP_COMMAND_TAILROOM];
+	BYTE rxBuffer[SSCP_MAX_PAYLOAD_SZ];
+	BYTE batchBuffer[SSCP_COMMAND_HEADROOM + SSCP_MAX_PAYLOAD_SZ + SSCP_COMMAND_TAILROOM]; /* Next frame of SSCP_ExchangeBatch() */
 };
 
-LONG SSCP_ExchangeRaw(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, const BYTE command[], DWORD commandSz, BYTE response[], DWORD maxResponseSz, DWORD* actResponseSz);
+struct _SSCP_BUS_ST
+{
+	SSCP_CTX_ST* master; /* Standalone context that owns the port */
+	SSCP_CTX_ST* readers[SSCP_BUS_MAX_READERS]; /* Reader sessions, by address */
+};
+
+void SSCP_BusDetachReader(SSCP_CTX_ST* ctx);
+LONG SSCP_BusMoveReader(SSCP_CTX_ST* ctx, BYTE address);
+LONG SSCP_NegotiateReaders(SSCP_CTX_ST* readers[], DWORD readerCount, DWORD baudrate);
+
+LONG SSCP_ExchangeRaw(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, BYTE timeoutClass, const BYTE command[], DWORD commandSz, BYTE response[], DWORD maxResponseSz, DWORD* actResponseSz);
+LONG SSCP_ExchangeRawSend(SSCP_CTX_ST* ctx, BYTE address, BYTE protocol, BYTE timeoutClass, const BYTE command[], DWORD commandSz, DWORD* sentAt);
+LONG SSCP_ExchangeRawRecv(SSCP_CTX_ST* ctx, BYTE timeoutClass, DWORD commandSz, DWORD sentAt, BYTE response[], DWORD maxResponseSz, DWORD* actResponseSz);
+
+/* Mutual authentication, step by step (see SSCP_Authenticate()) */
+typedef struct
+{
+	const BYTE* authKeyValue;
+	BYTE rndA[16];
+	BYTE rndB[16];
+	BYTE A[4];
+	BYTE command[4 + 16 + 32]; /* Of the current step */
+	DWORD commandSz;
+	BYTE sessionKeys[64]; /* Derived ahead of the 2nd step's acknowledgment, if derived is set */
+	BOOL derived;
+} SSCP_AUTH_STATE_ST;
+
+LONG SSCP_AuthenticateBegin(SSCP_CTX_ST* ctx, SSCP_AUTH_STATE_ST* auth, const BYTE authKeyValue[16]);
+LONG SSCP_AuthenticateContinue(SSCP_CTX_ST* ctx, SSCP_AUTH_STATE_ST* auth, const BYTE response[], DWORD responseSz);
+LONG SSCP_AuthenticateEnd(SSCP_CTX_ST* ctx, SSCP_AUTH_STATE_ST* auth);
+
+LONG SSCP_TransceiveNFC_Exchange(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz, DWORD commandApduSz, const BYTE** responseApdu, DWORD* responseApduSz);
+
+void SSCP_SCR16(const BYTE part1[], DWORD part1Sz, const BYTE part2[], DWORD part2Sz, BYTE pcrc[2]);
+WORD SSCP_CRC16_Update(WORD crc, const BYTE data[], DWORD dataSz);
+LONG SSCP_ExchangePrepare(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE command[], DWORD maxCommandSz, DWORD commandDataSz, DWORD* actCommandSz);
+LONG SSCP_ExchangeVerify(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE response[], DWORD responseSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
+LONG SSCP_ExchangePipelined(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE command[], DWORD maxCommandSz, DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
+LONG SSCP_ExchangeVerifyPlain(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE response[], DWORD responseSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
 
 LONG SSCP_Exchange(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData[], DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
+LONG SSCP_ExchangeInPlace(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE command[], DWORD maxCommandSz, DWORD commandDataSz, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
 LONG SSCP_Exchange_NoDataIn(SSCP_CTX_ST* ctx, DWORD commandHeader, BYTE responseData[], DWORD maxResponseDataSz, DWORD* actResponseDataSz);
 LONG SSCP_Exchange_NoDataOut(SSCP_CTX_ST* ctx, DWORD commandHeader, const BYTE commandData[], DWORD commandDataSz);
 LONG SSCP_Exchange_NoDataInOut(SSCP_CTX_ST* ctx, DWORD commandHeader);
@@ -50,28 +344,157 @@ LONG SSCP_Exchange_NoDataInOut(SSCP_CTX_ST* ctx, DWORD commandHeader);
 BOOL SSCP_HMAC(const BYTE keyValue[16], const BYTE buffer[], DWORD length, BYTE hmac[32]);
 BOOL SSCP_Cipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer[], DWORD length);
 BOOL SSCP_Decipher(const BYTE keyValue[16], const BYTE initVector[16], BYTE buffer[], DWORD length);
+BOOL SSCP_HMACEx(const HMAC_CTX_ST* hmac_ctx, const BYTE buffer[], DWORD length, BYTE hmac[32]);
+BOOL SSCP_CipherEx(AES_CTX_ST* aes_ctx, const BYTE initVector[16], BYTE buffer[], DWORD length);
+BOOL SSCP_DecipherEx(AES_CTX_ST* aes_ctx, const BYTE initVector[16], BYTE buffer[], DWORD length);
 BOOL SSCP_ComputeSessionKeys(SSCP_CTX_ST* ctx, const BYTE authKeyValue[16], const BYTE rndA[16], const BYTE rndB[16]);
+void SSCP_ExpandSessionKeys(SSCP_CTX_ST* ctx);
+void SSCP_SetSessionKeys(SSCP_CTX_ST* ctx, const BYTE T[64]);
+
+/* An authentication whose session keys are to be derived, see SSCP_DeriveSessionKeys() */
+typedef struct
+{
+	SSCP_KEY_CACHE_ST* cache; /* May be NULL */
+	const BYTE* authKeyValue;
+	const BYTE* rndB;
+	BYTE* sessionKeys; /* Out: T, 64 bytes (see SSCP_SetSessionKeys()) */
+	BOOL derived; /* Private */
+} SSCP_SESSION_DERIVATION_ST;
+
+BOOL SSCP_DeriveSessionKeys(SSCP_SESSION_DERIVATION_ST items[], DWORD itemCount, BOOL debug);
+
+/* Key cache (sscp-host-crypto-keys.c) */
+typedef struct
+{
+	volatile LONG claimed; /* 0 while the slot is free, the first thread to count it fills it */
+	volatile LONG ready; /* Filled, only read until it is replaced */
+	volatile LONG refs; /* Threads that use the entry: it is not replaced meanwhile */
+	volatile LONG replacing; /* The first thread to count it replaces the entry */
+	volatile LONG users; /* Of cipherPrime */
+	volatile LONG lastUse; /* Clock of the cache when the entry has last been used */
+	BYTE key[16];
+	BYTE keyPrime[16]; /* K' = AES(K, K) */
+	AES_CTX_ST cipherPrime; /* K', expanded */
+	HMAC_CTX_ST sign; /* HMAC midstates of K */
+} SSCP_KEY_CACHE_ENTRY_ST;
+
+struct _SSCP_KEY_CACHE_ST
+{
+	SSCP_KEY_CACHE_ENTRY_ST entries[SSCP_KEY_CACHE_SLOTS];
+	volatile LONG clock; /* Counts the uses of the entries */
+};
+
+BOOL SSCP_KeyCacheHMAC(SSCP_KEY_CACHE_ST* cache, const BYTE key[16], const BYTE buffer[], DWORD length, BYTE hmac[32]);
+void SSCP_KeyCacheEncrypt(SSCP_KEY_CACHE_ST* cache, const BYTE key[16], BYTE blocks[], DWORD blockCount, BYTE keyPrime[16]);
 
 void SSCP_GuardTime(SSCP_CTX_ST* ctx, DWORD guardTimeMs);
 void SSCP_InitGuardTime(SSCP_CTX_ST* ctx, DWORD guardTimeMs);
 void SSCP_WaitGuardTime(SSCP_CTX_ST* ctx);
+DWORD SSCP_GuardRemaining(SSCP_CTX_ST* ctx);
+DWORD SSCP_GetTickMs(void);
+DWORD SSCP_GetTickUs(void);
+void SSCP_SleepMs(DWORD delayMs);
+
+BYTE SSCP_TimeoutClass(DWORD commandHeader);
+DWORD SSCP_TransmitTimeMs(SSCP_CTX_ST* ctx, DWORD frameSz);
+DWORD SSCP_FirstByteTimeout(SSCP_CTX_ST* ctx, BYTE timeoutClass, DWORD frameSz);
+DWORD SSCP_InterByteTimeout(SSCP_CTX_ST* ctx);
+void SSCP_TimeoutSample(SSCP_CTX_ST* ctx, BYTE timeoutClass, DWORD frameSz, DWORD elapsedMs);
+void SSCP_TimeoutExpired(SSCP_CTX_ST* ctx, BYTE timeoutClass);
+
+BOOL SSCP_AsyncPending(SSCP_CTX_ST* ctx);
+
+BOOL SSCP_QueueForeign(SSCP_CTX_ST* ctx);
+LONG SSCP_QueueCall(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request);
+LONG SSCP_QueueCallJob(SSCP_CTX_ST* ctx, SSCP_REQUEST_JOB job, void* userData);
+LONG SSCP_QueuePostTo(SSCP_CTX_ST* ctx, SSCP_REQUEST_ST* request, SSCP_QUEUE_ST* completions);
+BOOL SSCP_QueuePin(SSCP_CTX_ST* ctx, DWORD core);
+DWORD SSCP_CpuCount(void);
+
+SSCP_QUEUE_ST* SSCP_QueueCompletionsAlloc(void);
+void SSCP_QueueCompletionsFree(SSCP_QUEUE_ST* completions);
+void SSCP_QueueComplete(SSCP_QUEUE_ST* completions, SSCP_REQUEST_ST* request);
+SSCP_REQUEST_ST* SSCP_QueueTake(SSCP_QUEUE_ST* completions, DWORD timeoutMs);
+
+void SSCP_StatsRecord(SSCP_CTX_ST* ctx, DWORD commandHeader, LONG rc, DWORD retries, DWORD elapsedUs);
+void SSCP_HealthRecord(SSCP_CTX_ST* ctx, LONG rc);
+
+BYTE SSCP_RetryAttempts(SSCP_CTX_ST* ctx);
+BOOL SSCP_RetryNext(SSCP_CTX_ST* ctx, BYTE attempt, LONG rc, DWORD* backoffMs);
+BOOL SSCP_RetryWait(SSCP_CTX_ST* ctx, BYTE attempt, LONG rc);
+void SSCP_RetryEnd(SSCP_CTX_ST* ctx, DWORD retries, LONG rc);
 
-LONG SSCP_SerialOpen(SSCP_CTX_ST* ctx, const char* commName);
-LONG SSCP_SerialClose(SSCP_CTX_ST* ctx);
-LONG SSCP_SerialConfigure(SSCP_CTX_ST* ctx, DWORD baudrate);
-LONG SSCP_SerialSetTimeouts(SSCP_CTX_ST* ctx, DWORD first_byte, DWORD inter_byte);
-LONG SSCP_SerialSend(SSCP_CTX_ST* ctx, const BYTE buffer[], DWORD length);
-LONG SSCP_SerialRecv(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length);
+LONG SSCP_TransportOpen(SSCP_CTX_ST* ctx, const SSCP_TRANSPORT_ST* transport, const char* commName, DWORD baudrate);
+LONG SSCP_TransportClose(SSCP_CTX_ST* ctx);
+LONG SSCP_TransportConfigure(SSCP_CTX_ST* ctx, DWORD baudrate);
+LONG SSCP_TransportSetTimeouts(SSCP_CTX_ST* ctx, DWORD firstByte, DWORD interByte);
+LONG SSCP_TransportSendV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount);
+LONG SSCP_TransportSendSomeV(SSCP_CTX_ST* ctx, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* sent);
+LONG SSCP_TransportRecvWait(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD length, DWORD timeoutMs, DWORD* received);
+const SSCP_TRANSPORT_ST* SSCP_TransportFromName(const char* commName);
+const SSCP_TRANSPORT_ST* SSCP_TransportBase(SSCP_CTX_ST* ctx);
+
+DWORD SSCP_SerialSkipChunks(SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD skip);
+LONG SSCP_SerialCoalesceChunks(BYTE buffer[], DWORD maxBufferSz, const SSCP_SERIAL_CHUNK_ST chunks[], DWORD chunkCount, DWORD* length);
+
+void SSCP_SerialFlushRing(SSCP_CTX_ST* ctx);
+LONG SSCP_SerialFillRing(SSCP_CTX_ST* ctx, DWORD timeoutMs, DWORD* received);
+LONG SSCP_SerialRingFrame(SSCP_CTX_ST* ctx, BYTE header[5], BYTE payload[], DWORD maxPayloadSz, BYTE crc[2]);
+BOOL SSCP_SerialRingSettle(SSCP_CTX_ST* ctx, BYTE header[5], BYTE crc[2]);
+LONG SSCP_SerialRecvFrame(SSCP_CTX_ST* ctx, BYTE header[5], BYTE payload[], DWORD maxPayloadSz, BYTE crc[2]);
+
+typedef void (*SSCP_SERIAL_PROGRESS)(SSCP_CTX_ST* ctx, BYTE payload[], DWORD received, DWORD length, void* userData);
+LONG SSCP_SerialRecvStream(SSCP_CTX_ST* ctx, BYTE header[5], BYTE payload[], DWORD maxPayloadSz, BYTE crc[2], SSCP_SERIAL_PROGRESS progress, void* userData);
 
 BOOL SSCP_GetRandom(BYTE buffer[], DWORD bufferSz);
+BOOL SSCP_GetRandomEx(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz);
+void SSCP_DrbgInstantiate(SSCP_CTX_ST* ctx, const BYTE seed[32]);
+void SSCP_DrbgReseed(SSCP_CTX_ST* ctx, const BYTE seed[32]);
+void SSCP_DrbgGenerate(SSCP_CTX_ST* ctx, BYTE output[], DWORD length);
+BOOL SSCP_DrbgDraw(SSCP_CTX_ST* ctx, BYTE buffer[], DWORD bufferSz);
+void SSCP_DrbgFree(SSCP_CTX_ST* ctx);
 
+#if SSCP_WITH_TRACE
 #define SSCP_Trace printf
+#define SSCP_TRACE_ON(ctx) (((ctx)->trace.ring != NULL) || ((ctx)->trace.sink != NULL))
+#else
+#define SSCP_Trace(...) ((void) 0)
+#define SSCP_TRACE_ON(ctx) FALSE
+#endif
+
+/* Record into the trace of the context, when SSCP_TRACE_ON() */
+void SSCP_TraceFrame(SSCP_CTX_ST* ctx, BYTE type, const BYTE header[5], const BYTE payload[], DWORD payloadSz);
+void SSCP_TraceEvent(SSCP_CTX_ST* ctx, BYTE type, DWORD info, DWORD retries, LONG result, DWORD durationUs);
+
+#ifdef _WIN32
+#define SSCP_ATOMIC_XCHG_PTR(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v))
+#define SSCP_ATOMIC_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define SSCP_ATOMIC_STORE_PTR(p, v) ((void) InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v)))
+#define SSCP_ATOMIC_ADD(p, v) InterlockedExchangeAdd((p), (v))
+#define SSCP_ATOMIC_LOAD(p) InterlockedCompareExchange((p), 0, 0)
+#define SSCP_ATOMIC_STORE(p, v) ((void) InterlockedExchange((p), (v)))
+#else
+#define SSCP_ATOMIC_XCHG_PTR(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define SSCP_ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define SSCP_ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define SSCP_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define SSCP_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define SSCP_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
 
-#include "sscp-host-crypto_i.h"
 #include "sscp-host-serial_i.h"
 
+/* Memory of the objects of the library (sscp-host-memory.c), zeroed */
+void* SSCP_MemAlloc(size_t size);
+void SSCP_MemFree(void* memory);
+size_t SSCP_MemMaxSize(void);
+
+/* Defaults of the settings of the new contexts, see SSCP_Alloc() */
 extern BOOL SSCP_DEBUG_AUTHENTICATE;
 extern BOOL SSCP_DEBUG_EXCHANGE;
+extern BOOL SSCP_DEBUG_CRYPTO;
+extern BOOL SSCP_DEBUG_SERIAL;
+extern BOOL SSCP_DEBUG_TCP;
 
 extern BOOL SSCP_SELFTEST;
 